@@ -32,7 +32,7 @@ class ActiveObjectMgr
 	virtual bool registerObject(std::unique_ptr<T> obj) = 0;
 	virtual void removeObject(u16 id) = 0;
 
-	void clear()
+	virtual void clear()
 	{
 		// on_destruct could add new objects so this has to be a loop
 		do {
@@ -4,6 +4,7 @@
 #include "catch.h"
 #include "server/activeobjectmgr.h"
 #include "util/numeric.h"
+#include "constants.h"
 
 namespace {
 
@@ -94,6 +95,47 @@ void benchGetObjectsInArea(Catch::Benchmark::Chronometer &meter)
 	mgr.clear(); // implementation expects this
 }
 
+template <size_t N>
+void benchGetAddedActiveObjectsAroundPos(Catch::Benchmark::Chronometer &meter)
+{
+	server::ActiveObjectMgr mgr;
+	std::set<u16> current_objects;
+	std::vector<u16> added_objects;
+
+	fill(mgr, N);
+	meter.measure([&] {
+		added_objects.clear();
+		mgr.getAddedActiveObjectsAroundPos(randpos(), "player",
+				48.0f * BS, 0.0f, current_objects, added_objects);
+		return added_objects.size();
+	});
+
+	mgr.clear(); // implementation expects this
+}
+
+template <size_t N>
+void benchMoveObjects(Catch::Benchmark::Chronometer &meter)
+{
+	server::ActiveObjectMgr mgr;
+	std::vector<u16> ids;
+
+	fill(mgr, N);
+	mgr.step(0, [&ids] (ServerActiveObject *obj) {
+		ids.push_back(obj->getId());
+	});
+	meter.measure([&] {
+		// what the environment does when an object moves
+		u16 id = ids[myrand_range(0, ids.size() - 1)];
+		ServerActiveObject *obj = mgr.getActiveObject(id);
+		v3f old_pos = obj->getBasePosition();
+		obj->setBasePosition(randpos());
+		mgr.updateObjectPosition(obj, old_pos);
+		return id;
+	});
+
+	mgr.clear(); // implementation expects this
+}
+
 #define BENCH_INSIDE_RADIUS(_count) \
 	BENCHMARK_ADVANCED("inside_radius_" #_count)(Catch::Benchmark::Chronometer meter) \
 	{ benchGetObjectsInsideRadius<_count>(meter); };
@@ -102,10 +144,27 @@ void benchGetObjectsInArea(Catch::Benchmark::Chronometer &meter)
 	BENCHMARK_ADVANCED("in_area_" #_count)(Catch::Benchmark::Chronometer meter) \
 	{ benchGetObjectsInArea<_count>(meter); };
 
+#define BENCH_ADDED_AROUND_POS(_count) \
+	BENCHMARK_ADVANCED("added_around_pos_" #_count)(Catch::Benchmark::Chronometer meter) \
+	{ benchGetAddedActiveObjectsAroundPos<_count>(meter); };
+
+#define BENCH_MOVE(_count) \
+	BENCHMARK_ADVANCED("move_" #_count)(Catch::Benchmark::Chronometer meter) \
+	{ benchMoveObjects<_count>(meter); };
+
 TEST_CASE("ActiveObjectMgr") {
 	BENCH_INSIDE_RADIUS(200)
 	BENCH_INSIDE_RADIUS(1450)
+	BENCH_INSIDE_RADIUS(10000)
+	BENCH_INSIDE_RADIUS(25000)
 
 	BENCH_IN_AREA(200)
 	BENCH_IN_AREA(1450)
+	BENCH_IN_AREA(10000)
+	BENCH_IN_AREA(25000)
+
+	BENCH_ADDED_AROUND_POS(1450)
+	BENCH_ADDED_AROUND_POS(10000)
+
+	BENCH_MOVE(10000)
 }
@@ -0,0 +1,117 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "catch.h"
+#include "constants.h"
+#include "porting.h"
+#include "settings.h"
+#include "network/lossy_link.h"
+#include "network/mtp/internal.h"
+#include "network/networkpacket.h"
+#include "network/peerhandler.h"
+#include <string>
+
+using namespace con;
+
+// Fills the buffer like a full send window and receives ACKs for it
+static void benchmark_acks(u32 window)
+{
+	// Close to the wrap around
+	const u16 next_expected = 65000;
+
+	SharedBuffer<u8> data(100);
+	Address address(127, 0, 0, 1, 30000);
+	std::vector<BufferedPacketPtr> packets;
+	for (u32 i = 1; i <= window; i++) {
+		packets.push_back(makePacket(address, makeReliablePacket(data, next_expected + i),
+			PROTOCOL_ID, PEER_ID_SERVER, 0));
+	}
+
+	// ACKs come in order, except for some packets that had to be resent
+	std::vector<u16> acks, late_acks;
+	for (u32 i = 1; i <= window; i++) {
+		u16 seqnum = next_expected + i;
+		if (i % 16 == 0)
+			late_acks.push_back(seqnum);
+		else
+			acks.push_back(seqnum);
+	}
+	acks.insert(acks.end(), late_acks.begin(), late_acks.end());
+
+	ReliablePacketBuffer buffer;
+	BENCHMARK("ReliablePacketBuffer ACKs, window " + std::to_string(window)) {
+		for (auto &p : packets)
+			buffer.insert(p, next_expected);
+		for (u16 seqnum : acks)
+			buffer.popSeqnum(seqnum);
+		return buffer.size();
+	};
+}
+
+namespace {
+
+struct PeerCounter : public con::PeerHandler
+{
+	void peerAdded(con::IPeer *peer) { last_id = peer->id; }
+	void deletingPeer(con::IPeer *peer, bool timeout) {}
+
+	session_t last_id = 0;
+};
+
+}
+
+// Sends reliable packets over a slow link with latency and loss,
+// to compare the congestion control modes
+static void benchmark_lossy_link(const char *congestion_control, u32 packet_count)
+{
+	PeerCounter hand_server, hand_client;
+
+	std::string old_cc = g_settings->get("congestion_control");
+	g_settings->set("congestion_control", congestion_control);
+	Connection server(512, CONNECTION_TIMEOUT, false, &hand_server);
+	Connection client(512, CONNECTION_TIMEOUT, false, &hand_client);
+	g_settings->set("congestion_control", old_cc);
+
+	server.Serve(Address(0, 0, 0, 0, 30010));
+
+	LossyLink link(Address(127, 0, 0, 1, 30010), 30011);
+	// 50 ms round trip time, 1% loss and 100 KB/s with a 200 ms buffer
+	link.delay_ms = 25;
+	link.loss_percent = 1;
+	link.bytes_per_ms = 100;
+	link.buffer_ms = 200;
+	link.start();
+
+	REQUIRE(connectForTesting(server, client, Address(127, 0, 0, 1, 30011)));
+	const session_t peer_id_client = hand_server.last_id;
+
+	BENCHMARK(std::string("Lossy link, congestion_control=") + congestion_control +
+			", " + std::to_string(packet_count) + " packets") {
+		for (u32 i = 0; i < packet_count; i++) {
+			NetworkPacket pkt(0x4c, 0);
+			pkt << i;
+			pkt.putRawString(std::string(400, 'x'));
+			server.Send(peer_id_client, 0, &pkt, true);
+		}
+		u32 received = 0;
+		NetworkPacket pkt;
+		while (received < packet_count && client.ReceiveTimeoutMs(&pkt, 10000))
+			received++;
+		return received;
+	};
+}
+
+TEST_CASE("benchmark_connection")
+{
+	benchmark_acks(512);
+	benchmark_acks(2048);
+	benchmark_acks(8192);
+	// Largest window allowed by MAX_RELIABLE_WINDOW_SIZE
+	benchmark_acks(MAX_RELIABLE_WINDOW_SIZE - 1);
+}
+
+TEST_CASE("benchmark_connection_lossy_link")
+{
+	benchmark_lossy_link("legacy", 100);
+	benchmark_lossy_link("cubic", 100);
+}
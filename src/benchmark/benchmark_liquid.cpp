@@ -0,0 +1,150 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "catch.h"
+#include "emerge.h"
+#include "filesys.h"
+#include "nodedef.h"
+#include "serverenvironment.h"
+#include "servermap.h"
+#include "settings.h"
+#include "util/directiontables.h"
+#include "unittest/mock_server.h"
+
+namespace {
+
+// A lake of sources above a large floor, the water falls down and spreads
+constexpr s16 FLOOR_RADIUS = 64;
+constexpr s16 LAKE_RADIUS = 24;
+constexpr s16 LAKE_HEIGHT = 8;
+
+struct FloodScene {
+	content_t c_stone, c_source;
+	ServerEnvironment *env;
+	ServerMap *map;
+
+	void setNode(v3s16 p, MapNode n)
+	{
+		map->setNode(p, n);
+		for (v3s16 dir : g_7dirs)
+			map->transforming_liquid_add(p + dir);
+	}
+
+	void setLake(content_t c)
+	{
+		for (s16 z = -LAKE_RADIUS; z < LAKE_RADIUS; z++)
+		for (s16 x = -LAKE_RADIUS; x < LAKE_RADIUS; x++)
+			setNode(v3s16(x, LAKE_HEIGHT, z), MapNode(c));
+	}
+
+	// Returns the number of steps until the liquids settled
+	int settle()
+	{
+		std::map<v3s16, MapBlock*> modified_blocks;
+		int steps = 0;
+		while (map->transforming_liquid_size() > 0 && steps < 1000) {
+			map->transformLiquids(modified_blocks, env);
+			steps++;
+		}
+		return steps;
+	}
+
+	// Breaks the dam and waits until the water is gone again
+	void flood()
+	{
+		setLake(c_source);
+		settle();
+		setLake(CONTENT_AIR);
+		settle();
+	}
+};
+
+void run_flood(const std::string &world_path, const char *name, u16 threads)
+{
+	MockServer server(world_path);
+	{
+		std::ofstream ofs(server.getWorldPath() + DIR_DELIM "world.mt",
+			std::ios::out | std::ios::binary);
+		ofs << "backend = dummy\n";
+	}
+	server.createScripting();
+	server.getScriptIface()->loadBuiltin();
+
+	FloodScene scene;
+	NodeDefManager *ndef = server.getWritableNodeDefManager();
+	{
+		ContentFeatures f;
+		f.name = "stone";
+		scene.c_stone = ndef->set(f.name, f);
+	}
+	for (LiquidType type : {LIQUID_SOURCE, LIQUID_FLOWING}) {
+		ContentFeatures f;
+		f.name = type == LIQUID_SOURCE ? "water_source" : "water_flowing";
+		f.drawtype = type == LIQUID_SOURCE ? NDT_LIQUID : NDT_FLOWINGLIQUID;
+		f.param_type_2 = type == LIQUID_SOURCE ? CPT2_NONE : CPT2_FLOWINGLIQUID;
+		f.walkable = false;
+		f.buildable_to = true;
+		f.liquid_type = type;
+		f.liquid_alternative_source = "water_source";
+		f.liquid_alternative_flowing = "water_flowing";
+		content_t c = ndef->set(f.name, f);
+		if (type == LIQUID_SOURCE)
+			scene.c_source = c;
+	}
+	ndef->resolveCrossrefs();
+
+	std::string old_threads = g_settings->get("liquid_threads");
+	g_settings->setU16("liquid_threads", threads);
+
+	MetricsBackend mb;
+	EmergeManager emerge(&server, &mb);
+	auto map = std::make_unique<ServerMap>(server.getWorldPath(), &server, &emerge, &mb);
+	scene.map = map.get();
+	ServerEnvironment env(std::move(map), &server, &mb);
+	scene.env = &env;
+
+	v3s16 bpmin = getNodeBlockPos(v3s16(-FLOOR_RADIUS, -1, -FLOOR_RADIUS));
+	v3s16 bpmax = getNodeBlockPos(v3s16(FLOOR_RADIUS - 1, LAKE_HEIGHT, FLOOR_RADIUS - 1));
+	for (s16 z = bpmin.Z; z <= bpmax.Z; z++)
+	for (s16 y = bpmin.Y; y <= bpmax.Y; y++)
+	for (s16 x = bpmin.X; x <= bpmax.X; x++) {
+		MapBlock *block = scene.map->createBlock(v3s16(x, y, z));
+		v3s16 relpos = block->getPosRelative();
+		for (s16 rz = 0; rz < MAP_BLOCKSIZE; rz++)
+		for (s16 ry = 0; ry < MAP_BLOCKSIZE; ry++)
+		for (s16 rx = 0; rx < MAP_BLOCKSIZE; rx++) {
+			content_t c = relpos.Y + ry < 0 ? scene.c_stone : CONTENT_AIR;
+			block->setNodeNoCheck(rx, ry, rz, MapNode(c));
+		}
+	}
+
+	// Make sure the scenario is sane
+	scene.setLake(scene.c_source);
+	REQUIRE(scene.settle() < 1000);
+	REQUIRE(scene.map->getNode(v3s16(LAKE_RADIUS + 4, 0, 0)).getContent() != CONTENT_AIR);
+	scene.setLake(CONTENT_AIR);
+	REQUIRE(scene.settle() < 1000);
+	REQUIRE(scene.map->getNode(v3s16(0, 0, 0)).getContent() == CONTENT_AIR);
+
+	BENCHMARK(name) {
+		scene.flood();
+	};
+
+	g_settings->set("liquid_threads", old_threads);
+}
+
+void run_benchmark(const char *name, u16 threads)
+{
+	const std::string world_path = fs::CreateTempDir();
+	run_flood(world_path, name, threads);
+	fs::RecursiveDelete(world_path);
+}
+
+}
+
+TEST_CASE("benchmark_liquid")
+{
+	run_benchmark("transformLiquids flood", 0);
+	run_benchmark("transformLiquids flood, 1 thread", 1);
+	run_benchmark("transformLiquids flood, 4 threads", 4);
+}
@@ -0,0 +1,351 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "catch.h"
+#include "dummygamedef.h"
+#include "nodedef.h"
+#include "noise.h"
+#include "client/content_mapblock.h"
+#include "client/mapblock_mesh.h"
+#include "client/mesh.h"
+#include "client/meshgen/collector.h"
+#include "client/minimap.h"
+#include "client/shader.h"
+#include "client/texturesource.h"
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Meshes are built without textures and shaders, so that no video driver is needed
+class NullTextureSource : public ITextureSource
+{
+public:
+	u32 getTextureId(const std::string &name) override { return 0; }
+	std::string getTextureName(u32 id) override { return ""; }
+	video::ITexture *getTexture(u32 id) override { return nullptr; }
+	video::ITexture *getTexture(const std::string &name, u32 *id) override
+	{
+		if (id)
+			*id = 0;
+		return nullptr;
+	}
+	video::ITexture *getTextureForMesh(const std::string &name, u32 *id) override
+	{
+		return getTexture(name, id);
+	}
+	Palette *getPalette(const std::string &name) override { return nullptr; }
+	bool isKnownSourceImage(const std::string &name) override { return false; }
+	video::SColor getTextureAverageColor(const std::string &name) override
+	{
+		return video::SColor(0);
+	}
+};
+
+class NullShaderSource : public IShaderSource
+{
+public:
+	ShaderInfo getShaderInfo(u32 id) override { return ShaderInfo(); }
+	u32 getShader(const std::string &name, MaterialType material_type,
+			NodeDrawType drawtype) override { return 0; }
+	u32 getShaderRaw(const std::string &name, bool blendAlpha) override { return 0; }
+};
+
+// The blocks of a mesh and its neighbours, in the order of
+// MeshUpdateQueue::fillDataFromMapBlocks()
+struct BlockScene
+{
+	std::vector<std::vector<MapNode>> blocks;
+
+	BlockScene() : blocks(27, std::vector<MapNode>(MAP_BLOCKSIZE * MAP_BLOCKSIZE *
+			MAP_BLOCKSIZE, MapNode(CONTENT_AIR, LIGHT_SUN, 0))) {}
+
+	MapNode &at(v3s16 p)
+	{
+		// p is relative to the block the mesh is made for
+		v3s16 bp = getContainerPos(p, MAP_BLOCKSIZE) + v3s16(1, 1, 1);
+		v3s16 rel = p - (bp - v3s16(1, 1, 1)) * MAP_BLOCKSIZE;
+		auto &block = blocks[bp.X * 9 + bp.Z * 3 + bp.Y];
+		return block[rel.Z * MAP_BLOCKSIZE * MAP_BLOCKSIZE + rel.Y * MAP_BLOCKSIZE + rel.X];
+	}
+};
+
+struct MeshBenchmark
+{
+	DummyGameDef gamedef;
+	NullTextureSource tsrc;
+	NullShaderSource shdrsrc;
+	content_t stone, dirt, grass, water, water_flowing, glass, plant, slab, mesh_node;
+
+	MeshBenchmark()
+	{
+		NodeDefManager *ndef = gamedef.getWritableNodeDefManager();
+		u32 texture_id = 1;
+
+		const auto add_node = [&] (const std::string &name, NodeDrawType drawtype,
+				MaterialType material) -> ContentFeatures {
+			ContentFeatures f;
+			f.name = "bench:" + name;
+			f.drawtype = drawtype;
+			for (TileSpec &tile : f.tiles) {
+				tile.layers[0].texture_id = texture_id;
+				tile.layers[0].material_type = material;
+			}
+			for (TileSpec &tile : f.special_tiles) {
+				tile.layers[0].texture_id = texture_id;
+				tile.layers[0].material_type = material;
+			}
+			texture_id++;
+			return f;
+		};
+
+		{
+			ContentFeatures f = add_node("stone", NDT_NORMAL, TILE_MATERIAL_BASIC);
+			f.solidness = 2;
+			stone = ndef->set(f.name, f);
+			f = add_node("dirt", NDT_NORMAL, TILE_MATERIAL_BASIC);
+			f.solidness = 2;
+			dirt = ndef->set(f.name, f);
+			f = add_node("grass", NDT_NORMAL, TILE_MATERIAL_BASIC);
+			f.solidness = 2;
+			grass = ndef->set(f.name, f);
+		}
+		for (bool flowing : {false, true}) {
+			ContentFeatures f = add_node(flowing ? "water_flowing" : "water_source",
+				flowing ? NDT_FLOWINGLIQUID : NDT_LIQUID,
+				TILE_MATERIAL_LIQUID_TRANSPARENT);
+			f.solidness = flowing ? 0 : 1;
+			f.alpha = ALPHAMODE_BLEND;
+			f.light_propagates = true;
+			f.param_type = CPT_LIGHT;
+			f.param_type_2 = flowing ? CPT2_FLOWINGLIQUID : CPT2_NONE;
+			f.liquid_type = flowing ? LIQUID_FLOWING : LIQUID_SOURCE;
+			f.liquid_alternative_source = "bench:water_source";
+			f.liquid_alternative_flowing = "bench:water_flowing";
+			(flowing ? water_flowing : water) = ndef->set(f.name, f);
+		}
+		{
+			ContentFeatures f = add_node("glass", NDT_GLASSLIKE, TILE_MATERIAL_ALPHA);
+			f.alpha = ALPHAMODE_BLEND;
+			f.light_propagates = true;
+			f.param_type = CPT_LIGHT;
+			glass = ndef->set(f.name, f);
+		}
+		{
+			ContentFeatures f = add_node("plant", NDT_PLANTLIKE, TILE_MATERIAL_BASIC);
+			f.walkable = false;
+			f.light_propagates = true;
+			f.param_type = CPT_LIGHT;
+			plant = ndef->set(f.name, f);
+		}
+		{
+			ContentFeatures f = add_node("slab", NDT_NODEBOX, TILE_MATERIAL_BASIC);
+			f.light_propagates = true;
+			f.param_type = CPT_LIGHT;
+			f.node_box.type = NODEBOX_FIXED;
+			f.node_box.fixed.emplace_back(-BS / 2, -BS / 2, -BS / 2, BS / 2, 0, BS / 2);
+			f.node_box.fixed.emplace_back(-BS / 4, 0, -BS / 4, BS / 4, BS / 4, BS / 4);
+			slab = ndef->set(f.name, f);
+		}
+		{
+			ContentFeatures f = add_node("mesh", NDT_MESH, TILE_MATERIAL_BASIC);
+			f.light_propagates = true;
+			f.param_type = CPT_LIGHT;
+			f.param_type_2 = CPT2_FACEDIR;
+			// owned by the NodeDefManager from here on
+			f.mesh_ptr = createCubeMesh(v3f(BS * 0.8f));
+			mesh_node = ndef->set(f.name, f);
+		}
+		ndef->resolveCrossrefs();
+	}
+
+	// Terrain with grass, water, plants, slabs and mesh nodes on its surface
+	BlockScene makeTerrain(s32 seed)
+	{
+		BlockScene scene;
+		PcgRandom pr(seed);
+		const s16 water_level = 2;
+		for (s16 z = -MAP_BLOCKSIZE; z < 2 * MAP_BLOCKSIZE; z++)
+		for (s16 x = -MAP_BLOCKSIZE; x < 2 * MAP_BLOCKSIZE; x++) {
+			s16 surface = 6 + noise2d_perlin(x / 40.0f, z / 40.0f, seed, 3, 0.5f) * 12;
+			for (s16 y = -MAP_BLOCKSIZE; y < 2 * MAP_BLOCKSIZE; y++) {
+				MapNode &n = scene.at(v3s16(x, y, z));
+				if (y < surface - 3)
+					n = MapNode(stone);
+				else if (y < surface)
+					n = MapNode(dirt);
+				else if (y == surface)
+					n = MapNode(surface < water_level ? dirt : grass);
+				else if (y <= water_level)
+					n = MapNode(water, LIGHT_SUN - MYMIN(water_level - y, LIGHT_SUN), 0);
+				else if (y == surface + 1) {
+					u32 r = pr.range(0, 99);
+					if (r < 10)
+						n = MapNode(plant, LIGHT_SUN, 0);
+					else if (r < 12)
+						n = MapNode(slab, LIGHT_SUN, 0);
+					else if (r < 13)
+						n = MapNode(mesh_node, LIGHT_SUN, pr.range(0, 23));
+				}
+			}
+		}
+		return scene;
+	}
+
+	// Every drawtype next to every other, the worst case for face culling
+	BlockScene makeMixed(s32 seed)
+	{
+		const content_t contents[] = {CONTENT_AIR, CONTENT_AIR, stone, water,
+			water_flowing, glass, plant, slab, mesh_node};
+		BlockScene scene;
+		PcgRandom pr(seed);
+		for (auto &block : scene.blocks) {
+			for (MapNode &n : block) {
+				content_t c = contents[pr.range(0, ARRLEN(contents) - 1)];
+				u8 param2 = c == water_flowing ? pr.range(0, 7) :
+					c == mesh_node ? pr.range(0, 23) : 0;
+				n = MapNode(c, pr.range(0, LIGHT_SUN), param2);
+			}
+		}
+		return scene;
+	}
+
+	void fill(MeshMakeData &data, BlockScene &scene, bool smooth_lighting)
+	{
+		data.fillBlockDataBegin(v3s16(0, 0, 0));
+		v3s16 pos;
+		int i = 0;
+		for (pos.X = -1; pos.X <= 1; pos.X++)
+		for (pos.Z = -1; pos.Z <= 1; pos.Z++)
+		for (pos.Y = -1; pos.Y <= 1; pos.Y++)
+			data.fillBlockData(pos, scene.blocks[i++].data());
+		data.m_smooth_lighting = smooth_lighting;
+		data.m_generate_minimap = true;
+	}
+
+	MeshMakeData *makeData(BlockScene &scene, bool smooth_lighting)
+	{
+		auto *data = new MeshMakeData(gamedef.ndef(), MAP_BLOCKSIZE, MeshGrid{1});
+		fill(*data, scene, smooth_lighting);
+		return data;
+	}
+};
+
+// Collects the transparent triangles like the MapBlockMesh constructor does
+static void collectTransparentTriangles(MeshCollector &collector,
+		std::vector<irr_ptr<scene::SMeshBuffer>> &buffers,
+		std::vector<MeshTriangle> &triangles)
+{
+	for (auto &prebuffers : collector.prebuffers)
+	for (PreMeshBuffer &p : prebuffers) {
+		if (!p.layer.isTransparent())
+			continue;
+		auto buf = make_irr<scene::SMeshBuffer>();
+		buf->append(&p.vertices[0], p.vertices.size(), nullptr, 0);
+		MeshTriangle t;
+		t.buffer = buf.get();
+		for (u32 i = 0; i < p.indices.size(); i += 3) {
+			t.p1 = p.indices[i];
+			t.p2 = p.indices[i + 1];
+			t.p3 = p.indices[i + 2];
+			t.updateAttributes();
+			triangles.push_back(t);
+		}
+		buffers.push_back(std::move(buf));
+	}
+}
+
+}
+
+static void benchScene(MeshBenchmark &bench, const std::string &label, BlockScene &scene)
+{
+	BENCHMARK_ADVANCED("fillBlockData_" + label)(Catch::Benchmark::Chronometer meter) {
+		MeshMakeData data(bench.gamedef.ndef(), MAP_BLOCKSIZE, MeshGrid{1});
+		meter.measure([&] {
+			bench.fill(data, scene, true);
+		});
+	};
+
+	for (bool smooth : {false, true}) {
+		const std::string suffix = label + (smooth ? "_smooth" : "_flat");
+		std::unique_ptr<MeshMakeData> data(bench.makeData(scene, smooth));
+
+		BENCHMARK("MapblockMeshGenerator_" + suffix) {
+			MeshCollector collector(v3f(7.5f * BS), v3f());
+			MapblockMeshGenerator(data.get(), &collector).generate();
+			return collector.prebuffers[0].size();
+		};
+
+		BENCHMARK_ADVANCED("MapBlockMesh_" + suffix)(Catch::Benchmark::Chronometer meter) {
+			std::vector<std::unique_ptr<MapBlockMesh>> meshes(meter.runs());
+			// meshes are freed outside of the measurement
+			meter.measure([&] (int i) {
+				meshes[i] = std::make_unique<MapBlockMesh>(&bench.tsrc,
+					&bench.shdrsrc, data.get());
+			});
+		};
+	}
+
+	for (u8 lod = 1; lod <= MAX_MESH_LOD; lod++) {
+		std::unique_ptr<MeshMakeData> data(bench.makeData(scene, false));
+		data->m_lod = lod;
+
+		BENCHMARK("MapblockMeshGenerator_" + label + "_lod" + std::to_string(lod)) {
+			MeshCollector collector(v3f(7.5f * BS), v3f());
+			MapblockMeshGenerator(data.get(), &collector).generateLod();
+			return collector.prebuffers[0].size();
+		};
+	}
+
+	std::unique_ptr<MeshMakeData> data(bench.makeData(scene, true));
+	MeshCollector collector(v3f(7.5f * BS), v3f());
+	MapblockMeshGenerator(data.get(), &collector).generate();
+	std::vector<irr_ptr<scene::SMeshBuffer>> buffers;
+	std::vector<MeshTriangle> triangles;
+	collectTransparentTriangles(collector, buffers, triangles);
+
+	BENCHMARK("MapBlockBspTree_" + label + "_" + std::to_string(triangles.size())) {
+		MapBlockBspTree tree;
+		tree.buildTree(&triangles, MAP_BLOCKSIZE);
+		std::vector<s32> order;
+		tree.traverse(v3f(0, 20 * BS, 0), order);
+		return order.size();
+	};
+
+	BENCHMARK("MinimapMapblock_" + label) {
+		MinimapMapblock block;
+		block.getMinimapNodes(&data->m_vmanip, v3s16(0, 0, 0));
+		return block.data[0].height;
+	};
+}
+
+TEST_CASE("benchmark_mapblock_mesh")
+{
+	MeshBenchmark bench;
+
+	BlockScene terrain = bench.makeTerrain(42);
+	BlockScene mixed = bench.makeMixed(42);
+
+	benchScene(bench, "terrain", terrain);
+	benchScene(bench, "mixed", mixed);
+
+	// Meshes of a whole batch of blocks, like the mesh generator threads
+	// make them when many blocks arrive at once
+	const u32 batch_size = 64;
+	for (u32 threads : {1, 2, 4, 8}) {
+		BENCHMARK("MapBlockMesh_terrain_batch" + std::to_string(batch_size) +
+				"_threads" + std::to_string(threads)) {
+			std::vector<std::thread> workers;
+			for (u32 t = 0; t < threads; t++) {
+				workers.emplace_back([&, t] {
+					for (u32 i = t; i < batch_size; i += threads) {
+						std::unique_ptr<MeshMakeData> data(bench.makeData(terrain, true));
+						MapBlockMesh mesh(&bench.tsrc, &bench.shdrsrc, data.get());
+					}
+				});
+			}
+			for (auto &worker : workers)
+				worker.join();
+		};
+	}
+}
@@ -329,12 +329,8 @@ Client::~Client()
 	m_mesh_update_manager->wait();
 
 	MeshUpdateResult r;
-	while (m_mesh_update_manager->getNextResult(r)) {
-		for (auto block : r.map_blocks)
-			if (block)
-				block->refDrop();
+	while (m_mesh_update_manager->getNextResult(r))
 		delete r.mesh;
-	}
 
 	delete m_inventory_from_server;
 
@@ -650,10 +646,6 @@ void Client::step(float dtime)
 
 				blocks_to_ack.emplace_back(p);
 			}
-
-			for (auto block : r.map_blocks)
-				if (block)
-					block->refDrop();
 		}
 		if (blocks_to_ack.size() > 0) {
 				// Acknowledge block(s)
@@ -46,6 +46,7 @@ class NodeDefManager;
 class ParticleManager;
 class RenderingEngine;
 class SingleMediaDownloader;
+class ZstdDictionary;
 struct ChatMessage;
 struct ClientDynamicInfo;
 struct ClientEvent;
@@ -168,6 +169,8 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	void handleCommand_AddNode(NetworkPacket* pkt);
 	void handleCommand_NodemetaChanged(NetworkPacket *pkt);
 	void handleCommand_BlockData(NetworkPacket* pkt);
+	void handleCommand_BlockDelta(NetworkPacket *pkt);
+	void handleCommand_BlockDictionary(NetworkPacket *pkt);
 	void handleCommand_Inventory(NetworkPacket* pkt);
 	void handleCommand_TimeOfDay(NetworkPacket* pkt);
 	void handleCommand_ChatMessage(NetworkPacket *pkt);
@@ -559,6 +562,9 @@ class Client : public con::PeerHandler, public InventoryManager, public IGameDef
 	// own state
 	LocalClientState m_state;
 
+	// Dictionary the server may compress blocks with
+	std::unique_ptr<ZstdDictionary> m_block_dictionary;
+
 	// Used for saving server map to disk client-side
 	MapDatabase *m_localdb = nullptr;
 	IntervalLimiter m_localdb_save_interval;
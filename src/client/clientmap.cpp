@@ -18,8 +18,11 @@
 #include "util/basic_macros.h"
 #include "util/tracy_wrapper.h"
 #include "client/renderingengine.h"
+#include "threading/thread.h"
+#include "threading/thread_pool.h"
 
-#include <queue>
+#include <algorithm>
+#include <functional>
 
 namespace {
 	// data structure that groups block meshes by material
@@ -144,6 +147,7 @@ static const std::string ClientMap_settings[] = {
 	"anisotropic_filter",
 	"transparency_sorting_group_by_buffers",
 	"transparency_sorting_distance",
+	"mesh_lod_distance",
 	"occlusion_culler",
 	"enable_raytraced_culling",
 };
@@ -159,8 +163,7 @@ ClientMap::ClientMap(
 		rendering_engine->get_scene_manager(), id),
 	m_client(client),
 	m_rendering_engine(rendering_engine),
-	m_control(control),
-	m_drawlist(MapBlockComparer(v3s16(0,0,0)))
+	m_control(control)
 {
 
 	/*
@@ -174,6 +177,10 @@ ClientMap::ClientMap(
 		g_settings->registerChangedCallback(name, on_settings_changed, this);
 	// load all settings at once
 	onSettingChanged("", true);
+
+	// The main thread helps out, leave some cores to the mesh generator threads
+	unsigned int culling_threads = MYMIN(3U, Thread::getNumberOfProcessors() / 2);
+	m_culling_pool = std::make_unique<ThreadPool>("DrawList", culling_threads);
 }
 
 void ClientMap::onSettingChanged(std::string_view name, bool all)
@@ -189,6 +196,8 @@ void ClientMap::onSettingChanged(std::string_view name, bool all)
 				g_settings->getBool("transparency_sorting_group_by_buffers");
 	if (all || name == "transparency_sorting_distance")
 		m_cache_transparency_sorting_distance = g_settings->getU16("transparency_sorting_distance");
+	if (all || name == "mesh_lod_distance")
+		m_cache_mesh_lod_distance = g_settings->getU16("mesh_lod_distance");
 	if (all || name == "occlusion_culler")
 		m_loops_occlusion_culler = g_settings->get("occlusion_culler") == "loops";
 	if (all || name == "enable_raytraced_culling")
@@ -320,6 +329,9 @@ class MapBlockFlags
 			return bits[address];
 		}
 
+		// Whether the chunk is outside of the view frustum, -1 if not known yet
+		s8 frustum_culled = -1;
+
 	private:
 		inline std::size_t getAddress(v3s16 pos) {
 			std::size_t address = (pos.X & CHUNK_MASK) + (pos.Y & CHUNK_MASK) * CHUNK_EDGE + (pos.Z & CHUNK_MASK) * (CHUNK_EDGE * CHUNK_EDGE);
@@ -340,6 +352,13 @@ class MapBlockFlags
 		}
 		return *chunk;
 	}
+
+	// Returns the position of the first block (or mesh cell) in the chunk of pos
+	v3s16 getChunkOrigin(v3s16 pos) const
+	{
+		return min_pos + (pos - min_pos) / CHUNK_EDGE * CHUNK_EDGE;
+	}
+
 private:
 	std::vector<std::unique_ptr<Chunk>> chunks;
 	v3s16 min_pos;
@@ -352,12 +371,6 @@ void ClientMap::updateDrawList()
 
 	m_needs_update_drawlist = false;
 
-	for (auto &i : m_drawlist) {
-		MapBlock *block = i.second;
-		block->refDrop();
-	}
-	m_drawlist.clear();
-
 	for (auto &block : m_keeplist) {
 		block->refDrop();
 	}
@@ -387,10 +400,13 @@ void ClientMap::updateDrawList()
 	}
 
 	const v3s16 camera_block = getContainerPos(cam_pos_nodes, MAP_BLOCKSIZE);
-	m_drawlist = decltype(m_drawlist)(MapBlockComparer(camera_block));
 
 	auto is_frustum_culled = m_client->getCamera()->getFrustumCuller();
 
+	// Frustum culling is only coarse here, to account for fast camera movement.
+	// This is needed because this function is not called every frame.
+	const float frustum_cull_extra_radius = 300.0f;
+
 	// Uncomment to debug occluded blocks in the wireframe mode
 	// TODO: Include this as a flag for an extended debugging setting
 	// if (occlusion_culling_enabled && m_control.show_wireframe)
@@ -399,6 +415,18 @@ void ClientMap::updateDrawList()
 	// Set of mesh holding blocks
 	std::set<v3s16> shortlist;
 
+	// The blocks are culled on several threads, which only read the map
+	m_sector_cache_frozen = true;
+	auto run_parallel = [&] (size_t count, const std::function<void(size_t)> &fn) {
+		// not worth waking up the threads for
+		if (count < 64) {
+			for (size_t i = 0; i < count; i++)
+				fn(i);
+		} else {
+			m_culling_pool->parallelFor(count, fn);
+		}
+	};
+
 	/*
 	 When range_all is enabled, enumerate all blocks visible in the
 	 frustum and display them.
@@ -409,7 +437,11 @@ void ClientMap::updateDrawList()
 		// Number of blocks with mesh in rendering range
 		u32 blocks_in_range_with_mesh = 0;
 
-		MapBlockVect sectorblocks;
+		// Sectors are culled by their horizontal distance first, then the
+		// blocks in them. Meshes can reach out of their sector.
+		const f32 sector_range = m_control.wanted_range * BS +
+				1.5f * mesh_grid.cell_size * MAP_BLOCKSIZE * BS;
+		std::vector<const MapSector *> sectors;
 
 		for (auto &sector_it : m_sectors) {
 			const MapSector *sector = sector_it.second;
@@ -420,10 +452,32 @@ void ClientMap::updateDrawList()
 				if (sp.X < p_blocks_min.X || sp.X > p_blocks_max.X ||
 						sp.Y < p_blocks_min.Z || sp.Y > p_blocks_max.Z)
 					continue;
+
+				f32 min_x = (sp.X * MAP_BLOCKSIZE - 0.5f) * BS;
+				f32 min_z = (sp.Y * MAP_BLOCKSIZE - 0.5f) * BS;
+				f32 dx = std::max({min_x - m_camera_position.X,
+						m_camera_position.X - (min_x + MAP_BLOCKSIZE * BS), 0.0f});
+				f32 dz = std::max({min_z - m_camera_position.Z,
+						m_camera_position.Z - (min_z + MAP_BLOCKSIZE * BS), 0.0f});
+				if (dx * dx + dz * dz > sector_range * sector_range)
+					continue;
 			}
+			sectors.push_back(sector);
+		}
+
+		struct SectorCulling {
+			std::vector<MapBlock *> blocks;
+			u32 in_range = 0;
+			u32 frustum_culled = 0;
+			u32 occlusion_culled = 0;
+		};
+		std::vector<SectorCulling> results(sectors.size());
+
+		run_parallel(sectors.size(), [&] (size_t i) {
+			SectorCulling &result = results[i];
 
 			// Loop through blocks in sector
-			for (const auto &entry : sector->getBlocks()) {
+			for (const auto &entry : sectors[i]->getBlocks()) {
 				MapBlock *block = entry.second.get();
 				MapBlockMesh *mesh = block->mesh;
 
@@ -451,15 +505,12 @@ void ClientMap::updateDrawList()
 
 				// Keep the block alive as long as it is in range.
 				block->resetUsageTimer();
-				blocks_in_range_with_mesh++;
+				result.in_range++;
 
 				// Frustum culling
-				// Only do coarse culling here, to account for fast camera movement.
-				// This is needed because this function is not called every frame.
-				float frustum_cull_extra_radius = 300.0f;
 				if (is_frustum_culled(mesh_sphere_center,
 						mesh_sphere_radius + frustum_cull_extra_radius)) {
-					blocks_frustum_culled++;
+					result.frustum_culled++;
 					continue;
 				}
 
@@ -467,10 +518,21 @@ void ClientMap::updateDrawList()
 				if (!m_control.range_all && occlusion_culling_enabled && m_enable_raytraced_culling &&
 						mesh &&
 						isMeshOccluded(block, mesh_grid.cell_size, cam_pos_nodes)) {
-					blocks_occlusion_culled++;
+					result.occlusion_culled++;
 					continue;
 				}
 
+				if (mesh_grid.cell_size > 1 || mesh)
+					result.blocks.push_back(block);
+			}
+		});
+
+		for (SectorCulling &result : results) {
+			blocks_in_range_with_mesh += result.in_range;
+			blocks_frustum_culled += result.frustum_culled;
+			blocks_occlusion_culled += result.occlusion_culled;
+
+			for (MapBlock *block : result.blocks) {
 				if (mesh_grid.cell_size > 1) {
 					// Block meshes are stored in the corner block of a chunk
 					// (where all coordinate are divisible by the chunk size)
@@ -479,10 +541,10 @@ void ClientMap::updateDrawList()
 					// All other blocks we can grab and add to the keeplist right away.
 					m_keeplist.push_back(block);
 					block->refGrab();
-				} else if (mesh) {
+				} else {
 					// without mesh chunking we can add the block to the drawlist
 					block->refGrab();
-					m_drawlist.emplace(block->getPos(), block);
+					m_drawlist_next.emplace_back(block->getPos(), block);
 				}
 			}
 		}
@@ -495,220 +557,327 @@ void ClientMap::updateDrawList()
 		// Block sides that were not traversed
 		u32 sides_skipped = 0;
 
-		std::queue<v3s16> blocks_to_consider;
-
 		v3s16 camera_mesh = mesh_grid.getMeshPos(camera_block);
 		v3s16 camera_cell = mesh_grid.getCellPos(camera_block);
 
 		// Bits per block:
-		// [ visited | 0 | 0 | 0 | 0 | Z visible | Y visible | X visible ]
+		// [ queued | 0 | 0 | 0 | 0 | Z visible | Y visible | X visible ]
 		MapBlockFlags meshes_seen(mesh_grid.getCellPos(p_blocks_min), mesh_grid.getCellPos(p_blocks_max) + 1);
 
-		// Start breadth-first search with the block the camera is in
-		blocks_to_consider.push(camera_mesh);
-		meshes_seen.getChunk(camera_cell).getBits(camera_cell) = 0x07; // mark all sides as visible
+		// Chunks of mesh cells that are entirely outside of the frustum
+		// are culled at once, without looking at the cells in them
+		const f32 chunk_size = MapBlockFlags::CHUNK_EDGE * mesh_grid.cell_size * MAP_BLOCKSIZE * BS;
+		auto is_chunk_frustum_culled = [&] (v3s16 cell) {
+			MapBlockFlags::Chunk &chunk = meshes_seen.getChunk(cell);
+			if (chunk.frustum_culled < 0) {
+				v3s16 origin = meshes_seen.getChunkOrigin(cell) * mesh_grid.cell_size;
+				v3f center = intToFloat(origin * MAP_BLOCKSIZE, BS) +
+						v3f(0.5f * chunk_size - 0.5f * BS);
+				chunk.frustum_culled = is_frustum_culled(center,
+						0.87f * chunk_size + frustum_cull_extra_radius);
+			}
+			return chunk.frustum_culled != 0;
+		};
 
-		// Recursively walk the space and pick mapblocks for drawing
-		while (!blocks_to_consider.empty()) {
+		// What culling found out about a mesh cell
+		struct CellCulling {
+			MapBlock *block;
+			bool drawn;
+			bool frustum_culled;
+			bool occlusion_culled;
+			u8 sides_skipped;
+			// Cells to visit next and their sides to mark as visible
+			u8 next_count;
+			std::array<std::pair<v3s16, u8>, 6> next;
+		};
+		std::vector<CellCulling> results;
 
-			v3s16 block_coord = blocks_to_consider.front();
-			blocks_to_consider.pop();
+		// Visit the cells in layers of the same (Manhattan) distance to the
+		// camera cell, each layer in parallel. The search only moves away from
+		// the camera, so all sides of a cell are known when its layer comes up.
+		std::vector<v3s16> layer{camera_mesh};
+		std::vector<v3s16> next_layer;
+		meshes_seen.getChunk(camera_cell).getBits(camera_cell) = 0x47; // mark all sides as visible
 
-			v3s16 cell_coord = mesh_grid.getCellPos(block_coord);
-			auto &flags = meshes_seen.getChunk(cell_coord).getBits(cell_coord);
+		// Walk the space and pick mapblocks for drawing
+		while (!layer.empty()) {
+			blocks_visited += layer.size();
+			results.resize(layer.size());
 
-			// Only visit each block once (it may have been queued up to three times)
-			if ((flags & 0x80) == 0x80)
-				continue;
-			flags |= 0x80;
+			run_parallel(layer.size(), [&] (size_t i) {
+				v3s16 block_coord = layer[i];
+				CellCulling &result = results[i];
+				result = {};
 
-			blocks_visited++;
+				v3s16 cell_coord = mesh_grid.getCellPos(block_coord);
+				u8 flags = meshes_seen.getChunk(cell_coord).getBits(cell_coord);
 
-			// Get the sector, block and mesh
-			MapSector *sector = this->getSectorNoGenerate(v2s16(block_coord.X, block_coord.Z));
+				// Get the sector, block and mesh
+				MapSector *sector = this->getSectorNoGenerate(v2s16(block_coord.X, block_coord.Z));
 
-			MapBlock *block = sector ? sector->getBlockNoCreateNoEx(block_coord.Y) : nullptr;
+				MapBlock *block = sector ? sector->getBlockNoCreateNoEx(block_coord.Y) : nullptr;
+				result.block = block;
 
-			MapBlockMesh *mesh = block ? block->mesh : nullptr;
+				MapBlockMesh *mesh = block ? block->mesh : nullptr;
 
-			// Calculate the coordinates for range and frustum culling
-			v3f mesh_sphere_center;
-			f32 mesh_sphere_radius;
+				// Calculate the coordinates for range and frustum culling
+				v3f mesh_sphere_center;
+				f32 mesh_sphere_radius;
 
-			v3s16 block_pos_nodes = block_coord * MAP_BLOCKSIZE;
+				v3s16 block_pos_nodes = block_coord * MAP_BLOCKSIZE;
 
-			if (mesh) {
-				mesh_sphere_center = intToFloat(block_pos_nodes, BS)
-						+ mesh->getBoundingSphereCenter();
-				mesh_sphere_radius = mesh->getBoundingRadius();
-			} else {
-				mesh_sphere_center = intToFloat(block_pos_nodes, BS) + v3f((mesh_grid.cell_size * MAP_BLOCKSIZE * 0.5f - 0.5f) * BS);
-				mesh_sphere_radius = 0.87f * mesh_grid.cell_size * MAP_BLOCKSIZE * BS;
-			}
-
-			// First, perform a simple distance check.
-			if (!m_control.range_all &&
-				mesh_sphere_center.getDistanceFrom(intToFloat(cam_pos_nodes, BS)) >
-					m_control.wanted_range * BS + mesh_sphere_radius)
-				continue; // Out of range, skip.
+				if (mesh) {
+					mesh_sphere_center = intToFloat(block_pos_nodes, BS)
+							+ mesh->getBoundingSphereCenter();
+					mesh_sphere_radius = mesh->getBoundingRadius();
+				} else {
+					mesh_sphere_center = intToFloat(block_pos_nodes, BS) + v3f((mesh_grid.cell_size * MAP_BLOCKSIZE * 0.5f - 0.5f) * BS);
+					mesh_sphere_radius = 0.87f * mesh_grid.cell_size * MAP_BLOCKSIZE * BS;
+				}
 
-			// Frustum culling
-			// Only do coarse culling here, to account for fast camera movement.
-			// This is needed because this function is not called every frame.
-			float frustum_cull_extra_radius = 300.0f;
-			if (is_frustum_culled(mesh_sphere_center,
-					mesh_sphere_radius + frustum_cull_extra_radius)) {
-				blocks_frustum_culled++;
-				continue;
-			}
+				// First, perform a simple distance check.
+				if (!m_control.range_all &&
+					mesh_sphere_center.getDistanceFrom(intToFloat(cam_pos_nodes, BS)) >
+						m_control.wanted_range * BS + mesh_sphere_radius)
+					return; // Out of range, skip.
 
-			// Calculate the vector from the camera block to the current block
-			// We use it to determine through which sides of the current block we can continue the search
-			v3s16 look = block_coord - camera_mesh;
+				// Frustum culling
+				if (is_frustum_culled(mesh_sphere_center,
+						mesh_sphere_radius + frustum_cull_extra_radius)) {
+					result.frustum_culled = true;
+					return;
+				}
 
-			// Occluded near sides will further occlude the far sides
-			u8 visible_outer_sides = flags & 0x07;
+				// Calculate the vector from the camera block to the current block
+				// We use it to determine through which sides of the current block we can continue the search
+				v3s16 look = block_coord - camera_mesh;
 
-			// Raytraced occlusion culling - send rays from the camera to the block's corners
-			if (occlusion_culling_enabled && m_enable_raytraced_culling &&
-					block && mesh &&
-					visible_outer_sides != 0x07 && isMeshOccluded(block, mesh_grid.cell_size, cam_pos_nodes)) {
-				blocks_occlusion_culled++;
-				continue;
-			}
+				// Occluded near sides will further occlude the far sides
+				u8 visible_outer_sides = flags & 0x07;
 
-			if (mesh_grid.cell_size > 1) {
-				// Block meshes are stored in the corner block of a chunk
-				// (where all coordinate are divisible by the chunk size)
-				// Add them to the de-dup set.
-				shortlist.emplace(block_coord.X, block_coord.Y, block_coord.Z);
-				// All other blocks we can grab and add to the keeplist right away.
-				if (block) {
-					m_keeplist.push_back(block);
-					block->refGrab();
+				// Raytraced occlusion culling - send rays from the camera to the block's corners
+				if (occlusion_culling_enabled && m_enable_raytraced_culling &&
+						block && mesh &&
+						visible_outer_sides != 0x07 && isMeshOccluded(block, mesh_grid.cell_size, cam_pos_nodes)) {
+					result.occlusion_culled = true;
+					return;
 				}
-			} else if (mesh) {
-				// without mesh chunking we can add the block to the drawlist
-				block->refGrab();
-				m_drawlist.emplace(block_coord, block);
-			}
 
-			// Decide which sides to traverse next or to block away
+				result.drawn = mesh_grid.cell_size > 1 || mesh;
 
-			// First, find the near sides that would occlude the far sides
-			// * A near side can itself be occluded by a nearby block (the test above ^^)
-			// * A near side can be visible but fully opaque by itself (e.g. ground at the 0 level)
+				// Decide which sides to traverse next or to block away
 
-			// mesh solid sides are +Z-Z+Y-Y+X-X
-			// if we are inside the block's coordinates on an axis,
-			// treat these sides as opaque, as they should not allow to reach the far sides
-			u8 block_inner_sides = (look.X == 0 ? 3 : 0) |
-				(look.Y == 0 ? 12 : 0) |
-				(look.Z == 0 ? 48 : 0);
+				// First, find the near sides that would occlude the far sides
+				// * A near side can itself be occluded by a nearby block (the test above ^^)
+				// * A near side can be visible but fully opaque by itself (e.g. ground at the 0 level)
 
-			// get the mask for the sides that are relevant based on the direction
-			u8 near_inner_sides = (look.X > 0 ? 1 : 2) |
-					(look.Y > 0 ? 4 : 8) |
-					(look.Z > 0 ? 16 : 32);
+				// mesh solid sides are +Z-Z+Y-Y+X-X
+				// if we are inside the block's coordinates on an axis,
+				// treat these sides as opaque, as they should not allow to reach the far sides
+				u8 block_inner_sides = (look.X == 0 ? 3 : 0) |
+					(look.Y == 0 ? 12 : 0) |
+					(look.Z == 0 ? 48 : 0);
 
-			// This bitset is +Z-Z+Y-Y+X-X (See MapBlockMesh), and axis is XYZ.
-			// Get he block's transparent sides
-			u8 transparent_sides = (occlusion_culling_enabled && block) ? ~block->solid_sides : 0x3F;
+				// get the mask for the sides that are relevant based on the direction
+				u8 near_inner_sides = (look.X > 0 ? 1 : 2) |
+						(look.Y > 0 ? 4 : 8) |
+						(look.Z > 0 ? 16 : 32);
 
-			// compress block transparent sides to ZYX mask of see-through axes
-			u8 near_transparency =  (block_inner_sides == 0x3F) ? near_inner_sides : (transparent_sides & near_inner_sides);
+				// This bitset is +Z-Z+Y-Y+X-X (See MapBlockMesh), and axis is XYZ.
+				// Get he block's transparent sides
+				u8 transparent_sides = (occlusion_culling_enabled && block) ? ~block->solid_sides : 0x3F;
 
-			// when we are inside the camera block, do not block any sides
-			if (block_inner_sides == 0x3F)
-				block_inner_sides = 0;
+				// compress block transparent sides to ZYX mask of see-through axes
+				u8 near_transparency =  (block_inner_sides == 0x3F) ? near_inner_sides : (transparent_sides & near_inner_sides);
 
-			near_transparency &= ~block_inner_sides & 0x3F;
+				// when we are inside the camera block, do not block any sides
+				if (block_inner_sides == 0x3F)
+					block_inner_sides = 0;
 
-			near_transparency |= (near_transparency >> 1);
-			near_transparency = (near_transparency & 1) |
-					((near_transparency >> 1) & 2) |
-					((near_transparency >> 2) & 4);
+				near_transparency &= ~block_inner_sides & 0x3F;
 
-			// combine with known visible sides that matter
-			near_transparency &= visible_outer_sides;
+				near_transparency |= (near_transparency >> 1);
+				near_transparency = (near_transparency & 1) |
+						((near_transparency >> 1) & 2) |
+						((near_transparency >> 2) & 4);
 
-			// The rule for any far side to be visible:
-			// * Any of the adjacent near sides is transparent (different axes)
-			// * The opposite near side (same axis) is transparent, if it is the dominant axis of the look vector
+				// combine with known visible sides that matter
+				near_transparency &= visible_outer_sides;
 
-			// Calculate vector from camera to mapblock center. Because we only need relation between
-			// coordinates we scale by 2 to avoid precision loss.
-			v3s16 precise_look = 2 * (block_pos_nodes - cam_pos_nodes) + mesh_grid.cell_size * MAP_BLOCKSIZE - 1;
+				// The rule for any far side to be visible:
+				// * Any of the adjacent near sides is transparent (different axes)
+				// * The opposite near side (same axis) is transparent, if it is the dominant axis of the look vector
 
-			// dominant axis flag
-			u8 dominant_axis = (abs(precise_look.X) > abs(precise_look.Y) && abs(precise_look.X) > abs(precise_look.Z)) |
-						((abs(precise_look.Y) > abs(precise_look.Z) && abs(precise_look.Y) > abs(precise_look.X)) << 1) |
-						((abs(precise_look.Z) > abs(precise_look.X) && abs(precise_look.Z) > abs(precise_look.Y)) << 2);
+				// Calculate vector from camera to mapblock center. Because we only need relation between
+				// coordinates we scale by 2 to avoid precision loss.
+				v3s16 precise_look = 2 * (block_pos_nodes - cam_pos_nodes) + mesh_grid.cell_size * MAP_BLOCKSIZE - 1;
 
-			// Queue next blocks for processing:
-			// - Examine "far" sides of the current blocks, i.e. never move towards the camera
-			// - Only traverse the sides that are not occluded
-			// - Only traverse the sides that are not opaque
-			// When queueing, mark the relevant side on the next block as 'visible'
-			for (s16 axis = 0; axis < 3; axis++) {
+				// dominant axis flag
+				u8 dominant_axis = (abs(precise_look.X) > abs(precise_look.Y) && abs(precise_look.X) > abs(precise_look.Z)) |
+							((abs(precise_look.Y) > abs(precise_look.Z) && abs(precise_look.Y) > abs(precise_look.X)) << 1) |
+							((abs(precise_look.Z) > abs(precise_look.X) && abs(precise_look.Z) > abs(precise_look.Y)) << 2);
 
-				// Select a bit from transparent_sides for the side
-				u8 far_side_mask = 1 << (2 * axis);
+				// Queue next blocks for processing:
+				// - Examine "far" sides of the current blocks, i.e. never move towards the camera
+				// - Only traverse the sides that are not occluded
+				// - Only traverse the sides that are not opaque
+				// When queueing, mark the relevant side on the next block as 'visible'
+				for (s16 axis = 0; axis < 3; axis++) {
 
-				// axis flag
-				u8 my_side = 1 << axis;
-				u8 adjacent_sides = my_side ^ 0x07;
+					// Select a bit from transparent_sides for the side
+					u8 far_side_mask = 1 << (2 * axis);
 
-				auto traverse_far_side = [&](s8 next_pos_offset) {
-					// far side is visible if adjacent near sides are transparent, or if opposite side on dominant axis is transparent
-					bool side_visible = ((near_transparency & adjacent_sides) | (near_transparency & my_side & dominant_axis)) != 0;
-					side_visible = side_visible && ((far_side_mask & transparent_sides) != 0);
+					// axis flag
+					u8 my_side = 1 << axis;
+					u8 adjacent_sides = my_side ^ 0x07;
 
-					v3s16 next_pos = block_coord;
-					next_pos[axis] += next_pos_offset;
+					auto traverse_far_side = [&](s8 next_pos_offset) {
+						// far side is visible if adjacent near sides are transparent, or if opposite side on dominant axis is transparent
+						bool side_visible = ((near_transparency & adjacent_sides) | (near_transparency & my_side & dominant_axis)) != 0;
+						side_visible = side_visible && ((far_side_mask & transparent_sides) != 0);
 
-					v3s16 next_cell = mesh_grid.getCellPos(next_pos);
+						v3s16 next_pos = block_coord;
+						next_pos[axis] += next_pos_offset;
 
-					// If a side is a see-through, mark the next block's side as visible, and queue
-					if (side_visible) {
-						auto &next_flags = meshes_seen.getChunk(next_cell).getBits(next_cell);
-						next_flags |= my_side;
-						blocks_to_consider.push(next_pos);
-					}
-					else {
-						sides_skipped++;
-					}
-				};
+						// If a side is a see-through, mark the next block's side as visible, and queue
+						if (side_visible)
+							result.next[result.next_count++] = {next_pos, my_side};
+						else
+							result.sides_skipped++;
+					};
+
+
+					// Test the '-' direction of the axis
+					if (look[axis] <= 0 && block_coord[axis] > p_blocks_min[axis])
+						traverse_far_side(-mesh_grid.cell_size);
 
+					// Test the '+' direction of the axis
+					far_side_mask <<= 1;
 
-				// Test the '-' direction of the axis
-				if (look[axis] <= 0 && block_coord[axis] > p_blocks_min[axis])
-					traverse_far_side(-mesh_grid.cell_size);
+					if (look[axis] >= 0 && block_coord[axis] < p_blocks_max[axis])
+						traverse_far_side(+mesh_grid.cell_size);
+				}
+			});
 
-				// Test the '+' direction of the axis
-				far_side_mask <<= 1;
+			next_layer.clear();
+			for (size_t i = 0; i < layer.size(); i++) {
+				const CellCulling &result = results[i];
+				blocks_frustum_culled += result.frustum_culled;
+				blocks_occlusion_culled += result.occlusion_culled;
+				sides_skipped += result.sides_skipped;
+
+				if (result.drawn) {
+					if (mesh_grid.cell_size > 1) {
+						// Block meshes are stored in the corner block of a chunk
+						// (where all coordinate are divisible by the chunk size)
+						// Add them to the de-dup set.
+						shortlist.emplace(layer[i]);
+						// All other blocks we can grab and add to the keeplist right away.
+						if (result.block) {
+							m_keeplist.push_back(result.block);
+							result.block->refGrab();
+						}
+					} else {
+						// without mesh chunking we can add the block to the drawlist
+						result.block->refGrab();
+						m_drawlist_next.emplace_back(layer[i], result.block);
+					}
+				}
 
-				if (look[axis] >= 0 && block_coord[axis] < p_blocks_max[axis])
-					traverse_far_side(+mesh_grid.cell_size);
+				for (u8 j = 0; j < result.next_count; j++) {
+					auto [next_pos, side] = result.next[j];
+					v3s16 next_cell = mesh_grid.getCellPos(next_pos);
+					u8 &next_flags = meshes_seen.getChunk(next_cell).getBits(next_cell);
+					next_flags |= side;
+					// Only visit each block once (it may be reached from up to three sides)
+					if (next_flags & 0x40)
+						continue;
+					next_flags |= 0x40;
+					if (is_chunk_frustum_culled(next_cell)) {
+						blocks_frustum_culled++;
+						continue;
+					}
+					next_layer.push_back(next_pos);
+				}
 			}
+			layer.swap(next_layer);
 		}
 		g_profiler->avg("MapBlocks sides skipped [#]", sides_skipped);
 		g_profiler->avg("MapBlocks examined [#]", blocks_visited);
 	}
+	m_sector_cache_frozen = false;
+
 	g_profiler->avg("MapBlocks shortlist [#]", shortlist.size());
 
-	assert(m_drawlist.empty() || shortlist.empty());
+	assert(m_drawlist_next.empty() || shortlist.empty());
 	for (auto pos : shortlist) {
 		MapBlock *block = getBlockNoCreateNoEx(pos);
 		if (block) {
 			block->refGrab();
-			m_drawlist.emplace(pos, block);
+			m_drawlist_next.emplace_back(pos, block);
 		}
 	}
+	std::sort(m_drawlist_next.begin(), m_drawlist_next.end(),
+			MapBlockComparer(camera_block));
+
+	// Swap in the new draw list and release the old one,
+	// keeping its memory for the next update
+	m_drawlist.swap(m_drawlist_next);
+	for (auto &i : m_drawlist_next)
+		i.second->refDrop();
+	m_drawlist_next.clear();
 
 	g_profiler->avg("MapBlocks occlusion culled [#]", blocks_occlusion_culled);
 	g_profiler->avg("MapBlocks frustum culled [#]", blocks_frustum_culled);
 	g_profiler->avg("MapBlocks drawn [#]", m_drawlist.size());
+
+	updateMeshLods();
+}
+
+// Level of detail of meshes at the given distance, in nodes, from the camera.
+// Every time the distance doubles, the detail halves.
+static u8 getLodForDistance(f32 distance, u16 lod_distance)
+{
+	if (lod_distance == 0 || distance < lod_distance)
+		return 0;
+	u8 lod = 1;
+	while (lod < MAX_MESH_LOD && distance >= 2 * lod_distance) {
+		distance /= 2;
+		lod++;
+	}
+	return lod;
+}
+
+u8 ClientMap::getMeshLod(v3s16 mesh_pos) const
+{
+	const MeshGrid mesh_grid = m_client->getMeshGrid();
+	const v3f center = intToFloat(mesh_pos * MAP_BLOCKSIZE, BS) +
+			v3f((mesh_grid.cell_size * MAP_BLOCKSIZE * 0.5f - 0.5f) * BS);
+	return getLodForDistance(center.getDistanceFrom(m_camera_position) / BS,
+			m_cache_mesh_lod_distance);
+}
+
+void ClientMap::updateMeshLods()
+{
+	const MeshGrid mesh_grid = m_client->getMeshGrid();
+	// Don't switch back and forth when moving along a boundary
+	const f32 margin = mesh_grid.cell_size * MAP_BLOCKSIZE * 0.5f;
+
+	u32 meshes_requested = 0;
+	for (auto &i : m_drawlist) {
+		MapBlockMesh *mesh = i.second->mesh;
+		if (!mesh)
+			continue;
+		f32 distance = (intToFloat(i.first * MAP_BLOCKSIZE, BS) +
+				mesh->getBoundingSphereCenter()).getDistanceFrom(m_camera_position) / BS;
+		u8 lod = mesh->getLod();
+		if (lod > getLodForDistance(distance + margin, m_cache_mesh_lod_distance) ||
+				lod < getLodForDistance(std::max(distance - margin, 0.0f), m_cache_mesh_lod_distance)) {
+			m_client->addUpdateMeshTask(i.first, false, false);
+			meshes_requested++;
+		}
+	}
+	g_profiler->avg("MapBlock meshes LOD changed [#]", meshes_requested);
 }
 
 void ClientMap::touchMapBlocks()
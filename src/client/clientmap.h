@@ -9,6 +9,7 @@
 #include "camera.h"
 #include <set>
 #include <map>
+#include <memory>
 
 struct MapDrawControl
 {
@@ -25,6 +26,7 @@ struct MapDrawControl
 class Client;
 class ITextureSource;
 class PartialMeshBuffer;
+class ThreadPool;
 
 namespace irr::scene
 {
@@ -107,6 +109,10 @@ class ClientMap : public Map, public scene::ISceneNode
 
 	void invalidateMapBlockMesh(MapBlockMesh *mesh);
 
+	// Returns the level of detail (see MeshMakeData::m_lod) the mesh at
+	// mesh_pos should be generated with, given the camera position
+	u8 getMeshLod(v3s16 mesh_pos) const;
+
 	// For debug printing
 	void PrintInfo(std::ostream &out) override;
 
@@ -124,17 +130,27 @@ class ClientMap : public Map, public scene::ISceneNode
 private:
 	bool isMeshOccluded(MapBlock *mesh_block, u16 mesh_size, v3s16 cam_pos_nodes);
 
+	// Requests new meshes for the drawn blocks whose level of detail
+	// no longer fits their distance to the camera
+	void updateMeshLods();
+
 	// update the vertex order in transparent mesh buffers
 	void updateTransparentMeshBuffers();
 
-	// Orders blocks by distance to the camera
+	// Blocks to draw with their positions
+	using DrawList = std::vector<std::pair<v3s16, MapBlock*>>;
+
+	// Orders blocks by distance to the camera, from far to near
 	class MapBlockComparer
 	{
 	public:
 		MapBlockComparer(const v3s16 &camera_block) : m_camera_block(camera_block) {}
 
-		bool operator() (const v3s16 &left, const v3s16 &right) const
+		bool operator() (const DrawList::value_type &left_entry,
+				const DrawList::value_type &right_entry) const
 		{
+			const v3s16 &left = left_entry.first;
+			const v3s16 &right = right_entry.first;
 			auto distance_left = left.getDistanceFromSQ(m_camera_block);
 			auto distance_right = right.getDistanceFromSQ(m_camera_block);
 			return distance_left > distance_right || (distance_left == distance_right && left > right);
@@ -159,8 +175,13 @@ class ClientMap : public Map, public scene::ISceneNode
 	video::SColor m_camera_light_color = video::SColor(0xFFFFFFFF);
 	bool m_needs_update_transparent_meshes = true;
 
-	std::map<v3s16, MapBlock*, MapBlockComparer> m_drawlist;
+	// Sorted with MapBlockComparer
+	DrawList m_drawlist;
+	// The next draw list is built here, then swapped with m_drawlist
+	DrawList m_drawlist_next;
 	std::vector<MapBlock*> m_keeplist;
+	// Threads that help with culling in updateDrawList()
+	std::unique_ptr<ThreadPool> m_culling_pool;
 	std::map<v3s16, MapBlock*> m_drawlist_shadow;
 	bool m_needs_update_drawlist;
 	CachedMeshBuffers m_dynamic_buffers;
@@ -170,6 +191,7 @@ class ClientMap : public Map, public scene::ISceneNode
 	bool m_cache_anistropic_filter;
 	bool m_cache_transparency_sorting_group_by_buffers;
 	u16 m_cache_transparency_sorting_distance;
+	u16 m_cache_mesh_lod_distance;
 
 	bool m_loops_occlusion_culler;
 	bool m_enable_raytraced_culling;
@@ -31,6 +31,16 @@ bool clientMediaUpdateCache(const std::string &raw_hash, const std::string &file
 	return false;
 }
 
+bool clientMediaLoadCache(const std::string &raw_hash, std::string &filedata)
+{
+	FileCache media_cache(getMediaCacheDir());
+	std::ostringstream os(std::ios_base::binary);
+	if (!media_cache.load(hex_encode(raw_hash), os))
+		return false;
+	filedata = os.str();
+	return true;
+}
+
 bool clientMediaUpdateCacheCopy(const std::string &raw_hash, const std::string &path)
 {
 	FileCache media_cache(getMediaCacheDir());
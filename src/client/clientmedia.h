@@ -24,6 +24,11 @@ struct HTTPFetchResult;
 bool clientMediaUpdateCache(const std::string &raw_hash,
 	const std::string &filedata);
 
+// Read file from media cache
+// Caller should check the hash.
+// return true if it was found
+bool clientMediaLoadCache(const std::string &raw_hash, std::string &filedata);
+
 // Copy file on disk(!) into media cache (unless it exists already)
 bool clientMediaUpdateCacheCopy(const std::string &raw_hash,
 	const std::string &path);
@@ -1771,15 +1771,196 @@ void MapblockMeshGenerator::drawNode()
 	}
 }
 
+void MapblockMeshGenerator::generateRow()
+{
+	collector->startRow(getRow(cur_node.p.Y, cur_node.p.Z, data->m_side_length));
+	for (cur_node.p.X = 0; cur_node.p.X < data->m_side_length; cur_node.p.X++) {
+		cur_node.n = data->m_vmanip.getNodeNoEx(blockpos_nodes + cur_node.p);
+		cur_node.f = &nodedef->get(cur_node.n);
+		drawNode();
+	}
+}
+
 void MapblockMeshGenerator::generate()
 {
 	ZoneScoped;
 
 	for (cur_node.p.Z = 0; cur_node.p.Z < data->m_side_length; cur_node.p.Z++)
 	for (cur_node.p.Y = 0; cur_node.p.Y < data->m_side_length; cur_node.p.Y++)
-	for (cur_node.p.X = 0; cur_node.p.X < data->m_side_length; cur_node.p.X++) {
-		cur_node.n = data->m_vmanip.getNodeNoEx(blockpos_nodes + cur_node.p);
-		cur_node.f = &nodedef->get(cur_node.n);
-		drawNode();
+		generateRow();
+}
+
+void MapblockMeshGenerator::generate(const MeshCollector &old,
+		const std::vector<bool> &dirty)
+{
+	ZoneScoped;
+
+	size_t strip = 0;
+	for (cur_node.p.Z = 0; cur_node.p.Z < data->m_side_length; cur_node.p.Z++)
+	for (cur_node.p.Y = 0; cur_node.p.Y < data->m_side_length; cur_node.p.Y++) {
+		u32 row = getRow(cur_node.p.Y, cur_node.p.Z, data->m_side_length);
+		if (dirty[row]) {
+			generateRow();
+		} else {
+			collector->startRow(row);
+			strip = collector->appendRow(old, strip);
+		}
+	}
+}
+
+// Whether a node is part of the simplified geometry of LOD meshes.
+// Small and thin nodes are left out, they can't be seen from far away.
+static bool isDrawnAtLod(const ContentFeatures &f)
+{
+	switch (f.drawtype) {
+	case NDT_NORMAL:
+	case NDT_LIQUID:
+	case NDT_GLASSLIKE:
+	case NDT_GLASSLIKE_FRAMED:
+	case NDT_GLASSLIKE_FRAMED_OPTIONAL:
+	case NDT_ALLFACES:
+	case NDT_ALLFACES_OPTIONAL:
+	case NDT_PLANTLIKE_ROOTED:
+	case NDT_NODEBOX:
+	case NDT_MESH:
+		return true;
+	default:
+		return false;
+	}
+}
+
+void MapblockMeshGenerator::generateLod()
+{
+	ZoneScoped;
+
+	static const v3s16 lod_tile_dirs[6] = {
+		v3s16(0, 1, 0),
+		v3s16(0, -1, 0),
+		v3s16(1, 0, 0),
+		v3s16(-1, 0, 0),
+		v3s16(0, 0, 1),
+		v3s16(0, 0, -1)
+	};
+
+	// Each cube of cell_size nodes is drawn as a single node:
+	// the topmost one that is drawn at all, to keep the surface looking right
+	const s16 cell_size = 1 << data->m_lod;
+	const s16 cell_count = data->m_side_length / cell_size;
+	struct Cell {
+		MapNode n;
+		v3s16 p;
+		const ContentFeatures *f = nullptr;
+	};
+	std::vector<Cell> cells(cell_count * cell_count * cell_count);
+	auto cell_index = [&] (v3s16 c) {
+		return (c.Z * cell_count + c.Y) * cell_count + c.X;
+	};
+
+	v3s16 c;
+	for (c.Z = 0; c.Z < cell_count; c.Z++)
+	for (c.Y = 0; c.Y < cell_count; c.Y++)
+	for (c.X = 0; c.X < cell_count; c.X++) {
+		Cell &cell = cells[cell_index(c)];
+		const v3s16 min = c * cell_size;
+		v3s16 p;
+		for (p.Y = min.Y + cell_size - 1; p.Y >= min.Y && !cell.f; p.Y--)
+		for (p.Z = min.Z; p.Z < min.Z + cell_size && !cell.f; p.Z++)
+		for (p.X = min.X; p.X < min.X + cell_size; p.X++) {
+			MapNode n = data->m_vmanip.getNodeNoEx(blockpos_nodes + p);
+			const ContentFeatures &f = nodedef->get(n);
+			if (isDrawnAtLod(f)) {
+				cell = {n, p, &f};
+				break;
+			}
+		}
+	}
+
+	// A face is hidden by a neighbor of the same kind or an opaque one
+	auto hides = [&] (MapNode neighbor, const ContentFeatures &f2, content_t c1) {
+		return neighbor.getContent() == c1 || f2.solidness == 2;
+	};
+
+	for (c.Z = 0; c.Z < cell_count; c.Z++)
+	for (c.Y = 0; c.Y < cell_count; c.Y++)
+	for (c.X = 0; c.X < cell_count; c.X++) {
+		const Cell &cell = cells[cell_index(c)];
+		if (!cell.f)
+			continue;
+		cur_node.n = cell.n;
+		cur_node.p = cell.p;
+		cur_node.f = cell.f;
+		const content_t c1 = cell.n.getContent();
+		const v3s16 min = c * cell_size;
+
+		u8 mask = 0; // k-th bit is set if k-th face is to be omitted
+		TileSpec tiles[6];
+		u16 lights[6];
+		for (int face = 0; face < 6; face++) {
+			const v3s16 dir = lod_tile_dirs[face];
+			const v3s16 c2 = c + dir;
+			const bool inside = c2.X >= 0 && c2.Y >= 0 && c2.Z >= 0 &&
+					c2.X < cell_count && c2.Y < cell_count && c2.Z < cell_count;
+			if (inside) {
+				const Cell &cell2 = cells[cell_index(c2)];
+				if (cell2.f && hides(cell2.n, *cell2.f, c1)) {
+					mask |= 1 << face;
+					continue;
+				}
+			}
+
+			// Look at the layer of nodes next to the face: for its light, and
+			// outside of the mesh, whether it's covered (like in drawSolidNode())
+			v3s16 from = min;
+			v3s16 to = min + (cell_size - 1);
+			for (int axis = 0; axis < 3; axis++) {
+				if (dir[axis] > 0)
+					from[axis] = to[axis] = min[axis] + cell_size;
+				else if (dir[axis] < 0)
+					from[axis] = to[axis] = min[axis] - 1;
+			}
+			bool covered = !inside;
+			u8 light_day = 0;
+			u8 light_night = 0;
+			v3s16 p;
+			for (p.Z = from.Z; p.Z <= to.Z; p.Z++)
+			for (p.Y = from.Y; p.Y <= to.Y; p.Y++)
+			for (p.X = from.X; p.X <= to.X; p.X++) {
+				MapNode neighbor = data->m_vmanip.getNodeNoEx(blockpos_nodes + p);
+				if (covered && neighbor.getContent() != CONTENT_IGNORE &&
+						!hides(neighbor, nodedef->get(neighbor), c1))
+					covered = false;
+				LightPair light(getFaceLight(cell.n, neighbor, nodedef));
+				light_day = std::max(light_day, light.lightDay);
+				light_night = std::max(light_night, light.lightNight);
+			}
+			if (covered) {
+				mask |= 1 << face;
+				continue;
+			}
+
+			getTile(dir, &tiles[face]);
+			for (auto &layer : tiles[face].layers) {
+				if (cell.f->drawtype == NDT_NORMAL)
+					layer.material_flags |= MATERIAL_FLAG_BACKFACE_CULLING;
+				layer.material_flags |= MATERIAL_FLAG_TILEABLE_HORIZONTAL;
+				layer.material_flags |= MATERIAL_FLAG_TILEABLE_VERTICAL;
+			}
+			lights[face] = LightPair(light_day, light_night);
+		}
+		if (mask == 0b0011'1111)
+			continue;
+
+		aabb3f box(intToFloat(min, BS) - v3f(0.5f * BS),
+				intToFloat(min + cell_size, BS) - v3f(0.5f * BS));
+		f32 texture_coord_buf[24];
+		generateCuboidTextureCoords(box, texture_coord_buf);
+		drawCuboid(box, tiles, 6, texture_coord_buf, mask, [&] (int face, video::S3DVertex vertices[4]) {
+			video::SColor color = encode_light(lights[face], cur_node.f->light_source);
+			if (!cur_node.f->light_source)
+				applyFacesShading(color, vertices[0].Normal);
+			for (int j = 0; j < 4; j++)
+				vertices[j].Color = color;
+			return QuadDiagonal::Diag02;
+		});
 	}
 }
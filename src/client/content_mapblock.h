@@ -47,6 +47,14 @@ class MapblockMeshGenerator
 public:
 	MapblockMeshGenerator(MeshMakeData *input, MeshCollector *output);
 	void generate();
+	// Generates the rows of nodes (see getRow()) marked in `dirty` and
+	// copies the geometry of the other rows from `old`
+	void generate(const MeshCollector &old, const std::vector<bool> &dirty);
+	// Generates a simplified mesh for the level of detail in MeshMakeData::m_lod
+	void generateLod();
+
+	// Rows of nodes along the X axis are the unit in which meshes are patched
+	static u32 getRow(s16 y, s16 z, u16 side_length) { return z * side_length + y; }
 
 private:
 	MeshMakeData *const data;
@@ -56,6 +64,8 @@ class MapblockMeshGenerator
 
 	const v3s16 blockpos_nodes;
 
+	void generateRow();
+
 // current node
 	struct {
 		v3s16 p; // relative to blockpos_nodes
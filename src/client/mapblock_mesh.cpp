@@ -45,19 +45,27 @@ void MeshMakeData::fillBlockDataBegin(const v3s16 &blockpos)
 	v3s16 blockpos_nodes = m_blockpos*MAP_BLOCKSIZE;
 
 	m_vmanip.clear();
-	// extra 1 block thick layer around the mesh
-	VoxelArea voxel_area(blockpos_nodes - v3s16(1,1,1) * MAP_BLOCKSIZE,
-			blockpos_nodes + v3s16(1,1,1) * (m_side_length + MAP_BLOCKSIZE) - v3s16(1,1,1));
+	// extra 1 node thick layer around the mesh, which is all that
+	// the mesh generator looks at
+	VoxelArea voxel_area(blockpos_nodes - v3s16(1,1,1),
+			blockpos_nodes + v3s16(1,1,1) * m_side_length);
 	m_vmanip.addArea(voxel_area);
 }
 
-void MeshMakeData::fillBlockData(const v3s16 &bp, MapNode *data)
+void MeshMakeData::fillBlockData(const v3s16 &bp, const MapNode *data)
 {
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 
+	// Only copy the part of the block that is inside the area
 	v3s16 blockpos_nodes = bp * MAP_BLOCKSIZE;
-	m_vmanip.copyFrom(data, data_area, v3s16(0,0,0), blockpos_nodes, data_size);
+	VoxelArea copy_area = m_vmanip.m_area.intersect(data_area + blockpos_nodes);
+	if (copy_area.hasEmptyExtent())
+		return;
+
+	m_vmanip.copyFrom(data, data_area, copy_area.MinEdge - blockpos_nodes,
+			copy_area.MinEdge,
+			copy_area.MaxEdge - copy_area.MinEdge + v3s16(1,1,1));
 }
 
 void MeshMakeData::fillSingleNode(MapNode data, MapNode padding)
@@ -84,6 +92,89 @@ void MeshMakeData::setCrack(int crack_level, v3s16 crack_pos)
 		m_crack_pos_relative = crack_pos - m_blockpos*MAP_BLOCKSIZE;
 }
 
+/*
+	RetainedMeshGeometry
+*/
+
+VoxelArea RetainedMeshGeometry::getArea(const MeshMakeData *data)
+{
+	v3s16 blockpos_nodes = data->m_blockpos * MAP_BLOCKSIZE;
+	return VoxelArea(blockpos_nodes - v3s16(1),
+			blockpos_nodes + v3s16(data->m_side_length));
+}
+
+bool RetainedMeshGeometry::findDirtyRows(const MeshMakeData *data,
+		std::vector<bool> &dirty) const
+{
+	if (data->m_blockpos != blockpos || data->m_side_length != side_length ||
+			data->m_smooth_lighting != smooth_lighting ||
+			data->m_enable_water_reflections != enable_water_reflections)
+		return false;
+
+	const s16 side = side_length;
+	dirty.assign(side * side, false);
+	u32 dirty_count = 0;
+	// Nodes are drawn depending on their neighbors, so a changed node
+	// affects the rows around it
+	auto mark = [&] (s16 y, s16 z) {
+		for (s16 z2 = std::max(z - 1, 0); z2 <= std::min<s16>(z + 1, side - 1); z2++)
+		for (s16 y2 = std::max(y - 1, 0); y2 <= std::min<s16>(y + 1, side - 1); y2++) {
+			u32 row = MapblockMeshGenerator::getRow(y2, z2, side);
+			if (!dirty[row]) {
+				dirty[row] = true;
+				dirty_count++;
+			}
+		}
+	};
+
+	const VoxelArea area = getArea(data);
+	const s16 width = area.getExtent().X;
+	const MapNode *old_row = nodes.data();
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++) {
+		const MapNode *row = &data->m_vmanip.m_data[
+				data->m_vmanip.m_area.index(area.MinEdge.X, y, z)];
+		if (!std::equal(row, row + width, old_row))
+			mark(y - area.MinEdge.Y - 1, z - area.MinEdge.Z - 1);
+		old_row += width;
+	}
+
+	// only the cracked node itself looks different
+	if (data->m_crack_pos_relative != crack_pos_relative) {
+		for (v3s16 p : {data->m_crack_pos_relative, crack_pos_relative}) {
+			if (VoxelArea(v3s16(0), v3s16(side - 1)).contains(p)) {
+				u32 row = MapblockMeshGenerator::getRow(p.Y, p.Z, side);
+				dirty_count += !dirty[row];
+				dirty[row] = true;
+			}
+		}
+	}
+
+	return dirty_count < dirty.size();
+}
+
+void RetainedMeshGeometry::keep(const MeshMakeData *data, MeshCollector &&collector_)
+{
+	blockpos = data->m_blockpos;
+	side_length = data->m_side_length;
+	smooth_lighting = data->m_smooth_lighting;
+	enable_water_reflections = data->m_enable_water_reflections;
+	crack_pos_relative = data->m_crack_pos_relative;
+
+	const VoxelArea area = getArea(data);
+	const s16 width = area.getExtent().X;
+	nodes.resize(area.getVolume());
+	MapNode *to = nodes.data();
+	for (s16 z = area.MinEdge.Z; z <= area.MaxEdge.Z; z++)
+	for (s16 y = area.MinEdge.Y; y <= area.MaxEdge.Y; y++) {
+		const MapNode *row = &data->m_vmanip.m_data[
+				data->m_vmanip.m_area.index(area.MinEdge.X, y, z)];
+		to = std::copy(row, row + width, to);
+	}
+
+	collector = std::move(collector_);
+}
+
 /*
 	Light and vertex color functions
 */
@@ -597,10 +688,19 @@ void PartialMeshBuffer::draw(video::IVideoDriver *driver) const
 	MapBlockMesh
 */
 
-MapBlockMesh::MapBlockMesh(Client *client, MeshMakeData *data):
-	m_tsrc(client->getTextureSource()),
-	m_shdrsrc(client->getShaderSource()),
+MapBlockMesh::MapBlockMesh(Client *client, MeshMakeData *data,
+		RetainedMeshGeometry *retained):
+	MapBlockMesh(client->getTextureSource(), client->getShaderSource(), data,
+		retained)
+{
+}
+
+MapBlockMesh::MapBlockMesh(ITextureSource *tsrc, IShaderSource *shdrsrc,
+		MeshMakeData *data, RetainedMeshGeometry *retained):
+	m_tsrc(tsrc),
+	m_shdrsrc(shdrsrc),
 	m_bounding_sphere_center((data->m_side_length * 0.5f - 0.5f) * BS),
+	m_lod(data->m_lod),
 	m_animation_force_timer(0), // force initial animation
 	m_last_crack(-1)
 {
@@ -637,8 +737,14 @@ MapBlockMesh::MapBlockMesh(Client *client, MeshMakeData *data):
 	MeshCollector collector(m_bounding_sphere_center, offset);
 
 	{
-		// Generate everything
-		MapblockMeshGenerator(data, &collector).generate();
+		MapblockMeshGenerator generator(data, &collector);
+		std::vector<bool> dirty;
+		if (data->m_lod)
+			generator.generateLod();
+		else if (retained && retained->findDirtyRows(data, dirty))
+			generator.generate(retained->collector, dirty);
+		else
+			generator.generate(); // Generate everything
 	}
 
 	/*
@@ -652,37 +758,37 @@ MapBlockMesh::MapBlockMesh(Client *client, MeshMakeData *data):
 
 		for(u32 i = 0; i < collector.prebuffers[layer].size(); i++)
 		{
-			PreMeshBuffer &p = collector.prebuffers[layer][i];
-
-			p.applyTileColor();
+			// the collector is left unchanged, it may be retained
+			const PreMeshBuffer &p = collector.prebuffers[layer][i];
+			TileLayer tile_layer = p.layer;
 
 			// Generate animation data
 			// - Cracks
-			if (p.layer.material_flags & MATERIAL_FLAG_CRACK) {
+			if (tile_layer.material_flags & MATERIAL_FLAG_CRACK) {
 				// Find the texture name plus ^[crack:N:
 				std::ostringstream os(std::ios::binary);
-				os << m_tsrc->getTextureName(p.layer.texture_id) << "^[crack";
-				if (p.layer.material_flags & MATERIAL_FLAG_CRACK_OVERLAY)
+				os << m_tsrc->getTextureName(tile_layer.texture_id) << "^[crack";
+				if (tile_layer.material_flags & MATERIAL_FLAG_CRACK_OVERLAY)
 					os << "o";  // use ^[cracko
-				u8 tiles = p.layer.scale;
+				u8 tiles = tile_layer.scale;
 				if (tiles > 1)
 					os << ":" << (u32)tiles;
-				os << ":" << (u32)p.layer.animation_frame_count << ":";
+				os << ":" << (u32)tile_layer.animation_frame_count << ":";
 				m_crack_materials.insert(std::make_pair(
 						std::pair<u8, u32>(layer, i), os.str()));
 				// Replace tile texture with the cracked one
-				p.layer.texture = m_tsrc->getTextureForMesh(
+				tile_layer.texture = m_tsrc->getTextureForMesh(
 						os.str() + "0",
-						&p.layer.texture_id);
+						&tile_layer.texture_id);
 			}
 			// - Texture animation
-			if (p.layer.material_flags & MATERIAL_FLAG_ANIMATION) {
+			if (tile_layer.material_flags & MATERIAL_FLAG_ANIMATION) {
 				// Add to MapBlockMesh in order to animate these tiles
 				auto &info = m_animation_info[{layer, i}];
-				info.tile = p.layer;
+				info.tile = tile_layer;
 				info.frame = 0;
 				// Replace tile texture with the first animation frame
-				p.layer.texture = (*p.layer.frames)[0].texture;
+				tile_layer.texture = (*tile_layer.frames)[0].texture;
 			}
 
 			// Create material
@@ -695,13 +801,13 @@ MapBlockMesh::MapBlockMesh(Client *client, MeshMakeData *data):
 
 			{
 				material.MaterialType = m_shdrsrc->getShaderInfo(
-						p.layer.shader_id).material;
-				p.layer.applyMaterialOptions(material, layer);
+						tile_layer.shader_id).material;
+				tile_layer.applyMaterialOptions(material, layer);
 			}
 
 			scene::SMeshBuffer *buf = new scene::SMeshBuffer();
 			buf->Material = material;
-			if (p.layer.isTransparent()) {
+			if (tile_layer.isTransparent()) {
 				buf->append(&p.vertices[0], p.vertices.size(), nullptr, 0);
 
 				MeshTriangle t;
@@ -718,6 +824,8 @@ MapBlockMesh::MapBlockMesh(Client *client, MeshMakeData *data):
 				buf->append(&p.vertices[0], p.vertices.size(),
 					&p.indices[0], p.indices.size());
 			}
+			p.applyTileColor(static_cast<video::S3DVertex *>(buf->getVertices()),
+				buf->getVertexCount());
 			mesh->addMeshBuffer(buf);
 			buf->drop();
 		}
@@ -730,6 +838,10 @@ MapBlockMesh::MapBlockMesh(Client *client, MeshMakeData *data):
 
 	m_bsp_tree.buildTree(&m_transparent_triangles, data->m_side_length);
 
+	// the geometry of LOD meshes can't be patched
+	if (retained && !data->m_lod)
+		retained->keep(data, std::move(collector));
+
 	// Check if animation is required for this mesh
 	m_has_animation =
 		!m_crack_materials.empty() ||
@@ -11,6 +11,7 @@
 
 #include "util/numeric.h"
 #include "client/tile.h"
+#include "client/meshgen/collector.h"
 #include "voxel.h"
 #include <array>
 #include <map>
@@ -33,6 +34,9 @@ class ITextureSource;
 class MapBlock;
 struct MinimapMapblock;
 
+// Highest level of detail (see MeshMakeData::m_lod) meshes are generated with
+constexpr u8 MAX_MESH_LOD = 3;
+
 struct MeshMakeData
 {
 	VoxelManipulator m_vmanip;
@@ -51,6 +55,9 @@ struct MeshMakeData
 	bool m_generate_minimap = false;
 	bool m_smooth_lighting = false;
 	bool m_enable_water_reflections = false;
+	// level of detail: if non-zero, cubes of (1 << m_lod) nodes per side
+	// are drawn as one node, see MAX_MESH_LOD
+	u8 m_lod = 0;
 
 	const NodeDefManager *m_nodedef;
 
@@ -60,7 +67,7 @@ struct MeshMakeData
 		Copy block data manually (to allow optimizations by the caller)
 	*/
 	void fillBlockDataBegin(const v3s16 &blockpos);
-	void fillBlockData(const v3s16 &bp, MapNode *data);
+	void fillBlockData(const v3s16 &bp, const MapNode *data);
 
 	/*
 		Prepare block data for rendering a single node located at (0,0,0).
@@ -73,6 +80,32 @@ struct MeshMakeData
 	void setCrack(int crack_level, v3s16 crack_pos);
 };
 
+/*
+	The node data and geometry of a generated mesh. When the mesh is updated,
+	only the rows of nodes near the nodes that changed are generated again,
+	the geometry of the others is copied from here.
+*/
+struct RetainedMeshGeometry
+{
+	v3s16 blockpos = v3s16(-1337,-1337,-1337);
+	u16 side_length = 0;
+	bool smooth_lighting = false;
+	bool enable_water_reflections = false;
+	v3s16 crack_pos_relative;
+	// the meshgen area and the 1 node thick layer around it
+	std::vector<MapNode> nodes;
+	MeshCollector collector{v3f()};
+
+	// Finds the rows of nodes that need to be generated for data.
+	// Returns false if all of them do.
+	bool findDirtyRows(const MeshMakeData *data, std::vector<bool> &dirty) const;
+
+	void keep(const MeshMakeData *data, MeshCollector &&collector);
+
+private:
+	static VoxelArea getArea(const MeshMakeData *data);
+};
+
 // represents a triangle as indexes into the vertex buffer in SMeshBuffer
 class MeshTriangle
 {
@@ -179,8 +212,13 @@ class PartialMeshBuffer
 class MapBlockMesh
 {
 public:
-	// Builds the mesh given
-	MapBlockMesh(Client *client, MeshMakeData *data);
+	// Builds the mesh given. If retained is given, it's used to generate
+	// only the changed parts and updated to the new mesh afterwards.
+	MapBlockMesh(Client *client, MeshMakeData *data,
+			RetainedMeshGeometry *retained = nullptr);
+	// Same, without needing a client (e.g. for benchmarks)
+	MapBlockMesh(ITextureSource *tsrc, IShaderSource *shdrsrc, MeshMakeData *data,
+			RetainedMeshGeometry *retained = nullptr);
 	~MapBlockMesh();
 
 	// Main animation function, parameters:
@@ -229,6 +267,9 @@ class MapBlockMesh
 	/// Center of the bounding-sphere, in BS-space, relative to block pos.
 	v3f getBoundingSphereCenter() const { return m_bounding_sphere_center; }
 
+	/// Level of detail the mesh was generated with, see MeshMakeData::m_lod
+	u8 getLod() const { return m_lod; }
+
 	/** Update transparent buffers to render towards the camera.
 	 * @param group_by_buffers If true, triangles in the same buffer are batched
 	 *     into the same PartialMeshBuffer, resulting in fewer draw calls, but
@@ -258,6 +299,7 @@ class MapBlockMesh
 
 	f32 m_bounding_radius;
 	v3f m_bounding_sphere_center;
+	u8 m_lod;
 
 	// Must animate() be called before rendering?
 	bool m_has_animation;
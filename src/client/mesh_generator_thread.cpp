@@ -6,6 +6,7 @@
 #include "settings.h"
 #include "profiler.h"
 #include "client.h"
+#include "clientmap.h"
 #include "mapblock.h"
 #include "map.h"
 #include "util/directiontables.h"
@@ -23,6 +24,9 @@ static struct BlockPlaceholder {
 
 } block_placeholder;
 
+// Number of meshes whose geometry is kept for incremental updates
+static constexpr size_t RETAINED_MESH_COUNT = 64;
+
 /*
 	QueuedMeshUpdate
 */
@@ -47,12 +51,8 @@ MeshUpdateQueue::~MeshUpdateQueue()
 {
 	MutexAutoLock lock(m_mutex);
 
-	for (QueuedMeshUpdate *q : m_queue) {
-		for (auto block : q->map_blocks)
-			if (block)
-				block->refDrop();
+	for (QueuedMeshUpdate *q : m_queue)
 		delete q;
-	}
 }
 
 bool MeshUpdateQueue::addBlock(Map *map, v3s16 p, bool ack_block_to_server, bool urgent)
@@ -61,13 +61,29 @@ bool MeshUpdateQueue::addBlock(Map *map, v3s16 p, bool ack_block_to_server, bool
 	if (!main_block)
 		return false;
 
-	MutexAutoLock lock(m_mutex);
-
 	MeshGrid mesh_grid = m_client->getMeshGrid();
 
 	// Mesh is placed at the corner block of a chunk
 	// (where all coordinate are divisible by the chunk size)
 	v3s16 mesh_position(mesh_grid.getMeshPos(p));
+
+	/*
+		Take the node data necessary for mesh generation. It is shared with
+		the blocks, which only copy it if they are changed in the meantime.
+		This is done before locking so that the workers aren't held up.
+	*/
+	std::vector<std::shared_ptr<const MapNode[]>> block_data;
+	block_data.reserve((mesh_grid.cell_size+2)*(mesh_grid.cell_size+2)*(mesh_grid.cell_size+2));
+	v3s16 pos;
+	for (pos.X = mesh_position.X - 1; pos.X <= mesh_position.X + mesh_grid.cell_size; pos.X++)
+	for (pos.Z = mesh_position.Z - 1; pos.Z <= mesh_position.Z + mesh_grid.cell_size; pos.Z++)
+	for (pos.Y = mesh_position.Y - 1; pos.Y <= mesh_position.Y + mesh_grid.cell_size; pos.Y++) {
+		MapBlock *block = map->getBlockNoCreateNoEx(pos);
+		block_data.push_back(block ? block->getSnapshot() : nullptr);
+	}
+
+	MutexAutoLock lock(m_mutex);
+
 	/*
 		Mark the block as urgent if requested
 	*/
@@ -80,46 +96,21 @@ bool MeshUpdateQueue::addBlock(Map *map, v3s16 p, bool ack_block_to_server, bool
 	*/
 	for (QueuedMeshUpdate *q : m_queue) {
 		if (q->p == mesh_position) {
-			// NOTE: We are not adding a new position to the queue, thus
-			//       refcount_from_queue stays the same.
 			if(ack_block_to_server)
 				q->ack_list.push_back(p);
 			q->crack_level = m_client->getCrackLevel();
 			q->crack_pos = m_client->getCrackPos();
+			q->lod = m_client->getEnv().getClientMap().getMeshLod(mesh_position);
 			q->urgent |= urgent;
-			v3s16 pos;
-			int i = 0;
-			for (pos.X = q->p.X - 1; pos.X <= q->p.X + mesh_grid.cell_size; pos.X++)
-			for (pos.Z = q->p.Z - 1; pos.Z <= q->p.Z + mesh_grid.cell_size; pos.Z++)
-			for (pos.Y = q->p.Y - 1; pos.Y <= q->p.Y + mesh_grid.cell_size; pos.Y++) {
-				if (!q->map_blocks[i]) {
-					MapBlock *block = map->getBlockNoCreateNoEx(pos);
-					if (block) {
-						block->refGrab();
-						q->map_blocks[i] = block;
-					}
-				}
-				i++;
+			// Keep the data of blocks that were unloaded in the meantime
+			for (size_t i = 0; i < block_data.size(); i++) {
+				if (block_data[i])
+					q->block_data[i] = std::move(block_data[i]);
 			}
 			return true;
 		}
 	}
 
-	/*
-		Make a list of blocks necessary for mesh generation and lock the blocks in memory.
-	*/
-	std::vector<MapBlock *> map_blocks;
-	map_blocks.reserve((mesh_grid.cell_size+2)*(mesh_grid.cell_size+2)*(mesh_grid.cell_size+2));
-	v3s16 pos;
-	for (pos.X = mesh_position.X - 1; pos.X <= mesh_position.X + mesh_grid.cell_size; pos.X++)
-	for (pos.Z = mesh_position.Z - 1; pos.Z <= mesh_position.Z + mesh_grid.cell_size; pos.Z++)
-	for (pos.Y = mesh_position.Y - 1; pos.Y <= mesh_position.Y + mesh_grid.cell_size; pos.Y++) {
-		MapBlock *block = map->getBlockNoCreateNoEx(pos);
-		map_blocks.push_back(block);
-		if (block)
-			block->refGrab();
-	}
-
 	/*
 		Add the block
 	*/
@@ -129,8 +120,9 @@ bool MeshUpdateQueue::addBlock(Map *map, v3s16 p, bool ack_block_to_server, bool
 		q->ack_list.push_back(p);
 	q->crack_level = m_client->getCrackLevel();
 	q->crack_pos = m_client->getCrackPos();
+	q->lod = m_client->getEnv().getClientMap().getMeshLod(mesh_position);
 	q->urgent = urgent;
-	q->map_blocks = std::move(map_blocks);
+	q->block_data = std::move(block_data);
 	m_queue.push_back(q);
 
 	return true;
@@ -172,6 +164,33 @@ void MeshUpdateQueue::done(v3s16 pos)
 	m_inflight_blocks.erase(pos);
 }
 
+std::unique_ptr<RetainedMeshGeometry> MeshUpdateQueue::takeRetained(v3s16 pos,
+		bool create)
+{
+	MutexAutoLock lock(m_mutex);
+	auto it = m_retained.find(pos);
+	if (it == m_retained.end())
+		return create ? std::make_unique<RetainedMeshGeometry>() : nullptr;
+	auto retained = std::move(it->second.second);
+	m_retained.erase(it);
+	return retained;
+}
+
+void MeshUpdateQueue::putRetained(v3s16 pos,
+		std::unique_ptr<RetainedMeshGeometry> retained)
+{
+	MutexAutoLock lock(m_mutex);
+	if (m_retained.size() >= RETAINED_MESH_COUNT) {
+		auto oldest = m_retained.begin();
+		for (auto it = m_retained.begin(); it != m_retained.end(); ++it) {
+			if (it->second.first < oldest->second.first)
+				oldest = it;
+		}
+		m_retained.erase(oldest);
+	}
+	m_retained[pos] = {++m_retained_counter, std::move(retained)};
+}
+
 
 void MeshUpdateQueue::fillDataFromMapBlocks(QueuedMeshUpdate *q)
 {
@@ -187,11 +206,14 @@ void MeshUpdateQueue::fillDataFromMapBlocks(QueuedMeshUpdate *q)
 	for (pos.X = q->p.X - 1; pos.X <= q->p.X + mesh_grid.cell_size; pos.X++)
 	for (pos.Z = q->p.Z - 1; pos.Z <= q->p.Z + mesh_grid.cell_size; pos.Z++)
 	for (pos.Y = q->p.Y - 1; pos.Y <= q->p.Y + mesh_grid.cell_size; pos.Y++) {
-		MapBlock *block = q->map_blocks[i++];
-		data->fillBlockData(pos, block ? block->getData() : block_placeholder.data);
+		const MapNode *nodes = q->block_data[i++].get();
+		data->fillBlockData(pos, nodes ? nodes : block_placeholder.data);
 	}
+	// The node data isn't needed anymore, let the blocks share it elsewhere
+	q->block_data.clear();
 
 	data->setCrack(q->crack_level, q->crack_pos);
+	data->m_lod = q->lod;
 	data->m_generate_minimap = !!m_client->getMinimap();
 	data->m_smooth_lighting = m_cache_smooth_lighting;
 	data->m_enable_water_reflections = m_cache_enable_water_reflections;
@@ -219,7 +241,15 @@ void MeshUpdateWorkerThread::doUpdate()
 
 		ScopeProfiler sp(g_profiler, "Client: Mesh making (sum)");
 
-		MapBlockMesh *mesh_new = new MapBlockMesh(m_client, q->data);
+		// Meshes updated due to node changes are likely to be updated
+		// again soon, keep their geometry to only patch it next time
+		auto retained = m_queue_in->takeRetained(q->p, q->urgent);
+
+		MapBlockMesh *mesh_new = new MapBlockMesh(m_client, q->data,
+				retained.get());
+
+		if (retained)
+			m_queue_in->putRetained(q->p, std::move(retained));
 
 		MeshUpdateResult r;
 		r.p = q->p;
@@ -227,7 +257,6 @@ void MeshUpdateWorkerThread::doUpdate()
 		r.solid_sides = get_solid_sides(q->data);
 		r.ack_list = std::move(q->ack_list);
 		r.urgent = q->urgent;
-		r.map_blocks = q->map_blocks;
 
 		m_manager->putResult(r);
 		m_queue_in->done(q->p);
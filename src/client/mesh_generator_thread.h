@@ -21,8 +21,11 @@ struct QueuedMeshUpdate
 	std::vector<v3s16> ack_list;
 	int crack_level = -1;
 	v3s16 crack_pos;
+	u8 lod = 0;
 	MeshMakeData *data = nullptr; // This is generated in MeshUpdateQueue::pop()
-	std::vector<MapBlock *> map_blocks;
+	// Node data of the blocks around p (see MapBlock::getSnapshot()),
+	// null where there is no block
+	std::vector<std::shared_ptr<const MapNode[]>> block_data;
 	bool urgent = false;
 
 	QueuedMeshUpdate() = default;
@@ -45,8 +48,8 @@ class MeshUpdateQueue
 
 	~MeshUpdateQueue();
 
-	// Caches the block at p and its neighbors (if needed) and queues a mesh
-	// update for the block at p
+	// Takes the node data of the block at p and its neighbors and queues
+	// a mesh update for the block at p
 	bool addBlock(Map *map, v3s16 p, bool ack_block_to_server, bool urgent);
 
 	// Returned pointer must be deleted
@@ -56,6 +59,14 @@ class MeshUpdateQueue
 	// Marks a position as finished, unblocking the next update
 	void done(v3s16 pos);
 
+	// Takes the geometry retained for the mesh at pos out of the cache.
+	// If there is none, a new empty entry is returned if create is set.
+	std::unique_ptr<RetainedMeshGeometry> takeRetained(v3s16 pos, bool create);
+
+	// Puts the geometry of the mesh at pos (back) into the cache,
+	// dropping the least recently used entry if it is full
+	void putRetained(v3s16 pos, std::unique_ptr<RetainedMeshGeometry> retained);
+
 	u32 size()
 	{
 		MutexAutoLock lock(m_mutex);
@@ -67,6 +78,11 @@ class MeshUpdateQueue
 	std::vector<QueuedMeshUpdate *> m_queue;
 	std::unordered_set<v3s16> m_urgents;
 	std::unordered_set<v3s16> m_inflight_blocks;
+	// Geometry of the meshes recently updated due to node changes,
+	// with the time they were last used
+	std::unordered_map<v3s16, std::pair<u64,
+			std::unique_ptr<RetainedMeshGeometry>>> m_retained;
+	u64 m_retained_counter = 0;
 	std::mutex m_mutex;
 
 	// TODO: Add callback to update these when g_settings changes, and update all meshes
@@ -83,7 +99,6 @@ struct MeshUpdateResult
 	u8 solid_sides;
 	std::vector<v3s16> ack_list;
 	bool urgent = false;
-	std::vector<MapBlock *> map_blocks;
 
 	MeshUpdateResult() = default;
 };
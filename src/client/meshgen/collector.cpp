@@ -29,6 +29,8 @@ void MeshCollector::append(const TileLayer &layer, const video::S3DVertex *verti
 	if (use_scale)
 		scale = 1.0f / layer.scale;
 
+	addToStrip(layernum, p, numVertices, numIndices);
+
 	u32 vertex_count = p.vertices.size();
 	for (u32 i = 0; i < numVertices; i++) {
 		p.vertices.emplace_back(vertices[i].Pos + offset, vertices[i].Normal,
@@ -41,6 +43,48 @@ void MeshCollector::append(const TileLayer &layer, const video::S3DVertex *verti
 		p.indices.push_back(indices[i] + vertex_count);
 }
 
+size_t MeshCollector::appendRow(const MeshCollector &from, size_t strip)
+{
+	for (; strip < from.strips.size() && from.strips[strip].row <= m_row; strip++) {
+		const PreMeshStrip &s = from.strips[strip];
+		if (s.row < m_row)
+			continue;
+		const PreMeshBuffer &src = from.prebuffers[s.layernum][s.buffer];
+		PreMeshBuffer &p = findBuffer(src.layer, s.layernum, s.vertex_count);
+
+		addToStrip(s.layernum, p, s.vertex_count, s.index_count);
+
+		// the vertices already have the offset and scale applied
+		u32 vertex_count = p.vertices.size();
+		p.vertices.insert(p.vertices.end(), src.vertices.begin() + s.vertex_start,
+				src.vertices.begin() + s.vertex_start + s.vertex_count);
+		for (u32 i = s.vertex_start; i < s.vertex_start + s.vertex_count; i++) {
+			m_bounding_radius_sq = std::max(m_bounding_radius_sq,
+					(src.vertices[i].Pos - offset - m_center_pos).getLengthSQ());
+		}
+
+		for (u32 i = s.index_start; i < s.index_start + s.index_count; i++)
+			p.indices.push_back(src.indices[i] - s.vertex_start + vertex_count);
+	}
+	return strip;
+}
+
+void MeshCollector::addToStrip(u8 layernum, const PreMeshBuffer &p,
+		u32 numVertices, u32 numIndices)
+{
+	u16 buffer = &p - prebuffers[layernum].data();
+	if (!strips.empty()) {
+		PreMeshStrip &last = strips.back();
+		if (last.row == m_row && last.layernum == layernum && last.buffer == buffer) {
+			last.vertex_count += numVertices;
+			last.index_count += numIndices;
+			return;
+		}
+	}
+	strips.push_back({m_row, layernum, buffer, (u32)p.vertices.size(), numVertices,
+			(u32)p.indices.size(), numIndices});
+}
+
 PreMeshBuffer &MeshCollector::findBuffer(
 		const TileLayer &layer, u8 layernum, u32 numVertices)
 {
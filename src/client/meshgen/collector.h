@@ -21,12 +21,18 @@ struct PreMeshBuffer
 
 	/// @brief Colorizes vertices as indicated by tile layer
 	void applyTileColor()
+	{
+		applyTileColor(vertices.data(), vertices.size());
+	}
+
+	/// @brief Same, for a copy of the vertices
+	void applyTileColor(video::S3DVertex *copy, u32 count) const
 	{
 		video::SColor tc = layer.color;
 		if (tc == video::SColor(0xFFFFFFFF))
 			return;
-		for (auto &vertex : vertices) {
-			video::SColor *c = &vertex.Color;
+		for (u32 i = 0; i < count; i++) {
+			video::SColor *c = &copy[i].Color;
 			c->set(c->getAlpha(),
 				c->getRed() * tc.getRed() / 255U,
 				c->getGreen() * tc.getGreen() / 255U,
@@ -35,9 +41,23 @@ struct PreMeshBuffer
 	}
 };
 
+// The vertices and indices a row of nodes added to one PreMeshBuffer
+struct PreMeshStrip
+{
+	u32 row;
+	u8 layernum;
+	u16 buffer; // index in prebuffers[layernum]
+	u32 vertex_start;
+	u32 vertex_count;
+	u32 index_start;
+	u32 index_count;
+};
+
 struct MeshCollector
 {
 	std::array<std::vector<PreMeshBuffer>, MAX_TILE_LAYERS> prebuffers;
+	// in the order they were added, thus sorted by row
+	std::vector<PreMeshStrip> strips;
 	// bounding sphere radius and center
 	f32 m_bounding_radius_sq = 0.0f;
 	v3f m_center_pos;
@@ -47,15 +67,25 @@ struct MeshCollector
 	// offset: offset added to vertices
 	MeshCollector(const v3f center_pos, v3f offset = v3f()) : m_center_pos(center_pos), offset(offset) {}
 
+	// Set by the mesh generator before it adds the geometry of a row of nodes
+	void startRow(u32 row) { m_row = row; }
+
 	void append(const TileSpec &material,
 			const video::S3DVertex *vertices, u32 numVertices,
 			const u16 *indices, u32 numIndices);
 
+	// Appends the geometry `from` has for the current row, beginning at
+	// from.strips[strip]. Returns the index of the first strip of a later row.
+	size_t appendRow(const MeshCollector &from, size_t strip);
+
 private:
+	u32 m_row = 0;
+
 	void append(const TileLayer &material,
 			const video::S3DVertex *vertices, u32 numVertices,
 			const u16 *indices, u32 numIndices,
 			u8 layernum, bool use_scale = false);
 
 	PreMeshBuffer &findBuffer(const TileLayer &layer, u8 layernum, u32 numVertices);
+	void addToStrip(u8 layernum, const PreMeshBuffer &p, u32 numVertices, u32 numIndices);
 };
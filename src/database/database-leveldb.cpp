@@ -18,6 +18,7 @@
 #include "util/string.h"
 
 #include "leveldb/db.h"
+#include "leveldb/write_batch.h"
 
 
 #define ENSURE_STATUS_OK(s) \
@@ -74,6 +75,24 @@ bool Database_LevelDB::deleteBlock(const v3s16 &pos)
 	return true;
 }
 
+bool Database_LevelDB::saveBlocks(const std::vector<std::pair<v3s16, std::string_view>> &blocks)
+{
+	leveldb::WriteBatch batch;
+	for (const auto &it : blocks) {
+		leveldb::Slice data_s(it.second.data(), it.second.size());
+		batch.Put(i64tos(getBlockAsInteger(it.first)), data_s);
+	}
+
+	leveldb::Status status = m_database->Write(leveldb::WriteOptions(), &batch);
+	if (!status.ok()) {
+		warningstream << "saveBlocks: LevelDB error saving " << blocks.size()
+			<< " blocks: " << status.ToString() << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
 void Database_LevelDB::listAllLoadableBlocks(std::vector<v3s16> &dst)
 {
 	std::unique_ptr<leveldb::Iterator> it(m_database->NewIterator(leveldb::ReadOptions()));
@@ -20,7 +20,10 @@
 #include "settings.h"
 #include "remoteplayer.h"
 #include "server/player_sao.h"
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
+#include <unordered_set>
 
 Database_PostgreSQL::Database_PostgreSQL(const std::string &connect_string,
 	const char *type) :
@@ -175,6 +178,34 @@ void MapDatabasePostgreSQL::createDatabase()
 	infostream << "PostgreSQL: Map Database was initialized." << std::endl;
 }
 
+// Number of blocks handled by one statement in loadBlocks()/saveBlocks()
+static constexpr size_t BLOCK_BATCH_SIZE = 32;
+
+// Builds "($1::int4, $2::bytea), ($3::int4, $4::bytea), ..." for the given types
+static std::string batchValues(const std::vector<const char *> &types, size_t count)
+{
+	std::string ret;
+	int param = 1;
+	for (size_t i = 0; i < count; i++) {
+		ret.append(i > 0 ? ", (" : "(");
+		for (size_t j = 0; j < types.size(); j++) {
+			if (j > 0)
+				ret.append(", ");
+			ret.append("$").append(std::to_string(param++)).append("::").append(types[j]);
+		}
+		ret.append(")");
+	}
+	return ret;
+}
+
+// Reads an int4 column of a result in binary format
+static inline s32 pg_binary_to_int(PGresult *res, int row, int col)
+{
+	u32 val;
+	memcpy(&val, PQgetvalue(res, row, col), sizeof(val));
+	return (s32) ntohl(val);
+}
+
 void MapDatabasePostgreSQL::initStatements()
 {
 	prepareStatement("read_block",
@@ -207,6 +238,19 @@ void MapDatabasePostgreSQL::initStatements()
 
 	prepareStatement("list_all_loadable_blocks",
 		"SELECT posX, posY, posZ FROM blocks");
+
+	prepareStatement("read_blocks",
+		"SELECT posX, posY, posZ, data FROM blocks "
+			"WHERE (posX, posY, posZ) IN (" +
+			batchValues({"int4", "int4", "int4"}, BLOCK_BATCH_SIZE) + ")");
+
+	if (getPGVersion() >= 90500) {
+		prepareStatement("write_blocks",
+			"INSERT INTO blocks (posX, posY, posZ, data) VALUES " +
+				batchValues({"int4", "int4", "int4", "bytea"}, BLOCK_BATCH_SIZE) +
+				" ON CONFLICT ON CONSTRAINT blocks_pkey DO "
+				"UPDATE SET data = EXCLUDED.data");
+	}
 }
 
 bool MapDatabasePostgreSQL::saveBlock(const v3s16 &pos, std::string_view data)
@@ -283,6 +327,114 @@ bool MapDatabasePostgreSQL::deleteBlock(const v3s16 &pos)
 	return true;
 }
 
+bool MapDatabasePostgreSQL::saveBlocks(const std::vector<std::pair<v3s16, std::string_view>> &blocks)
+{
+	if (getPGVersion() < 90500)
+		return MapDatabase::saveBlocks(blocks);
+
+	verifyDatabase();
+
+	// A statement can't update the same row twice, so only keep the last
+	// data of each block
+	std::vector<size_t> order;
+	order.reserve(blocks.size());
+	{
+		std::unordered_set<v3s16> seen;
+		for (size_t i = blocks.size(); i-- > 0; ) {
+			if (seen.insert(blocks[i].first).second)
+				order.push_back(i);
+		}
+		std::reverse(order.begin(), order.end());
+	}
+
+	bool ok = true;
+	size_t i = 0;
+	for (; i + BLOCK_BATCH_SIZE <= order.size(); i += BLOCK_BATCH_SIZE) {
+		s32 coords[BLOCK_BATCH_SIZE * 3];
+		const void *args[BLOCK_BATCH_SIZE * 4];
+		int argLen[BLOCK_BATCH_SIZE * 4];
+		int argFmt[BLOCK_BATCH_SIZE * 4];
+
+		for (size_t j = 0; j < BLOCK_BATCH_SIZE; j++) {
+			const auto &block = blocks[order[i + j]];
+			// Verify if we don't overflow the platform integer with the mapblock size
+			if (block.second.size() > INT_MAX) {
+				errorstream << "Database_PostgreSQL::saveBlocks: Data truncation! "
+					<< "data.size() over 0xFFFFFFFF (== " << block.second.size()
+					<< ")" << std::endl;
+				return false;
+			}
+
+			coords[j * 3] = htonl(block.first.X);
+			coords[j * 3 + 1] = htonl(block.first.Y);
+			coords[j * 3 + 2] = htonl(block.first.Z);
+			for (int k = 0; k < 3; k++) {
+				args[j * 4 + k] = &coords[j * 3 + k];
+				argLen[j * 4 + k] = sizeof(s32);
+			}
+			args[j * 4 + 3] = block.second.data();
+			argLen[j * 4 + 3] = block.second.size();
+		}
+		std::fill(argFmt, argFmt + ARRLEN(argFmt), 1);
+
+		execPrepared("write_blocks", ARRLEN(args), args, argLen, argFmt);
+	}
+
+	// Rest one by one
+	for (; i < order.size(); i++)
+		ok &= saveBlock(blocks[order[i]].first, blocks[order[i]].second);
+
+	return ok;
+}
+
+void MapDatabasePostgreSQL::loadBlocks(const std::vector<v3s16> &pos, std::vector<std::string> *blocks)
+{
+	verifyDatabase();
+
+	blocks->clear();
+	blocks->resize(pos.size());
+
+	for (size_t i = 0; i < pos.size(); i += BLOCK_BATCH_SIZE) {
+		const size_t end = std::min(i + BLOCK_BATCH_SIZE, pos.size());
+
+		// Fill up the last batch with duplicates
+		s32 coords[BLOCK_BATCH_SIZE * 3];
+		const void *args[BLOCK_BATCH_SIZE * 3];
+		int argLen[BLOCK_BATCH_SIZE * 3];
+		int argFmt[BLOCK_BATCH_SIZE * 3];
+		for (size_t j = 0; j < BLOCK_BATCH_SIZE; j++) {
+			const v3s16 p = pos[std::min(i + j, end - 1)];
+			coords[j * 3] = htonl(p.X);
+			coords[j * 3 + 1] = htonl(p.Y);
+			coords[j * 3 + 2] = htonl(p.Z);
+		}
+		for (size_t k = 0; k < ARRLEN(args); k++) {
+			args[k] = &coords[k];
+			argLen[k] = sizeof(s32);
+			argFmt[k] = 1;
+		}
+
+		PGresult *results = execPrepared("read_blocks", ARRLEN(args), args,
+			argLen, argFmt, false);
+
+		const int numrows = PQntuples(results);
+		for (int row = 0; row < numrows; row++) {
+			const v3s16 p(
+				pg_binary_to_int(results, row, 0),
+				pg_binary_to_int(results, row, 1),
+				pg_binary_to_int(results, row, 2)
+			);
+			// The rows come in no particular order
+			for (size_t j = i; j < end; j++) {
+				if (pos[j] == p)
+					(*blocks)[j] = pg_to_string(results, row, 3);
+			}
+		}
+
+		PQclear(results);
+	}
+}
+
 void MapDatabasePostgreSQL::listAllLoadableBlocks(std::vector<v3s16> &dst)
 {
 	verifyDatabase();
@@ -14,6 +14,7 @@
 #include "irrlicht_changes/printing.h"
 #include "server/player_sao.h"
 
+#include <algorithm>
 #include <cassert>
 
 // When to print messages when the database is being held locked by another process
@@ -220,6 +221,8 @@ MapDatabaseSQLite3::~MapDatabaseSQLite3()
 	FINALIZE_STATEMENT(write)
 	FINALIZE_STATEMENT(list)
 	FINALIZE_STATEMENT(delete)
+	FINALIZE_STATEMENT(read_batch)
+	FINALIZE_STATEMENT(write_batch)
 }
 
 
@@ -247,6 +250,21 @@ void MapDatabaseSQLite3::createDatabase()
 		"Failed to create database table");
 }
 
+// Number of blocks handled by one statement in loadBlocks()/saveBlocks()
+static constexpr size_t BLOCK_BATCH_SIZE = 32;
+
+// Repeats sql count times, separated by commas
+static std::string repeatList(const char *sql, size_t count)
+{
+	std::string ret;
+	for (size_t i = 0; i < count; i++) {
+		if (i > 0)
+			ret.append(", ");
+		ret.append(sql);
+	}
+	return ret;
+}
+
 void MapDatabaseSQLite3::initStatements()
 {
 	assert(checkTable("blocks"));
@@ -265,6 +283,39 @@ void MapDatabaseSQLite3::initStatements()
 		PREPARE_STATEMENT(delete, "DELETE FROM `blocks` WHERE `pos` = ?");
 		PREPARE_STATEMENT(list, "SELECT `pos` FROM `blocks`");
 	}
+
+	// OR instead of a row value IN () since that needs a newer SQLite
+	std::string read_batch, write_batch;
+	if (m_new_format) {
+		read_batch = "SELECT `x`, `y`, `z`, `data` FROM `blocks` WHERE ";
+		for (size_t i = 0; i < BLOCK_BATCH_SIZE; i++) {
+			if (i > 0)
+				read_batch.append(" OR ");
+			read_batch.append("(`x` = ? AND `y` = ? AND `z` = ?)");
+		}
+		write_batch = "REPLACE INTO `blocks` (`x`, `y`, `z`, `data`) VALUES " +
+			repeatList("(?, ?, ?, ?)", BLOCK_BATCH_SIZE);
+	} else {
+		read_batch = "SELECT `pos`, `data` FROM `blocks` WHERE `pos` IN (" +
+			repeatList("?", BLOCK_BATCH_SIZE) + ")";
+		write_batch = "REPLACE INTO `blocks` (`pos`, `data`) VALUES " +
+			repeatList("(?, ?)", BLOCK_BATCH_SIZE);
+	}
+	PREPARE_STATEMENT(read_batch, read_batch.c_str());
+	PREPARE_STATEMENT(write_batch, write_batch.c_str());
+}
+
+inline int MapDatabaseSQLite3::readPos(sqlite3_stmt *stmt, v3s16 &pos, int index)
+{
+	if (m_new_format) {
+		pos.X = sqlite_to_int(stmt, index);
+		pos.Y = sqlite_to_int(stmt, index + 1);
+		pos.Z = sqlite_to_int(stmt, index + 2);
+		return index + 3;
+	} else {
+		pos = getIntegerAsBlock(sqlite_to_int64(stmt, index));
+		return index + 1;
+	}
 }
 
 inline int MapDatabaseSQLite3::bindPos(sqlite3_stmt *stmt, v3s16 pos, int index)
@@ -328,19 +379,67 @@ void MapDatabaseSQLite3::loadBlock(const v3s16 &pos, std::string *block)
 	sqlite3_reset(m_stmt_read);
 }
 
+bool MapDatabaseSQLite3::saveBlocks(const std::vector<std::pair<v3s16, std::string_view>> &blocks)
+{
+	verifyDatabase();
+
+	size_t i = 0;
+	for (; i + BLOCK_BATCH_SIZE <= blocks.size(); i += BLOCK_BATCH_SIZE) {
+		int col = 1;
+		for (size_t j = i; j < i + BLOCK_BATCH_SIZE; j++) {
+			col = bindPos(m_stmt_write_batch, blocks[j].first, col);
+			blob_to_sqlite(m_stmt_write_batch, col++, blocks[j].second);
+		}
+
+		SQLRES(sqlite3_step(m_stmt_write_batch), SQLITE_DONE, "Failed to save blocks")
+		sqlite3_reset(m_stmt_write_batch);
+	}
+
+	// Rest one by one
+	bool ok = true;
+	for (; i < blocks.size(); i++)
+		ok &= saveBlock(blocks[i].first, blocks[i].second);
+
+	return ok;
+}
+
+void MapDatabaseSQLite3::loadBlocks(const std::vector<v3s16> &pos, std::vector<std::string> *blocks)
+{
+	verifyDatabase();
+
+	blocks->clear();
+	blocks->resize(pos.size());
+
+	for (size_t i = 0; i < pos.size(); i += BLOCK_BATCH_SIZE) {
+		const size_t end = std::min(i + BLOCK_BATCH_SIZE, pos.size());
+
+		// Fill up the last batch with duplicates
+		int col = 1;
+		for (size_t j = i; j < i + BLOCK_BATCH_SIZE; j++)
+			col = bindPos(m_stmt_read_batch, pos[std::min(j, end - 1)], col);
+
+		v3s16 p;
+		while (sqlite3_step(m_stmt_read_batch) == SQLITE_ROW) {
+			col = readPos(m_stmt_read_batch, p);
+			auto data = sqlite_to_blob(m_stmt_read_batch, col);
+			// The rows come in no particular order
+			for (size_t j = i; j < end; j++) {
+				if (pos[j] == p)
+					(*blocks)[j].assign(data);
+			}
+		}
+
+		sqlite3_reset(m_stmt_read_batch);
+	}
+}
+
 void MapDatabaseSQLite3::listAllLoadableBlocks(std::vector<v3s16> &dst)
 {
 	verifyDatabase();
 
 	v3s16 p;
 	while (sqlite3_step(m_stmt_list) == SQLITE_ROW) {
-		if (m_new_format) {
-			p.X = sqlite_to_int(m_stmt_list, 0);
-			p.Y = sqlite_to_int(m_stmt_list, 1);
-			p.Z = sqlite_to_int(m_stmt_list, 2);
-		} else {
-			p = getIntegerAsBlock(sqlite_to_int64(m_stmt_list, 0));
-		}
+		readPos(m_stmt_list, p);
 		dst.push_back(p);
 	}
 
@@ -175,6 +175,8 @@ class MapDatabaseSQLite3 : private Database_SQLite3, public MapDatabase
 	bool saveBlock(const v3s16 &pos, std::string_view data);
 	void loadBlock(const v3s16 &pos, std::string *block);
 	bool deleteBlock(const v3s16 &pos);
+	bool saveBlocks(const std::vector<std::pair<v3s16, std::string_view>> &blocks);
+	void loadBlocks(const std::vector<v3s16> &pos, std::vector<std::string> *blocks);
 	void listAllLoadableBlocks(std::vector<v3s16> &dst);
 
 	PARENT_CLASS_FUNCS
@@ -184,6 +186,9 @@ class MapDatabaseSQLite3 : private Database_SQLite3, public MapDatabase
 	virtual void initStatements();
 
 private:
+	/// @brief Read block position from result at column index
+	/// @return index of next column after position
+	int readPos(sqlite3_stmt *stmt, v3s16 &pos, int index = 0);
 	/// @brief Bind block position into statement at column index
 	/// @return index of next column after position
 	int bindPos(sqlite3_stmt *stmt, v3s16 pos, int index = 1);
@@ -194,6 +199,9 @@ class MapDatabaseSQLite3 : private Database_SQLite3, public MapDatabase
 	sqlite3_stmt *m_stmt_write = nullptr;
 	sqlite3_stmt *m_stmt_list = nullptr;
 	sqlite3_stmt *m_stmt_delete = nullptr;
+	// These handle a fixed number of blocks, see BLOCK_BATCH_SIZE
+	sqlite3_stmt *m_stmt_read_batch = nullptr;
+	sqlite3_stmt *m_stmt_write_batch = nullptr;
 };
 
 class PlayerDatabaseSQLite3 : private Database_SQLite3, public PlayerDatabase
@@ -33,6 +33,23 @@ static inline s64 pythonmodulo(s64 i, s16 mod)
 }
 
 
+bool MapDatabase::saveBlocks(const std::vector<std::pair<v3s16, std::string_view>> &blocks)
+{
+	bool ok = true;
+	for (const auto &it : blocks)
+		ok &= saveBlock(it.first, it.second);
+	return ok;
+}
+
+
+void MapDatabase::loadBlocks(const std::vector<v3s16> &pos, std::vector<std::string> *blocks)
+{
+	blocks->resize(pos.size());
+	for (size_t i = 0; i < pos.size(); i++)
+		loadBlock(pos[i], &(*blocks)[i]);
+}
+
+
 s64 MapDatabase::getBlockAsInteger(const v3s16 &pos)
 {
 	return (u64) pos.Z * 0x1000000 +
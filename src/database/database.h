@@ -6,6 +6,7 @@
 
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 #include "irr_v3d.h"
 #include "irrlichttypes.h"
@@ -33,6 +34,14 @@ class MapDatabase : public Database
 	virtual void loadBlock(const v3s16 &pos, std::string *block) = 0;
 	virtual bool deleteBlock(const v3s16 &pos) = 0;
 
+	/// Saves multiple blocks at once.
+	/// Backends should override this if they can do it in fewer round-trips.
+	/// @return false if any of the blocks failed to save
+	virtual bool saveBlocks(const std::vector<std::pair<v3s16, std::string_view>> &blocks);
+	/// Loads multiple blocks at once. Missing blocks result in empty strings.
+	/// @param blocks receives one string per position
+	virtual void loadBlocks(const std::vector<v3s16> &pos, std::vector<std::string> *blocks);
+
 	static s64 getBlockAsInteger(const v3s16 &pos);
 	static v3s16 getIntegerAsBlock(s64 i);
 
@@ -16,6 +16,7 @@
 #include "filesys.h"
 #include "log.h"
 #include "servermap.h"
+#include "server/block_prefetcher.h"
 #include "database/database.h"
 #include "mapblock.h"
 #include "mapgen/mg_biome.h"
@@ -314,6 +315,20 @@ bool EmergeManager::isBlockInQueue(v3s16 pos)
 }
 
 
+bool EmergeManager::canPrefetch()
+{
+	return m_db && m_db->prefetcher;
+}
+
+
+void EmergeManager::prefetchBlocks(const std::vector<v3s16> &positions)
+{
+	if (!canPrefetch() || positions.empty())
+		return;
+	m_db->prefetcher->request(positions);
+}
+
+
 //
 // Mapgen-related helper functions
 //
@@ -528,7 +543,8 @@ bool EmergeThread::popBlockEmerge(v3s16 *pos, BlockEmergeData *bedata)
 
 
 EmergeAction EmergeThread::getBlockOrStartGen(const v3s16 pos, bool allow_gen,
-	 const std::string *from_db, MapBlock **block, BlockMakeData *bmdata)
+	const std::string *from_db, DetachedBlock *detached,
+	MapBlock **block, BlockMakeData *bmdata)
 {
 	//TimeTaker tt("", nullptr, PRECISION_MICRO);
 	Server::EnvAutoLock envlock(m_server);
@@ -555,7 +571,10 @@ EmergeAction EmergeThread::getBlockOrStartGen(const v3s16 pos, bool allow_gen,
 		}
 		// 2). Second invocation, we have the data
 		if (!from_db->empty()) {
-			*block = m_map->loadBlock(*from_db, pos);
+			if (detached)
+				*block = m_map->loadBlock(std::move(*detached));
+			else
+				*block = m_map->loadBlock(*from_db, pos);
 			if (block_ok(*block))
 				return EMERGE_FROM_DISK;
 		}
@@ -698,20 +717,24 @@ void *EmergeThread::run()
 		bool allow_gen = bedata.flags & BLOCK_EMERGE_ALLOW_GEN;
 		EMERGE_DBG_OUT("pos=" << pos << " allow_gen=" << allow_gen);
 
-		action = getBlockOrStartGen(pos, allow_gen, nullptr, &block, &bmdata);
+		action = getBlockOrStartGen(pos, allow_gen, nullptr, nullptr, &block, &bmdata);
 
 		/* Try to load it */
 		if (action == EMERGE_FROM_DISK) {
 			auto &m_db = *m_emerge->m_db;
 			{
 				ScopeProfiler sp(g_profiler, "EmergeThread: load block - async (sum)");
-				MutexAutoLock dblock(m_db.mutex);
 				// Note: this can throw an exception, but there isn't really
 				// a good, safe way to handle it.
 				m_db.loadBlock(pos, databuf);
 			}
+			// Do the expensive part without holding the env lock
+			DetachedBlock detached;
+			bool have_detached = !databuf.empty() &&
+				m_map->deSerializeDetached(databuf, pos, detached);
 			// actually load it, then decide again
-			action = getBlockOrStartGen(pos, allow_gen, &databuf, &block, &bmdata);
+			action = getBlockOrStartGen(pos, allow_gen, &databuf,
+				have_detached ? &detached : nullptr, &block, &bmdata);
 			databuf.clear();
 		}
 
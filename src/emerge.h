@@ -183,6 +183,11 @@ class EmergeManager {
 	size_t getQueueSize();
 	bool isBlockInQueue(v3s16 pos);
 
+	// Whether the map database supports reading ahead
+	bool canPrefetch();
+	// Hints that these blocks will likely be emerged soon, most important first
+	void prefetchBlocks(const std::vector<v3s16> &positions);
+
 	Mapgen *getCurrentMapgen();
 
 	// Mapgen helpers methods
@@ -10,6 +10,7 @@
 
 #include "emerge.h"
 
+#include <memory>
 #include <queue>
 
 #include "util/thread.h"
@@ -17,6 +18,7 @@
 
 class Server;
 class ServerMap;
+struct DetachedBlock;
 class Mapgen;
 
 class EmergeManager;
@@ -70,13 +72,16 @@ class EmergeThread : public Thread {
 	 * @param pos block position
 	 * @param from_db serialized block data, optional
 	 *                (for second call after EMERGE_FROM_DISK was returned)
+	 * @param detached from_db already deserialized outside of the env lock,
+	 *                 optional (see ServerMap::deSerializeDetached)
 	 * @param allow_gen allow invoking mapgen?
 	 * @param block output pointer for block
 	 * @param data info for mapgen
 	 * @return what to do for this block
 	 */
 	EmergeAction getBlockOrStartGen(v3s16 pos, bool allow_gen,
-		const std::string *from_db,  MapBlock **block, BlockMakeData *data);
+		const std::string *from_db, DetachedBlock *detached,
+		MapBlock **block, BlockMakeData *data);
 
 	MapBlock *finishGen(v3s16 pos, BlockMakeData *bmdata,
 		std::map<v3s16, MapBlock *> *modified_blocks);
@@ -70,8 +70,10 @@ MapSector * Map::getSectorNoGenerateNoLock(v2s16 p)
 	MapSector *sector = n->second;
 
 	// Cache the last result
-	m_sector_cache_p = p;
-	m_sector_cache = sector;
+	if (!m_sector_cache_frozen) {
+		m_sector_cache_p = p;
+		m_sector_cache = sector;
+	}
 
 	return sector;
 }
@@ -327,6 +329,8 @@ void Map::timerUpdate(float dtime, float unload_timeout, s32 max_loaded_blocks,
 				} else {
 					all_blocks_deleted = false;
 					block_count_all++;
+					if (m_pack_idle_blocks && block->refGet() == 0)
+						block->packIfIdle();
 				}
 			}
 
@@ -346,6 +350,8 @@ void Map::timerUpdate(float dtime, float unload_timeout, s32 max_loaded_blocks,
 
 			for (MapBlock *block : blocks) {
 				block->incrementUsageTimer(dtime);
+				if (m_pack_idle_blocks && block->refGet() == 0)
+					block->packIfIdle();
 				mapblock_queue.push(TimeOrderedMapBlock(sector, block));
 			}
 		}
@@ -284,10 +284,16 @@ class Map /*: public NodeContainer*/
 	// Be sure to set this to NULL when the cached sector is deleted
 	MapSector *m_sector_cache = nullptr;
 	v2s16 m_sector_cache_p;
+	// While set, lookups don't update the cache, so that several threads
+	// can look up sectors at once as long as the map isn't modified
+	bool m_sector_cache_frozen = false;
 
 	// This stores the properties of the nodes on the map.
 	const NodeDefManager *m_nodedef;
 
+	// Whether timerUpdate() should pack blocks that aren't written to
+	bool m_pack_idle_blocks = false;
+
 	// Can be implemented by child class
 	virtual void reportMetrics(u64 save_time_us, u32 saved_blocks, u32 all_blocks) {}
 
@@ -4,6 +4,7 @@
 
 #include "mapblock.h"
 
+#include <algorithm>
 #include <sstream>
 #include "map.h"
 #include "light.h"
@@ -50,10 +51,22 @@ static const char *modified_reason_strings[] = {
 	MapBlock
 */
 
+std::atomic<u64> MapBlock::s_next_content_version {1};
+
+// The node data may outlive the block if a snapshot still uses it
+static std::shared_ptr<MapNode[]> allocateNodes()
+{
+	return std::shared_ptr<MapNode[]>(new MapNode[MapBlock::nodecount],
+		[] (MapNode *nodes) {
+			delete[] nodes;
+			porting::TrackFreedMemory(sizeof(MapNode) * MapBlock::nodecount);
+		});
+}
+
 MapBlock::MapBlock(v3s16 pos, IGameDef *gamedef):
 		m_pos(pos),
 		m_pos_relative(pos * MAP_BLOCKSIZE),
-		data(new MapNode[nodecount]),
+		data(allocateNodes()),
 		m_gamedef(gamedef)
 {
 	reallocate();
@@ -68,9 +81,6 @@ MapBlock::~MapBlock()
 		mesh = nullptr;
 	}
 #endif
-
-	delete[] data;
-	porting::TrackFreedMemory(sizeof(MapNode) * nodecount);
 }
 
 static inline size_t get_max_objects_per_block()
@@ -164,8 +174,17 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 
+	// Reading shouldn't unpack the block
+	std::unique_ptr<MapNode[]> tmp;
+	const MapNode *nodes = data.get();
+	if (!nodes) {
+		tmp = std::make_unique<MapNode[]>(nodecount);
+		unpackTo(tmp.get());
+		nodes = tmp.get();
+	}
+
 	// Copy from data to VoxelManipulator
-	dst.copyFrom(data, data_area, v3s16(0,0,0),
+	dst.copyFrom(nodes, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
 }
 
@@ -174,9 +193,245 @@ void MapBlock::copyFrom(const VoxelManipulator &src)
 	v3s16 data_size(MAP_BLOCKSIZE, MAP_BLOCKSIZE, MAP_BLOCKSIZE);
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 
+	NodeData nodes = getData();
+
+	// Keep the old nodes to find the changed ones
+	std::unique_ptr<MapNode[]> old;
+	if (m_change_log) {
+		old = std::make_unique<MapNode[]>(nodecount);
+		memcpy(old.get(), nodes.get(), nodecount * sizeof(MapNode));
+	}
+
 	// Copy from VoxelManipulator to data
-	src.copyTo(data, data_area, v3s16(0,0,0),
+	src.copyTo(nodes.get(), data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
+
+	if (old) {
+		for (u32 i = 0; i < nodecount; i++) {
+			if (nodes[i] != old[i])
+				logNodeChange(i);
+		}
+	}
+}
+
+/*
+	Node change log
+*/
+
+// Dropping the older half of a full log keeps the recent changes usable
+#define NODE_CHANGE_LOG_MAX 1024
+
+void MapBlock::startNodeChangeLog()
+{
+	if (m_change_log)
+		return;
+	m_change_log = std::make_unique<NodeChangeLog>();
+	m_change_log->since = m_content_version;
+}
+
+void MapBlock::logNodeChange(u32 i)
+{
+	auto &changes = m_change_log->changes;
+	if (changes.size() >= NODE_CHANGE_LOG_MAX) {
+		const size_t n = changes.size() / 2;
+		m_change_log->since = changes[n - 1].content_version + 1;
+		changes.erase(changes.begin(), changes.begin() + n);
+	}
+	changes.push_back({m_content_version, (u16)i});
+}
+
+bool MapBlock::getChangedNodes(u64 content_version, std::vector<u16> &dst) const
+{
+	if (!m_change_log || content_version < m_change_log->since)
+		return false;
+
+	// A change made while the block had this version came after anything
+	// the client could have been sent of it
+	const auto &changes = m_change_log->changes;
+	auto it = std::partition_point(changes.begin(), changes.end(),
+		[&] (const NodeChangeLog::Change &c) {
+			return c.content_version < content_version;
+		});
+	const size_t start = dst.size();
+	for (; it != changes.end(); ++it)
+		dst.push_back(it->index);
+	std::sort(dst.begin() + start, dst.end());
+	dst.erase(std::unique(dst.begin() + start, dst.end()), dst.end());
+	return true;
+}
+
+void MapBlock::trimNodeChangeLog(u64 content_version)
+{
+	if (!m_change_log || content_version <= m_change_log->since)
+		return;
+
+	auto &changes = m_change_log->changes;
+	auto it = std::partition_point(changes.begin(), changes.end(),
+		[&] (const NodeChangeLog::Change &c) {
+			return c.content_version < content_version;
+		});
+	changes.erase(changes.begin(), it);
+	if (changes.empty())
+		changes.shrink_to_fit();
+	m_change_log->since = content_version;
+}
+
+/*
+	Packed node storage
+*/
+
+static inline u32 nodeKey(MapNode n)
+{
+	return (u32)n.param0 << 16 | (u32)n.param1 << 8 | n.param2;
+}
+
+bool MapBlock::pack()
+{
+	if (!data)
+		return true;
+	// getData() handed out a pointer to the flat array
+	if (m_data_writers > 0)
+		return false;
+
+	// Find the distinct nodes. Like updateContentCounts() this starts
+	// with a linear search and falls back to sorting.
+	constexpr size_t LINEAR_MAX = 16;
+	std::vector<MapNode> palette;
+	u8 indices[nodecount];
+	size_t last = 0;
+	u32 i = 0;
+	for (; i < nodecount; i++) {
+		const MapNode n = data[i];
+		if (!palette.empty() && palette[last] == n) {
+			indices[i] = last;
+			continue;
+		}
+		last = 0;
+		while (last < palette.size() && palette[last] != n)
+			last++;
+		if (last == palette.size()) {
+			if (last == LINEAR_MAX)
+				break;
+			palette.push_back(n);
+		}
+		indices[i] = last;
+	}
+
+	if (i < nodecount) {
+		std::vector<u32> keys(nodecount);
+		for (u32 j = 0; j < nodecount; j++)
+			keys[j] = nodeKey(data[j]);
+		SORT_AND_UNIQUE(keys);
+		if (keys.size() > 256)
+			return false;
+		palette.clear();
+		for (u32 key : keys)
+			palette.emplace_back(key >> 16, (key >> 8) & 0xff, key & 0xff);
+		for (u32 j = 0; j < nodecount; j++) {
+			auto it = std::lower_bound(keys.begin(), keys.end(), nodeKey(data[j]));
+			indices[j] = it - keys.begin();
+		}
+	}
+
+	u8 bits = 0;
+	while ((1U << bits) < palette.size())
+		bits = bits ? bits * 2 : 1;
+
+	m_indices.reset();
+	if (bits > 0) {
+		const u32 size = nodecount * bits / 8;
+		m_indices = std::make_unique<u8[]>(size);
+		memset(m_indices.get(), 0, size);
+		for (u32 j = 0; j < nodecount; j++) {
+			const u32 bit = j * bits;
+			m_indices[bit >> 3] |= indices[j] << (bit & 7);
+		}
+	}
+	m_index_bits = bits;
+	m_palette = std::move(palette);
+	m_palette.shrink_to_fit();
+
+	data.reset();
+	return true;
+}
+
+void MapBlock::unpack()
+{
+	if (data)
+		return;
+
+	auto nodes = allocateNodes();
+	unpackTo(nodes.get());
+	data = std::move(nodes);
+
+	m_palette.clear();
+	m_palette.shrink_to_fit();
+	m_indices.reset();
+	m_index_bits = 0;
+}
+
+void MapBlock::unpackTo(MapNode *dst) const
+{
+	if (data) {
+		memcpy(dst, data.get(), nodecount * sizeof(MapNode));
+	} else if (m_index_bits == 0) {
+		std::fill(dst, dst + nodecount, m_palette[0]);
+	} else {
+		for (u32 i = 0; i < nodecount; i++)
+			dst[i] = m_palette[getPackedIndex(i)];
+	}
+}
+
+std::shared_ptr<const MapNode[]> MapBlock::getSnapshot()
+{
+	if (data && m_data_writers == 0) {
+		m_shared = true;
+		return data;
+	}
+
+	auto nodes = allocateNodes();
+	if (data)
+		memcpy(nodes.get(), data.get(), nodecount * sizeof(MapNode));
+	else
+		unpackTo(nodes.get());
+	return nodes;
+}
+
+void MapBlock::copyData()
+{
+	auto nodes = allocateNodes();
+	memcpy(nodes.get(), data.get(), nodecount * sizeof(MapNode));
+	data = std::move(nodes);
+}
+
+void MapBlock::setPackedNode(u32 i, MapNode n)
+{
+	size_t p = 0;
+	while (p < m_palette.size() && m_palette[p] != n)
+		p++;
+	if (p == m_palette.size()) {
+		if (p == (1U << m_index_bits)) {
+			// No room left, keep it simple
+			unpack();
+			data[i] = n;
+			return;
+		}
+		m_palette.push_back(n);
+	}
+
+	if (m_index_bits > 0) {
+		const u32 bit = i * m_index_bits;
+		const u8 mask = ((1 << m_index_bits) - 1) << (bit & 7);
+		u8 &byte = m_indices[bit >> 3];
+		byte = (byte & ~mask) | (p << (bit & 7));
+	}
+}
+
+size_t MapBlock::getNodeDataSize() const
+{
+	if (data)
+		return nodecount * sizeof(MapNode);
+	return m_palette.capacity() * sizeof(MapNode) + nodecount * m_index_bits / 8;
 }
 
 void MapBlock::actuallyUpdateIsAir()
@@ -186,7 +441,7 @@ void MapBlock::actuallyUpdateIsAir()
 
 	bool only_air = true;
 	for (u32 i = 0; i < nodecount; i++) {
-		MapNode &n = data[i];
+		MapNode n = readNode(i);
 		if (n.getContent() != CONTENT_AIR) {
 			only_air = false;
 			break;
@@ -202,6 +457,90 @@ void MapBlock::expireIsAirCache()
 	m_is_air_expired = true;
 }
 
+void MapBlock::updateContentCounts()
+{
+	m_content_counts_expired = false;
+	m_content_counts.clear();
+
+	if (!data) {
+		// Count the palette indices instead
+		u16 counts[256] = {};
+		for (u32 i = 0; i < nodecount; i++)
+			counts[getPackedIndex(i)]++;
+		for (size_t p = 0; p < m_palette.size(); p++) {
+			if (counts[p] == 0)
+				continue;
+			const content_t c = m_palette[p].getContent();
+			auto it = std::find_if(m_content_counts.begin(), m_content_counts.end(),
+				[c] (const ContentCount &cc) {
+					return cc.content == c;
+				});
+			if (it == m_content_counts.end())
+				m_content_counts.push_back({c, counts[p]});
+			else
+				it->count += counts[p];
+		}
+		std::sort(m_content_counts.begin(), m_content_counts.end(),
+			[] (const ContentCount &a, const ContentCount &b) {
+				return a.content < b.content;
+			});
+		return;
+	}
+
+	// Most blocks consist of only a handful of content types,
+	// so a linear search with a shortcut for runs of equal nodes is fast
+	constexpr size_t LINEAR_MAX = 16;
+	size_t last = 0;
+	u32 i = 0;
+	for (; i < nodecount; i++) {
+		content_t c = data[i].getContent();
+		if (!m_content_counts.empty() && m_content_counts[last].content == c) {
+			m_content_counts[last].count++;
+			continue;
+		}
+		last = 0;
+		while (last < m_content_counts.size() && m_content_counts[last].content != c)
+			last++;
+		if (last == m_content_counts.size()) {
+			if (last == LINEAR_MAX)
+				break;
+			m_content_counts.push_back({c, 0});
+		}
+		m_content_counts[last].count++;
+	}
+
+	if (i < nodecount) {
+		// Too many different ones, do it the other way
+		std::vector<content_t> ids(nodecount);
+		for (u32 j = 0; j < nodecount; j++)
+			ids[j] = data[j].getContent();
+		std::sort(ids.begin(), ids.end());
+		m_content_counts.clear();
+		for (content_t c : ids) {
+			if (m_content_counts.empty() || m_content_counts.back().content != c)
+				m_content_counts.push_back({c, 0});
+			m_content_counts.back().count++;
+		}
+	} else {
+		std::sort(m_content_counts.begin(), m_content_counts.end(),
+			[] (const ContentCount &a, const ContentCount &b) {
+				return a.content < b.content;
+			});
+	}
+}
+
+u16 MapBlock::getContentCount(content_t c)
+{
+	const auto &counts = getContentCounts();
+	auto it = std::lower_bound(counts.begin(), counts.end(), c,
+		[] (const ContentCount &a, content_t c) {
+			return a.content < c;
+		});
+	if (it == counts.end() || it->content != c)
+		return 0;
+	return it->count;
+}
+
 /*
 	Serialization
 */
@@ -249,8 +588,9 @@ static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 // Correct ids in the block to match nodedef based on names.
 // Unknown ones are added to nodedef.
 // Will not update itself to match id-name pairs in nodedef.
-static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
-		IGameDef *gamedef)
+// Returns false if an id would have to be allocated, but allocate is false
+static bool correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
+		IGameDef *gamedef, bool allocate = true)
 {
 	const NodeDefManager *nodedef = gamedef->ndef();
 	// This means the block contains incorrect ids, and we contain
@@ -284,6 +624,8 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 
 		content_t global_id;
 		if (!nodedef->getId(name, global_id)) {
+			if (!allocate)
+				return false;
 			global_id = gamedef->allocateUnknownNodeId(name);
 			if (global_id == CONTENT_IGNORE) {
 				unallocatable_contents.insert(name);
@@ -309,6 +651,7 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 				<< "Could not allocate global id for node name \""
 				<< node_name << "\"" << std::endl;
 	}
+	return true;
 }
 
 void MapBlock::serialize(std::ostream &os_compressed, u8 version, bool disk, int compression_level)
@@ -316,9 +659,26 @@ void MapBlock::serialize(std::ostream &os_compressed, u8 version, bool disk, int
 	if (!ser_ver_supported_write(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 
-	std::ostringstream os_raw(std::ios_base::binary);
-	std::ostream &os = version >= 29 ? os_raw : os_compressed;
+	if (version >= 29) {
+		std::ostringstream os_raw(std::ios_base::binary);
+		serializeBody(os_raw, version, disk, compression_level);
+		// now compress the whole thing
+		compress(os_raw.str(), os_compressed, version, compression_level);
+	} else {
+		serializeBody(os_compressed, version, disk, compression_level);
+	}
+}
+
+void MapBlock::serializeUncompressed(std::ostream &os, u8 version, bool disk)
+{
+	if (version < 29 || !ser_ver_supported_write(version))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+
+	serializeBody(os, version, disk, -1);
+}
 
+void MapBlock::serializeBody(std::ostream &os, u8 version, bool disk, int compression_level)
+{
 	// First byte
 	u8 flags = 0;
 	if(is_underground)
@@ -347,7 +707,7 @@ void MapBlock::serialize(std::ostream &os_compressed, u8 version, bool disk, int
 	if(disk)
 	{
 		MapNode *tmp_nodes = new MapNode[nodecount];
-		memcpy(tmp_nodes, data, nodecount * sizeof(MapNode));
+		unpackTo(tmp_nodes);
 		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
 
 		buf = MapNode::serializeBulk(version, tmp_nodes, nodecount,
@@ -361,9 +721,16 @@ void MapBlock::serialize(std::ostream &os_compressed, u8 version, bool disk, int
 			nimap.serialize(os);
 		}
 	}
+	else if (data)
+	{
+		buf = MapNode::serializeBulk(version, data.get(), nodecount,
+				content_width, params_width);
+	}
 	else
 	{
-		buf = MapNode::serializeBulk(version, data, nodecount,
+		auto tmp_nodes = std::make_unique<MapNode[]>(nodecount);
+		unpackTo(tmp_nodes.get());
+		buf = MapNode::serializeBulk(version, tmp_nodes.get(), nodecount,
 				content_width, params_width);
 	}
 
@@ -382,7 +749,7 @@ void MapBlock::serialize(std::ostream &os_compressed, u8 version, bool disk, int
 	if (version >= 29) {
 		m_node_metadata.serialize(os, version, disk);
 	} else {
-		// use os_raw from above to avoid allocating another stream object
+		std::ostringstream os_raw(std::ios_base::binary);
 		m_node_metadata.serialize(os_raw, version, disk);
 		// prior to 29 node data was compressed individually
 		compress(os_raw.str(), os, version, compression_level);
@@ -413,11 +780,6 @@ void MapBlock::serialize(std::ostream &os_compressed, u8 version, bool disk, int
 			m_node_timers.serialize(os, version);
 		}
 	}
-
-	if (version >= 29) {
-		// now compress the whole thing
-		compress(os_raw.str(), os_compressed, version, compression_level);
-	}
 }
 
 void MapBlock::serializeNetworkSpecific(std::ostream &os)
@@ -425,7 +787,24 @@ void MapBlock::serializeNetworkSpecific(std::ostream &os)
 	writeU8(os, 2); // version
 }
 
-void MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk)
+void MapBlock::deSerialize(std::istream &is, u8 version, bool disk,
+		const ZstdDictionary *dict)
+{
+	deSerializeBody(is, version, disk, nullptr, dict);
+}
+
+bool MapBlock::deSerializeDetached(std::istream &is, u8 version, NameIdMapping &nimap)
+{
+	return deSerializeBody(is, version, true, &nimap);
+}
+
+bool MapBlock::correctNodeIds(const NameIdMapping &nimap, bool allocate)
+{
+	return correctBlockNodeIds(&nimap, getData().get(), m_gamedef, allocate);
+}
+
+bool MapBlock::deSerializeBody(std::istream &in_compressed, u8 version, bool disk,
+		NameIdMapping *detached_nimap, const ZstdDictionary *dict)
 {
 	if (!ser_ver_supported_read(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
@@ -433,17 +812,25 @@ void MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk)
 	TRACESTREAM(<<"MapBlock::deSerialize "<<getPos()<<std::endl);
 
 	m_is_air_expired = true;
+	m_content_counts_expired = true;
+	newContentVersion();
+	m_change_log.reset();
+	unpack();
+	unshare();
+	m_idle_passes = 0;
 
 	if(version <= 21)
 	{
+		if (detached_nimap)
+			return false;
 		deSerialize_pre22(in_compressed, version, disk);
-		return;
+		return true;
 	}
 
 	// Decompress the whole block (version >= 29)
 	std::stringstream in_raw(std::ios_base::binary | std::ios_base::in | std::ios_base::out);
 	if (version >= 29)
-		decompress(in_compressed, in_raw, version);
+		decompress(in_compressed, in_raw, version, dict);
 	std::istream &is = version >= 29 ? in_raw : in_compressed;
 
 	u8 flags = readU8(is);
@@ -484,12 +871,12 @@ void MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk)
 		Bulk node data
 	*/
 	if (version >= 29) {
-		MapNode::deSerializeBulk(is, version, data, nodecount,
+		MapNode::deSerializeBulk(is, version, data.get(), nodecount,
 			content_width, params_width);
 	} else {
 		// use in_raw from above to avoid allocating another stream object
 		decompress(is, in_raw, version);
-		MapNode::deSerializeBulk(in_raw, version, data, nodecount,
+		MapNode::deSerializeBulk(in_raw, version, data.get(), nodecount,
 			content_width, params_width);
 	}
 
@@ -553,7 +940,8 @@ void MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk)
 		}
 
 		// Dynamically re-set ids based on node names
-		correctBlockNodeIds(&nimap, data, m_gamedef);
+		if (!detached_nimap)
+			correctBlockNodeIds(&nimap, data.get(), m_gamedef);
 
 		if(version >= 25){
 			TRACESTREAM(<<"MapBlock::deSerialize "<<getPos()
@@ -564,10 +952,14 @@ void MapBlock::deSerialize(std::istream &in_compressed, u8 version, bool disk)
 		u16 dummy;
 		m_is_air = nimap.size() == 1 && nimap.getId("air", dummy);
 		m_is_air_expired = false;
+
+		if (detached_nimap)
+			*detached_nimap = std::move(nimap);
 	}
 
 	TRACESTREAM(<<"MapBlock::deSerialize "<<getPos()
 			<<": Done."<<std::endl);
+	return true;
 }
 
 void MapBlock::deSerializeNetworkSpecific(std::istream &is)
@@ -770,7 +1162,7 @@ void MapBlock::deSerialize_pre22(std::istream &is, u8 version, bool disk)
 			m_is_air = false;
 			m_is_air_expired = true;
 		}
-		correctBlockNodeIds(&nimap, data, m_gamedef);
+		correctBlockNodeIds(&nimap, data.get(), m_gamedef);
 	}
 
 	// Legacy data changes
@@ -4,6 +4,8 @@
 
 #pragma once
 
+#include <atomic>
+#include <memory>
 #include <vector>
 #include "irr_v3d.h"
 #include "mapnode.h"
@@ -13,6 +15,7 @@
 #include "nodemetadata.h"
 #include "nodetimer.h"
 #include "modifiedstate.h"
+#include "util/basic_macros.h"
 #include "util/numeric.h" // getContainerPos
 #include "settings.h"
 
@@ -20,7 +23,9 @@ class Map;
 class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
+class NameIdMapping;
 class VoxelManipulator;
+class ZstdDictionary;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
@@ -75,16 +80,87 @@ class MapBlock
 
 	void reallocate()
 	{
+		NodeData nodes = getData();
 		for (u32 i = 0; i < nodecount; i++)
-			data[i] = MapNode(CONTENT_IGNORE);
+			nodes[i] = MapNode(CONTENT_IGNORE);
+		m_change_log.reset();
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_REALLOCATE);
 	}
 
-	MapNode* getData()
+	// Writable access to all nodes, see getData()
+	class NodeData
 	{
-		return data;
+	public:
+		NodeData(MapBlock *block) : m_block(block)
+		{
+			block->unpack();
+			block->unshare();
+			block->m_idle_passes = 0;
+			block->expireContentCounts();
+			block->m_data_writers++;
+			m_nodes = block->data.get();
+		}
+
+		~NodeData() { m_block->m_data_writers--; }
+
+		DISABLE_CLASS_COPY(NodeData)
+
+		MapNode &operator[](u32 i) const { return m_nodes[i]; }
+		MapNode *get() const { return m_nodes; }
+
+	private:
+		MapBlock *m_block;
+		MapNode *m_nodes;
+	};
+
+	// Unpacks the node data if needed. While the returned view exists, the
+	// block isn't packed and snapshots get a copy of the nodes, so keep it
+	// only for the current operation.
+	NodeData getData()
+	{
+		return NodeData(this);
+	}
+
+	// Returns the node data for use on other threads, where it doesn't change.
+	// The block shares its own data, it is only copied once the block is
+	// written to while the snapshot is still in use.
+	// Packed blocks (only on the server) and blocks that are being written
+	// through getData() are copied right away.
+	std::shared_ptr<const MapNode[]> getSnapshot();
+
+	////
+	//// Packed node storage
+	////
+
+	/*
+		While packed, the nodes are stored as a palette of distinct MapNodes
+		plus an index into it for every node, using as few bits as possible
+		(none at all if the block is uniform).
+		Reading works in both representations. Writing a node that doesn't
+		fit into the palette converts the block back into the flat array.
+	*/
+	bool isPacked() const
+	{
+		return !data;
+	}
+
+	// Returns whether the data is packed afterwards.
+	// Fails if the block has too many distinct nodes.
+	bool pack();
+
+	void unpack();
+
+	// To be called periodically: packs the block if the flat data
+	// wasn't written to since the previous call
+	void packIfIdle()
+	{
+		if (data && m_idle_passes < 2 && ++m_idle_passes == 2)
+			pack();
 	}
 
+	// Heap memory used for the node data
+	size_t getNodeDataSize() const;
+
 	////
 	//// Modification tracking methods
 	////
@@ -98,8 +174,10 @@ class MapBlock
 		} else if (mod == m_modified) {
 			m_modified_reason |= reason;
 		}
-		if (mod == MOD_STATE_WRITE_NEEDED)
-			contents.clear();
+		if (mod == MOD_STATE_WRITE_NEEDED) {
+			expireContentCounts();
+			newContentVersion();
+		}
 	}
 
 	inline u32 getModified()
@@ -120,6 +198,32 @@ class MapBlock
 		m_modified_reason = 0;
 	}
 
+	// Changes whenever something that is sent to clients is modified.
+	// A version is never used twice, not even by different blocks.
+	inline u64 getContentVersion() const
+	{
+		return m_content_version;
+	}
+
+	////
+	//// Node change log
+	////
+
+	// Starts logging which nodes are changed, so that a client that has an
+	// older version of the block can be sent just these nodes.
+	void startNodeChangeLog();
+	// Forgets the logged changes and stops logging, once no client has
+	// the block anymore.
+	void stopNodeChangeLog() { m_change_log.reset(); }
+
+	// Adds the sorted indices of the nodes changed since the block had the
+	// given content version to dst.
+	// Returns false if the log doesn't reach back that far.
+	bool getChangedNodes(u64 content_version, std::vector<u16> &dst) const;
+
+	// Forgets the changes made before the block had the given content version.
+	void trimNodeChangeLog(u64 content_version);
+
 	////
 	//// Flags
 	////
@@ -141,6 +245,7 @@ class MapBlock
 		if (newflags != m_lighting_complete) {
 			m_lighting_complete = newflags;
 			raiseModified(MOD_STATE_WRITE_AT_UNLOAD, MOD_REASON_SET_LIGHTING_COMPLETE);
+			newContentVersion();
 		}
 	}
 
@@ -236,7 +341,7 @@ class MapBlock
 		if (!*valid_position)
 			return {CONTENT_IGNORE};
 
-		return data[z * zstride + y * ystride + x];
+		return readNode(z * zstride + y * ystride + x);
 	}
 
 	inline MapNode getNode(v3s16 p, bool *valid_position)
@@ -255,7 +360,7 @@ class MapBlock
 		if (!isValidPosition(x, y, z))
 			throw InvalidPositionException();
 
-		data[z * zstride + y * ystride + x] = n;
+		writeNode(z * zstride + y * ystride + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE);
 	}
 
@@ -270,7 +375,7 @@ class MapBlock
 
 	inline MapNode getNodeNoCheck(s16 x, s16 y, s16 z)
 	{
-		return data[z * zstride + y * ystride + x];
+		return readNode(z * zstride + y * ystride + x);
 	}
 
 	inline MapNode getNodeNoCheck(v3s16 p)
@@ -280,7 +385,7 @@ class MapBlock
 
 	inline void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode n)
 	{
-		data[z * zstride + y * ystride + x] = n;
+		writeNode(z * zstride + y * ystride + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_SET_NODE);
 	}
 
@@ -310,6 +415,38 @@ class MapBlock
 		return m_is_air;
 	}
 
+	////
+	//// Content type statistics (used by ABMs and LBMs)
+	////
+
+	struct ContentCount {
+		content_t content;
+		u16 count; // number of nodes
+	};
+
+	// Returns the content types present in this block, sorted by content id.
+	// This is computed lazily and expires whenever the block's nodes change.
+	inline const std::vector<ContentCount> &getContentCounts()
+	{
+		if (m_content_counts_expired)
+			updateContentCounts();
+		return m_content_counts;
+	}
+
+	// Whether getContentCounts() is available without scanning the block
+	inline bool hasContentCounts() const
+	{
+		return !m_content_counts_expired;
+	}
+
+	// Returns the number of nodes with the given content
+	u16 getContentCount(content_t c);
+
+	inline void expireContentCounts()
+	{
+		m_content_counts_expired = true;
+	}
+
 	bool onObjectsActivation();
 	bool saveStaticObject(u16 id, const StaticObject &obj, u32 reason);
 
@@ -414,11 +551,28 @@ class MapBlock
 	// Set disk to true for on-disk format, false for over-the-network format
 	// Precondition: version >= SER_FMT_VER_LOWEST_WRITE
 	void serialize(std::ostream &result, u8 version, bool disk, int compression_level);
+	// Writes what serialize() would compress as a whole, so that compress()
+	// can be applied to the result later on.
+	// Precondition: version >= 29
+	void serializeUncompressed(std::ostream &result, u8 version, bool disk);
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
-	void deSerialize(std::istream &is, u8 version, bool disk);
-
-	void serializeNetworkSpecific(std::ostream &os);
+	// dict is the dictionary the data may have been compressed with.
+	void deSerialize(std::istream &is, u8 version, bool disk,
+			const ZstdDictionary *dict = nullptr);
+	// Like deSerialize() with disk == true, but doesn't look at the nodedef,
+	// which may only happen with the environment locked. This is what makes
+	// it usable on detached blocks. The node ids are left as they are in the
+	// data, correctNodeIds() must be called with nimap before using the block.
+	// Returns false if this isn't possible for the version.
+	bool deSerializeDetached(std::istream &is, u8 version, NameIdMapping &nimap);
+	// Converts the node ids of a block from deSerializeDetached() to the
+	// global ones. Unknown nodes are added to the nodedef if allocate is set,
+	// otherwise false is returned, leaving the block in an undefined state.
+	// @note call with the environment locked
+	bool correctNodeIds(const NameIdMapping &nimap, bool allocate = true);
+
+	static void serializeNetworkSpecific(std::ostream &os);
 	void deSerializeNetworkSpecific(std::istream &is);
 
 	bool storeActiveObject(u16 id);
@@ -435,8 +589,74 @@ class MapBlock
 		Private methods
 	*/
 
+	void serializeBody(std::ostream &os, u8 version, bool disk, int compression_level);
+	// If detached_nimap is given, the ids are not corrected but the mapping
+	// is stored to it instead (see deSerializeDetached())
+	bool deSerializeBody(std::istream &is, u8 version, bool disk,
+			NameIdMapping *detached_nimap, const ZstdDictionary *dict = nullptr);
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
 
+	void updateContentCounts();
+
+	inline void newContentVersion()
+	{
+		m_content_version = s_next_content_version.fetch_add(1,
+			std::memory_order_relaxed);
+	}
+
+	inline u8 getPackedIndex(u32 i) const
+	{
+		if (m_index_bits == 0)
+			return 0;
+		const u32 bit = i * m_index_bits;
+		const u8 mask = (1 << m_index_bits) - 1;
+		return (m_indices[bit >> 3] >> (bit & 7)) & mask;
+	}
+
+	inline MapNode readNode(u32 i) const
+	{
+		if (data)
+			return data[i];
+		return m_palette[getPackedIndex(i)];
+	}
+
+	inline void writeNode(u32 i, MapNode n)
+	{
+		if (m_change_log && readNode(i) != n)
+			logNodeChange(i);
+		if (data) {
+			unshare();
+			data[i] = n;
+		} else {
+			setPackedNode(i, n);
+		}
+		m_idle_passes = 0;
+		m_content_counts_expired = true;
+	}
+
+	// Makes sure that no snapshot shares the data before it is written to
+	inline void unshare()
+	{
+		// Blocks that never had a snapshot (all of them on the server)
+		// don't need to check
+		if (!m_shared)
+			return;
+		if (data.use_count() > 1)
+			copyData();
+		else // reads of snapshots released by other threads come first
+			std::atomic_thread_fence(std::memory_order_acquire);
+		m_shared = false;
+	}
+
+	void copyData();
+
+	void setPackedNode(u32 i, MapNode n);
+
+	void logNodeChange(u32 i);
+
+	// Copies all nodes to dst, which must hold nodecount elements
+	void unpackTo(MapNode *dst) const;
+
 	/*
 	 * PLEASE NOTE: When adding something here be mindful of position and size
 	 * of member variables! This is also the reason for the weird public-private
@@ -477,8 +697,14 @@ class MapBlock
 	 * Note that this is not an inline array because that has implications for
 	 * heap fragmentation (the array is exactly 16K), CPU caches and/or
 	 * optimizability of algorithms working on this array.
+	 * This is null while the block is packed.
+	 * Shared with the snapshots that are still in use, see getSnapshot().
 	 */
-	MapNode *const data; // of `nodecount` elements
+	std::shared_ptr<MapNode[]> data; // of `nodecount` elements
+
+	// Packed node storage, see isPacked()
+	std::vector<MapNode> m_palette;
+	std::unique_ptr<u8[]> m_indices; // of `nodecount * m_index_bits / 8` bytes
 
 	// provides the item and node definitions
 	IGameDef *m_gamedef;
@@ -489,20 +715,23 @@ class MapBlock
 	*/
 	float m_usage_timer = 0;
 
-public:
-	//// ABM optimizations ////
-	// True if we never want to cache content types for this block
-	bool do_not_cache_contents = false;
-	// Cache of content types
-	// This is actually a set but for the small sizes we have a vector should be
-	// more efficient.
-	// Can be empty, in which case nothing was cached yet.
-	std::vector<content_t> contents;
+	// see getContentCounts()
+	std::vector<ContentCount> m_content_counts;
 
-private:
 	// Whether day and night lighting differs
 	bool m_is_air = false;
 	bool m_is_air_expired = true;
+	bool m_content_counts_expired = true;
+
+	// Bits per node in m_indices: 0, 1, 2, 4 or 8
+	u8 m_index_bits = 0;
+	// Number of packIfIdle() calls since the data was last written to
+	u8 m_idle_passes = 0;
+
+	// Whether a snapshot may still share data, see getSnapshot()
+	bool m_shared = false;
+	// Number of NodeData views of the data
+	u16 m_data_writers = 0;
 
 	/*
 		- On the server, this is used for telling whether the
@@ -512,6 +741,23 @@ class MapBlock
 	u16 m_modified = MOD_STATE_CLEAN;
 	u32 m_modified_reason = 0;
 
+	// see getContentVersion()
+	u64 m_content_version = 0;
+	static std::atomic<u64> s_next_content_version;
+
+	// see startNodeChangeLog()
+	struct NodeChangeLog {
+		struct Change {
+			// Content version of the block before the change
+			u64 content_version;
+			u16 index;
+		};
+		// All changes after this content version are logged
+		u64 since;
+		std::vector<Change> changes;
+	};
+	std::unique_ptr<NodeChangeLog> m_change_log;
+
 	/*
 		When block is removed from active blocks, this is set to gametime.
 		Value BLOCK_TIMESTAMP_UNDEFINED=0xffffffff means there is no timestamp.
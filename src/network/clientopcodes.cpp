@@ -111,6 +111,8 @@ const ToClientCommandHandler toClientCommandTable[TOCLIENT_NUM_MSG_TYPES] =
 	{ "TOCLIENT_FORMSPEC_PREPEND",         TOCLIENT_STATE_CONNECTED, &Client::handleCommand_FormspecPrepend }, // 0x61,
 	{ "TOCLIENT_MINIMAP_MODES",            TOCLIENT_STATE_CONNECTED, &Client::handleCommand_MinimapModes }, // 0x62,
 	{ "TOCLIENT_SET_LIGHTING",             TOCLIENT_STATE_CONNECTED, &Client::handleCommand_SetLighting }, // 0x63,
+	{ "TOCLIENT_BLOCK_DELTA",              TOCLIENT_STATE_CONNECTED, &Client::handleCommand_BlockDelta }, // 0x64,
+	{ "TOCLIENT_BLOCK_DICTIONARY",         TOCLIENT_STATE_CONNECTED, &Client::handleCommand_BlockDictionary }, // 0x65,
 };
 
 const static ServerCommandFactory null_command_factory = { nullptr, 0, false };
@@ -211,4 +213,5 @@ const ServerCommandFactory serverCommandFactoryTable[TOSERVER_NUM_MSG_TYPES] =
 	{ "TOSERVER_SRP_BYTES_A",        1, true }, // 0x51
 	{ "TOSERVER_SRP_BYTES_M",        1, true }, // 0x52
 	{ "TOSERVER_UPDATE_CLIENT_INFO", 2, true }, // 0x53
+	{ "TOSERVER_BLOCK_DICTIONARY",   1, true }, // 0x54
 };
@@ -298,7 +298,8 @@ void Client::handleCommand_BlockData(NetworkPacket* pkt)
 		/*
 			Update an existing block
 		*/
-		block->deSerialize(istr, m_server_ser_ver, false);
+		block->deSerialize(istr, m_server_ser_ver, false,
+				m_block_dictionary.get());
 		block->deSerializeNetworkSpecific(istr);
 	}
 	else {
@@ -306,7 +307,8 @@ void Client::handleCommand_BlockData(NetworkPacket* pkt)
 			Create a new block
 		*/
 		block = sector->createBlankBlock(p.Y);
-		block->deSerialize(istr, m_server_ser_ver, false);
+		block->deSerialize(istr, m_server_ser_ver, false,
+				m_block_dictionary.get());
 		block->deSerializeNetworkSpecific(istr);
 	}
 
@@ -320,6 +322,81 @@ void Client::handleCommand_BlockData(NetworkPacket* pkt)
 	addUpdateMeshTaskWithEdge(p, true);
 }
 
+void Client::handleCommand_BlockDelta(NetworkPacket *pkt)
+{
+	v3s16 p;
+	u8 flags;
+	u16 lighting_complete, run_count;
+	*pkt >> p >> flags >> lighting_complete >> run_count;
+
+	// The block may have been deleted in the meantime, the server sends
+	// all of it again when we need it
+	MapBlock *block = m_env.getMap().getBlockNoCreateNoEx(p);
+	if (!block)
+		return;
+
+	for (u16 i = 0; i < run_count; i++) {
+		u16 index, count;
+		*pkt >> index >> count;
+		if ((u32)index + count > MapBlock::nodecount)
+			throw PacketError("TOCLIENT_BLOCK_DELTA: node index out of range");
+
+		for (u32 k = index; k < (u32)index + count; k++) {
+			MapNode n;
+			*pkt >> n.param0 >> n.param1 >> n.param2;
+			v3s16 relpos(k % MAP_BLOCKSIZE, k / MAP_BLOCKSIZE % MAP_BLOCKSIZE,
+				k / (MAP_BLOCKSIZE * MAP_BLOCKSIZE));
+			block->setNodeNoCheck(relpos, n);
+			block->m_node_metadata.remove(relpos);
+		}
+	}
+
+	block->setIsUnderground(flags & 0x01);
+	block->setGenerated(!(flags & 0x08));
+	block->setLightingComplete(lighting_complete);
+	block->expireIsAirCache();
+
+	addUpdateMeshTaskWithEdge(p, false, true);
+}
+
+void Client::handleCommand_BlockDictionary(NetworkPacket *pkt)
+{
+	std::string digest;
+	*pkt >> digest;
+	std::string data = pkt->readLongString();
+
+	// If it was only announced, it might be cached from an earlier visit
+	const bool announced = data.empty();
+	if (announced)
+		clientMediaLoadCache(digest, data);
+
+	if (hashing::sha1(data) != digest) {
+		if (!announced) {
+			errorstream << "Client: Received block dictionary with wrong hash"
+					<< std::endl;
+			return;
+		}
+		NetworkPacket resp(TOSERVER_BLOCK_DICTIONARY, 2 + digest.size() + 1);
+		resp << digest << (u8)0;
+		Send(&resp);
+		return;
+	}
+
+	try {
+		m_block_dictionary = std::make_unique<ZstdDictionary>(data);
+	} catch (SerializationError &e) {
+		errorstream << "Client: Invalid block dictionary: " << e.what()
+				<< std::endl;
+		return;
+	}
+	if (!announced)
+		clientMediaUpdateCache(digest, data);
+
+	NetworkPacket resp(TOSERVER_BLOCK_DICTIONARY, 2 + digest.size() + 1);
+	resp << digest << (u8)1;
+	Send(&resp);
+}
+
 void Client::handleCommand_Inventory(NetworkPacket* pkt)
 {
 	if (pkt->getSize() < 1)
@@ -31,6 +31,16 @@ enum rate_stat_type {
 	AVG_LOSS_RATE,
 };
 
+// Determines which packets of a peer are sent first when its send quota
+// doesn't suffice for all of them
+enum PacketPriority : u8 {
+	// Small packets that the peer needs right away, e.g. object updates
+	PACKET_PRIORITY_CRITICAL,
+	// Large transfers such as mapblocks and media
+	PACKET_PRIORITY_BULK,
+	PACKET_PRIORITY_MAX
+};
+
 class IPeer {
 public:
 	// Unique id of the peer
@@ -59,7 +69,8 @@ class IConnection
 		return ReceiveTimeoutMs(pkt, 0);
 	}
 
-	virtual void Send(session_t peer_id, u8 channelnum, NetworkPacket *pkt, bool reliable) = 0;
+	virtual void Send(session_t peer_id, u8 channelnum, NetworkPacket *pkt, bool reliable,
+			PacketPriority priority = PACKET_PRIORITY_CRITICAL) = 0;
 
 	virtual session_t GetPeerID() const = 0;
 	virtual Address GetPeerAddress(session_t peer_id) = 0;
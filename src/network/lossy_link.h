@@ -0,0 +1,113 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <map>
+#include <string>
+#include "noise.h"
+#include "porting.h"
+#include "threading/thread.h"
+#include "network/mtp/impl.h"
+#include "network/networkpacket.h"
+#include "network/socket.h"
+
+// Connects the client to the server at the address and waits until the
+// server knows the client, which happens with its first packet.
+// Returns false on timeout.
+inline bool connectForTesting(con::Connection &server, con::Connection &client,
+		const Address &address, u64 timeout_ms = 5000)
+{
+	client.Connect(address);
+
+	u64 start = porting::getTimeMs();
+	while (!client.Connected()) {
+		NetworkPacket dummy;
+		client.ReceiveTimeoutMs(&dummy, 10);
+		if (porting::getTimeMs() - start >= timeout_ms)
+			return false;
+	}
+
+	NetworkPacket pkt(0x4b, 0);
+	pkt << (u8)1;
+	client.Send(PEER_ID_SERVER, 0, &pkt, true);
+	NetworkPacket recvpacket;
+	return server.ReceiveTimeoutMs(&recvpacket, timeout_ms);
+}
+
+// Forwards datagrams between one client and a server like a slow link:
+// limited bandwidth with a small buffer, latency and random loss.
+// Only meant for the connection tests and benchmarks.
+class LossyLink : public Thread
+{
+public:
+	LossyLink(const Address &server, u16 port) :
+		Thread("LossyLink"),
+		m_socket(false),
+		m_server(server)
+	{
+		m_socket.Bind(Address(0, 0, 0, 0, port));
+		m_socket.setTimeoutMs(1);
+	}
+
+	~LossyLink()
+	{
+		stop();
+		wait();
+	}
+
+	u32 delay_ms = 0;
+	u32 loss_percent = 0;
+	u32 bytes_per_ms = 0; // 0 = unlimited
+	u32 buffer_ms = 0;
+
+	void *run()
+	{
+		u8 buf[2048];
+		while (!stopRequested()) {
+			Address sender;
+			int size = m_socket.Receive(sender, buf, sizeof(buf));
+			u64 now = porting::getTimeUs();
+			if (size > 0) {
+				bool to_client = sender == m_server;
+				if (!to_client)
+					m_client = sender;
+				forward(to_client, std::string((char *)buf, size), now);
+			}
+
+			while (!m_in_flight.empty() && m_in_flight.begin()->first <= now) {
+				const auto &it = m_in_flight.begin()->second;
+				m_socket.Send(it.first, it.second.data(), it.second.size());
+				m_in_flight.erase(m_in_flight.begin());
+			}
+		}
+		return nullptr;
+	}
+
+private:
+	void forward(bool to_client, std::string &&data, u64 now)
+	{
+		if (m_random.range(100) < loss_percent)
+			return;
+
+		u64 &free_at = m_free_at[to_client];
+		free_at = MYMAX(free_at, now);
+		if (bytes_per_ms > 0) {
+			// Drop if the buffer of the link is full
+			if (free_at - now > buffer_ms * 1000)
+				return;
+			free_at += data.size() * 1000 / bytes_per_ms;
+		}
+
+		m_in_flight.emplace(free_at + delay_ms * 1000,
+			std::make_pair(to_client ? m_client : m_server, std::move(data)));
+	}
+
+	UDPSocket m_socket;
+	Address m_server;
+	Address m_client;
+	PcgRandom m_random;
+	// Time in us when each direction is done sending the queued data
+	u64 m_free_at[2] = {0, 0};
+	std::multimap<u64, std::pair<Address, std::string>> m_in_flight;
+};
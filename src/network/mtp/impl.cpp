@@ -45,6 +45,41 @@ namespace con
 #define RESEND_TIMEOUT_MAX 2.0f
 #define RESEND_TIMEOUT_FACTOR 2
 
+/*
+	BufferedPacket
+*/
+
+// Unused packet memory, shared by all connections
+static std::mutex g_packet_pool_mutex;
+static std::vector<std::vector<u8>> g_packet_pool;
+// Larger buffers are not kept
+#define PACKET_POOL_MAX_BUFFER_SIZE 1500
+#define PACKET_POOL_MAX_BUFFERS 1024
+
+BufferedPacket::BufferedPacket(u32 a_size)
+{
+	{
+		MutexAutoLock lock(g_packet_pool_mutex);
+		if (!g_packet_pool.empty() && a_size <= PACKET_POOL_MAX_BUFFER_SIZE) {
+			m_data = std::move(g_packet_pool.back());
+			g_packet_pool.pop_back();
+		}
+	}
+	m_data.resize(a_size);
+	data = m_data.data();
+}
+
+BufferedPacket::~BufferedPacket()
+{
+	if (m_data.capacity() > PACKET_POOL_MAX_BUFFER_SIZE)
+		return;
+	m_data.clear();
+
+	MutexAutoLock lock(g_packet_pool_mutex);
+	if (g_packet_pool.size() < PACKET_POOL_MAX_BUFFERS)
+		g_packet_pool.push_back(std::move(m_data));
+}
+
 u16 BufferedPacket::getSeqnum() const
 {
 	if (size() < BASE_HEADER_SIZE + 3)
@@ -65,7 +100,15 @@ void BufferedPacket::setSenderPeerId(session_t id)
 BufferedPacketPtr makePacket(const Address &address, const SharedBuffer<u8> &data,
 		u32 protocol_id, session_t sender_peer_id, u8 channel)
 {
-	u32 packet_size = data.getSize() + BASE_HEADER_SIZE;
+	return makePacket(address, protocol_id, sender_peer_id, channel,
+		nullptr, 0, *data, data.getSize());
+}
+
+BufferedPacketPtr makePacket(const Address &address, u32 protocol_id,
+		session_t sender_peer_id, u8 channel, const u8 *headers, u32 headers_size,
+		const u8 *payload, u32 payload_size)
+{
+	u32 packet_size = BASE_HEADER_SIZE + headers_size + payload_size;
 
 	auto p = std::make_shared<BufferedPacket>(packet_size);
 	p->address = address;
@@ -74,75 +117,25 @@ BufferedPacketPtr makePacket(const Address &address, const SharedBuffer<u8> &dat
 	writeU16(&p->data[4], sender_peer_id);
 	writeU8(&p->data[6], channel);
 
-	memcpy(&p->data[BASE_HEADER_SIZE], *data, data.getSize());
+	if (headers_size > 0)
+		memcpy(&p->data[BASE_HEADER_SIZE], headers, headers_size);
+	if (payload_size > 0)
+		memcpy(&p->data[BASE_HEADER_SIZE + headers_size], payload, payload_size);
 
 	return p;
 }
 
-SharedBuffer<u8> makeOriginalPacket(const SharedBuffer<u8> &data)
-{
-	u32 header_size = 1;
-	u32 packet_size = data.getSize() + header_size;
-	SharedBuffer<u8> b(packet_size);
-
-	writeU8(&(b[0]), PACKET_TYPE_ORIGINAL);
-	if (data.getSize() > 0) {
-		memcpy(&(b[header_size]), *data, data.getSize());
-	}
-	return b;
-}
-
-// Split data in chunks and add TYPE_SPLIT headers to them
-void makeSplitPacket(const SharedBuffer<u8> &data, u32 chunksize_max, u16 seqnum,
-		std::list<SharedBuffer<u8>> *chunks)
-{
-	// Chunk packets, containing the TYPE_SPLIT header
-	const u32 chunk_header_size = 7;
-	const u32 maximum_data_size = chunksize_max - chunk_header_size;
-	u32 start = 0, end = 0;
-	u16 chunk_num = 0;
-	do {
-		end = start + maximum_data_size - 1;
-		if (end > data.getSize() - 1)
-			end = data.getSize() - 1;
-
-		u32 payload_size = end - start + 1;
-		u32 packet_size = chunk_header_size + payload_size;
-
-		SharedBuffer<u8> chunk(packet_size);
-
-		writeU8(&chunk[0], PACKET_TYPE_SPLIT);
-		writeU16(&chunk[1], seqnum);
-		// [3] u16 chunk_count is written at next stage
-		writeU16(&chunk[5], chunk_num);
-		memcpy(&chunk[chunk_header_size], &data[start], payload_size);
-
-		chunks->push_back(chunk);
-
-		start = end + 1;
-		sanity_check(chunk_num < 0xFFFF); // overflow
-		chunk_num++;
-	}
-	while (end != data.getSize() - 1);
-
-	for (auto &chunk : *chunks) {
-		// Write chunk_count
-		writeU16(&chunk[3], chunk_num);
-	}
-}
-
 void makeAutoSplitPacket(const SharedBuffer<u8> &data, u32 chunksize_max,
 		u16 &split_seqnum, std::list<SharedBuffer<u8>> *list)
 {
-	u32 original_header_size = 1;
-
-	if (data.getSize() + original_header_size > chunksize_max) {
-		makeSplitPacket(data, chunksize_max, split_seqnum, list);
-		split_seqnum++;
-		return;
-	}
-
-	list->push_back(makeOriginalPacket(data));
+	forEachAutoSplitChunk(*data, data.getSize(), chunksize_max, split_seqnum,
+		[&] (const u8 *headers, u32 headers_size, const u8 *payload, u32 payload_size) {
+			SharedBuffer<u8> chunk(headers_size + payload_size);
+			memcpy(*chunk, headers, headers_size);
+			if (payload_size > 0)
+				memcpy(&chunk[headers_size], payload, payload_size);
+			list->push_back(chunk);
+		});
 }
 
 SharedBuffer<u8> makeReliablePacket(const SharedBuffer<u8> &data, u16 seqnum)
@@ -163,83 +156,120 @@ SharedBuffer<u8> makeReliablePacket(const SharedBuffer<u8> &data, u16 seqnum)
 	ReliablePacketBuffer
 */
 
+#define RELIABLE_RING_MIN_SIZE 64
+
+template <typename F>
+void ReliablePacketBuffer::forEachNoLock(F &&f)
+{
+	if (m_count == 0)
+		return;
+	for (u16 seqnum = m_first; ; seqnum++) {
+		if (BufferedPacketPtr &packet = slot(seqnum))
+			f(packet);
+		if (seqnum == m_last)
+			break;
+	}
+}
+
 void ReliablePacketBuffer::print()
 {
 	MutexAutoLock listlock(m_list_mutex);
 	LOG(dout_con<<"Dump of ReliablePacketBuffer:" << std::endl);
 	unsigned int index = 0;
-	for (BufferedPacketPtr &packet : m_list) {
+	forEachNoLock([&] (BufferedPacketPtr &packet) {
 		LOG(dout_con<<index<< ":" << packet->getSeqnum() << std::endl);
 		index++;
-	}
+	});
 }
 
 bool ReliablePacketBuffer::empty()
 {
 	MutexAutoLock listlock(m_list_mutex);
-	return m_list.empty();
+	return m_count == 0;
 }
 
 u32 ReliablePacketBuffer::size()
 {
 	MutexAutoLock listlock(m_list_mutex);
-	return m_list.size();
-}
-
-ReliablePacketBuffer::FindResult ReliablePacketBuffer::findPacketNoLock(u16 seqnum)
-{
-	for (auto it = m_list.begin(); it != m_list.end(); ++it) {
-		if ((*it)->getSeqnum() == seqnum)
-			return it;
-	}
-	return m_list.end();
+	return m_count;
 }
 
 bool ReliablePacketBuffer::getFirstSeqnum(u16& result)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
+	if (m_count == 0)
 		return false;
-	result = m_list.front()->getSeqnum();
+	result = m_first;
 	return true;
 }
 
-BufferedPacketPtr ReliablePacketBuffer::popFirst()
+BufferedPacketPtr ReliablePacketBuffer::removeNoLock(u16 seqnum)
 {
-	MutexAutoLock listlock(m_list_mutex);
-	if (m_list.empty())
-		throw NotFoundException("Buffer is empty");
+	BufferedPacketPtr p = std::move(slot(seqnum));
+	slot(seqnum) = nullptr;
+	m_count--;
 
-	BufferedPacketPtr p(m_list.front());
-	m_list.pop_front();
+	if (m_count > 0) {
+		// Move the bounds to the next packets
+		if (seqnum == m_first) {
+			while (!slot(m_first))
+				m_first++;
+		} else if (seqnum == m_last) {
+			while (!slot(m_last))
+				m_last--;
+		}
+	}
 
-	if (m_list.empty()) {
-		m_oldest_non_answered_ack = 0;
-	} else {
-		m_oldest_non_answered_ack = m_list.front()->getSeqnum();
+	// Give the memory of a large window back, with some slack so that
+	// the ring isn't resized all the time
+	const u32 span = m_count > 0 ? (u32)(u16)(m_last - m_first) + 1 : 0;
+	if (m_ring.size() > RELIABLE_RING_MIN_SIZE && span <= m_ring.size() / 8) {
+		size_t size = RELIABLE_RING_MIN_SIZE;
+		while (size < span * 2)
+			size *= 2;
+		resizeNoLock(size);
 	}
 	return p;
 }
 
+void ReliablePacketBuffer::growNoLock(u32 span)
+{
+	size_t size = MYMAX(m_ring.size(), RELIABLE_RING_MIN_SIZE);
+	while (size < span)
+		size *= 2;
+	if (size != m_ring.size())
+		resizeNoLock(size);
+}
+
+void ReliablePacketBuffer::resizeNoLock(size_t size)
+{
+	std::vector<BufferedPacketPtr> ring(size);
+	forEachNoLock([&] (BufferedPacketPtr &packet) {
+		ring[packet->getSeqnum() & (size - 1)] = std::move(packet);
+	});
+	m_ring = std::move(ring);
+}
+
+BufferedPacketPtr ReliablePacketBuffer::popFirst()
+{
+	MutexAutoLock listlock(m_list_mutex);
+	if (m_count == 0)
+		throw NotFoundException("Buffer is empty");
+
+	return removeNoLock(m_first);
+}
+
 BufferedPacketPtr ReliablePacketBuffer::popSeqnum(u16 seqnum)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	auto r = findPacketNoLock(seqnum);
-	if (r == m_list.end()) {
+	if (m_count == 0 || (u16)(seqnum - m_first) > (u16)(m_last - m_first) ||
+			!slot(seqnum)) {
 		LOG(dout_con<<"Sequence number: " << seqnum
 				<< " not found in reliable buffer"<<std::endl);
 		throw NotFoundException("seqnum not found in buffer");
 	}
 
-	BufferedPacketPtr p(*r);
-	m_list.erase(r);
-
-	if (m_list.empty()) {
-		m_oldest_non_answered_ack = 0;
-	} else {
-		m_oldest_non_answered_ack = m_list.front()->getSeqnum();
-	}
-	return p;
+	return removeNoLock(seqnum);
 }
 
 void ReliablePacketBuffer::insert(BufferedPacketPtr &p_ptr, u16 next_expected)
@@ -271,45 +301,28 @@ void ReliablePacketBuffer::insert(BufferedPacketPtr &p_ptr, u16 next_expected)
 		return;
 	}
 
-	sanity_check(m_list.size() <= SEQNUM_MAX); // FIXME: Handle the error?
-
-	// Find the right place for the packet and insert it there
-	// If list is empty, just add it
-	if (m_list.empty()) {
-		m_list.push_back(p_ptr);
-		m_oldest_non_answered_ack = seqnum;
+	// If the buffer is empty, just add it
+	if (m_count == 0) {
+		growNoLock(1);
+		slot(seqnum) = p_ptr;
+		m_first = m_last = seqnum;
+		m_count = 1;
 		// Done.
 		return;
 	}
 
-	// Otherwise find the right place
-	auto it = m_list.begin();
-	// Find the first packet in the list which has a higher seqnum
-	u16 s = (*it)->getSeqnum();
-
-	/* case seqnum is smaller then next_expected seqnum */
-	/* this is true e.g. on wrap around */
-	if (seqnum < next_expected) {
-		while(((s < seqnum) || (s >= next_expected)) && (it != m_list.end())) {
-			++it;
-			if (it != m_list.end())
-				s = (*it)->getSeqnum();
-		}
-	}
-	/* non wrap around case (at least for incoming and next_expected */
-	else
-	{
-		while(((s < seqnum) && (s >= next_expected)) && (it != m_list.end())) {
-			++it;
-			if (it != m_list.end())
-				s = (*it)->getSeqnum();
-		}
-	}
+	// Seqnums are only compared within the window, so this is unambiguous
+	// even on wrap around
+	const bool before_first = (u16)(seqnum - m_first) >= MAX_RELIABLE_WINDOW_SIZE;
+	const u16 new_first = before_first ? seqnum : m_first;
+	u16 new_last = m_last;
+	if (!before_first && (u16)(seqnum - m_first) > (u16)(m_last - m_first))
+		new_last = seqnum;
+	growNoLock((u32)(u16)(new_last - new_first) + 1);
 
-	if (s == seqnum) {
+	if (BufferedPacketPtr &i = slot(seqnum)) {
 		/* nothing to do this seems to be a resent packet */
 		/* for paranoia reason data should be compared */
-		auto &i = *it;
 		if (
 			(i->getSeqnum() != seqnum) ||
 			(i->size() != p.size()) ||
@@ -334,42 +347,40 @@ void ReliablePacketBuffer::insert(BufferedPacketPtr &p_ptr, u16 next_expected)
 			warningstream << buf << std::flush;
 			throw IncomingDataCorruption("duplicated packet isn't same as original one");
 		}
-	}
-	/* insert or push back */
-	else if (it != m_list.end()) {
-		m_list.insert(it, p_ptr);
-	} else {
-		m_list.push_back(p_ptr);
+		return;
 	}
 
-	/* update last packet number */
-	m_oldest_non_answered_ack = m_list.front()->getSeqnum();
+	slot(seqnum) = p_ptr;
+	m_first = new_first;
+	m_last = new_last;
+	m_count++;
 }
 
 void ReliablePacketBuffer::fixPeerId(session_t new_id)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	for (auto &packet : m_list)
+	forEachNoLock([&] (BufferedPacketPtr &packet) {
 		packet->setSenderPeerId(new_id);
+	});
 }
 
 void ReliablePacketBuffer::incrementTimeouts(float dtime)
 {
 	MutexAutoLock listlock(m_list_mutex);
-	for (auto &packet : m_list) {
+	forEachNoLock([&] (BufferedPacketPtr &packet) {
 		packet->time += dtime;
 		packet->totaltime += dtime;
-	}
+	});
 }
 
 u32 ReliablePacketBuffer::getTimedOuts(float timeout)
 {
 	MutexAutoLock listlock(m_list_mutex);
 	u32 count = 0;
-	for (auto &packet : m_list) {
+	forEachNoLock([&] (BufferedPacketPtr &packet) {
 		if (packet->totaltime >= timeout)
 			count++;
-	}
+	});
 	return count;
 }
 
@@ -378,22 +389,22 @@ std::vector<ConstSharedPtr<BufferedPacket>>
 {
 	MutexAutoLock listlock(m_list_mutex);
 	std::vector<ConstSharedPtr<BufferedPacket>> timed_outs;
-	for (auto &packet : m_list) {
+	forEachNoLock([&] (BufferedPacketPtr &packet) {
+		if (timed_outs.size() >= max_packets)
+			return;
+
 		// resend time scales exponentially with each cycle
 		const float pkt_timeout = timeout * powf(RESEND_SCALE_BASE, packet->resend_count);
 
 		if (packet->time < pkt_timeout)
-			continue;
+			return;
 
 		// caller will resend packet so reset time and increase counter
 		packet->time = 0.0f;
 		packet->resend_count++;
 
 		timed_outs.emplace_back(packet);
-
-		if (timed_outs.size() >= max_packets)
-			break;
-	}
+	});
 	return timed_outs;
 }
 
@@ -593,12 +604,13 @@ ConnectionCommandPtr ConnectionCommand::peer_id_set(session_t own_peer_id)
 }
 
 ConnectionCommandPtr ConnectionCommand::send(session_t peer_id, u8 channelnum,
-	NetworkPacket *pkt, bool reliable)
+	NetworkPacket *pkt, bool reliable, PacketPriority priority)
 {
 	auto c = create(CONNCMD_SEND);
 	c->peer_id = peer_id;
 	c->channelnum = channelnum;
 	c->reliable = reliable;
+	c->priority = priority;
 	c->data = pkt->oldForgePacket();
 	return c;
 }
@@ -739,12 +751,128 @@ void Channel::UpdatePacketTooLateCounter()
 	current_packet_too_late++;
 }
 
-void Channel::UpdateTimers(float dtime)
+void CubicWindow::reset(float window)
+{
+	*this = CubicWindow();
+	m_window = window;
+}
+
+// Scaling constant and multiplicative decrease factor of CUBIC
+#define CUBIC_C 0.4f
+#define CUBIC_BETA 0.7f
+
+void CubicWindow::onAck(unsigned int acked, float now, float rtt)
+{
+	if (inSlowStart()) {
+		m_window = MYMIN(m_window + acked, (float)MAX_RELIABLE_WINDOW_SIZE_SEND);
+		return;
+	}
+
+	if (m_epoch_start < 0) {
+		m_epoch_start = now;
+		if (m_window < m_window_max) {
+			m_k = std::cbrt((m_window_max - m_window) / CUBIC_C);
+		} else {
+			m_k = 0.0f;
+			m_window_max = m_window;
+		}
+		m_window_reno = m_window;
+	}
+
+	// Aim for where the cubic function will be one round trip later
+	float t = now - m_epoch_start + rtt - m_k;
+	float target = CUBIC_C * t * t * t + m_window_max;
+	target = rangelim(target, m_window, m_window * 1.5f);
+
+	// Never grow slower than Reno would
+	m_window_reno += 3.0f * (1.0f - CUBIC_BETA) / (1.0f + CUBIC_BETA) *
+			acked / m_window;
+	target = MYMAX(target, m_window_reno);
+
+	m_window += (target - m_window) / m_window * acked;
+	m_window = MYMIN(m_window, (float)MAX_RELIABLE_WINDOW_SIZE_SEND);
+}
+
+void CubicWindow::onLoss(float now, float rtt)
+{
+	// Packets sent in the same round trip were lost to the same congestion
+	if (m_last_loss >= 0 && now - m_last_loss < rtt)
+		return;
+	m_last_loss = now;
+
+	// Fast convergence: release bandwidth to newer flows
+	if (m_window < m_window_max)
+		m_window_max = m_window * (1.0f + CUBIC_BETA) / 2.0f;
+	else
+		m_window_max = m_window;
+
+	m_window = MYMAX(m_window * CUBIC_BETA, (float)MIN_CONGESTION_WINDOW_SIZE);
+	m_ssthresh = m_window;
+	m_epoch_start = -1.0f;
+}
+
+void Channel::setCongestionControl(CongestionControl cc)
+{
+	m_congestion_control = cc;
+	m_cubic.reset(m_window_size);
+}
+
+float Channel::getPacingDelay() const
+{
+	if (canSendPaced())
+		return 0.0f;
+	return (1.0f - m_pacing_tokens) / m_pacing_rate;
+}
+
+void Channel::UpdateCubicWindow(float dtime, float rtt)
+{
+	unsigned int packet_loss;
+	unsigned int packets_successful;
+	{
+		MutexAutoLock internal(m_internal_mutex);
+		packet_loss = current_packet_loss;
+		packets_successful = current_packet_successful;
+		current_packet_loss = 0;
+		current_packet_too_late = 0;
+		current_packet_successful = 0;
+	}
+
+	m_cubic_clock += dtime;
+	// Until the first ACK arrives assume the lowest resend timeout
+	const float cubic_rtt = rtt > 0 ? rtt : RESEND_TIMEOUT_MIN;
+
+	// Only grow the window if it limits us
+	bool window_limited = !queued_reliables.empty() ||
+			outgoing_reliables_sent.size() * 2 >= m_window_size;
+
+	if (packet_loss > 0)
+		m_cubic.onLoss(m_cubic_clock, cubic_rtt);
+	else if (packets_successful > 0 && window_limited)
+		m_cubic.onAck(packets_successful, m_cubic_clock, cubic_rtt);
+
+	setWindowSize(std::lround(m_cubic.getWindow()));
+
+	if (rtt <= 0)
+		return;
+
+	// Spread the window over the round trip, with some headroom so that the
+	// window can still grow
+	const float gain = m_cubic.inSlowStart() ? 2.0f : 1.25f;
+	const float burst = MYMAX(PACING_MIN_BURST, m_window_size / 4);
+	if (m_pacing_rate <= 0)
+		m_pacing_tokens = burst;
+	m_pacing_rate = gain * m_window_size / rtt;
+	m_pacing_tokens = MYMIN(m_pacing_tokens + m_pacing_rate * dtime, burst);
+}
+
+void Channel::UpdateTimers(float dtime, float rtt)
 {
 	bpm_counter += dtime;
 	packet_loss_counter += dtime;
 
-	if (packet_loss_counter > 1.0f) {
+	if (m_congestion_control == CONGESTION_CONTROL_CUBIC) {
+		UpdateCubicWindow(dtime, rtt);
+	} else if (packet_loss_counter > 1.0f) {
 		packet_loss_counter -= 1.0f;
 
 		unsigned int packet_loss;
@@ -933,6 +1061,11 @@ void Peer::RTTStatistics(float rtt, const std::string &profiler_id,
 			g_profiler->graphAdd(profiler_id + " jitter [ms]", jitter * 1000.f);
 		}
 	}
+	if (m_rtt.smoothed_rtt < 0)
+		m_rtt.smoothed_rtt = rtt;
+	else
+		m_rtt.smoothed_rtt += (rtt - m_rtt.smoothed_rtt) / 8;
+
 	/* save values required for next loop */
 	m_last_rtt = rtt;
 }
@@ -979,8 +1112,10 @@ void Peer::Drop()
 UDPPeer::UDPPeer(session_t id, const Address &address, Connection *connection) :
 	Peer(id, address, connection)
 {
-	for (Channel &channel : channels)
+	for (Channel &channel : channels) {
 		channel.setWindowSize(START_RELIABLE_WINDOW_SIZE);
+		channel.setCongestionControl(connection->getCongestionControl());
+	}
 }
 
 bool UDPPeer::isTimedOut(float timeout, std::string &reason)
@@ -1008,7 +1143,9 @@ void UDPPeer::reportRTT(float rtt)
 	RTTStatistics(rtt,"rudp",MAX_RELIABLE_WINDOW_SIZE*10);
 
 	// use this value to decide the resend timeout
-	const float rtt_stat = getStat(AVG_RTT);
+	const float rtt_stat =
+			m_connection->getCongestionControl() == CONGESTION_CONTROL_CUBIC ?
+			getSmoothedRTT() : getStat(AVG_RTT);
 	if (rtt_stat < 0)
 		return;
 	float timeout = rtt_stat * RESEND_TIMEOUT_FACTOR;
@@ -1085,29 +1222,21 @@ bool UDPPeer::processReliableSendCommand(
 							- BASE_HEADER_SIZE
 							- RELIABLE_HEADER_SIZE;
 
-	std::list<SharedBuffer<u8>> originals;
-
-	if (c.raw) {
-		originals.emplace_back(c.data);
-	} else {
-		u16 split_seqnum = chan.readNextSplitSeqNum();
-		makeAutoSplitPacket(c.data, chunksize_max, split_seqnum, &originals);
-		chan.setNextSplitSeqNum(split_seqnum);
-	}
-
-	sanity_check(originals.size() < MAX_RELIABLE_WINDOW_SIZE);
-
-	bool have_sequence_number = false;
+	bool have_sequence_number = true;
 	bool have_initial_sequence_number = false;
 	std::queue<BufferedPacketPtr> toadd;
 	u16 initial_sequence_number = 0;
 
-	for (SharedBuffer<u8> &original : originals) {
-		u16 seqnum = chan.getOutgoingSequenceNumber(have_sequence_number);
-
+	// Puts the chunk into a reliable packet, the data is copied only once
+	auto add_chunk = [&] (const u8 *headers, u32 headers_size,
+			const u8 *payload, u32 payload_size) {
 		/* oops, we don't have enough sequence numbers to send this packet */
 		if (!have_sequence_number)
-			break;
+			return;
+
+		u16 seqnum = chan.getOutgoingSequenceNumber(have_sequence_number);
+		if (!have_sequence_number)
+			return;
 
 		if (!have_initial_sequence_number)
 		{
@@ -1115,16 +1244,33 @@ bool UDPPeer::processReliableSendCommand(
 			have_initial_sequence_number = true;
 		}
 
-		SharedBuffer<u8> reliable = makeReliablePacket(original, seqnum);
+		u8 all_headers[RELIABLE_HEADER_SIZE + MAX_CHUNK_HEADER_SIZE];
+		writeU8(&all_headers[0], PACKET_TYPE_RELIABLE);
+		writeU16(&all_headers[1], seqnum);
+		if (headers_size > 0)
+			memcpy(&all_headers[RELIABLE_HEADER_SIZE], headers, headers_size);
 
 		// Add base headers and make a packet
-		BufferedPacketPtr p = con::makePacket(address, reliable,
+		BufferedPacketPtr p = con::makePacket(address,
 				m_connection->GetProtocolID(), m_connection->GetPeerID(),
-				c.channelnum);
+				c.channelnum, all_headers, RELIABLE_HEADER_SIZE + headers_size,
+				payload, payload_size);
+		p->priority = c.priority;
 
 		toadd.push(p);
+	};
+
+	if (c.raw) {
+		add_chunk(nullptr, 0, *c.data, c.data.getSize());
+	} else {
+		u16 split_seqnum = chan.readNextSplitSeqNum();
+		forEachAutoSplitChunk(*c.data, c.data.getSize(), chunksize_max,
+				split_seqnum, add_chunk);
+		chan.setNextSplitSeqNum(split_seqnum);
 	}
 
+	sanity_check(toadd.size() < MAX_RELIABLE_WINDOW_SIZE);
+
 	if (have_sequence_number) {
 		while (!toadd.empty()) {
 			BufferedPacketPtr p = toadd.front();
@@ -1179,9 +1325,14 @@ void UDPPeer::RunCommandQueues(
 							unsigned int maxtransfer)
 {
 
+	// With congestion control queue as many commands as the window has
+	// sequence numbers for, the window keeps the link from being flooded
+	const bool queue_all =
+			m_connection->getCongestionControl() == CONGESTION_CONTROL_CUBIC;
+
 	for (Channel &channel : channels) {
 
-		if ((!channel.queued_commands.empty()) &&
+		while ((!channel.queued_commands.empty()) &&
 				(channel.queued_reliables.size() < maxtransfer)) {
 			try {
 				ConnectionCommandPtr c = channel.queued_commands.front();
@@ -1197,11 +1348,15 @@ void UDPPeer::RunCommandQueues(
 							<< " Failed to queue packets for peer_id: " << c->peer_id
 							<< ", delaying sending of " << c->data.getSize()
 							<< " bytes" << std::endl);
+					break;
 				}
 			}
 			catch (ItemNotFoundException &e) {
 				// intentionally empty
+				break;
 			}
+			if (!queue_all)
+				break;
 		}
 	}
 }
@@ -1299,6 +1454,14 @@ Connection::Connection(u32 max_packet_size, float timeout,
 	 * from the connection timeout */
 	m_udpSocket.setTimeoutMs(500);
 
+	const std::string cc = g_settings->get("congestion_control");
+	if (cc == "cubic") {
+		m_congestion_control = CONGESTION_CONTROL_CUBIC;
+	} else if (cc != "legacy") {
+		warningstream << "Unknown congestion_control \"" << cc
+			<< "\", using legacy" << std::endl;
+	}
+
 	m_sendThread->setParent(this);
 	m_receiveThread->setParent(this);
 
@@ -1509,7 +1672,7 @@ bool Connection::ReceiveTimeoutMs(NetworkPacket *pkt, u32 timeout_ms)
 }
 
 void Connection::Send(session_t peer_id, u8 channelnum,
-		NetworkPacket *pkt, bool reliable)
+		NetworkPacket *pkt, bool reliable, PacketPriority priority)
 {
 	assert(channelnum < CHANNEL_COUNT); // Pre-condition
 
@@ -1522,7 +1685,7 @@ void Connection::Send(session_t peer_id, u8 channelnum,
 		FATAL_ERROR(oss.str().c_str());
 	}
 
-	putCommand(ConnectionCommand::send(peer_id, channelnum, pkt, reliable));
+	putCommand(ConnectionCommand::send(peer_id, channelnum, pkt, reliable, priority));
 }
 
 Address Connection::GetPeerAddress(session_t peer_id)
@@ -92,6 +92,14 @@ typedef std::shared_ptr<BufferedPacket> BufferedPacketPtr;
 class Connection;
 class PeerHandler;
 
+// Algorithm that sizes the window of reliable packets in flight
+enum CongestionControl : u8 {
+	// Loss ratio checked once per second
+	CONGESTION_CONTROL_LEGACY,
+	// CUBIC window with paced sending
+	CONGESTION_CONTROL_CUBIC,
+};
+
 class Peer : public IPeer {
 	public:
 		friend class PeerHelper;
@@ -167,6 +175,9 @@ class Peer : public IPeer {
 
 		virtual void reportRTT(float rtt) {};
 
+		// Smoothed round trip time in seconds, or -1 without samples
+		float getSmoothedRTT() const { return m_rtt.smoothed_rtt; }
+
 		void RTTStatistics(float rtt,
 							const std::string &profiler_id = "",
 							unsigned int num_samples = 1000);
@@ -194,6 +205,7 @@ class Peer : public IPeer {
 			float min_rtt = FLT_MAX;
 			float max_rtt = 0.0f;
 			float avg_rtt = -1.0f;
+			float smoothed_rtt = -1.0f;
 		};
 
 		rttstats m_rtt;
@@ -239,7 +251,8 @@ class Connection final : public IConnection
 	bool Connected();
 	void Disconnect();
 	bool ReceiveTimeoutMs(NetworkPacket *pkt, u32 timeout_ms);
-	void Send(session_t peer_id, u8 channelnum, NetworkPacket *pkt, bool reliable);
+	void Send(session_t peer_id, u8 channelnum, NetworkPacket *pkt, bool reliable,
+			PacketPriority priority = PACKET_PRIORITY_CRITICAL);
 	session_t GetPeerID() const { return m_peer_id; }
 	Address GetPeerAddress(session_t peer_id);
 	float getPeerStat(session_t peer_id, rtt_stat_type type);
@@ -248,6 +261,8 @@ class Connection final : public IConnection
 	const std::string getDesc();
 	void DisconnectPeer(session_t peer_id);
 
+	CongestionControl getCongestionControl() const { return m_congestion_control; }
+
 protected:
 	PeerHelper getPeerNoEx(session_t peer_id);
 	session_t   lookupPeer(const Address& sender);
@@ -301,6 +316,8 @@ class Connection final : public IConnection
 	// Backwards compatibility
 	PeerHandler *m_bc_peerhandler;
 
+	CongestionControl m_congestion_control = CONGESTION_CONTROL_LEGACY;
+
 	bool m_shutting_down = false;
 };
 
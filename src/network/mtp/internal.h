@@ -5,6 +5,8 @@
 #pragma once
 
 #include "network/mtp/impl.h"
+#include "util/serialize.h"
+#include <unordered_map>
 
 // Constant that differentiates the protocol from random data and other protocols
 #define PROTOCOL_ID 0x4f457403
@@ -176,13 +178,13 @@ class IncomingDataCorruption : public BaseException
 	Struct for all kinds of packets. Includes following data:
 		BASE_HEADER
 		u8[] packet data (usually copied from SharedBuffer<u8>)
+
+	The memory is recycled through a pool, since packets are created and
+	destroyed at a high rate while sending.
 */
 struct BufferedPacket {
-	BufferedPacket(u32 a_size)
-	{
-		m_data.resize(a_size);
-		data = &m_data[0];
-	}
+	BufferedPacket(u32 a_size);
+	~BufferedPacket();
 
 	DISABLE_CLASS_COPY(BufferedPacket)
 
@@ -197,6 +199,7 @@ struct BufferedPacket {
 	u64 absolute_send_time = -1;
 	Address address; // Sender or destination
 	unsigned int resend_count = 0;
+	PacketPriority priority = PACKET_PRIORITY_CRITICAL;
 
 private:
 	std::vector<u8> m_data; // Data of the packet, including headers
@@ -207,6 +210,51 @@ struct BufferedPacket {
 BufferedPacketPtr makePacket(const Address &address, const SharedBuffer<u8> &data,
 		u32 protocol_id, session_t sender_peer_id, u8 channel);
 
+// Same, but the data is given as headers and payload which are copied
+// straight into the packet
+BufferedPacketPtr makePacket(const Address &address, u32 protocol_id,
+		session_t sender_peer_id, u8 channel, const u8 *headers, u32 headers_size,
+		const u8 *payload, u32 payload_size);
+
+// Maximum size of the headers added by forEachAutoSplitChunk()
+#define MAX_CHUNK_HEADER_SIZE 7
+
+/*
+	Splits the data like makeAutoSplitPacket(), without copying it.
+	Calls f(headers, headers_size, payload, payload_size) for every chunk,
+	where headers is the TYPE_ORIGINAL or TYPE_SPLIT header and payload
+	points into data.
+*/
+template <typename F>
+void forEachAutoSplitChunk(const u8 *data, u32 size, u32 chunksize_max,
+		u16 &split_seqnum, F &&f)
+{
+	u8 headers[MAX_CHUNK_HEADER_SIZE];
+
+	const u32 original_header_size = 1;
+	if (size + original_header_size <= chunksize_max) {
+		writeU8(&headers[0], PACKET_TYPE_ORIGINAL);
+		f(headers, original_header_size, data, size);
+		return;
+	}
+
+	const u32 chunk_header_size = 7;
+	const u32 maximum_data_size = chunksize_max - chunk_header_size;
+	const u32 chunk_count = (size + maximum_data_size - 1) / maximum_data_size;
+	sanity_check(chunk_count <= 0xFFFF); // overflow
+
+	writeU8(&headers[0], PACKET_TYPE_SPLIT);
+	writeU16(&headers[1], split_seqnum);
+	writeU16(&headers[3], chunk_count);
+	for (u32 chunk_num = 0; chunk_num < chunk_count; chunk_num++) {
+		const u32 start = chunk_num * maximum_data_size;
+		writeU16(&headers[5], chunk_num);
+		f(headers, chunk_header_size, data + start,
+			MYMIN(maximum_data_size, size - start));
+	}
+	split_seqnum++;
+}
+
 // Depending on size, make a TYPE_ORIGINAL or TYPE_SPLIT packet
 // Increments split_seqnum if a split packet is made
 void makeAutoSplitPacket(const SharedBuffer<u8> &data, u32 chunksize_max,
@@ -241,6 +289,11 @@ struct IncomingSplitPacket
 /*
 	A buffer which stores reliable packets and sorts them internally
 	for fast access to the smallest one.
+
+	Packets are kept in a ring indexed by their seqnum, so looking one up
+	takes constant time. The ring grows to fit the range of seqnums
+	that is buffered at the same time (at most the window size) and
+	shrinks again once that range got much smaller.
 */
 
 class ReliablePacketBuffer
@@ -265,13 +318,23 @@ class ReliablePacketBuffer
 
 
 private:
-	typedef std::list<BufferedPacketPtr>::iterator FindResult;
-
-	FindResult findPacketNoLock(u16 seqnum);
-
-	std::list<BufferedPacketPtr> m_list;
-
-	u16 m_oldest_non_answered_ack;
+	BufferedPacketPtr &slot(u16 seqnum)
+	{
+		return m_ring[seqnum & (m_ring.size() - 1)];
+	}
+	// Calls f for every packet from the first to the last seqnum
+	template <typename F>
+	void forEachNoLock(F &&f);
+	BufferedPacketPtr removeNoLock(u16 seqnum);
+	void growNoLock(u32 span);
+	void resizeNoLock(size_t size);
+
+	// Size is always a power of two
+	std::vector<BufferedPacketPtr> m_ring;
+	u32 m_count = 0;
+	// Seqnums of the first and last packet, valid if m_count > 0
+	u16 m_first = 0;
+	u16 m_last = 0;
 
 	std::mutex m_list_mutex;
 };
@@ -295,7 +358,7 @@ class IncomingSplitBuffer
 
 private:
 	// Key is seqnum
-	std::map<u16, IncomingSplitPacket*> m_buf;
+	std::unordered_map<u16, IncomingSplitPacket*> m_buf;
 
 	std::mutex m_map_mutex;
 };
@@ -324,6 +387,7 @@ struct ConnectionCommand
 	Buffer<u8> data;
 	bool reliable = false;
 	bool raw = false;
+	PacketPriority priority = PACKET_PRIORITY_CRITICAL;
 
 	DISABLE_CLASS_COPY(ConnectionCommand);
 
@@ -333,7 +397,8 @@ struct ConnectionCommand
 	static ConnectionCommandPtr disconnect_peer(session_t peer_id);
 	static ConnectionCommandPtr resend_one(session_t peer_id);
 	static ConnectionCommandPtr peer_id_set(session_t own_peer_id);
-	static ConnectionCommandPtr send(session_t peer_id, u8 channelnum, NetworkPacket *pkt, bool reliable);
+	static ConnectionCommandPtr send(session_t peer_id, u8 channelnum, NetworkPacket *pkt,
+			bool reliable, PacketPriority priority);
 	static ConnectionCommandPtr ack(session_t peer_id, u8 channelnum, const Buffer<u8> &data);
 	static ConnectionCommandPtr createPeer(session_t peer_id, const Buffer<u8> &data);
 
@@ -362,6 +427,40 @@ struct ConnectionCommand
 #define START_RELIABLE_WINDOW_SIZE 64
 /* minimum value for window size */
 #define MIN_RELIABLE_WINDOW_SIZE 32
+/* minimum value for window size with congestion control */
+#define MIN_CONGESTION_WINDOW_SIZE 8
+/* smallest burst of reliable packets allowed by pacing */
+#define PACING_MIN_BURST 8
+
+/*
+	CUBIC congestion window (RFC 8312), counted in packets.
+	Times are in seconds on an arbitrary monotonic clock.
+*/
+class CubicWindow
+{
+public:
+	void reset(float window);
+
+	// Grows the window after `acked` packets were acknowledged
+	void onAck(unsigned int acked, float now, float rtt);
+	// Shrinks the window, only once per round trip for a burst of losses
+	void onLoss(float now, float rtt);
+
+	float getWindow() const { return m_window; }
+	bool inSlowStart() const { return m_window < m_ssthresh; }
+
+private:
+	float m_window = START_RELIABLE_WINDOW_SIZE;
+	float m_ssthresh = MAX_RELIABLE_WINDOW_SIZE_SEND;
+	// Window before the last reduction
+	float m_window_max = 0.0f;
+	// Window a Reno sender would have
+	float m_window_reno = 0.0f;
+	// Time after which the cubic function reaches m_window_max
+	float m_k = 0.0f;
+	float m_epoch_start = -1.0f;
+	float m_last_loss = -1.0f;
+};
 
 class Channel
 {
@@ -401,7 +500,18 @@ class Channel
 	void UpdateBytesLost(unsigned int bytes);
 	void UpdateBytesReceived(unsigned int bytes);
 
-	void UpdateTimers(float dtime);
+	// rtt is the smoothed round trip time of the peer, or -1 if not known yet
+	void UpdateTimers(float dtime, float rtt);
+
+	void setCongestionControl(CongestionControl cc);
+
+	// Whether pacing allows another reliable packet to be sent now
+	bool canSendPaced() const
+		{ return m_pacing_rate <= 0 || m_pacing_tokens >= 1.0f; }
+	void onPacedSend()
+		{ if (m_pacing_rate > 0) m_pacing_tokens -= 1.0f; }
+	// Seconds until pacing allows the next reliable packet
+	float getPacingDelay() const;
 
 	float getCurrentDownloadRateKB()
 		{ MutexAutoLock lock(m_internal_mutex); return cur_kbps; };
@@ -429,7 +539,9 @@ class Channel
 
 	void setWindowSize(long size)
 	{
-		m_window_size = (u16)rangelim(size, MIN_RELIABLE_WINDOW_SIZE, MAX_RELIABLE_WINDOW_SIZE_SEND);
+		const long min_size = m_congestion_control == CONGESTION_CONTROL_CUBIC ?
+				MIN_CONGESTION_WINDOW_SIZE : MIN_RELIABLE_WINDOW_SIZE;
+		m_window_size = (u16)rangelim(size, min_size, MAX_RELIABLE_WINDOW_SIZE_SEND);
 	}
 
 private:
@@ -461,6 +573,16 @@ class Channel
 	float bpm_counter = 0.0f;
 
 	unsigned int rate_samples = 0;
+
+	void UpdateCubicWindow(float dtime, float rtt);
+
+	CongestionControl m_congestion_control = CONGESTION_CONTROL_LEGACY;
+	CubicWindow m_cubic;
+	float m_cubic_clock = 0.0f;
+
+	// Token bucket of the send thread, in packets per second
+	float m_pacing_rate = 0.0f;
+	float m_pacing_tokens = 0.0f;
 };
 
 
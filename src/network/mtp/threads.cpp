@@ -3,6 +3,7 @@
 // Copyright (C) 2013-2017 celeron55, Perttu Ahola <celeron55@gmail.com>
 // Copyright (C) 2017 celeron55, Loic Blot <loic.blot@unix-experience.fr>
 
+#include <cmath>
 #include "network/mtp/threads.h"
 #include "log.h"
 #include "profiler.h"
@@ -30,6 +31,14 @@ namespace con
 
 #define MAX_NEW_PEERS_PER_SEC 30
 
+// Packets handed to the socket at once
+#define SEND_BATCH_SIZE 64
+// Datagrams fetched from the socket at once
+#define RECEIVE_BATCH_SIZE 16
+// Packets waiting for a receive worker, more are dropped (the sender
+// resends the reliable ones)
+#define RECEIVE_WORKER_QUEUE_MAX 1024
+
 static inline session_t readPeerId(const u8 *packetdata)
 {
 	return readU16(&packetdata[4]);
@@ -83,7 +92,8 @@ void *ConnectionSendThread::run()
 		PROFILE(ScopeProfiler sp(g_profiler, ThreadIdentifier.str(), SPT_AVG));
 
 		/* wait for trigger or timeout */
-		m_send_sleep_semaphore.wait(50);
+		m_send_sleep_semaphore.wait(m_send_wait_ms);
+		m_send_wait_ms = 50;
 
 		/* remove all triggers */
 		while (m_send_sleep_semaphore.wait(0)) {
@@ -123,6 +133,8 @@ void *ConnectionSendThread::run()
 		/* send queued packets */
 		sendPackets(dtime, calculate_quota());
 
+		flushSends();
+
 		END_DEBUG_EXCEPTION_HANDLER
 	}
 
@@ -139,8 +151,13 @@ bool ConnectionSendThread::packetsQueued()
 {
 	std::vector<session_t> peerIds = m_connection->getPeerIDs();
 
-	if (!m_outgoing_queue.empty() && !peerIds.empty())
-		return true;
+	if (peerIds.empty())
+		return false;
+
+	for (const auto &queue : m_outgoing_queue) {
+		if (!queue.empty())
+			return true;
+	}
 
 	for (session_t peerId : peerIds) {
 		PeerHelper peer = m_connection->getPeerNoEx(peerId);
@@ -239,10 +256,10 @@ void ConnectionSendThread::runTimeouts(float dtime, u32 peer_packet_quota)
 				m_iteration_packets_avaialble = 0;
 
 			for (const auto &k : timed_outs)
-				resendReliable(channel, k.get(), resend_timeout);
+				resendReliable(channel, k, resend_timeout);
 
 			auto ws_old = channel.getWindowSize();
-			channel.UpdateTimers(dtime);
+			channel.UpdateTimers(dtime, udpPeer->getSmoothedRTT());
 			auto ws_new = channel.getWindowSize();
 			if (ws_old != ws_new) {
 				dout_con << m_connection->getDesc() <<
@@ -269,9 +286,10 @@ void ConnectionSendThread::runTimeouts(float dtime, u32 peer_packet_quota)
 	}
 }
 
-void ConnectionSendThread::resendReliable(Channel &channel, const BufferedPacket *k, float resend_timeout)
+void ConnectionSendThread::resendReliable(Channel &channel,
+		const ConstSharedPtr<BufferedPacket> &k, float resend_timeout)
 {
-	assert(k);
+	assert(k.get());
 	u8 channelnum = readChannel(k->data);
 	u16 seqnum = k->getSeqnum();
 
@@ -290,25 +308,41 @@ void ConnectionSendThread::resendReliable(Channel &channel, const BufferedPacket
 		<< ", seqnum=" << seqnum
 		<< std::endl;
 
+	// Resends bypass pacing and don't use up its tokens: they replace
+	// packets that were lost, holding them back would only delay the
+	// channel, and the loss already shrinks the window
 	rawSend(k);
 
 	// do not handle rtt here as we can't decide if this packet was
 	// lost or really takes more time to transmit
 }
 
-void ConnectionSendThread::rawSend(const BufferedPacket *p)
+void ConnectionSendThread::rawSend(const ConstSharedPtr<BufferedPacket> &p)
 {
-	assert(p);
-	try {
-		m_connection->m_udpSocket.Send(p->address, p->data, p->size());
-		//LOG(dout_con << m_connection->getDesc()
-		//	<< " rawSend: " << p->size()
-		//	<< " bytes sent" << std::endl);
-	} catch (SendFailedException &e) {
+	assert(p.get());
+	m_send_batch.push_back(p);
+	if (m_send_batch.size() >= SEND_BATCH_SIZE)
+		flushSends();
+}
+
+void ConnectionSendThread::flushSends()
+{
+	if (m_send_batch.empty())
+		return;
+
+	m_send_datagrams.clear();
+	for (const auto &p : m_send_batch)
+		m_send_datagrams.push_back({&p->address, p->data, (int)p->size()});
+
+	size_t failed = m_connection->m_udpSocket.SendBatch(
+		m_send_datagrams.data(), m_send_datagrams.size());
+	if (failed > 0) {
 		LOG(derr_con << m_connection->getDesc()
-			<< "SendFailedException: " << e.what() << " to "
-			<< p->address.serializeString() << std::endl);
+			<< "Failed to send " << failed << " of "
+			<< m_send_batch.size() << " packets" << std::endl);
 	}
+
+	m_send_batch.clear();
 }
 
 void ConnectionSendThread::sendAsPacketReliable(BufferedPacketPtr &p, Channel *channel)
@@ -328,7 +362,8 @@ void ConnectionSendThread::sendAsPacketReliable(BufferedPacketPtr &p, Channel *c
 	}
 
 	// Send the packet
-	rawSend(p.get());
+	rawSend(p);
+	channel->onPacedSend();
 }
 
 bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
@@ -350,15 +385,18 @@ bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
 		if (!have_seqnum)
 			return false;
 
-		SharedBuffer<u8> reliable = makeReliablePacket(data, seqnum);
+		u8 headers[RELIABLE_HEADER_SIZE];
+		writeU8(&headers[0], PACKET_TYPE_RELIABLE);
+		writeU16(&headers[1], seqnum);
 
 		// Add base headers and make a packet
-		BufferedPacketPtr p = con::makePacket(peer->getAddress(), reliable,
+		BufferedPacketPtr p = con::makePacket(peer->getAddress(),
 			m_connection->GetProtocolID(), m_connection->GetPeerID(),
-			channelnum);
+			channelnum, headers, RELIABLE_HEADER_SIZE, *data, data.getSize());
 
 		// first check if our send window is already maxed out
-		if (channel->outgoing_reliables_sent.size() < channel->getWindowSize()) {
+		if (channel->outgoing_reliables_sent.size() < channel->getWindowSize() &&
+				channel->canSendPaced()) {
 			LOG(dout_con << m_connection->getDesc()
 				<< " INFO: sending a reliable packet to peer_id " << peer_id
 				<< " channel: " << (u32)channelnum
@@ -381,7 +419,7 @@ bool ConnectionSendThread::rawSendAsPacket(session_t peer_id, u8 channelnum,
 		channelnum);
 
 	// Send the packet
-	rawSend(p.get());
+	rawSend(p);
 	return true;
 }
 
@@ -428,7 +466,7 @@ void ConnectionSendThread::processReliableCommand(ConnectionCommandPtr &c)
 			auto list = channel.outgoing_reliables_sent.getResend(0, 1);
 
 			if (!list.empty())
-				resendReliable(channel, list.front().get(), -1);
+				resendReliable(channel, list.front(), -1);
 
 			return;
 		}
@@ -484,7 +522,7 @@ void ConnectionSendThread::processNonReliableCommand(ConnectionCommandPtr &c_ptr
 		case CONNCMD_SEND:
 			LOG(dout_con << m_connection->getDesc()
 				<< " UDP processing CONNCMD_SEND" << std::endl);
-			send(c.peer_id, c.channelnum, c.data);
+			send(c.peer_id, c.channelnum, c.data, c.priority);
 			return;
 		case CONNCMD_SEND_TO_ALL:
 			LOG(dout_con << m_connection->getDesc()
@@ -605,7 +643,7 @@ void ConnectionSendThread::fix_peer_id(session_t own_peer_id)
 }
 
 void ConnectionSendThread::send(session_t peer_id, u8 channelnum,
-	const SharedBuffer<u8> &data)
+	const SharedBuffer<u8> &data, PacketPriority priority)
 {
 	assert(channelnum < CHANNEL_COUNT); // Pre-condition
 
@@ -632,7 +670,7 @@ void ConnectionSendThread::send(session_t peer_id, u8 channelnum,
 	peer->setNextSplitSequenceNumber(channelnum, split_sequence_number);
 
 	for (const SharedBuffer<u8> &original : originals) {
-		sendAsPacket(peer_id, channelnum, original);
+		sendAsPacket(peer_id, channelnum, original, false, priority);
 	}
 }
 
@@ -668,12 +706,26 @@ void ConnectionSendThread::sendToAllReliable(ConnectionCommandPtr &c)
 	}
 }
 
+/*
+	Share of a peer's send quota each packet priority gets while packets of
+	both are waiting. Latency-critical packets are sent first, but can't take
+	the share of the bulk packets, so that neither starves the other. Shares
+	that aren't used go to the other priority.
+*/
+static const u32 packet_priority_weights[PACKET_PRIORITY_MAX] = { 3, 1 };
+
 void ConnectionSendThread::sendPackets(float dtime, u32 peer_packet_quota)
 {
 	std::vector<session_t> peerIds = m_connection->getPeerIDs();
 	std::vector<session_t> pendingDisconnect;
 	std::map<session_t, bool> pending_unreliable;
 
+	u32 weight_sum = 0;
+	for (u32 weight : packet_priority_weights)
+		weight_sum += weight;
+	const u32 bulk_reserve = peer_packet_quota *
+		packet_priority_weights[PACKET_PRIORITY_BULK] / weight_sum;
+
 	for (session_t peerId : peerIds) {
 		PeerHelper peer = m_connection->getPeerNoEx(peerId);
 		//peer may have been removed
@@ -695,82 +747,131 @@ void ConnectionSendThread::sendPackets(float dtime, u32 peer_packet_quota)
 			pendingDisconnect.push_back(peerId);
 		}
 
-		PROFILE(std::stringstream
-		peerIdentifier);
-		PROFILE(
-			peerIdentifier << "sendPackets[" << m_connection->getDesc() << ";" << peerId
-				<< ";RELIABLE]");
-		PROFILE(ScopeProfiler
-		peerprofiler(g_profiler, peerIdentifier.str(), SPT_AVG));
-
-		//LOG(dout_con << m_connection->getDesc()
-		//	<< " Handle per peer queues: peer_id=" << peerId
-		//	<< " packet quota: " << peer->m_increment_packets_remaining << std::endl);
+		// first latency-critical packets, leaving the share of the bulk packets
+		sendQueuedReliables(udpPeer, bulk_reserve, true);
+	}
+	sendQueuedUnreliables(PACKET_PRIORITY_CRITICAL, bulk_reserve, nullptr);
 
-		// first send queued reliable packets for all peers (if possible)
-		for (unsigned int i = 0; i < CHANNEL_COUNT; i++) {
-			Channel &channel = udpPeer->channels[i];
+	// then everything else with the rest of the quota
+	for (session_t peerId : peerIds) {
+		PeerHelper peer = m_connection->getPeerNoEx(peerId);
+		UDPPeer *udpPeer = dynamic_cast<UDPPeer *>(&peer);
+		if (udpPeer)
+			sendQueuedReliables(udpPeer, 0, false);
+	}
+	sendQueuedUnreliables(PACKET_PRIORITY_BULK, 0, &pending_unreliable);
+	sendQueuedUnreliables(PACKET_PRIORITY_CRITICAL, 0, &pending_unreliable);
 
-			// Reduces logging verbosity
-			if (channel.queued_reliables.empty())
+	if (peer_packet_quota > 0 && !stopRequested()) {
+		for (session_t peerId : peerIds) {
+			PeerHelper peer = m_connection->getPeerNoEx(peerId);
+			if (!peer)
 				continue;
+			if (peer->m_increment_packets_remaining == 0) {
+				LOG(warningstream << m_connection->getDesc()
+					<< " Packet quota used up for peer_id=" << peerId
+					<< ", was " << peer_packet_quota << " pkts" << std::endl);
+			}
+		}
+	}
 
-			u16 next_to_ack = 0;
-			channel.outgoing_reliables_sent.getFirstSeqnum(next_to_ack);
-			u16 next_to_receive = 0;
-			channel.incoming_reliables.getFirstSeqnum(next_to_receive);
-
-			LOG(dout_con << m_connection->getDesc() << "\t channel: "
-				<< i << ", peer quota:"
-				<< peer->m_increment_packets_remaining
-				<< std::endl
-				<< "\t\t\treliables on wire: "
-				<< channel.outgoing_reliables_sent.size()
-				<< ", waiting for ack for " << next_to_ack
-				<< std::endl
-				<< "\t\t\tincoming_reliables: "
-				<< channel.incoming_reliables.size()
-				<< ", next reliable packet: "
-				<< channel.readNextIncomingSeqNum()
-				<< ", next queued: " << next_to_receive
-				<< std::endl
-				<< "\t\t\treliables queued : "
-				<< channel.queued_reliables.size()
-				<< std::endl
-				<< "\t\t\tqueued commands  : "
-				<< channel.queued_commands.size()
-				<< std::endl);
+	for (session_t peerId : pendingDisconnect) {
+		if (!pending_unreliable[peerId]) {
+			m_connection->deletePeer(peerId, false);
+		}
+	}
+}
 
-			while (!channel.queued_reliables.empty() &&
-					channel.outgoing_reliables_sent.size()
-					< channel.getWindowSize() &&
-					peer->m_increment_packets_remaining > 0) {
-				BufferedPacketPtr p = channel.queued_reliables.front();
-				channel.queued_reliables.pop();
+void ConnectionSendThread::sendQueuedReliables(UDPPeer *peer, u32 reserve,
+	bool critical_only)
+{
+	PROFILE(std::stringstream
+	peerIdentifier);
+	PROFILE(
+		peerIdentifier << "sendPackets[" << m_connection->getDesc() << ";" << peer->id
+			<< ";RELIABLE]");
+	PROFILE(ScopeProfiler
+	peerprofiler(g_profiler, peerIdentifier.str(), SPT_AVG));
+
+	for (unsigned int i = 0; i < CHANNEL_COUNT; i++) {
+		Channel &channel = peer->channels[i];
+
+		// Reduces logging verbosity
+		if (channel.queued_reliables.empty())
+			continue;
 
-				LOG(dout_con << m_connection->getDesc()
-					<< " INFO: sending a queued reliable packet "
-					<< " channel: " << i
-					<< ", seqnum: " << p->getSeqnum()
-					<< std::endl);
+		u16 next_to_ack = 0;
+		channel.outgoing_reliables_sent.getFirstSeqnum(next_to_ack);
+		u16 next_to_receive = 0;
+		channel.incoming_reliables.getFirstSeqnum(next_to_receive);
+
+		LOG(dout_con << m_connection->getDesc() << "\t channel: "
+			<< i << ", peer quota:"
+			<< peer->m_increment_packets_remaining
+			<< std::endl
+			<< "\t\t\treliables on wire: "
+			<< channel.outgoing_reliables_sent.size()
+			<< ", waiting for ack for " << next_to_ack
+			<< std::endl
+			<< "\t\t\tincoming_reliables: "
+			<< channel.incoming_reliables.size()
+			<< ", next reliable packet: "
+			<< channel.readNextIncomingSeqNum()
+			<< ", next queued: " << next_to_receive
+			<< std::endl
+			<< "\t\t\treliables queued : "
+			<< channel.queued_reliables.size()
+			<< std::endl
+			<< "\t\t\tqueued commands  : "
+			<< channel.queued_commands.size()
+			<< std::endl);
+
+		// packets of a channel can only be sent in order
+		while (!channel.queued_reliables.empty() &&
+				channel.outgoing_reliables_sent.size()
+				< channel.getWindowSize() &&
+				channel.canSendPaced() &&
+				peer->m_increment_packets_remaining > reserve) {
+			BufferedPacketPtr p = channel.queued_reliables.front();
+			if (critical_only && p->priority != PACKET_PRIORITY_CRITICAL)
+				break;
+			channel.queued_reliables.pop();
 
-				sendAsPacketReliable(p, &channel);
-				peer->m_increment_packets_remaining--;
-			}
+			LOG(dout_con << m_connection->getDesc()
+				<< " INFO: sending a queued reliable packet "
+				<< " channel: " << i
+				<< ", seqnum: " << p->getSeqnum()
+				<< std::endl);
+
+			sendAsPacketReliable(p, &channel);
+			peer->m_increment_packets_remaining--;
+		}
+
+		// wake up again as soon as pacing allows the next packet
+		if (!channel.queued_reliables.empty() && !channel.canSendPaced()) {
+			u32 wait_ms = std::ceil(channel.getPacingDelay() * 1000.0f);
+			m_send_wait_ms = rangelim(wait_ms, 1, m_send_wait_ms);
 		}
 	}
+}
+
+void ConnectionSendThread::sendQueuedUnreliables(PacketPriority priority,
+	u32 reserve, std::map<session_t, bool> *pending)
+{
+	std::queue<OutgoingPacket> &queue = m_outgoing_queue[priority];
 
-	if (!m_outgoing_queue.empty()) {
+	if (!queue.empty()) {
 		LOG(dout_con << m_connection->getDesc()
 			<< " Handle non reliable queue ("
-			<< m_outgoing_queue.size() << " pkts)" << std::endl);
+			<< queue.size() << " pkts, priority " << (int)priority << ")"
+			<< std::endl);
 	}
 
-	unsigned int initial_queuesize = m_outgoing_queue.size();
+	unsigned int initial_queuesize = queue.size();
 	/* send non reliable packets*/
 	for (unsigned int i = 0; i < initial_queuesize; i++) {
-		OutgoingPacket packet = m_outgoing_queue.front();
-		m_outgoing_queue.pop();
+		OutgoingPacket packet = queue.front();
+		queue.pop();
 
 		if (packet.reliable)
 			continue;
@@ -786,47 +887,78 @@ void ConnectionSendThread::sendPackets(float dtime, u32 peer_packet_quota)
 		}
 
 		/* send acks immediately */
-		if (packet.ack || peer->m_increment_packets_remaining > 0 || stopRequested()) {
+		if (packet.ack || peer->m_increment_packets_remaining > reserve ||
+				stopRequested()) {
 			rawSendAsPacket(packet.peer_id, packet.channelnum,
 				packet.data, packet.reliable);
 			if (peer->m_increment_packets_remaining > 0)
 				peer->m_increment_packets_remaining--;
 		} else {
-			m_outgoing_queue.push(packet);
-			pending_unreliable[packet.peer_id] = true;
+			queue.push(packet);
+			if (pending)
+				(*pending)[packet.peer_id] = true;
 		}
 	}
+}
 
-	if (peer_packet_quota > 0 && !stopRequested()) {
-		for (session_t peerId : peerIds) {
-			PeerHelper peer = m_connection->getPeerNoEx(peerId);
-			if (!peer)
-				continue;
-			if (peer->m_increment_packets_remaining == 0) {
-				LOG(warningstream << m_connection->getDesc()
-					<< " Packet quota used up for peer_id=" << peerId
-					<< ", was " << peer_packet_quota << " pkts" << std::endl);
-			}
-		}
-	}
+void ConnectionSendThread::sendAsPacket(session_t peer_id, u8 channelnum,
+	const SharedBuffer<u8> &data, bool ack, PacketPriority priority)
+{
+	OutgoingPacket packet(peer_id, channelnum, data, false, ack, priority);
+	m_outgoing_queue[priority].push(packet);
+}
 
-	for (session_t peerId : pendingDisconnect) {
-		if (!pending_unreliable[peerId]) {
-			m_connection->deletePeer(peerId, false);
+ConnectionReceiveWorker::ConnectionReceiveWorker(ConnectionReceiveThread *parent,
+		u16 index) :
+	Thread("ConnReceive" + std::to_string(index)),
+	m_parent(parent)
+{
+}
+
+bool ConnectionReceiveWorker::push(ReceivedPacket &&packet)
+{
+	// Only the receive thread adds packets, so the limit holds
+	if (m_queued.load() >= RECEIVE_WORKER_QUEUE_MAX)
+		return false;
+	m_queued++;
+	m_queue.push_back(std::move(packet));
+	return true;
+}
+
+void *ConnectionReceiveWorker::run()
+{
+	while (!stopRequested()) {
+		BEGIN_DEBUG_EXCEPTION_HANDLER
+
+		ReceivedPacket packet = m_queue.pop_frontNoEx(100);
+		if (packet.size > 0) {
+			m_queued--;
+			m_parent->handleReceived(packet);
 		}
+
+		END_DEBUG_EXCEPTION_HANDLER
 	}
+	return nullptr;
 }
 
-void ConnectionSendThread::sendAsPacket(session_t peer_id, u8 channelnum,
-	const SharedBuffer<u8> &data, bool ack)
+ConnectionReceiveThread::ConnectionReceiveThread() :
+	Thread("ConnectionReceive"),
+	m_num_workers(g_settings->getU16("network_receive_threads"))
 {
-	OutgoingPacket packet(peer_id, channelnum, data, false, ack);
-	m_outgoing_queue.push(packet);
 }
 
-ConnectionReceiveThread::ConnectionReceiveThread() :
-	Thread("ConnectionReceive")
+ConnectionReceiveThread::~ConnectionReceiveThread()
+{
+	stopWorkers();
+}
+
+void ConnectionReceiveThread::stopWorkers()
 {
+	for (auto &worker : m_workers)
+		worker->stop();
+	for (auto &worker : m_workers)
+		worker->wait();
+	m_workers.clear();
 }
 
 void *ConnectionReceiveThread::run()
@@ -844,9 +976,12 @@ void *ConnectionReceiveThread::run()
 	// theoretical reliable upper boundary of a udp packet for all IPv6 enabled
 	// infrastructure
 	const unsigned int packet_maxsize = 1500;
-	SharedBuffer<u8> packetdata(packet_maxsize);
-
-	bool packet_queued = true;
+	m_receive_buffer.resize(packet_maxsize * RECEIVE_BATCH_SIZE);
+	m_datagrams.resize(RECEIVE_BATCH_SIZE);
+	for (size_t i = 0; i < m_datagrams.size(); i++) {
+		m_datagrams[i].data = &m_receive_buffer[i * packet_maxsize];
+		m_datagrams[i].capacity = packet_maxsize;
+	}
 
 #ifdef DEBUG_CONNECTION_KBPS
 	u64 curtime = porting::getTimeMs();
@@ -866,7 +1001,7 @@ void *ConnectionReceiveThread::run()
 #endif
 
 		/* receive packets */
-		receive(packetdata, packet_queued);
+		receive();
 
 #ifdef DEBUG_CONNECTION_KBPS
 		debug_print_timer += dtime;
@@ -921,91 +1056,116 @@ void *ConnectionReceiveThread::run()
 		END_DEBUG_EXCEPTION_HANDLER
 	}
 
+	stopWorkers();
+
 	PROFILE(g_profiler->remove(ThreadIdentifier.str()));
 	return NULL;
 }
 
 // Receive packets from the network and buffers and create ConnectionEvents
-void ConnectionReceiveThread::receive(SharedBuffer<u8> &packetdata,
-		bool &packet_queued)
+void ConnectionReceiveThread::receive()
 {
-	try {
-		// First, see if there any buffered packets we can process now
-		if (packet_queued) {
-			session_t peer_id;
-			SharedBuffer<u8> resultdata;
-			while (true) {
-				try {
-					if (!getFromBuffers(peer_id, resultdata))
-						break;
-
-					m_connection->putEvent(ConnectionEvent::dataReceived(peer_id, resultdata));
-				}
-				catch (ProcessedSilentlyException &e) {
-					/* try reading again */
-				}
-			}
-			packet_queued = false;
-		}
+	// Wait for incoming data and take everything that arrived meanwhile
+	size_t count = m_connection->m_udpSocket.ReceiveBatch(
+		m_datagrams.data(), m_datagrams.size());
 
-		// Call Receive() to wait for incoming data
-		Address sender;
-		s32 received_size = m_connection->m_udpSocket.Receive(sender,
-			*packetdata, packetdata.getSize());
-		if (received_size < 0)
-			return;
+	for (size_t i = 0; i < count; i++)
+		processDatagram(m_datagrams[i]);
+}
 
-		if ((received_size < BASE_HEADER_SIZE) ||
-				(readU32(&packetdata[0]) != m_connection->GetProtocolID())) {
-			LOG(derr_con << m_connection->getDesc()
-				<< "Receive(): Invalid incoming packet, "
-				<< "size: " << received_size
-				<< ", protocol: "
-				<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
-				<< std::endl);
-			return;
-		}
+void ConnectionReceiveThread::processDatagram(const IncomingDatagram &dg)
+{
+	const Address &sender = dg.sender;
+	const s32 received_size = dg.size;
+	const u8 *packetdata = static_cast<const u8 *>(dg.data);
 
-		session_t peer_id = readPeerId(*packetdata);
-		u8 channelnum = readChannel(*packetdata);
+	if ((received_size < BASE_HEADER_SIZE) ||
+			(readU32(&packetdata[0]) != m_connection->GetProtocolID())) {
+		LOG(derr_con << m_connection->getDesc()
+			<< "Receive(): Invalid incoming packet, "
+			<< "size: " << received_size
+			<< ", protocol: "
+			<< ((received_size >= 4) ? readU32(&packetdata[0]) : -1)
+			<< std::endl);
+		return;
+	}
 
-		if (channelnum >= CHANNEL_COUNT) {
-			LOG(derr_con << m_connection->getDesc()
-				<< "Receive(): Invalid channel " << (int)channelnum << std::endl);
-			return;
-		}
+	session_t peer_id = readPeerId(packetdata);
+	u8 channelnum = readChannel(packetdata);
 
-		const bool knew_peer_id = peer_id != PEER_ID_INEXISTENT;
-
-		if (!m_connection->ConnectedToServer()) {
-			// Try to identify peer by sender address
-			if (peer_id == PEER_ID_INEXISTENT) {
-				peer_id = m_connection->lookupPeer(sender);
-				if (peer_id != PEER_ID_INEXISTENT) {
-					/* During join it can happen that the CONTROLTYPE_SET_PEER_ID
-					 * packet is lost. Since resends are not active at this stage
-					 * we need to remind the peer manually. */
-					m_connection->doResendOne(peer_id);
-				}
+	if (channelnum >= CHANNEL_COUNT) {
+		LOG(derr_con << m_connection->getDesc()
+			<< "Receive(): Invalid channel " << (int)channelnum << std::endl);
+		return;
+	}
+
+	const bool knew_peer_id = peer_id != PEER_ID_INEXISTENT;
+
+	const bool is_server = !m_connection->ConnectedToServer();
+	if (is_server) {
+		// Try to identify peer by sender address
+		if (peer_id == PEER_ID_INEXISTENT) {
+			peer_id = m_connection->lookupPeer(sender);
+			if (peer_id != PEER_ID_INEXISTENT) {
+				/* During join it can happen that the CONTROLTYPE_SET_PEER_ID
+				 * packet is lost. Since resends are not active at this stage
+				 * we need to remind the peer manually. */
+				m_connection->doResendOne(peer_id);
 			}
+		}
 
-			// Someone new is trying to talk to us. Add them.
-			if (peer_id == PEER_ID_INEXISTENT) {
-				auto &l = m_new_peer_ratelimit;
-				l.tick();
-				if (++l.counter > MAX_NEW_PEERS_PER_SEC) {
-					if (!l.logged) {
-						warningstream << m_connection->getDesc()
-							<< "Receive(): More than " << MAX_NEW_PEERS_PER_SEC
-							<< " new clients within 1s. Throttling." << std::endl;
-					}
-					l.logged = true;
-					// We simply drop the packet, the client can try again.
-				} else {
-					peer_id = m_connection->createPeer(sender, 0);
+		// Someone new is trying to talk to us. Add them.
+		if (peer_id == PEER_ID_INEXISTENT) {
+			auto &l = m_new_peer_ratelimit;
+			l.tick();
+			if (++l.counter > MAX_NEW_PEERS_PER_SEC) {
+				if (!l.logged) {
+					warningstream << m_connection->getDesc()
+						<< "Receive(): More than " << MAX_NEW_PEERS_PER_SEC
+						<< " new clients within 1s. Throttling." << std::endl;
 				}
+				l.logged = true;
+				// We simply drop the packet, the client can try again.
+			} else {
+				peer_id = m_connection->createPeer(sender, 0);
 			}
 		}
+	}
+
+	ReceivedPacket packet;
+	packet.peer_id = peer_id;
+	packet.knew_peer_id = knew_peer_id;
+	packet.sender = sender;
+	packet.channelnum = channelnum;
+	packet.size = received_size;
+	// Make a new SharedBuffer from the data without the base headers
+	packet.data = SharedBuffer<u8>(&packetdata[BASE_HEADER_SIZE],
+		received_size - BASE_HEADER_SIZE);
+
+	if (!is_server || m_num_workers == 0) {
+		handleReceived(packet);
+		return;
+	}
+
+	// All packets of a peer go to the same worker to keep them in order
+	if (m_workers.empty()) {
+		for (u16 i = 0; i < m_num_workers; i++) {
+			m_workers.push_back(std::make_unique<ConnectionReceiveWorker>(this, i));
+			m_workers.back()->start();
+		}
+	}
+	if (!m_workers[peer_id % m_workers.size()]->push(std::move(packet)))
+		g_profiler->graphAdd("packets_dropped", 1);
+}
+
+void ConnectionReceiveThread::handleReceived(const ReceivedPacket &packet)
+{
+	try {
+		const Address &sender = packet.sender;
+		const s32 received_size = packet.size;
+		const session_t peer_id = packet.peer_id;
+		const u8 channelnum = packet.channelnum;
+		const bool knew_peer_id = packet.knew_peer_id;
 
 		PeerHelper peer = m_connection->getPeerNoEx(peer_id);
 		if (!peer) {
@@ -1049,16 +1209,10 @@ void ConnectionReceiveThread::receive(SharedBuffer<u8> &packetdata,
 		channel->UpdateBytesReceived(received_size);
 
 		// Throw the received packet to channel->processPacket()
-
-		// Make a new SharedBuffer from the data without the base headers
-		SharedBuffer<u8> strippeddata(received_size - BASE_HEADER_SIZE);
-		memcpy(*strippeddata, &packetdata[BASE_HEADER_SIZE],
-			strippeddata.getSize());
-
 		try {
 			// Process it (the result is some data with no headers made by us)
 			SharedBuffer<u8> resultdata = processPacket
-				(channel, strippeddata, peer_id, channelnum, false);
+				(channel, packet.data, peer_id, channelnum, false);
 
 			LOG(dout_con << m_connection->getDesc()
 				<< " ProcessPacket from peer_id: " << peer_id
@@ -1070,37 +1224,31 @@ void ConnectionReceiveThread::receive(SharedBuffer<u8> &packetdata,
 		catch (ProcessedSilentlyException &e) {
 		}
 		catch (ProcessedQueued &e) {
-			// we set it to true anyway (see below)
 		}
 
-		/* Every time we receive a packet it can happen that a previously
-		 * buffered packet is now ready to process. */
-		packet_queued = true;
+		/* Receiving a packet can make previously buffered packets of
+		 * this channel ready to process. */
+		processBuffers(channel);
 	}
 	catch (InvalidIncomingDataException &e) {
 	}
 }
 
-bool ConnectionReceiveThread::getFromBuffers(session_t &peer_id, SharedBuffer<u8> &dst)
+void ConnectionReceiveThread::processBuffers(Channel *channel)
 {
-	std::vector<session_t> peerids = m_connection->getPeerIDs();
-
-	for (session_t peerid : peerids) {
-		PeerHelper peer = m_connection->getPeerNoEx(peerid);
-		if (!peer)
-			continue;
-
-		UDPPeer *p = dynamic_cast<UDPPeer *>(&peer);
-		if (!p)
-			continue;
+	session_t peer_id;
+	SharedBuffer<u8> resultdata;
+	while (true) {
+		try {
+			if (!checkIncomingBuffers(channel, peer_id, resultdata))
+				break;
 
-		for (Channel &channel : p->channels) {
-			if (checkIncomingBuffers(&channel, peer_id, dst)) {
-				return true;
-			}
+			m_connection->putEvent(ConnectionEvent::dataReceived(peer_id, resultdata));
+		}
+		catch (ProcessedSilentlyException &e) {
+			/* try reading again */
 		}
 	}
-	return false;
 }
 
 bool ConnectionReceiveThread::checkIncomingBuffers(Channel *channel,
@@ -1200,8 +1348,13 @@ SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Control(Channel *chan
 		try {
 			BufferedPacketPtr p = channel->outgoing_reliables_sent.popSeqnum(seqnum);
 
-			// the rtt calculation will be a bit off for re-sent packets but that's okay
-			{
+			const bool cubic = m_connection->getCongestionControl() ==
+					CONGESTION_CONTROL_CUBIC;
+
+			// an ACK of a re-sent packet may belong to any of the copies,
+			// so with congestion control only packets that were sent once
+			// give a rtt
+			if (p->resend_count == 0 || !cubic) {
 				// Get round trip time
 				u64 current_time = porting::getTimeMs();
 
@@ -1224,7 +1377,10 @@ SharedBuffer<u8> ConnectionReceiveThread::handlePacketType_Control(Channel *chan
 
 			// put bytes for max bandwidth calculation
 			channel->UpdateBytesSent(p->size(), 1);
-			if (channel->outgoing_reliables_sent.size() == 0)
+			// With congestion control refill the window before it runs dry
+			u32 in_flight = channel->outgoing_reliables_sent.size();
+			if (in_flight == 0 ||
+					(cubic && in_flight == channel->getWindowSize() / 2u))
 				m_connection->TriggerSend();
 		} catch (NotFoundException &e) {
 			LOG(derr_con << m_connection->getDesc()
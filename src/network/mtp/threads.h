@@ -9,7 +9,9 @@
 /* may only be included from in src/network */
 /********************************************/
 
+#include <atomic>
 #include <cassert>
+#include <memory>
 #include "threading/thread.h"
 #include "network/mtp/internal.h"
 
@@ -25,14 +27,17 @@ struct OutgoingPacket
 	SharedBuffer<u8> data;
 	bool reliable;
 	bool ack;
+	PacketPriority priority;
 
 	OutgoingPacket(session_t peer_id_, u8 channelnum_, const SharedBuffer<u8> &data_,
-			bool reliable_,bool ack_=false):
+			bool reliable_,bool ack_=false,
+			PacketPriority priority_=PACKET_PRIORITY_CRITICAL):
 		peer_id(peer_id_),
 		channelnum(channelnum_),
 		data(data_),
 		reliable(reliable_),
-		ack(ack_)
+		ack(ack_),
+		priority(priority_)
 	{
 	}
 };
@@ -59,8 +64,11 @@ class ConnectionSendThread : public Thread
 
 private:
 	void runTimeouts(float dtime, u32 peer_packet_quota);
-	void resendReliable(Channel &channel, const BufferedPacket *k, float resend_timeout);
-	void rawSend(const BufferedPacket *p);
+	void resendReliable(Channel &channel, const ConstSharedPtr<BufferedPacket> &k,
+			float resend_timeout);
+	// Queues the packet for the next flushSends()
+	void rawSend(const ConstSharedPtr<BufferedPacket> &p);
+	void flushSends();
 	bool rawSendAsPacket(session_t peer_id, u8 channelnum,
 			const SharedBuffer<u8> &data, bool reliable);
 
@@ -71,15 +79,22 @@ class ConnectionSendThread : public Thread
 	void disconnect();
 	void disconnect_peer(session_t peer_id);
 	void fix_peer_id(session_t own_peer_id);
-	void send(session_t peer_id, u8 channelnum, const SharedBuffer<u8> &data);
+	void send(session_t peer_id, u8 channelnum, const SharedBuffer<u8> &data,
+			PacketPriority priority = PACKET_PRIORITY_CRITICAL);
 	void sendReliable(ConnectionCommandPtr &c);
 	void sendToAll(u8 channelnum, const SharedBuffer<u8> &data);
 	void sendToAllReliable(ConnectionCommandPtr &c);
 
 	void sendPackets(float dtime, u32 peer_packet_quota);
+	// Sends queued reliables of the peer until `reserve` packets of its quota
+	// are left. With critical_only, each channel stops at its first bulk packet.
+	void sendQueuedReliables(UDPPeer *peer, u32 reserve, bool critical_only);
+	// Same for the unreliable packets of one priority, for all peers
+	void sendQueuedUnreliables(PacketPriority priority, u32 reserve,
+			std::map<session_t, bool> *pending);
 
 	void sendAsPacket(session_t peer_id, u8 channelnum, const SharedBuffer<u8> &data,
-			bool ack = false);
+			bool ack = false, PacketPriority priority = PACKET_PRIORITY_CRITICAL);
 
 	void sendAsPacketReliable(BufferedPacketPtr &p, Channel *channel);
 
@@ -88,18 +103,57 @@ class ConnectionSendThread : public Thread
 	Connection *m_connection = nullptr;
 	unsigned int m_max_packet_size;
 	float m_timeout;
-	std::queue<OutgoingPacket> m_outgoing_queue;
+	// Unreliable packets and ACKs, by priority
+	std::queue<OutgoingPacket> m_outgoing_queue[PACKET_PRIORITY_MAX];
+	// Packets waiting to be passed to the socket in one go
+	std::vector<ConstSharedPtr<BufferedPacket>> m_send_batch;
+	std::vector<OutgoingDatagram> m_send_datagrams;
 	Semaphore m_send_sleep_semaphore;
+	// Lowered when pacing holds back queued reliables
+	u32 m_send_wait_ms = 50;
 
 	unsigned int m_iteration_packets_avaialble;
 	unsigned int m_max_data_packets_per_iteration;
 	unsigned int m_max_packets_requeued = 256;
 };
 
+// A datagram that was checked and assigned to a peer by the receive thread
+struct ReceivedPacket
+{
+	session_t peer_id = PEER_ID_INEXISTENT;
+	bool knew_peer_id = false;
+	Address sender;
+	u8 channelnum = 0;
+	s32 size = 0; // including the base headers
+	SharedBuffer<u8> data; // without the base headers
+};
+
+class ConnectionReceiveThread;
+
+// Processes the packets of a subset of the peers for the receive thread
+class ConnectionReceiveWorker : public Thread
+{
+public:
+	ConnectionReceiveWorker(ConnectionReceiveThread *parent, u16 index);
+
+	void *run();
+
+	// Returns false if the queue is full, the packet is dropped then
+	bool push(ReceivedPacket &&packet);
+
+private:
+	ConnectionReceiveThread *m_parent;
+	MutexedQueue<ReceivedPacket> m_queue;
+	std::atomic<u32> m_queued{0};
+};
+
 class ConnectionReceiveThread : public Thread
 {
 public:
+	friend class ConnectionReceiveWorker;
+
 	ConnectionReceiveThread();
+	~ConnectionReceiveThread();
 
 	void *run();
 
@@ -110,13 +164,19 @@ class ConnectionReceiveThread : public Thread
 	}
 
 private:
-	void receive(SharedBuffer<u8> &packetdata, bool &packet_queued);
-
-	// Returns next data from a buffer if possible
+	void receive();
+	// Identifies the peer of a datagram, then handles it or passes it
+	// to a worker
+	void processDatagram(const IncomingDatagram &dg);
+	// Processes a packet for its peer, may be called from the workers
+	void handleReceived(const ReceivedPacket &packet);
+	// Hands packets that became ready in the channel buffer to the user
+	void processBuffers(Channel *channel);
+	void stopWorkers();
+
+	// Returns next data from the buffer of the channel if possible
 	// If found, returns true; if not, false.
 	// If found, sets peer_id and dst
-	bool getFromBuffers(session_t &peer_id, SharedBuffer<u8> &dst);
-
 	bool checkIncomingBuffers(
 			Channel *channel, session_t &peer_id, SharedBuffer<u8> &dst);
 
@@ -171,6 +231,14 @@ class ConnectionReceiveThread : public Thread
 
 	Connection *m_connection = nullptr;
 
+	// Storage for one batch of received datagrams
+	std::vector<u8> m_receive_buffer;
+	std::vector<IncomingDatagram> m_datagrams;
+
+	// Packets are processed by this many workers on a server
+	const u16 m_num_workers;
+	std::vector<std::unique_ptr<ConnectionReceiveWorker>> m_workers;
+
 	RateLimitHelper m_new_peer_ratelimit;
 };
 }
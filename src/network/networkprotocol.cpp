@@ -62,10 +62,14 @@
 	PROTOCOL VERSION 47
 		Add particle blend mode "clip"
 		[scheduled bump for 5.11.0]
+	PROTOCOL VERSION 48
+		Add TOCLIENT_BLOCK_DELTA
+		Add TOCLIENT_BLOCK_DICTIONARY and TOSERVER_BLOCK_DICTIONARY
+		[scheduled bump for 5.12.0]
 */
 
 // Note: Also update core.protocol_versions in builtin when bumping
-const u16 LATEST_PROTOCOL_VERSION = 47;
+const u16 LATEST_PROTOCOL_VERSION = 48;
 
 // See also formspec [Version History] in doc/lua_api.md
 const u16 FORMSPEC_API_VERSION = 8;
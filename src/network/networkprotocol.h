@@ -677,7 +677,36 @@ enum ToClientCommand : u16
 			f32 center_weight_power
 	*/
 
-	TOCLIENT_NUM_MSG_TYPES = 0x64,
+	TOCLIENT_BLOCK_DELTA = 0x64,
+	/*
+		Changes to a block the client already has, instead of TOCLIENT_BLOCKDATA.
+		The node metadata of the changed nodes is removed.
+
+		v3s16 blockpos
+		u8 flags // as in the serialized block
+		u16 lighting_complete
+		u16 run count
+		for each run of consecutive changed nodes:
+			u16 index of the first node (z * 256 + y * 16 + x)
+			u16 node count
+			for each node:
+				u16 param0
+				u8 param1
+				u8 param2
+	*/
+
+	TOCLIENT_BLOCK_DICTIONARY = 0x65,
+	/*
+		The zstd dictionary that blocks can be compressed with. The server
+		only uses it for a client once it got TOSERVER_BLOCK_DICTIONARY
+		with have = 1.
+
+		std::string SHA1 of the dictionary (raw bytes)
+		u32 len
+		u8[len] dictionary, empty if it is only announced
+	*/
+
+	TOCLIENT_NUM_MSG_TYPES = 0x66,
 };
 
 enum ToServerCommand : u16
@@ -886,7 +915,15 @@ enum ToServerCommand : u16
 		v2f32 max_fs_info
 	*/
 
-	TOSERVER_NUM_MSG_TYPES = 0x54,
+	TOSERVER_BLOCK_DICTIONARY = 0x54,
+	/*
+		Answer to TOCLIENT_BLOCK_DICTIONARY
+
+		std::string SHA1 of the dictionary (raw bytes)
+		u8 have // 1: loaded, blocks may use it, 0: please send it
+	*/
+
+	TOSERVER_NUM_MSG_TYPES = 0x55,
 };
 
 enum AuthMechanism
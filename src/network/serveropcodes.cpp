@@ -95,6 +95,7 @@ const ToServerCommandHandler toServerCommandTable[TOSERVER_NUM_MSG_TYPES] =
 	{ "TOSERVER_SRP_BYTES_A",              TOSERVER_STATE_NOT_CONNECTED, &Server::handleCommand_SrpBytesA }, // 0x51
 	{ "TOSERVER_SRP_BYTES_M",              TOSERVER_STATE_NOT_CONNECTED, &Server::handleCommand_SrpBytesM }, // 0x52
 	{ "TOSERVER_UPDATE_CLIENT_INFO",       TOSERVER_STATE_INGAME, &Server::handleCommand_UpdateClientInfo }, // 0x53
+	{ "TOSERVER_BLOCK_DICTIONARY",         TOSERVER_STATE_STARTUP, &Server::handleCommand_BlockDictionary }, // 0x54
 };
 
 const static ClientCommandFactory null_command_factory = { nullptr, 0, false };
@@ -143,7 +144,7 @@ const ClientCommandFactory clientCommandFactoryTable[TOCLIENT_NUM_MSG_TYPES] =
 	null_command_factory, // 0x1D
 	null_command_factory, // 0x1E
 	null_command_factory, // 0x1F
-	{ "TOCLIENT_BLOCKDATA",                2, true }, // 0x20
+	{ "TOCLIENT_BLOCKDATA",                2, true, con::PACKET_PRIORITY_BULK }, // 0x20
 	{ "TOCLIENT_ADDNODE",                  0, true }, // 0x21
 	{ "TOCLIENT_REMOVENODE",               0, true }, // 0x22
 	null_command_factory, // 0x23
@@ -167,12 +168,12 @@ const ClientCommandFactory clientCommandFactoryTable[TOCLIENT_NUM_MSG_TYPES] =
 	null_command_factory, // 0x35
 	{ "TOCLIENT_FOV",                      0, true }, // 0x36
 	null_command_factory, // 0x37
-	{ "TOCLIENT_MEDIA",                    2, true }, // 0x38
+	{ "TOCLIENT_MEDIA",                    2, true, con::PACKET_PRIORITY_BULK }, // 0x38
 	null_command_factory, // 0x39
-	{ "TOCLIENT_NODEDEF",                  0, true }, // 0x3A
+	{ "TOCLIENT_NODEDEF",                  0, true, con::PACKET_PRIORITY_BULK }, // 0x3A
 	null_command_factory, // 0x3B
 	{ "TOCLIENT_ANNOUNCE_MEDIA",           0, true }, // 0x3C
-	{ "TOCLIENT_ITEMDEF",                  0, true }, // 0x3D
+	{ "TOCLIENT_ITEMDEF",                  0, true, con::PACKET_PRIORITY_BULK }, // 0x3D
 	null_command_factory, // 0x3E
 	{ "TOCLIENT_PLAY_SOUND",               0, true }, // 0x3f (may be sent as unrel too)
 	{ "TOCLIENT_STOP_SOUND",               0, true }, // 0x40
@@ -211,4 +212,6 @@ const ClientCommandFactory clientCommandFactoryTable[TOCLIENT_NUM_MSG_TYPES] =
 	{ "TOCLIENT_FORMSPEC_PREPEND",         0, true }, // 0x61
 	{ "TOCLIENT_MINIMAP_MODES",            0, true }, // 0x62
 	{ "TOCLIENT_SET_LIGHTING",             0, true }, // 0x63
+	{ "TOCLIENT_BLOCK_DELTA",              2, true, con::PACKET_PRIORITY_BULK }, // 0x64
+	{ "TOCLIENT_BLOCK_DICTIONARY",         2, true, con::PACKET_PRIORITY_BULK }, // 0x65
 };
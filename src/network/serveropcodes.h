@@ -28,6 +28,8 @@ struct ClientCommandFactory
 	const char* name;
 	u8 channel;
 	bool reliable;
+	// Large packets are sent after the latency-critical ones
+	con::PacketPriority priority = con::PACKET_PRIORITY_CRITICAL;
 };
 
 extern const ToServerCommandHandler toServerCommandTable[TOSERVER_NUM_MSG_TYPES];
@@ -301,6 +301,10 @@ void Server::handleCommand_Init2(NetworkPacket* pkt)
 	// Send media announcement
 	sendMediaAnnouncement(peer_id, lang);
 
+	// The client tells whether it needs the dictionary itself
+	if (m_block_dictionary && protocol_version >= 48)
+		SendBlockDictionary(peer_id, false);
+
 	RemoteClient *client = getClient(peer_id, CS_InitDone);
 
 	// Keep client language for server translations
@@ -416,11 +420,16 @@ void Server::handleCommand_GotBlocks(NetworkPacket* pkt)
 
 	ClientInterface::AutoLock lock(m_clients);
 	RemoteClient *client = m_clients.lockedGetClientNoEx(pkt->getPeerId());
+	Map &map = m_env->getMap();
 
 	for (u16 i = 0; i < count; i++) {
 		v3s16 p;
 		*pkt >> p;
-		client->GotBlock(p);
+		// Only the blocks a client keeps get their changes sent later
+		if (client->GotBlock(p) && client->net_proto_version >= 48) {
+			if (MapBlock *block = map.getBlockNoCreateNoEx(p))
+				block->startNodeChangeLog();
+		}
 	}
 }
 
@@ -1820,3 +1829,28 @@ void Server::handleCommand_UpdateClientInfo(NetworkPacket *pkt)
 	RemoteClient *client = getClient(peer_id, CS_Invalid);
 	client->setDynamicInfo(info);
 }
+
+void Server::handleCommand_BlockDictionary(NetworkPacket *pkt)
+{
+	std::string digest;
+	u8 have;
+	*pkt >> digest >> have;
+
+	session_t peer_id = pkt->getPeerId();
+	if (!m_block_dictionary || digest != m_block_dictionary_digest)
+		return;
+
+	RemoteClient *client = getClient(peer_id, CS_InitDone);
+	if (have) {
+		client->use_block_dictionary = true;
+		verbosestream << "Server: " << getPlayerName(peer_id)
+				<< " has the block dictionary" << std::endl;
+	} else if (!client->block_dictionary_sent) {
+		client->block_dictionary_sent = true;
+		SendBlockDictionary(peer_id, true);
+	} else {
+		// It's large, don't let a client ask for it over and over
+		infostream << "Server: Ignoring repeated block dictionary request of "
+				<< getPlayerName(peer_id) << std::endl;
+	}
+}
@@ -4,6 +4,7 @@
 
 #include "socket.h"
 
+#include <atomic>
 #include <cstdio>
 #include <iostream>
 #include <cstdlib>
@@ -35,6 +36,15 @@ typedef int socklen_t;
 #define SOCKET_ERR_STR(e) strerror(e)
 #endif
 
+#ifdef __linux__
+// sendmmsg() and recvmmsg() can still be missing at runtime (ENOSYS)
+#define HAVE_MMSG 1
+static std::atomic<bool> g_mmsg_unsupported(false);
+#endif
+
+// Maximum number of datagrams per sendmmsg()/recvmmsg() call
+static constexpr size_t MMSG_BATCH = 64;
+
 static bool g_sockets_initialized = false;
 
 // Initialize sockets
@@ -58,6 +68,37 @@ void sockets_cleanup()
 	g_sockets_initialized = false;
 }
 
+static socklen_t make_sockaddr(const Address &addr, struct sockaddr_storage &storage)
+{
+	memset(&storage, 0, sizeof(storage));
+	if (addr.getFamily() == AF_INET6) {
+		auto *address = reinterpret_cast<struct sockaddr_in6 *>(&storage);
+		address->sin6_family = AF_INET6;
+		address->sin6_addr = addr.getAddress6();
+		address->sin6_port = htons(addr.getPort());
+		return sizeof(struct sockaddr_in6);
+	}
+
+	auto *address = reinterpret_cast<struct sockaddr_in *>(&storage);
+	address->sin_family = AF_INET;
+	address->sin_addr = addr.getAddress();
+	address->sin_port = htons(addr.getPort());
+	return sizeof(struct sockaddr_in);
+}
+
+static Address parse_sockaddr(const struct sockaddr_storage &storage)
+{
+	if (storage.ss_family == AF_INET6) {
+		const auto *address = reinterpret_cast<const struct sockaddr_in6 *>(&storage);
+		const auto *bytes = reinterpret_cast<const IPv6AddressBytes *>
+			(address->sin6_addr.s6_addr);
+		return Address(bytes, ntohs(address->sin6_port));
+	}
+
+	const auto *address = reinterpret_cast<const struct sockaddr_in *>(&storage);
+	return Address(ntohl(address->sin_addr.s_addr), ntohs(address->sin_port));
+}
+
 /*
 	UDPSocket
 */
@@ -182,29 +223,86 @@ void UDPSocket::Send(const Address &destination, const void *data, int size)
 	if (destination.getFamily() != m_addr_family)
 		throw SendFailedException("Address family mismatch");
 
-	int sent;
-	if (m_addr_family == AF_INET6) {
-		struct sockaddr_in6 address = {};
-		address.sin6_family = AF_INET6;
-		address.sin6_addr = destination.getAddress6();
-		address.sin6_port = htons(destination.getPort());
-
-		sent = sendto(m_handle, (const char *)data, size, 0,
-				(struct sockaddr *)&address, sizeof(struct sockaddr_in6));
-	} else {
-		struct sockaddr_in address = {};
-		address.sin_family = AF_INET;
-		address.sin_addr = destination.getAddress();
-		address.sin_port = htons(destination.getPort());
+	struct sockaddr_storage address;
+	socklen_t address_len = make_sockaddr(destination, address);
 
-		sent = sendto(m_handle, (const char *)data, size, 0,
-				(struct sockaddr *)&address, sizeof(struct sockaddr_in));
-	}
+	int sent = sendto(m_handle, (const char *)data, size, 0,
+			(struct sockaddr *)&address, address_len);
 
 	if (sent != size)
 		throw SendFailedException("Failed to send packet");
 }
 
+size_t UDPSocket::SendBatch(const OutgoingDatagram *datagrams, size_t count)
+{
+	size_t failed = 0;
+
+#if HAVE_MMSG
+	struct mmsghdr msgs[MMSG_BATCH];
+	struct iovec iovs[MMSG_BATCH];
+	struct sockaddr_storage addresses[MMSG_BATCH];
+
+	while (count > 0 && !g_mmsg_unsupported) {
+		size_t used = 0; // datagrams handled by this round
+		size_t n = 0; // messages to send
+		for (; used < count && n < MMSG_BATCH; used++) {
+			const OutgoingDatagram &dg = datagrams[used];
+			if (INTERNET_SIMULATOR && myrand() % INTERNET_SIMULATOR_PACKET_LOSS == 0)
+				continue;
+			if (dg.destination->getFamily() != m_addr_family) {
+				failed++;
+				continue;
+			}
+
+			iovs[n].iov_base = const_cast<void *>(dg.data);
+			iovs[n].iov_len = dg.size;
+			msgs[n] = {};
+			msgs[n].msg_hdr.msg_name = &addresses[n];
+			msgs[n].msg_hdr.msg_namelen = make_sockaddr(*dg.destination, addresses[n]);
+			msgs[n].msg_hdr.msg_iov = &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			n++;
+		}
+
+		for (size_t i = 0; i < n;) {
+			int sent = -1;
+			if (!g_mmsg_unsupported) {
+				sent = sendmmsg(m_handle, &msgs[i], n - i, 0);
+				if (sent < 0 && LAST_SOCKET_ERR() == ENOSYS)
+					g_mmsg_unsupported = true;
+			}
+			if (sent > 0) {
+				i += sent;
+				continue;
+			}
+
+			// Sending stopped at this message, retry it on its own so that
+			// only this one is lost if it is at fault
+			const struct msghdr &hdr = msgs[i].msg_hdr;
+			ssize_t ret = sendto(m_handle, hdr.msg_iov->iov_base,
+					hdr.msg_iov->iov_len, 0,
+					(const struct sockaddr *)hdr.msg_name, hdr.msg_namelen);
+			if (ret != (ssize_t)hdr.msg_iov->iov_len)
+				failed++;
+			i++;
+		}
+
+		datagrams += used;
+		count -= used;
+	}
+#endif
+
+	for (size_t i = 0; i < count; i++) {
+		try {
+			Send(*datagrams[i].destination, datagrams[i].data, datagrams[i].size);
+		} catch (SendFailedException &e) {
+			failed++;
+		}
+	}
+
+	return failed;
+}
+
 int UDPSocket::Receive(Address &sender, void *data, int size)
 {
 	// Return on timeout
@@ -212,42 +310,74 @@ int UDPSocket::Receive(Address &sender, void *data, int size)
 	if (!WaitData(m_timeout_ms))
 		return -1;
 
-	size = MYMAX(size, 0);
-
-	int received;
-	if (m_addr_family == AF_INET6) {
-		struct sockaddr_in6 address;
-		memset(&address, 0, sizeof(address));
-		socklen_t address_len = sizeof(address);
-
-		received = recvfrom(m_handle, (char *)data, size, 0,
-				(struct sockaddr *)&address, &address_len);
+	return receiveNow(sender, data, size);
+}
 
-		if (received < 0)
-			return -1;
+size_t UDPSocket::ReceiveBatch(IncomingDatagram *datagrams, size_t count)
+{
+	// Return on timeout
+	assert(m_timeout_ms >= 0);
+	if (count == 0 || !WaitData(m_timeout_ms))
+		return 0;
+
+#if HAVE_MMSG
+	if (!g_mmsg_unsupported) {
+		struct mmsghdr msgs[MMSG_BATCH];
+		struct iovec iovs[MMSG_BATCH];
+		struct sockaddr_storage addresses[MMSG_BATCH];
+
+		count = MYMIN(count, MMSG_BATCH);
+		for (size_t i = 0; i < count; i++) {
+			iovs[i].iov_base = datagrams[i].data;
+			iovs[i].iov_len = MYMAX(datagrams[i].capacity, 0);
+			msgs[i] = {};
+			msgs[i].msg_hdr.msg_name = &addresses[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
-		u16 address_port = ntohs(address.sin6_port);
-		const auto *bytes = reinterpret_cast<IPv6AddressBytes*>
-			(address.sin6_addr.s6_addr);
-		sender = Address(bytes, address_port);
-	} else {
-		struct sockaddr_in address;
-		memset(&address, 0, sizeof(address));
+		// Only take what is already there
+		int received = recvmmsg(m_handle, msgs, count, MSG_DONTWAIT, nullptr);
+		if (received >= 0) {
+			for (int i = 0; i < received; i++) {
+				datagrams[i].sender = parse_sockaddr(addresses[i]);
+				datagrams[i].size = msgs[i].msg_len;
+			}
+			return received;
+		}
+		if (LAST_SOCKET_ERR() != ENOSYS)
+			return 0;
+		g_mmsg_unsupported = true;
+	}
+#endif
 
-		socklen_t address_len = sizeof(address);
+	size_t received = 0;
+	while (received < count && (received == 0 || WaitData(0))) {
+		IncomingDatagram &dg = datagrams[received];
+		dg.size = receiveNow(dg.sender, dg.data, dg.capacity);
+		if (dg.size < 0)
+			break;
+		received++;
+	}
+	return received;
+}
 
-		received = recvfrom(m_handle, (char *)data, size, 0,
-				(struct sockaddr *)&address, &address_len);
+int UDPSocket::receiveNow(Address &sender, void *data, int size)
+{
+	size = MYMAX(size, 0);
 
-		if (received < 0)
-			return -1;
+	struct sockaddr_storage address;
+	memset(&address, 0, sizeof(address));
+	socklen_t address_len = sizeof(address);
 
-		u32 address_ip = ntohl(address.sin_addr.s_addr);
-		u16 address_port = ntohs(address.sin_port);
+	int received = recvfrom(m_handle, (char *)data, size, 0,
+			(struct sockaddr *)&address, &address_len);
 
-		sender = Address(address_ip, address_port);
-	}
+	if (received < 0)
+		return -1;
 
+	sender = parse_sockaddr(address);
 	return received;
 }
 
@@ -13,6 +13,21 @@
 void sockets_init();
 void sockets_cleanup();
 
+struct OutgoingDatagram
+{
+	const Address *destination;
+	const void *data;
+	int size;
+};
+
+struct IncomingDatagram
+{
+	Address sender;
+	void *data;
+	int capacity;
+	int size; // set on receive
+};
+
 class UDPSocket
 {
 public:
@@ -24,8 +39,14 @@ class UDPSocket
 	void Bind(Address addr);
 
 	void Send(const Address &destination, const void *data, int size);
+	// Sends several datagrams with as few system calls as possible.
+	// Returns the number of datagrams that failed to send.
+	size_t SendBatch(const OutgoingDatagram *datagrams, size_t count);
 	// Returns -1 if there is no data
 	int Receive(Address &sender, void *data, int size);
+	// Waits like Receive(), then fetches up to count datagrams that are
+	// available. Returns the number of datagrams received.
+	size_t ReceiveBatch(IncomingDatagram *datagrams, size_t count);
 	void setTimeoutMs(int timeout_ms);
 	// Returns true if there is data, false if timeout occurred
 	bool WaitData(int timeout_ms);
@@ -34,6 +55,9 @@ class UDPSocket
 	int GetHandle() const { return m_handle; };
 
 private:
+	// Receives one datagram after WaitData(), returns -1 on error
+	int receiveNow(Address &sender, void *data, int size);
+
 	int m_handle = -1;
 	int m_timeout_ms = -1;
 	unsigned short m_addr_family = 0;
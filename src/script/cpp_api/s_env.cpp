@@ -10,6 +10,7 @@
 #include "mapgen/mapgen.h"
 #include "lua_api/l_env.h"
 #include "server.h"
+#include "server/tick_profiler.h"
 #include "scripting_server.h"
 #include "script/common/c_content.h"
 
@@ -132,6 +133,12 @@ void ScriptApiEnv::environment_OnGenerated(v3s16 minp, v3s16 maxp,
 
 void ScriptApiEnv::environment_Step(float dtime)
 {
+	TickProfiler *tick_profiler = getServer()->getTickProfiler();
+	if (tick_profiler) {
+		environment_StepProfiled(dtime, tick_profiler);
+		return;
+	}
+
 	SCRIPTAPI_PRECHECKHEADER
 
 	// Get core.registered_globalsteps
@@ -142,6 +149,39 @@ void ScriptApiEnv::environment_Step(float dtime)
 	runCallbacks(1, RUN_CALLBACKS_MODE_FIRST);
 }
 
+void ScriptApiEnv::environment_StepProfiled(float dtime, TickProfiler *tick_profiler)
+{
+	SCRIPTAPI_PRECHECKHEADER
+
+	// Like core.run_callbacks(), but keeping track of the time per mod
+	int error_handler = PUSH_ERROR_HANDLER(L);
+
+	lua_getglobal(L, "core");
+	lua_getfield(L, -1, "registered_globalsteps");
+	int callbacks = lua_gettop(L);
+	lua_getfield(L, -2, "callback_origins");
+	int origins = lua_gettop(L);
+
+	size_t count = lua_objlen(L, callbacks);
+	for (size_t i = 1; i <= count; i++) {
+		lua_rawgeti(L, callbacks, i);
+
+		// Not rawget, unknown origins come from the metatable
+		lua_pushvalue(L, -1);
+		lua_gettable(L, origins);
+		lua_getfield(L, -1, "mod");
+		std::string mod = lua_isstring(L, -1) ? readParam<std::string>(L, -1) : "??";
+		lua_pop(L, 2);
+		setOriginDirect(mod.c_str());
+
+		lua_pushnumber(L, dtime);
+		u64 start_us = porting::getTimeUs();
+		PCALL_RES(lua_pcall(L, 1, 0, error_handler));
+		tick_profiler->add(tick_profiler->getPhase("globalstep:" + mod),
+			porting::getTimeUs() - start_us);
+	}
+}
+
 void ScriptApiEnv::player_event(ServerActiveObject *player, const std::string &type)
 {
 	SCRIPTAPI_PRECHECKHEADER
@@ -12,6 +12,7 @@
 
 class ServerEnvironment;
 class MapBlock;
+class TickProfiler;
 struct ScriptCallbackState;
 
 class ScriptApiEnv : virtual public ScriptApiBase
@@ -51,6 +52,9 @@ class ScriptApiEnv : virtual public ScriptApiBase
 		const std::unordered_set<v3s16> &positions, float dtime_s);
 
 private:
+	// environment_Step() that records the time of each mod
+	void environment_StepProfiled(float dtime, TickProfiler *tick_profiler);
+
 	void readABMs();
 
 	void readLBMs();
@@ -8,7 +8,10 @@
 
 #include <zlib.h>
 #include <zstd.h>
+#include <zdict.h>
+#include <algorithm>
 #include <memory>
+#include <sstream>
 
 /* report a zlib or i/o error */
 static void zerr(int ret)
@@ -186,13 +189,127 @@ struct ZSTD_Deleter {
 	}
 };
 
-void compressZstd(const u8 *data, size_t data_size, std::ostream &os, int level)
+ZstdDictionary::ZstdDictionary(const std::string &data, int level) :
+	m_data(data)
+{
+	m_id = ZDICT_getDictID(m_data.data(), m_data.size());
+	if (m_id == 0)
+		throw SerializationError("ZstdDictionary: not a dictionary");
+
+	// map the levels like compress()
+	m_cdict = ZSTD_createCDict(m_data.data(), m_data.size(), level + 1);
+	m_ddict = ZSTD_createDDict(m_data.data(), m_data.size());
+	if (!m_cdict || !m_ddict) {
+		ZSTD_freeCDict(m_cdict);
+		ZSTD_freeDDict(m_ddict);
+		throw SerializationError("ZstdDictionary: failed to load");
+	}
+}
+
+ZstdDictionary::~ZstdDictionary()
+{
+	ZSTD_freeCDict(m_cdict);
+	ZSTD_freeDDict(m_ddict);
+}
+
+// Total compressed size of the samples
+static size_t compressedSize(const std::vector<const std::string *> &samples,
+		int level, const ZstdDictionary *dict)
+{
+	size_t total = 0;
+	for (const std::string *sample : samples) {
+		std::ostringstream os(std::ios_base::binary);
+		// map the levels like compress()
+		compressZstd(*sample, os, level + 1, dict);
+		total += os.str().size();
+	}
+	return total;
+}
+
+std::string trainZstdDictionary(const std::vector<std::string> &samples,
+		size_t max_size, int level)
+{
+	// Every other sample is kept back to check the dictionaries with
+	std::vector<const std::string *> train, check;
+	for (size_t i = 0; i < samples.size(); i++)
+		(i % 2 ? check : train).push_back(&samples[i]);
+
+	std::string buf;
+	std::vector<size_t> sizes;
+	for (const std::string *sample : train) {
+		buf.append(*sample);
+		sizes.push_back(sample->size());
+	}
+
+	std::vector<std::string> candidates;
+
+	// What ZDICT picks from the samples
+	std::string dict(max_size, '\0');
+	size_t ret = ZDICT_trainFromBuffer(dict.data(), dict.size(), buf.data(),
+			sizes.data(), sizes.size());
+	if (!ZDICT_isError(ret)) {
+		dict.resize(ret);
+		candidates.push_back(std::move(dict));
+	}
+
+	// ZDICT favors what most samples have in common. When most of them are
+	// trivial to compress anyway, the samples that compress worst are a
+	// better dictionary.
+	std::vector<std::pair<size_t, const std::string *>> by_size;
+	for (const std::string *sample : train)
+		by_size.emplace_back(compressedSize({sample}, level, nullptr), sample);
+	std::sort(by_size.begin(), by_size.end(), [] (auto &a, auto &b) {
+		return a.first > b.first;
+	});
+	std::string content;
+	// leave room for the header and entropy tables
+	const size_t max_content = max_size - std::min<size_t>(max_size / 4, 4096);
+	for (auto &it : by_size) {
+		if (content.size() + it.second->size() > max_content)
+			break;
+		content.append(*it.second);
+	}
+	if (!content.empty()) {
+		ZDICT_params_t params{};
+		params.compressionLevel = level + 1;
+		dict.assign(max_size, '\0');
+		ret = ZDICT_finalizeDictionary(dict.data(), dict.size(), content.data(),
+				content.size(), buf.data(), sizes.data(), sizes.size(), params);
+		if (!ZDICT_isError(ret)) {
+			dict.resize(ret);
+			candidates.push_back(std::move(dict));
+		}
+	}
+
+	// Anything less is not worth having to get the dictionary first
+	std::string best;
+	size_t best_size = compressedSize(check, level, nullptr) * 9 / 10;
+	for (std::string &candidate : candidates) {
+		size_t size;
+		try {
+			ZstdDictionary zdict(candidate, level);
+			size = compressedSize(check, level, &zdict);
+		} catch (SerializationError &e) {
+			continue;
+		}
+		if (size < best_size) {
+			best_size = size;
+			best = std::move(candidate);
+		}
+	}
+	return best;
+}
+
+void compressZstd(const u8 *data, size_t data_size, std::ostream &os, int level,
+		const ZstdDictionary *dict)
 {
 	// reusing the context is recommended for performance
 	// it will be destroyed when the thread ends
 	thread_local std::unique_ptr<ZSTD_CStream, ZSTD_Deleter> stream(ZSTD_createCStream());
 
 	ZSTD_initCStream(stream.get(), level);
+	if (dict)
+		ZSTD_CCtx_refCDict(stream.get(), dict->getCDict());
 
 	const size_t bufsize = 16384;
 	char output_buffer[bufsize];
@@ -227,7 +344,7 @@ void compressZstd(const u8 *data, size_t data_size, std::ostream &os, int level)
 
 }
 
-void decompressZstd(std::istream &is, std::ostream &os)
+void decompressZstd(std::istream &is, std::ostream &os, const ZstdDictionary *dict)
 {
 	// reusing the context is recommended for performance
 	// it will be destroyed when the thread ends
@@ -241,6 +358,7 @@ void decompressZstd(std::istream &is, std::ostream &os)
 
 	ZSTD_outBuffer output = { output_buffer, bufsize, 0 };
 	ZSTD_inBuffer input = { input_buffer, 0, 0 };
+	bool first_read = true;
 	size_t ret;
 	do
 	{
@@ -250,6 +368,17 @@ void decompressZstd(std::istream &is, std::ostream &os)
 			input.pos = 0;
 			if (input.size == 0)
 				throw SerializationError("decompressZstd: data ended too early");
+
+			// The frame header tells which dictionary is needed
+			if (first_read) {
+				first_read = false;
+				u32 dict_id = ZSTD_getDictID_fromFrame(input_buffer, input.size);
+				if (dict_id != 0) {
+					if (!dict || dict->getId() != dict_id)
+						throw SerializationError("decompressZstd: unknown dictionary");
+					ZSTD_DCtx_refDDict(stream.get(), dict->getDDict());
+				}
+			}
 		}
 
 		ret = ZSTD_decompressStream(stream.get(), &output, &input);
@@ -272,12 +401,13 @@ void decompressZstd(std::istream &is, std::ostream &os)
 	}
 }
 
-void compress(const u8 *data, u32 size, std::ostream &os, u8 version, int level)
+void compress(const u8 *data, u32 size, std::ostream &os, u8 version, int level,
+		const ZstdDictionary *dict)
 {
 	if(version >= 29)
 	{
 		// map the zlib levels [0,9] to [1,10]. -1 becomes 0 which indicates the default (currently 3)
-		compressZstd(data, size, os, level + 1);
+		compressZstd(data, size, os, level + 1, dict);
 		return;
 	}
 
@@ -322,11 +452,12 @@ void compress(const u8 *data, u32 size, std::ostream &os, u8 version, int level)
 	os.write((char*)&current_byte, 1);
 }
 
-void decompress(std::istream &is, std::ostream &os, u8 version)
+void decompress(std::istream &is, std::ostream &os, u8 version,
+		const ZstdDictionary *dict)
 {
 	if(version >= 29)
 	{
-		decompressZstd(is, os);
+		decompressZstd(is, os, dict);
 		return;
 	}
 
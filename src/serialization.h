@@ -6,8 +6,11 @@
 
 #include "irrlichttypes.h"
 #include "exceptions.h"
+#include "util/basic_macros.h"
 #include <iostream>
+#include <string>
 #include <string_view>
+#include <vector>
 
 /*
 	Map format serialization version
@@ -78,6 +81,46 @@ inline bool ser_ver_supported_write(s32 v)
 	Compression functions
 */
 
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+/*
+	A zstd dictionary makes small data that is similar to the data it was
+	trained from compress much better. Compressed data records the id of the
+	dictionary it needs, so it can be decompressed without knowing whether
+	a dictionary was used.
+*/
+class ZstdDictionary
+{
+public:
+	// level is the compression level as for compress(), it can't be
+	// changed later.
+	// Throws SerializationError if data is not a zstd dictionary.
+	ZstdDictionary(const std::string &data, int level = -1);
+	~ZstdDictionary();
+
+	DISABLE_CLASS_COPY(ZstdDictionary)
+
+	u32 getId() const { return m_id; }
+	const std::string &getData() const { return m_data; }
+
+	const ZSTD_CDict_s *getCDict() const { return m_cdict; }
+	const ZSTD_DDict_s *getDDict() const { return m_ddict; }
+
+private:
+	std::string m_data;
+	u32 m_id;
+	ZSTD_CDict_s *m_cdict = nullptr;
+	ZSTD_DDict_s *m_ddict = nullptr;
+};
+
+// Returns a dictionary of at most max_size bytes for data like the samples,
+// which is compressed with level as for compress().
+// Returns an empty string if no dictionary makes such data at least 10%
+// smaller.
+std::string trainZstdDictionary(const std::vector<std::string> &samples,
+		size_t max_size, int level = -1);
+
 void compressZlib(const u8 *data, size_t data_size, std::ostream &os, int level = -1);
 inline void compressZlib(std::string_view data, std::ostream &os, int level = -1)
 {
@@ -85,17 +128,26 @@ inline void compressZlib(std::string_view data, std::ostream &os, int level = -1
 }
 void decompressZlib(std::istream &is, std::ostream &os, size_t limit = 0);
 
-void compressZstd(const u8 *data, size_t data_size, std::ostream &os, int level = 0);
-inline void compressZstd(std::string_view data, std::ostream &os, int level = 0)
+// level is ignored if a dictionary is given
+void compressZstd(const u8 *data, size_t data_size, std::ostream &os, int level = 0,
+		const ZstdDictionary *dict = nullptr);
+inline void compressZstd(std::string_view data, std::ostream &os, int level = 0,
+		const ZstdDictionary *dict = nullptr)
 {
-	compressZstd(reinterpret_cast<const u8*>(data.data()), data.size(), os, level);
+	compressZstd(reinterpret_cast<const u8*>(data.data()), data.size(), os, level, dict);
 }
-void decompressZstd(std::istream &is, std::ostream &os);
+// dict is only used if the data needs it
+void decompressZstd(std::istream &is, std::ostream &os,
+		const ZstdDictionary *dict = nullptr);
 
 // These choose between zstd, zlib and a self-made one according to version
-void compress(const u8 *data, u32 size, std::ostream &os, u8 version, int level = -1);
-inline void compress(std::string_view data, std::ostream &os, u8 version, int level = -1)
+// The dictionary is only used with zstd.
+void compress(const u8 *data, u32 size, std::ostream &os, u8 version, int level = -1,
+		const ZstdDictionary *dict = nullptr);
+inline void compress(std::string_view data, std::ostream &os, u8 version, int level = -1,
+		const ZstdDictionary *dict = nullptr)
 {
-	compress(reinterpret_cast<const u8*>(data.data()), data.size(), os, version, level);
+	compress(reinterpret_cast<const u8*>(data.data()), data.size(), os, version, level, dict);
 }
-void decompress(std::istream &is, std::ostream &os, u8 version);
+void decompress(std::istream &is, std::ostream &os, u8 version,
+		const ZstdDictionary *dict = nullptr);
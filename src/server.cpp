@@ -53,6 +53,9 @@
 #include "remoteplayer.h"
 #include "server/player_sao.h"
 #include "server/serverinventorymgr.h"
+#include "server/block_sender.h"
+#include "server/serialized_block_cache.h"
+#include "server/tick_profiler.h"
 #include "translation.h"
 #include "database/database-sqlite3.h"
 #if USE_POSTGRESQL
@@ -327,6 +330,18 @@ Server::Server(
 
 	m_lag_gauge->set(g_settings->getFloat("dedicated_server_step"));
 
+	if (g_settings->getBool("profiler_tick_phases"))
+		m_tick_profiler = std::make_unique<TickProfiler>(m_metrics_backend.get());
+
+	if (u32 cache_size = g_settings->getU32("block_send_cache_size"))
+		m_block_cache = std::make_unique<SerializedBlockCache>((size_t)cache_size << 20);
+	if (u16 threads = g_settings->getU16("block_send_threads")) {
+		m_block_sender = std::make_unique<AsyncBlockSender>(&m_clients,
+			m_block_cache.get(),
+			rangelim(g_settings->getS16("map_compression_level_net"), -1, 9),
+			threads);
+	}
+
 	m_path_mod_data = porting::path_user + DIR_DELIM "mod_data";
 	if (!fs::CreateDir(m_path_mod_data))
 		throw ServerError("Failed to create mod data dir");
@@ -346,6 +361,9 @@ Server::~Server()
 		delete m_thread;
 	}
 
+	// Finish sending blocks
+	m_block_sender.reset();
+
 	// Stop all emerge activity and finish off mapgen callbacks. Do this before
 	// shutdown callbacks since there may be state that is finalized in a
 	// callback.
@@ -555,6 +573,8 @@ void Server::init()
 
 	m_env->loadMeta();
 
+	loadBlockDictionary();
+
 	// Those settings can be overwritten in world.mt, they are
 	// intended to be cached after environment loading.
 	m_liquid_transform_every = g_settings->getFloat("liquid_update");
@@ -637,8 +657,12 @@ void Server::AsyncRunStep(float dtime, bool initial_step)
 		return;
 	}
 
+	const u64 step_start_us = porting::getTimeUs();
+	TickProfiler *tick_profiler = m_tick_profiler.get();
+
 	{
 		// Send blocks to clients
+		TickPhaseTimer tpt(tick_profiler, TP_SEND_BLOCKS);
 		SendBlocks(dtime);
 	}
 
@@ -710,6 +734,7 @@ void Server::AsyncRunStep(float dtime, bool initial_step)
 		EnvAutoLock lock(this);
 		// Run Map's timers and unload unused data
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
+		TickPhaseTimer tpt(tick_profiler, TP_MAP_UNLOAD);
 		m_env->getMap().timerUpdate(map_timer_and_unload_dtime,
 			std::max(g_settings->getFloat("server_unload_unused_data_timeout"), 0.0f),
 			-1);
@@ -749,6 +774,7 @@ void Server::AsyncRunStep(float dtime, bool initial_step)
 		EnvAutoLock lock(this);
 
 		ScopeProfiler sp(g_profiler, "Server: liquid transform");
+		TickPhaseTimer tpt(tick_profiler, TP_LIQUIDS);
 
 		std::map<v3s16, MapBlock*> modified_blocks;
 		m_env->getServerMap().transformLiquids(modified_blocks, m_env);
@@ -854,6 +880,7 @@ void Server::AsyncRunStep(float dtime, bool initial_step)
 	{
 		EnvAutoLock envlock(this);
 		ScopeProfiler sp(g_profiler, "Server: send SAO messages");
+		TickPhaseTimer tpt(tick_profiler, TP_OBJECT_MESSAGES);
 
 		// Key = object id
 		// Value = data sent by object
@@ -955,6 +982,7 @@ void Server::AsyncRunStep(float dtime, bool initial_step)
 	{
 		// We will be accessing the environment
 		EnvAutoLock lock(this);
+		TickPhaseTimer tpt(tick_profiler, TP_MAP_EDIT_EVENTS);
 
 		// Single change sending is disabled if queue size is big
 		bool disable_single_change_sending = false;
@@ -978,6 +1006,10 @@ void Server::AsyncRunStep(float dtime, bool initial_step)
 			// for them.
 			std::unordered_set<u16> far_players;
 
+			// The change must not arrive before the block it applies to
+			if (m_block_sender && event->type != MEET_OTHER)
+				m_block_sender->waitFor(getNodeBlockPos(event->p));
+
 			switch (event->type) {
 			case MEET_ADDNODE:
 			case MEET_SWAPNODE:
@@ -1006,7 +1038,7 @@ void Server::AsyncRunStep(float dtime, bool initial_step)
 			}
 			case MEET_OTHER:
 				prof.add("MEET_OTHER", 1);
-				m_clients.markBlocksNotSent(event->modified_blocks);
+				sendBlockChanges(event->modified_blocks);
 				break;
 			default:
 				prof.add("unknown", 1);
@@ -1064,6 +1096,7 @@ void Server::AsyncRunStep(float dtime, bool initial_step)
 			EnvAutoLock lock(this);
 
 			ScopeProfiler sp(g_profiler, "Server: map saving (sum)");
+			TickPhaseTimer tpt(tick_profiler, TP_MAP_SAVE);
 
 			// Save ban file
 			if (m_banmanager->isModified()) {
@@ -1082,6 +1115,9 @@ void Server::AsyncRunStep(float dtime, bool initial_step)
 	}
 
 	m_shutdown_state.tick(dtime, this);
+
+	if (tick_profiler)
+		tick_profiler->finishStep(porting::getTimeUs() - step_start_us);
 }
 
 void Server::Receive(float min_time)
@@ -2374,6 +2410,132 @@ void Server::sendNodeChangePkt(NetworkPacket &pkt, v3s16 block_pos,
 	}
 }
 
+// More changed nodes than this are sent as a whole block
+#define BLOCK_DELTA_MAX_NODES 256
+
+static inline v3s16 nodeIndexToPos(u16 i)
+{
+	return v3s16(i % MAP_BLOCKSIZE, i / MAP_BLOCKSIZE % MAP_BLOCKSIZE,
+		i / (MAP_BLOCKSIZE * MAP_BLOCKSIZE));
+}
+
+static void makeBlockDeltaPkt(NetworkPacket &pkt, MapBlock *block,
+		const std::vector<u16> &changed)
+{
+	u8 flags = 0;
+	if (block->getIsUnderground())
+		flags |= 0x01;
+	if (!block->isAir())
+		flags |= 0x02;
+	if (!block->isGenerated())
+		flags |= 0x08;
+
+	// Group consecutive indices into runs
+	std::vector<std::pair<u16, u16>> runs;
+	for (u16 i : changed) {
+		if (!runs.empty() && runs.back().first + runs.back().second == i)
+			runs.back().second++;
+		else
+			runs.emplace_back(i, 1);
+	}
+
+	pkt << block->getPos() << flags << block->getLightingComplete()
+		<< (u16)runs.size();
+	for (auto [first, count] : runs) {
+		pkt << first << count;
+		for (u16 i = first; i < first + count; i++) {
+			MapNode n = block->getNodeNoCheck(nodeIndexToPos(i));
+			pkt << n.param0 << n.param1 << n.param2;
+		}
+	}
+}
+
+void Server::sendBlockChanges(const std::vector<v3s16> &blocks,
+		float far_d_nodes)
+{
+	float maxd = far_d_nodes * BS;
+	Map &map = m_env->getMap();
+	std::vector<session_t> clients = m_clients.getClientIDs();
+	ClientInterface::AutoLock clientlock(m_clients);
+
+	std::vector<u16> changed;
+	// Clients that had the same version of a block share the packet
+	std::unordered_map<u64, std::unique_ptr<NetworkPacket>> pkts;
+
+	for (v3s16 blockpos : blocks) {
+		MapBlock *block = map.getBlockNoCreateNoEx(blockpos);
+		const v3f block_center = intToFloat(blockpos * MAP_BLOCKSIZE, BS) +
+				v3f(MAP_BLOCKSIZE * BS / 2);
+		bool waited = false;
+		pkts.clear();
+
+		for (session_t client_id : clients) {
+			RemoteClient *client = m_clients.lockedGetClientNoEx(client_id);
+			if (!client)
+				continue;
+
+			RemotePlayer *player = m_env->getPlayer(client_id);
+			PlayerSAO *sao = player ? player->getPlayerSAO() : nullptr;
+
+			// If player is far away, only set modified blocks not sent.
+			// This also wakes up the block sending of an idle client.
+			const u64 version = client->getBlockVersion(blockpos);
+			if (version == 0 || !block || client->net_proto_version < 48 ||
+					(sao && sao->getBasePosition().getDistanceFrom(
+						block_center) > maxd)) {
+				client->SetBlockNotSent(blockpos);
+				continue;
+			}
+			if (version == block->getContentVersion())
+				continue;
+
+			auto it = pkts.find(version);
+			if (it == pkts.end()) {
+				std::unique_ptr<NetworkPacket> pkt;
+				changed.clear();
+				if (block->getChangedNodes(version, changed) &&
+						changed.size() <= BLOCK_DELTA_MAX_NODES &&
+						std::none_of(changed.begin(), changed.end(), [&] (u16 i) {
+							return block->m_node_metadata.get(nodeIndexToPos(i));
+						})) {
+					pkt = std::make_unique<NetworkPacket>(TOCLIENT_BLOCK_DELTA,
+						6 + 1 + 2 + 2 + changed.size() * (4 + 4));
+					makeBlockDeltaPkt(*pkt, block, changed);
+				}
+				// nullptr means a whole block must be sent
+				it = pkts.emplace(version, std::move(pkt)).first;
+			}
+
+			if (!it->second) {
+				client->SetBlockNotSent(blockpos);
+				continue;
+			}
+
+			// The changes must not arrive before the block they apply to
+			if (m_block_sender && !waited) {
+				m_block_sender->waitFor(blockpos);
+				waited = true;
+			}
+			Send(client_id, it->second.get());
+			client->setBlockVersion(blockpos, block->getContentVersion());
+		}
+
+		// Changes older than what every client has are of no use anymore
+		if (block) {
+			u64 oldest = U64_MAX;
+			for (auto &it : m_clients.getClientList()) {
+				const u64 version = it.second->getBlockVersion(blockpos);
+				if (version != 0)
+					oldest = std::min(oldest, version);
+			}
+			if (oldest == U64_MAX)
+				block->stopNodeChangeLog();
+			else
+				block->trimNodeChangeLog(oldest);
+		}
+	}
+}
+
 void Server::sendMetadataChanged(const std::unordered_set<v3s16> &positions, float far_d_nodes)
 {
 	NodeMetadataList meta_updates_list(false);
@@ -2427,34 +2589,38 @@ void Server::sendMetadataChanged(const std::unordered_set<v3s16> &positions, flo
 }
 
 void Server::SendBlockNoLock(session_t peer_id, MapBlock *block, u8 ver,
-		u16 net_proto_version, SerializedBlockCache *cache)
+		u16 net_proto_version, const ZstdDictionary *dict,
+		SerializedBlockCache *cache, std::shared_ptr<const std::string> data)
 {
 	thread_local const int net_compression_level = rangelim(g_settings->getS16("map_compression_level_net"), -1, 9);
-	std::string s, *sptr = nullptr;
 
-	if (cache) {
-		auto it = cache->find({block->getPos(), ver});
-		if (it != cache->end())
-			sptr = &it->second;
-	}
+	if (!data && cache)
+		data = cache->get(block->getPos(), ver, dict != nullptr,
+				block->getContentVersion());
 
 	// Serialize the block in the right format
-	if (!sptr) {
+	if (!data) {
 		std::ostringstream os(std::ios_base::binary);
-		block->serialize(os, ver, false, net_compression_level);
+		if (dict && ver >= 29) {
+			std::ostringstream os_raw(std::ios_base::binary);
+			block->serializeUncompressed(os_raw, ver, false);
+			compress(os_raw.str(), os, ver, net_compression_level, dict);
+		} else {
+			block->serialize(os, ver, false, net_compression_level);
+		}
 		block->serializeNetworkSpecific(os);
-		s = os.str();
-		sptr = &s;
+		data = std::make_shared<const std::string>(os.str());
+
+		// Store away in cache
+		if (cache)
+			cache->put(block->getPos(), ver, dict != nullptr,
+				block->getContentVersion(), data);
 	}
 
-	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + sptr->size(), peer_id);
+	NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + data->size(), peer_id);
 	pkt << block->getPos();
-	pkt.putRawString(*sptr);
+	pkt.putRawString(*data);
 	Send(&pkt);
-
-	// Store away in cache
-	if (cache && sptr == &s)
-		(*cache)[{block->getPos(), ver}] = std::move(s);
 }
 
 void Server::SendBlocks(float dtime)
@@ -2499,12 +2665,21 @@ void Server::SendBlocks(float dtime)
 	ScopeProfiler sp(g_profiler, "Server::SendBlocks(): Send to clients");
 	Map &map = m_env->getMap();
 
-	SerializedBlockCache cache, *cache_ptr = nullptr;
-	if (unique_clients > 1) {
+	SerializedBlockCache cache(SIZE_MAX), *cache_ptr = m_block_cache.get();
+	if (!cache_ptr && unique_clients > 1) {
 		// caching is pointless with a single client
 		cache_ptr = &cache;
 	}
 
+	// Blocks for m_block_sender, by position, serialization version and
+	// whether the dictionary is used
+	struct SendJob {
+		u64 content_version;
+		std::string raw;
+		std::vector<session_t> peer_ids;
+	};
+	std::map<std::tuple<v3s16, u8, bool>, SendJob> jobs;
+
 	for (const PrioritySortedBlockTransfer &block_to_send : queue) {
 		if (total_sending >= max_blocks_to_send)
 			break;
@@ -2518,12 +2693,41 @@ void Server::SendBlocks(float dtime)
 		if (!client)
 			continue;
 
-		SendBlockNoLock(block_to_send.peer_id, block, client->serialization_version,
-				client->net_proto_version, cache_ptr);
+		const u8 ver = client->serialization_version;
+		const ZstdDictionary *dict = client->use_block_dictionary ?
+				m_block_dictionary.get() : nullptr;
+		std::shared_ptr<const std::string> data;
+		if (cache_ptr) {
+			data = cache_ptr->get(block->getPos(), ver, dict != nullptr,
+					block->getContentVersion());
+		}
+		if (m_block_sender && ver >= 29 && !data) {
+			// Only copy the contents here, compressing happens without
+			// holding the environment lock
+			auto [it, is_new] = jobs.try_emplace({block->getPos(), ver, dict != nullptr});
+			SendJob &job = it->second;
+			if (is_new) {
+				job.content_version = block->getContentVersion();
+				std::ostringstream os(std::ios_base::binary);
+				block->serializeUncompressed(os, ver, false);
+				job.raw = os.str();
+			}
+			job.peer_ids.push_back(block_to_send.peer_id);
+		} else {
+			SendBlockNoLock(block_to_send.peer_id, block, ver,
+					client->net_proto_version, dict, cache_ptr, std::move(data));
+		}
 
-		client->SentBlock(block_to_send.pos);
+		client->SentBlock(block_to_send.pos, block->getContentVersion());
 		total_sending++;
 	}
+
+	for (auto &it : jobs) {
+		SendJob &job = it.second;
+		auto [pos, ver, use_dict] = it.first;
+		m_block_sender->push(pos, ver, use_dict ? m_block_dictionary : nullptr,
+				job.content_version, std::move(job.raw), std::move(job.peer_ids));
+	}
 }
 
 bool Server::SendBlock(session_t peer_id, const v3s16 &blockpos)
@@ -2536,8 +2740,12 @@ bool Server::SendBlock(session_t peer_id, const v3s16 &blockpos)
 	RemoteClient *client = m_clients.lockedGetClientNoEx(peer_id, CS_Active);
 	if (!client || client->isBlockSent(blockpos))
 		return false;
+	if (m_block_sender)
+		m_block_sender->waitFor(blockpos);
 	SendBlockNoLock(peer_id, block, client->serialization_version,
-			client->net_proto_version);
+			client->net_proto_version,
+			client->use_block_dictionary ? m_block_dictionary.get() : nullptr,
+			m_block_cache.get());
 
 	return true;
 }
@@ -2813,6 +3021,71 @@ void Server::stepPendingDynMediaCallbacks(float dtime)
 	}
 }
 
+// Number of stored blocks the block dictionary is trained from
+#define BLOCK_DICTIONARY_SAMPLES 1000
+#define BLOCK_DICTIONARY_MAX_SIZE (128 * 1024)
+
+void Server::loadBlockDictionary()
+{
+	if (!g_settings->getBool("map_compression_dictionary_net"))
+		return;
+
+	const std::string path = m_path_world + DIR_DELIM "block_dictionary.bin";
+	const int level = rangelim(g_settings->getS16("map_compression_level_net"), -1, 9);
+	std::string data;
+	if (!fs::ReadFile(path, data)) {
+		std::vector<std::string> samples;
+		m_env->getServerMap().getBlockSamples(BLOCK_DICTIONARY_SAMPLES,
+				SER_FMT_VER_HIGHEST_WRITE, samples);
+		// A new world has nothing to learn from yet, try again next time
+		if (samples.size() < BLOCK_DICTIONARY_SAMPLES / 10) {
+			infostream << "Server: Not enough blocks to train the block "
+					"dictionary" << std::endl;
+			return;
+		}
+
+		data = trainZstdDictionary(samples, BLOCK_DICTIONARY_MAX_SIZE, level);
+		// An empty file remembers the failure, reading the samples is slow
+		if (!fs::safeWriteToFile(path, data)) {
+			warningstream << "Server: Failed to save the block dictionary to \""
+					<< path << "\"" << std::endl;
+		}
+		if (data.empty()) {
+			infostream << "Server: No block dictionary makes the blocks of "
+					"this world smaller" << std::endl;
+			return;
+		}
+		actionstream << "Server: Trained the block dictionary from "
+				<< samples.size() << " blocks" << std::endl;
+	}
+
+	if (data.empty()) {
+		infostream << "Server: Not using a block dictionary, \"" << path
+				<< "\" is empty" << std::endl;
+		return;
+	}
+
+	try {
+		m_block_dictionary = std::make_shared<ZstdDictionary>(data, level);
+	} catch (SerializationError &e) {
+		warningstream << "Server: Invalid block dictionary \"" << path
+				<< "\": " << e.what() << std::endl;
+		return;
+	}
+	m_block_dictionary_digest = hashing::sha1(data);
+}
+
+void Server::SendBlockDictionary(session_t peer_id, bool with_data)
+{
+	const std::string &data = m_block_dictionary->getData();
+	NetworkPacket pkt(TOCLIENT_BLOCK_DICTIONARY,
+			2 + m_block_dictionary_digest.size() + 4 + (with_data ? data.size() : 0),
+			peer_id);
+	pkt << m_block_dictionary_digest;
+	pkt.putLongString(with_data ? std::string_view(data) : std::string_view());
+	Send(&pkt);
+}
+
 void Server::SendMinimapModes(session_t peer_id,
 		std::vector<MinimapMode> &modes, size_t wanted_mode)
 {
@@ -4095,6 +4368,11 @@ void dedicated_server_loop(Server &server, bool &kill)
 				infostream << "Profiler:" << std::endl;
 				g_profiler->print(infostream);
 				g_profiler->clear();
+				if (TickProfiler *tick_profiler = server.getTickProfiler()) {
+					infostream << "Server step phases:" << std::endl;
+					tick_profiler->print(infostream);
+					tick_profiler->reset();
+				}
 			}
 		}
 	}
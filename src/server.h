@@ -51,6 +51,10 @@ struct PlayerHPChangeReason;
 class IRollbackManager;
 struct RollbackAction;
 class EmergeManager;
+class TickProfiler;
+class SerializedBlockCache;
+class AsyncBlockSender;
+class ZstdDictionary;
 class ServerScripting;
 class ServerEnvironment;
 struct SoundSpec;
@@ -231,6 +235,7 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void handleCommand_SrpBytesM(NetworkPacket* pkt);
 	void handleCommand_HaveMedia(NetworkPacket *pkt);
 	void handleCommand_UpdateClientInfo(NetworkPacket *pkt);
+	void handleCommand_BlockDictionary(NetworkPacket *pkt);
 
 	void ProcessData(NetworkPacket *pkt);
 
@@ -321,6 +326,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	IRollbackManager *getRollbackManager() { return m_rollback; }
 	virtual EmergeManager *getEmergeManager() { return m_emerge.get(); }
 	virtual ModStorageDatabase *getModStorageDatabase() { return m_mod_storage_database; }
+	// Null unless profiler_tick_phases is enabled. Not under envlock.
+	TickProfiler *getTickProfiler() { return m_tick_profiler.get(); }
 
 	IWritableItemDefManager* getWritableItemDefManager();
 	NodeDefManager* getWritableNodeDefManager();
@@ -504,15 +511,6 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 		std::unordered_set<session_t> waiting_players;
 	};
 
-	// The standard library does not implement std::hash for pairs so we have this:
-	struct SBCHash {
-		size_t operator() (const std::pair<v3s16, u16> &p) const {
-			return std::hash<v3s16>()(p.first) ^ p.second;
-		}
-	};
-
-	typedef std::unordered_map<std::pair<v3s16, u16>, std::string, SBCHash> SerializedBlockCache;
-
 	void init();
 
 	void SendMovement(session_t peer_id);
@@ -566,13 +564,24 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void sendNodeChangePkt(NetworkPacket &pkt, v3s16 block_pos,
 			v3f p, float far_d_nodes, std::unordered_set<u16> *far_players);
 
+	// Sends the nodes of the blocks that changed since each client got
+	// them, or has the blocks sent again if that isn't possible or the
+	// client is far away
+	void sendBlockChanges(const std::vector<v3s16> &blocks,
+			float far_d_nodes = 100);
+
 	void sendMetadataChanged(const std::unordered_set<v3s16> &positions,
 			float far_d_nodes = 100);
 
 	// Environment and Connection must be locked when called
-	// `cache` may only be very short lived! (invalidation not handeled)
+	// `cache` entries are tied to the content version, so outdated ones are
+	// never sent
+	// `dict` is the block dictionary if the client has it, or null
+	// `data` is the serialized block if the caller already looked it up
 	void SendBlockNoLock(session_t peer_id, MapBlock *block, u8 ver,
-		u16 net_proto_version, SerializedBlockCache *cache = nullptr);
+		u16 net_proto_version, const ZstdDictionary *dict,
+		SerializedBlockCache *cache = nullptr,
+		std::shared_ptr<const std::string> data = nullptr);
 
 	// Sends blocks to clients (locks env and con on its own)
 	void SendBlocks(float dtime);
@@ -585,6 +594,11 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			const std::unordered_set<std::string> &tosend);
 	void stepPendingDynMediaCallbacks(float dtime);
 
+	// Loads the block dictionary of the world, or trains it if there is none
+	void loadBlockDictionary();
+	// Announces the block dictionary, or sends it with with_data
+	void SendBlockDictionary(session_t peer_id, bool with_data);
+
 	// Adds a ParticleSpawner on peer with peer_id (PEER_ID_INEXISTENT == all)
 	void SendAddParticleSpawner(session_t peer_id, u16 protocol_version,
 		const ParticleSpawnerParameters &p, u16 attached_id, u32 id);
@@ -787,6 +801,17 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	MetricCounterPtr m_packet_recv_counter;
 	MetricCounterPtr m_packet_recv_processed_counter;
 	MetricCounterPtr m_map_edit_event_counter;
+
+	std::unique_ptr<TickProfiler> m_tick_profiler;
+
+	// Blocks serialized for sending, may be null
+	std::unique_ptr<SerializedBlockCache> m_block_cache;
+	// Compresses blocks for sending in the background, may be null
+	std::unique_ptr<AsyncBlockSender> m_block_sender;
+	// Makes blocks sent to clients smaller, may be null
+	std::shared_ptr<const ZstdDictionary> m_block_dictionary;
+	// SHA1 digest of the dictionary
+	std::string m_block_dictionary_digest;
 };
 
 /*
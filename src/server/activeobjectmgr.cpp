@@ -2,6 +2,8 @@
 // SPDX-License-Identifier: LGPL-2.1-or-later
 // Copyright (C) 2010-2018 nerzhul, Loic BLOT <loic.blot@unix-experience.fr>
 
+#include <algorithm>
+#include <cmath>
 #include <log.h>
 #include "mapblock.h"
 #include "profiler.h"
@@ -19,12 +21,22 @@ ActiveObjectMgr::~ActiveObjectMgr()
 	}
 }
 
+void ActiveObjectMgr::clear()
+{
+	// on_destruct could add new objects so this has to be a loop
+	do {
+		clearIf([] (ServerActiveObject *, u16) { return true; });
+	} while (!m_active_objects.empty());
+}
+
 void ActiveObjectMgr::clearIf(const std::function<bool(ServerActiveObject *, u16)> &cb)
 {
 	for (auto &it : m_active_objects.iter()) {
 		if (!it.second)
 			continue;
 		if (cb(it.second.get(), it.first)) {
+			m_spatial_map.remove(it.second.get(), it.second->getBasePosition());
+			m_player_ids.erase(it.first);
 			// Remove reference from m_active_objects
 			m_active_objects.remove(it.first);
 		}
@@ -77,6 +89,9 @@ bool ActiveObjectMgr::registerObject(std::unique_ptr<ServerActiveObject> obj)
 	}
 
 	auto obj_id = obj->getId();
+	m_spatial_map.insert(obj.get(), obj->getBasePosition());
+	if (obj->getType() == ACTIVEOBJECT_TYPE_PLAYER)
+		m_player_ids.insert(obj_id);
 	m_active_objects.put(obj_id, std::move(obj));
 
 	auto new_size = m_active_objects.size();
@@ -95,6 +110,11 @@ void ActiveObjectMgr::removeObject(u16 id)
 	verbosestream << "Server::ActiveObjectMgr::removeObject(): "
 			<< "id=" << id << std::endl;
 
+	if (ServerActiveObject *obj = getActiveObject(id)) {
+		m_spatial_map.remove(obj, obj->getBasePosition());
+		m_player_ids.erase(id);
+	}
+
 	// this will take the object out of the map and then destruct it
 	bool ok = m_active_objects.remove(id);
 	if (!ok) {
@@ -113,39 +133,71 @@ void ActiveObjectMgr::invalidateActiveObjectObserverCaches()
 	}
 }
 
+void ActiveObjectMgr::updateObjectPosition(ServerActiveObject *obj,
+		const v3f &old_pos)
+{
+	m_spatial_map.updatePosition(obj, old_pos, obj->getBasePosition());
+}
+
+template <typename F>
+void ActiveObjectMgr::forEachObjectInArea(const aabb3f &box, F &&cb)
+{
+	// Visiting the cells would be slower than just going through the objects.
+	// Note that this visits objects outside of the box too.
+	if (m_spatial_map.getCellCount(box) > m_spatial_map.size()) {
+		for (auto &ao_it : m_active_objects.iter()) {
+			if (ao_it.second)
+				cb(ao_it.first, ao_it.second.get());
+		}
+		return;
+	}
+
+	// Collect the ids first: the callback may run Lua code that moves,
+	// adds or removes objects.
+	std::vector<u16> ids;
+	m_spatial_map.forEachInArea(box, [&] (ServerActiveObject *obj) {
+		if (box.isPointInside(obj->getBasePosition()))
+			ids.push_back(obj->getId());
+	});
+	// Keep the order the same as when iterating m_active_objects
+	std::sort(ids.begin(), ids.end());
+
+	for (u16 id : ids) {
+		if (ServerActiveObject *obj = getActiveObject(id))
+			cb(id, obj);
+	}
+}
+
 void ActiveObjectMgr::getObjectsInsideRadius(const v3f &pos, float radius,
 		std::vector<ServerActiveObject *> &result,
 		std::function<bool(ServerActiveObject *obj)> include_obj_cb)
 {
 	float r2 = radius * radius;
-	for (auto &activeObject : m_active_objects.iter()) {
-		ServerActiveObject *obj = activeObject.second.get();
-		if (!obj)
-			continue;
+	// Negative radii are treated like positive ones by the distance check
+	const float r = std::fabs(radius);
+	aabb3f box(pos - r, pos + r);
+	forEachObjectInArea(box, [&] (u16 id, ServerActiveObject *obj) {
 		const v3f &objectpos = obj->getBasePosition();
 		if (objectpos.getDistanceFromSQ(pos) > r2)
-			continue;
+			return;
 
 		if (!include_obj_cb || include_obj_cb(obj))
 			result.push_back(obj);
-	}
+	});
 }
 
 void ActiveObjectMgr::getObjectsInArea(const aabb3f &box,
 		std::vector<ServerActiveObject *> &result,
 		std::function<bool(ServerActiveObject *obj)> include_obj_cb)
 {
-	for (auto &activeObject : m_active_objects.iter()) {
-		ServerActiveObject *obj = activeObject.second.get();
-		if (!obj)
-			continue;
+	forEachObjectInArea(box, [&] (u16 id, ServerActiveObject *obj) {
 		const v3f &objectpos = obj->getBasePosition();
 		if (!box.isPointInside(objectpos))
-			continue;
+			return;
 
 		if (!include_obj_cb || include_obj_cb(obj))
 			result.push_back(obj);
-	}
+	});
 }
 
 void ActiveObjectMgr::getAddedActiveObjectsAroundPos(
@@ -155,41 +207,55 @@ void ActiveObjectMgr::getAddedActiveObjectsAroundPos(
 		std::vector<u16> &added_objects)
 {
 	/*
-		Go through the object list,
+		Go through the objects near the player (and all players if
+		player_radius is 0),
 		- discard removed/deactivated objects,
 		- discard objects that are too far away,
 		- discard objects that are found in current_objects,
 		- discard objects that are not observed by the player.
 		- add remaining objects to added_objects
 	*/
-	for (auto &ao_it : m_active_objects.iter()) {
-		u16 id = ao_it.first;
-
-		// Get object
-		ServerActiveObject *object = ao_it.second.get();
-		if (!object)
-			continue;
-
+	auto check_object = [&] (u16 id, ServerActiveObject *object) {
 		if (object->isGone())
-			continue;
+			return;
 
 		f32 distance_f = object->getBasePosition().getDistanceFrom(player_pos);
 		if (object->getType() == ACTIVEOBJECT_TYPE_PLAYER) {
 			// Discard if too far
 			if (distance_f > player_radius && player_radius != 0)
-				continue;
+				return;
 		} else if (distance_f > radius)
-			continue;
+			return;
 
 		if (!object->isEffectivelyObservedBy(player_name))
-			continue;
+			return;
 
 		// Discard if already on current_objects
 		auto n = current_objects.find(id);
 		if (n != current_objects.end())
-			continue;
+			return;
 		// Add to added_objects
 		added_objects.push_back(id);
+	};
+
+	// Without a distance limit for players they can't be found spatially
+	const bool all_players = player_radius == 0;
+
+	f32 search_radius = all_players ? radius : std::max(radius, player_radius);
+	aabb3f box(player_pos - search_radius, player_pos + search_radius);
+	forEachObjectInArea(box, [&] (u16 id, ServerActiveObject *object) {
+		if (all_players && object->getType() == ACTIVEOBJECT_TYPE_PLAYER)
+			return;
+		check_object(id, object);
+	});
+
+	if (all_players) {
+		std::vector<u16> player_ids(m_player_ids.begin(), m_player_ids.end());
+		std::sort(player_ids.begin(), player_ids.end());
+		for (u16 id : player_ids) {
+			if (ServerActiveObject *object = getActiveObject(id))
+				check_object(id, object);
+		}
 	}
 }
 
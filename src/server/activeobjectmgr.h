@@ -5,9 +5,11 @@
 #pragma once
 
 #include <functional>
+#include <unordered_set>
 #include <vector>
 #include "../activeobjectmgr.h"
 #include "serveractiveobject.h"
+#include "spatial_map.h"
 
 namespace server
 {
@@ -16,6 +18,7 @@ class ActiveObjectMgr final : public ::ActiveObjectMgr<ServerActiveObject>
 public:
 	~ActiveObjectMgr() override;
 
+	void clear() override;
 	// If cb returns true, the obj will be deleted
 	void clearIf(const std::function<bool(ServerActiveObject *, u16)> &cb);
 	void step(float dtime,
@@ -25,6 +28,9 @@ class ActiveObjectMgr final : public ::ActiveObjectMgr<ServerActiveObject>
 
 	void invalidateActiveObjectObserverCaches();
 
+	// Must be called whenever the base position of an object changes
+	void updateObjectPosition(ServerActiveObject *obj, const v3f &old_pos);
+
 	void getObjectsInsideRadius(const v3f &pos, float radius,
 			std::vector<ServerActiveObject *> &result,
 			std::function<bool(ServerActiveObject *obj)> include_obj_cb);
@@ -36,5 +42,14 @@ class ActiveObjectMgr final : public ::ActiveObjectMgr<ServerActiveObject>
 			f32 radius, f32 player_radius,
 			const std::set<u16> &current_objects,
 			std::vector<u16> &added_objects);
+
+private:
+	// Calls cb for (at least) the objects inside the box, in id order.
+	template <typename F>
+	void forEachObjectInArea(const aabb3f &box, F &&cb);
+
+	SpatialMap m_spatial_map;
+	// Players may have to be sent regardless of distance
+	std::unordered_set<u16> m_player_ids;
 };
 } // namespace server
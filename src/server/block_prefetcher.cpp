@@ -0,0 +1,181 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "block_prefetcher.h"
+#include "block_saver.h"
+#include "database/database.h"
+#include "log.h"
+#include "profiler.h"
+#include "servermap.h"
+#include "threading/mutex_auto_lock.h"
+
+// Maximum number of blocks read in one go
+static constexpr size_t READ_BATCH_SIZE = 64;
+
+BlockPrefetcher::BlockPrefetcher(MapDatabaseAccessor *db, size_t max_blocks) :
+	m_db(db),
+	m_max_blocks(max_blocks),
+	m_reader("MapPrefetch", 1)
+{
+}
+
+BlockPrefetcher::~BlockPrefetcher()
+{
+	// Nothing is going to use the results anymore
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_queue.clear();
+	m_reading.clear();
+}
+
+void BlockPrefetcher::request(const std::vector<v3s16> &positions)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (v3s16 pos : positions) {
+		if (m_cache.count(pos) || m_reading.count(pos))
+			continue;
+		m_reading[pos] = ++m_next_ticket;
+		m_queue.push_back(pos);
+	}
+
+	// Requests go stale quickly, so prefer the newer ones
+	while (m_queue.size() > m_max_blocks) {
+		m_reading.erase(m_queue.front());
+		m_queue.pop_front();
+	}
+
+	if (!m_read_queued && !m_queue.empty()) {
+		m_read_queued = true;
+		m_reader.push([this] () { readJob(); });
+	}
+}
+
+bool BlockPrefetcher::take(v3s16 pos, std::string &blob)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_cache.find(pos);
+	if (it == m_cache.end())
+		return false;
+	blob = std::move(it->second.blob);
+	m_cache.erase(it);
+	g_profiler->add("BlockPrefetcher: hits [#]", 1);
+	return true;
+}
+
+void BlockPrefetcher::invalidate(v3s16 pos)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_cache.erase(pos);
+	m_reading.erase(pos);
+}
+
+void BlockPrefetcher::wait()
+{
+	m_reader.waitIdle();
+}
+
+size_t BlockPrefetcher::size()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_cache.size();
+}
+
+void BlockPrefetcher::evict()
+{
+	while (m_cache.size() > m_max_blocks) {
+		auto [pos, ticket] = m_cache_order.front();
+		m_cache_order.pop_front();
+		auto it = m_cache.find(pos);
+		if (it != m_cache.end() && it->second.ticket == ticket)
+			m_cache.erase(it);
+	}
+
+	// Drop entries of blocks that were taken in the meantime
+	if (m_cache_order.size() > 2 * m_max_blocks) {
+		std::deque<std::pair<v3s16, u64>> order;
+		for (auto &it : m_cache_order) {
+			auto it2 = m_cache.find(it.first);
+			if (it2 != m_cache.end() && it2->second.ticket == it.second)
+				order.push_back(it);
+		}
+		m_cache_order = std::move(order);
+	}
+}
+
+void BlockPrefetcher::readJob()
+{
+	std::vector<v3s16> batch;
+	std::vector<u64> tickets;
+	std::vector<bool> skip;
+	std::vector<std::string> blobs, blobs_ro;
+
+	while (true) {
+		batch.clear();
+		tickets.clear();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_queue.empty()) {
+				m_read_queued = false;
+				return;
+			}
+			while (!m_queue.empty() && batch.size() < READ_BATCH_SIZE) {
+				v3s16 pos = m_queue.front();
+				m_queue.pop_front();
+				auto it = m_reading.find(pos);
+				if (it == m_reading.end())
+					continue; // invalidated
+				batch.push_back(pos);
+				tickets.push_back(it->second);
+			}
+		}
+		if (batch.empty())
+			continue;
+
+		bool ok = true;
+		skip.assign(batch.size(), false);
+		{
+			MutexAutoLock dblock(m_db->mutex);
+			// Blocks that are still being saved would be outdated in the
+			// database. Loads get them from the saver anyway.
+			if (m_db->saver) {
+				for (size_t i = 0; i < batch.size(); i++)
+					skip[i] = m_db->saver->contains(batch[i]);
+			}
+
+			try {
+				m_db->dbase->loadBlocks(batch, &blobs);
+				if (m_db->dbase_ro) {
+					std::vector<v3s16> missing;
+					for (size_t i = 0; i < batch.size(); i++) {
+						if (blobs[i].empty())
+							missing.push_back(batch[i]);
+					}
+					m_db->dbase_ro->loadBlocks(missing, &blobs_ro);
+					for (size_t i = 0, j = 0; i < batch.size(); i++) {
+						if (blobs[i].empty())
+							blobs[i] = std::move(blobs_ro[j++]);
+					}
+				}
+			} catch (std::exception &e) {
+				errorstream << "BlockPrefetcher: Failed to read " << batch.size()
+					<< " blocks: " << e.what() << std::endl;
+				ok = false;
+			}
+		}
+
+		g_profiler->add("BlockPrefetcher: read blocks [#]", batch.size());
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (size_t i = 0; i < batch.size(); i++) {
+			auto it = m_reading.find(batch[i]);
+			// Invalidated or requested again while reading
+			if (it == m_reading.end() || it->second != tickets[i])
+				continue;
+			m_reading.erase(it);
+			if (!ok || skip[i])
+				continue;
+			m_cache[batch[i]] = {tickets[i], std::move(blobs[i])};
+			m_cache_order.emplace_back(batch[i], tickets[i]);
+		}
+		evict();
+	}
+}
@@ -0,0 +1,78 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "irr_v3d.h"
+#include "threading/thread_pool.h"
+#include "util/basic_macros.h"
+
+struct MapDatabaseAccessor;
+
+/*
+	Reads map blocks from the database ahead of time.
+
+	The server thread tells it which blocks are likely to be emerged soon
+	(see RemoteClient::GetNextBlocks()). They are read in batches by a
+	background thread and kept in a bounded cache, from which
+	MapDatabaseAccessor::loadBlock() takes them.
+	Every write to the database must be followed by invalidate().
+*/
+class BlockPrefetcher
+{
+public:
+	BlockPrefetcher(MapDatabaseAccessor *db, size_t max_blocks);
+	~BlockPrefetcher();
+
+	DISABLE_CLASS_COPY(BlockPrefetcher)
+
+	// Queues blocks for reading, most important first.
+	// Blocks that are already cached or queued are ignored.
+	void request(const std::vector<v3s16> &positions);
+
+	// Removes the cached data of pos and hands it out, in the format of
+	// MapDatabase. Empty data means the block does not exist.
+	// Returns false if the block is not cached.
+	bool take(v3s16 pos, std::string &blob);
+
+	// Forgets everything about pos, including pending reads
+	void invalidate(v3s16 pos);
+
+	// Blocks until all queued reads are done
+	// @note do not call with the database locked
+	void wait();
+
+	size_t size();
+
+private:
+	struct Entry {
+		u64 ticket;
+		std::string blob;
+	};
+
+	void readJob();
+	// @note call locked
+	void evict();
+
+	MapDatabaseAccessor *const m_db;
+	const size_t m_max_blocks;
+
+	std::mutex m_mutex;
+	// Ticket of every queued or in-progress read. A read is only cached
+	// if its ticket is still present when it finishes.
+	std::unordered_map<v3s16, u64> m_reading;
+	std::deque<v3s16> m_queue;
+	std::unordered_map<v3s16, Entry> m_cache;
+	// Order of insertion into m_cache, may contain stale entries
+	std::deque<std::pair<v3s16, u64>> m_cache_order;
+	u64 m_next_ticket = 0;
+	bool m_read_queued = false;
+
+	// Declared last so it is shut down first
+	ThreadPool m_reader;
+};
@@ -0,0 +1,252 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "block_saver.h"
+#include <sstream>
+#include "database/database.h"
+#include "log.h"
+#include "serialization.h"
+#include "servermap.h"
+#include "threading/mutex_auto_lock.h"
+
+// Maximum number of blocks written in one transaction
+static constexpr size_t WRITE_BATCH_SIZE = 256;
+// How often flush() tries again after writing failed
+static constexpr int FLUSH_RETRIES = 3;
+
+AsyncBlockSaver::AsyncBlockSaver(MapDatabaseAccessor *db, u8 version,
+		int compression_level, unsigned int num_threads) :
+	m_db(db),
+	m_version(version),
+	m_compression_level(compression_level),
+	m_writer("MapWriter", 1),
+	m_workers("MapCompress", num_threads)
+{
+}
+
+AsyncBlockSaver::~AsyncBlockSaver()
+{
+	if (!flush()) {
+		errorstream << "AsyncBlockSaver: Giving up, " << size()
+			<< " blocks were not saved" << std::endl;
+	}
+}
+
+void AsyncBlockSaver::push(v3s16 pos, std::string &&raw)
+{
+	auto data = std::make_shared<const std::string>(std::move(raw));
+	u64 seq;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		seq = ++m_next_seq;
+		Entry &e = m_pending[pos];
+		e.seq = seq;
+		e.raw = data;
+		e.blob.reset();
+		m_ready.erase(pos);
+		m_compressing++;
+	}
+	m_workers.push([this, pos, seq, data] () {
+		compressJob(pos, seq, data);
+	});
+}
+
+bool AsyncBlockSaver::get(v3s16 pos, std::string &blob)
+{
+	std::shared_ptr<const std::string> raw;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_pending.find(pos);
+		if (it == m_pending.end())
+			return false;
+		if (it->second.blob) {
+			blob = *it->second.blob;
+			return true;
+		}
+		raw = it->second.raw;
+	}
+	// Not compressed yet, do it here
+	blob = compress(*raw);
+	return true;
+}
+
+bool AsyncBlockSaver::contains(v3s16 pos)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pending.count(pos) != 0;
+}
+
+void AsyncBlockSaver::listPending(std::vector<v3s16> &dst)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	dst.reserve(dst.size() + m_pending.size());
+	for (auto &it : m_pending)
+		dst.push_back(it.first);
+}
+
+void AsyncBlockSaver::discard(v3s16 pos)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// A compression job that is still running drops its result
+	m_pending.erase(pos);
+	m_ready.erase(pos);
+	if (m_pending.empty())
+		m_flushed_cv.notify_all();
+}
+
+bool AsyncBlockSaver::flush()
+{
+	m_workers.waitIdle();
+	std::unique_lock<std::mutex> lock(m_mutex);
+	for (int tries = 0; tries <= FLUSH_RETRIES; tries++) {
+		const u32 failures = m_write_failures;
+		// Blocks left over from failed writes need a new one
+		if (!m_write_queued && shouldWrite()) {
+			m_write_queued = true;
+			m_writer.push([this] () { writeJob(); });
+		}
+		m_flushed_cv.wait(lock, [&] {
+			return m_pending.empty() || m_write_failures != failures;
+		});
+		if (m_pending.empty())
+			return true;
+	}
+	return false;
+}
+
+size_t AsyncBlockSaver::size()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_pending.size();
+}
+
+std::string AsyncBlockSaver::compress(const std::string &raw) const
+{
+	/*
+		[0] u8 serialization version
+		[1] data
+	*/
+	std::ostringstream os(std::ios_base::binary);
+	os.write((const char*) &m_version, 1);
+	::compress(raw, os, m_version, m_compression_level);
+	return os.str();
+}
+
+void AsyncBlockSaver::compressJob(v3s16 pos, u64 seq,
+		std::shared_ptr<const std::string> raw)
+{
+	auto blob = std::make_shared<const std::string>(compress(*raw));
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_compressing--;
+	auto it = m_pending.find(pos);
+	// Drop the result if the block was queued again in the meantime
+	if (it != m_pending.end() && it->second.seq == seq) {
+		it->second.raw.reset();
+		it->second.blob = std::move(blob);
+		m_ready.insert(pos);
+	}
+	if (!m_write_queued && shouldWrite()) {
+		m_write_queued = true;
+		m_writer.push([this] () { writeJob(); });
+	}
+}
+
+bool AsyncBlockSaver::shouldWrite() const
+{
+	// Wait for a full batch, unless nothing else is coming
+	return m_ready.size() >= WRITE_BATCH_SIZE ||
+		(m_compressing == 0 && !m_ready.empty());
+}
+
+void AsyncBlockSaver::writeJob()
+{
+	struct Item {
+		v3s16 pos;
+		u64 seq;
+		std::shared_ptr<const std::string> blob;
+	};
+	std::vector<Item> batch;
+	std::vector<std::pair<v3s16, std::string_view>> blocks;
+
+	while (true) {
+		batch.clear();
+		blocks.clear();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!shouldWrite()) {
+				m_write_queued = false;
+				return;
+			}
+			for (auto it = m_ready.begin(); it != m_ready.end() &&
+					batch.size() < WRITE_BATCH_SIZE; it = m_ready.erase(it)) {
+				const Entry &e = m_pending.at(*it);
+				batch.push_back({*it, e.seq, e.blob});
+			}
+		}
+
+		bool ok = false;
+		{
+			MutexAutoLock dblock(m_db->mutex);
+			{
+				// Blocks that were deleted meanwhile must stay deleted
+				std::lock_guard<std::mutex> lock(m_mutex);
+				for (const Item &item : batch) {
+					auto it = m_pending.find(item.pos);
+					if (it != m_pending.end() && it->second.seq == item.seq)
+						blocks.emplace_back(item.pos, *item.blob);
+				}
+			}
+
+			bool in_transaction = false;
+			try {
+				m_db->dbase->beginSave();
+				in_transaction = true;
+				ok = m_db->dbase->saveBlocks(blocks);
+				in_transaction = false;
+				m_db->dbase->endSave();
+				if (!ok) {
+					errorstream << "AsyncBlockSaver: Failed to save some of "
+						<< blocks.size() << " blocks" << std::endl;
+				}
+			} catch (std::exception &e) {
+				ok = false;
+				errorstream << "AsyncBlockSaver: Failed to save " << blocks.size()
+					<< " blocks: " << e.what() << std::endl;
+				// Don't leave the transaction open for whoever saves next
+				if (in_transaction) {
+					try {
+						m_db->dbase->endSave();
+					} catch (std::exception &e) {
+						errorstream << "AsyncBlockSaver: Failed to end the "
+							"transaction: " << e.what() << std::endl;
+					}
+				}
+			}
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!ok) {
+			// Keep the data around and try again with the next write,
+			// instead of retrying right away
+			for (const Item &item : batch) {
+				auto it = m_pending.find(item.pos);
+				if (it != m_pending.end() && it->second.seq == item.seq)
+					m_ready.insert(item.pos);
+			}
+			m_write_failures++;
+			m_write_queued = false;
+			m_flushed_cv.notify_all();
+			return;
+		}
+
+		// Loads are served from the database now
+		for (const Item &item : batch) {
+			auto it = m_pending.find(item.pos);
+			if (it != m_pending.end() && it->second.seq == item.seq)
+				m_pending.erase(it);
+		}
+		if (m_pending.empty())
+			m_flushed_cv.notify_all();
+	}
+}
@@ -0,0 +1,101 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "irr_v3d.h"
+#include "threading/thread_pool.h"
+#include "util/basic_macros.h"
+
+struct MapDatabaseAccessor;
+
+/*
+	Compresses and writes map blocks in the background.
+
+	The server thread hands over blocks that were serialized without
+	compression (see MapBlock::serializeUncompressed()). They are compressed
+	by a pool of workers and then written by a single writer, which groups
+	them into large transactions. Blocks that failed to be written are kept
+	and retried with the next write.
+	Until a block has been written, loads must go through get() and
+	deletions through discard().
+*/
+class AsyncBlockSaver
+{
+public:
+	AsyncBlockSaver(MapDatabaseAccessor *db, u8 version, int compression_level,
+			unsigned int num_threads);
+	// Writes everything that was queued, as far as possible
+	~AsyncBlockSaver();
+
+	DISABLE_CLASS_COPY(AsyncBlockSaver)
+
+	// Queues a block for saving, replacing previous data of the same block
+	void push(v3s16 pos, std::string &&raw);
+
+	// Retrieves the data that is yet to be written for pos, in the
+	// format of MapDatabase. Returns false if there is none.
+	// @note do not call with the database locked, this may compress
+	bool get(v3s16 pos, std::string &blob);
+
+	// Whether pos is yet to be written
+	bool contains(v3s16 pos);
+
+	// Adds the positions of the blocks that are yet to be written to dst
+	void listPending(std::vector<v3s16> &dst);
+
+	// Forgets the data that is yet to be written for pos, so that a block
+	// that is deleted from the database doesn't come back.
+	// @note call with the database locked
+	void discard(v3s16 pos);
+
+	// Blocks until all queued blocks were written. Returns false if writing
+	// them failed several times in a row.
+	// @note do not call with the database locked
+	bool flush();
+
+	size_t size();
+
+private:
+	struct Entry {
+		u64 seq;
+		// Uncompressed data, until it was compressed
+		std::shared_ptr<const std::string> raw;
+		// Data for the database
+		std::shared_ptr<const std::string> blob;
+	};
+
+	std::string compress(const std::string &raw) const;
+	void compressJob(v3s16 pos, u64 seq, std::shared_ptr<const std::string> raw);
+	void writeJob();
+	// Whether a batch is worth writing
+	// @note call locked
+	bool shouldWrite() const;
+
+	MapDatabaseAccessor *const m_db;
+	const u8 m_version;
+	const int m_compression_level;
+
+	std::mutex m_mutex;
+	std::condition_variable m_flushed_cv;
+	// Latest data of every block that wasn't written yet
+	std::unordered_map<v3s16, Entry> m_pending;
+	// Blocks with compressed data waiting for the writer
+	std::unordered_set<v3s16> m_ready;
+	u64 m_next_seq = 0;
+	u32 m_compressing = 0;
+	bool m_write_queued = false;
+	// Number of failed writes, whose blocks stay in m_pending to be retried
+	u32 m_write_failures = 0;
+
+	// Declared last so they are shut down first
+	ThreadPool m_writer;
+	ThreadPool m_workers;
+};
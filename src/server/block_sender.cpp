@@ -0,0 +1,105 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "block_sender.h"
+#include <sstream>
+#include "clientiface.h"
+#include "irrlicht_changes/printing.h"
+#include "log.h"
+#include "mapblock.h"
+#include "network/networkpacket.h"
+#include "profiler.h"
+#include "serialization.h"
+#include "serialized_block_cache.h"
+
+AsyncBlockSender::AsyncBlockSender(ClientInterface *clients,
+		SerializedBlockCache *cache, int compression_level,
+		unsigned int num_threads) :
+	m_clients(clients),
+	m_cache(cache),
+	m_compression_level(compression_level),
+	m_workers("BlockSend", num_threads)
+{
+}
+
+AsyncBlockSender::~AsyncBlockSender()
+{
+	wait();
+}
+
+void AsyncBlockSender::push(v3s16 pos, u8 ver,
+		std::shared_ptr<const ZstdDictionary> dict, u64 content_version,
+		std::string &&raw, std::vector<session_t> &&peer_ids)
+{
+	auto job = std::make_shared<Job>();
+	job->pos = pos;
+	job->ver = ver;
+	job->dict = std::move(dict);
+	job->content_version = content_version;
+	job->raw = std::move(raw);
+	job->peer_ids = std::move(peer_ids);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto &queue = m_pending[pos];
+	queue.push_back(std::move(job));
+	// Otherwise the job is started once the previous one is done
+	if (queue.size() == 1)
+		schedule(queue.front());
+}
+
+void AsyncBlockSender::schedule(std::shared_ptr<Job> job)
+{
+	m_workers.push([this, job] () {
+		sendJob(*job);
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_pending.find(job->pos);
+		auto &queue = it->second;
+		queue.pop_front();
+		if (queue.empty()) {
+			m_pending.erase(it);
+			m_sent_cv.notify_all();
+		} else {
+			schedule(queue.front());
+		}
+	});
+}
+
+void AsyncBlockSender::waitFor(v3s16 pos)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_pending.count(pos) == 0)
+		return;
+	g_profiler->add("AsyncBlockSender: waits [#]", 1);
+	m_sent_cv.wait(lock, [&] { return m_pending.count(pos) == 0; });
+}
+
+void AsyncBlockSender::wait()
+{
+	m_workers.waitIdle();
+}
+
+void AsyncBlockSender::sendJob(const Job &job)
+{
+	std::shared_ptr<const std::string> data;
+	try {
+		std::ostringstream os(std::ios_base::binary);
+		compress(job.raw, os, job.ver, m_compression_level, job.dict.get());
+		MapBlock::serializeNetworkSpecific(os);
+		data = std::make_shared<const std::string>(os.str());
+	} catch (std::exception &e) {
+		errorstream << "AsyncBlockSender: Failed to compress block "
+			<< job.pos << ": " << e.what() << std::endl;
+		return;
+	}
+
+	if (m_cache)
+		m_cache->put(job.pos, job.ver, job.dict != nullptr, job.content_version, data);
+
+	for (session_t peer_id : job.peer_ids) {
+		NetworkPacket pkt(TOCLIENT_BLOCKDATA, 2 + 2 + 2 + data->size(), peer_id);
+		pkt << job.pos;
+		pkt.putRawString(*data);
+		m_clients->send(peer_id, &pkt);
+	}
+}
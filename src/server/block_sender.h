@@ -0,0 +1,82 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "irr_v3d.h"
+#include "network/networkprotocol.h" // session_t
+#include "threading/thread_pool.h"
+#include "util/basic_macros.h"
+
+class ClientInterface;
+class SerializedBlockCache;
+class ZstdDictionary;
+
+/*
+	Compresses map blocks for the network in the background.
+
+	The server thread hands over blocks that were serialized without
+	compression (see MapBlock::serializeUncompressed()), so it only needs
+	the environment lock for copying the block contents. A pool of workers
+	compresses them, adds them to the cache and sends them to every
+	client they were meant for.
+*/
+class AsyncBlockSender
+{
+public:
+	// cache may be null
+	AsyncBlockSender(ClientInterface *clients, SerializedBlockCache *cache,
+			int compression_level, unsigned int num_threads);
+	// Sends everything that was queued
+	~AsyncBlockSender();
+
+	DISABLE_CLASS_COPY(AsyncBlockSender)
+
+	// Queues a block for compression and sending
+	// dict may be null
+	void push(v3s16 pos, u8 ver, std::shared_ptr<const ZstdDictionary> dict,
+			u64 content_version, std::string &&raw,
+			std::vector<session_t> &&peer_ids);
+
+	// Blocks until all queued data of pos was handed to the connection.
+	// Changes to the block must not be sent to clients before that,
+	// or they could be overwritten by the outdated block.
+	void waitFor(v3s16 pos);
+
+	// Blocks until all queued blocks were sent
+	void wait();
+
+private:
+	struct Job {
+		v3s16 pos;
+		u8 ver;
+		std::shared_ptr<const ZstdDictionary> dict;
+		u64 content_version;
+		std::string raw;
+		std::vector<session_t> peer_ids;
+	};
+
+	// @note call locked
+	void schedule(std::shared_ptr<Job> job);
+	void sendJob(const Job &job);
+
+	ClientInterface *const m_clients;
+	SerializedBlockCache *const m_cache;
+	const int m_compression_level;
+
+	std::mutex m_mutex;
+	std::condition_variable m_sent_cv;
+	// Queued jobs for every block. Only the first one is handed to the
+	// workers, so that a block is never sent out of order.
+	std::unordered_map<v3s16, std::deque<std::shared_ptr<Job>>> m_pending;
+
+	// Declared last so it is shut down first
+	ThreadPool m_workers;
+};
@@ -22,6 +22,13 @@
 #include "util/string.h"
 #include "face_position_cache.h"
 
+// How often to look for blocks to read ahead, in seconds
+static constexpr float PREFETCH_INTERVAL = 0.25f;
+// How far ahead along the movement of a player to read, in seconds
+static constexpr float PREFETCH_TIME_AHEAD = 2.0f;
+// Maximum number of blocks to read ahead per client and interval
+static constexpr size_t PREFETCH_MAX_BLOCKS = 256;
+
 static std::string string_sanitize_ascii(const std::string &s, u32 max_length)
 {
 	std::string out;
@@ -413,29 +420,96 @@ void RemoteClient::GetNextBlocks (
 		// if the distance has changed, clear the occlusion cache
 		m_blocks_occ.clear();
 	}
+
+	/*
+		Read blocks from the database ahead of time that will likely be
+		emerged soon: those at the next distances in sight, followed by
+		those along the path of a moving player.
+	*/
+	m_prefetch_timer -= dtime;
+	if (m_prefetch_timer <= 0.0f && emerge->canPrefetch()) {
+		m_prefetch_timer = PREFETCH_INTERVAL;
+
+		std::vector<v3s16> prefetch;
+		auto add = [&] (v3s16 p) {
+			if (prefetch.size() < PREFETCH_MAX_BLOCKS &&
+					!blockpos_over_max_limit(p) &&
+					!env->getMap().getBlockNoCreateNoEx(p))
+				prefetch.push_back(p);
+		};
+
+		const s16 d_prefetch_max = std::min<s16>(d + max_d_increment_at_time, full_d_max);
+		for (s16 d2 = d; d2 <= d_prefetch_max; d2++) {
+			for (v3s16 p : FacePositionCache::getFacePositions(d2)) {
+				p += center;
+				if (isBlockInSight(p, camera_pos, camera_dir, camera_fov,
+						d_blocks_in_sight))
+					add(p);
+			}
+		}
+
+		if (playerspeed.getLength() > 1.0f * BS) {
+			const f32 ahead = std::min(playerspeed.getLength() * PREFETCH_TIME_AHEAD,
+				d_blocks_in_sight);
+			for (f32 t = MAP_BLOCKSIZE * BS; t <= ahead; t += MAP_BLOCKSIZE * BS) {
+				v3s16 bp = getNodeBlockPos(floatToInt(playerpos + playerspeeddir * t, BS));
+				for (s16 z = -1; z <= 1; z++)
+				for (s16 y = -1; y <= 1; y++)
+				for (s16 x = -1; x <= 1; x++)
+					add(bp + v3s16(x, y, z));
+			}
+		}
+
+		emerge->prefetchBlocks(prefetch);
+	}
 }
 
-void RemoteClient::GotBlock(v3s16 p)
+bool RemoteClient::GotBlock(v3s16 p)
 {
-	if (m_blocks_sending.find(p) != m_blocks_sending.end()) {
-		m_blocks_sending.erase(p);
+	auto it = m_blocks_sending.find(p);
+	if (it != m_blocks_sending.end()) {
 		// only add to sent blocks if it actually was sending
 		// (it might have been modified since)
-		m_blocks_sent.insert(p);
-	} else {
-		m_excess_gotblocks++;
+		m_blocks_sent[p] = it->second;
+		m_blocks_sending.erase(it);
+		return true;
 	}
+	m_excess_gotblocks++;
+	return false;
 }
 
-void RemoteClient::SentBlock(v3s16 p)
+void RemoteClient::SentBlock(v3s16 p, u64 content_version)
 {
 	if (m_blocks_sending.find(p) == m_blocks_sending.end())
-		m_blocks_sending[p] = 0.0f;
+		m_blocks_sending[p] = content_version;
 	else
 		infostream<<"RemoteClient::SentBlock(): Sent block"
 				" already in m_blocks_sending"<<std::endl;
 }
 
+u64 RemoteClient::getBlockVersion(v3s16 p) const
+{
+	auto it = m_blocks_sending.find(p);
+	if (it != m_blocks_sending.end())
+		return it->second;
+	it = m_blocks_sent.find(p);
+	if (it != m_blocks_sent.end())
+		return it->second;
+	return 0;
+}
+
+void RemoteClient::setBlockVersion(v3s16 p, u64 content_version)
+{
+	auto it = m_blocks_sending.find(p);
+	if (it != m_blocks_sending.end()) {
+		it->second = content_version;
+		return;
+	}
+	it = m_blocks_sent.find(p);
+	if (it != m_blocks_sent.end())
+		it->second = content_version;
+}
+
 void RemoteClient::SetBlockNotSent(v3s16 p)
 {
 	m_nothing_to_send_pause_timer = 0;
@@ -763,16 +837,16 @@ void ClientInterface::send(session_t peer_id, NetworkPacket *pkt)
 	auto &ccf = clientCommandFactoryTable[pkt->getCommand()];
 	FATAL_ERROR_IF(!ccf.name, "packet type missing in table");
 
-	m_con->Send(peer_id, ccf.channel, pkt, ccf.reliable);
+	m_con->Send(peer_id, ccf.channel, pkt, ccf.reliable, ccf.priority);
 }
 
 void ClientInterface::sendCustom(session_t peer_id, u8 channel, NetworkPacket *pkt, bool reliable)
 {
 	// check table anyway to prevent mistakes
-	FATAL_ERROR_IF(!clientCommandFactoryTable[pkt->getCommand()].name,
-		"packet type missing in table");
+	auto &ccf = clientCommandFactoryTable[pkt->getCommand()];
+	FATAL_ERROR_IF(!ccf.name, "packet type missing in table");
 
-	m_con->Send(peer_id, channel, pkt, reliable);
+	m_con->Send(peer_id, channel, pkt, reliable, ccf.priority);
 }
 
 void ClientInterface::sendToAll(NetworkPacket *pkt)
@@ -784,7 +858,7 @@ void ClientInterface::sendToAll(NetworkPacket *pkt)
 		if (client->net_proto_version != 0) {
 			auto &ccf = clientCommandFactoryTable[pkt->getCommand()];
 			FATAL_ERROR_IF(!ccf.name, "packet type missing in table");
-			m_con->Send(client->peer_id, ccf.channel, pkt, ccf.reliable);
+			m_con->Send(client->peer_id, ccf.channel, pkt, ccf.reliable, ccf.priority);
 		}
 	}
 }
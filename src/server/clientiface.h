@@ -221,6 +221,10 @@ class RemoteClient
 	u8 serialization_version;
 	//
 	u16 net_proto_version = 0;
+	// Whether blocks may be compressed with the block dictionary
+	bool use_block_dictionary = false;
+	// Whether the client was sent the data of the block dictionary
+	bool block_dictionary_sent = false;
 
 	/* Authentication information */
 	std::string enc_pwd = "";
@@ -247,9 +251,10 @@ class RemoteClient
 	void GetNextBlocks(ServerEnvironment *env, EmergeManager* emerge,
 			float dtime, std::vector<PrioritySortedBlockTransfer> &dest);
 
-	void GotBlock(v3s16 p);
+	// Returns true if the block was being sent
+	bool GotBlock(v3s16 p);
 
-	void SentBlock(v3s16 p);
+	void SentBlock(v3s16 p, u64 content_version);
 
 	void SetBlockNotSent(v3s16 p);
 	void SetBlocksNotSent(const std::vector<v3s16> &blocks);
@@ -269,6 +274,13 @@ class RemoteClient
 		return m_blocks_sent.find(p) != m_blocks_sent.end();
 	}
 
+	// Returns the content version of the block that was sent (or is being
+	// sent) to the client, or 0 if there is none
+	u64 getBlockVersion(v3s16 p) const;
+
+	// Records that the changes up to this content version were sent
+	void setBlockVersion(v3s16 p, u64 content_version);
+
 	bool markMediaSent(const std::string &name) {
 		auto insert_result = m_media_sent.emplace(name);
 		return insert_result.second; // true = was inserted
@@ -352,10 +364,10 @@ class RemoteClient
 		- A block is cleared from here when client says it has
 		  deleted it from it's memory
 
-		List of block positions.
+		Maps block positions to the content version the client has.
 		No MapBlock* is stored here because the blocks can get deleted.
 	*/
-	std::unordered_set<v3s16> m_blocks_sent;
+	std::unordered_map<v3s16, u64> m_blocks_sent;
 
 	/*
 		Cache of blocks that have been occlusion culled at the current distance.
@@ -388,9 +400,9 @@ class RemoteClient
 		- The size of this list is limited to some value
 		Block is added when it is sent with BLOCKDATA.
 		Block is removed when GOTBLOCKS is received.
-		Value is time from sending. (not used at the moment)
+		Value is the content version that was sent.
 	*/
-	std::unordered_map<v3s16, float> m_blocks_sending;
+	std::unordered_map<v3s16, u64> m_blocks_sending;
 
 	/*
 		Blocks that have been modified since blocks were
@@ -414,6 +426,9 @@ class RemoteClient
 	// CPU usage optimization
 	float m_nothing_to_send_pause_timer = 0.0f;
 
+	// Time until blocks are read ahead from the database again
+	float m_prefetch_timer = 0.0f;
+
 	// measure how long it takes the server to send the complete map
 	float m_map_send_completion_timer = 0.0f;
 
@@ -0,0 +1,74 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "serialized_block_cache.h"
+#include "profiler.h"
+
+SerializedBlockCache::SerializedBlockCache(size_t max_bytes) :
+	m_max_bytes(max_bytes)
+{
+}
+
+std::shared_ptr<const std::string> SerializedBlockCache::get(v3s16 pos, u8 ver,
+		bool dict, u64 content_version)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_entries.find({pos, ver, dict});
+	if (it == m_entries.end())
+		return nullptr;
+	if (it->second.content_version != content_version) {
+		// The block was modified, this is never going to be used again
+		remove(it);
+		return nullptr;
+	}
+	m_lru.splice(m_lru.begin(), m_lru, it->second.lru_it);
+	g_profiler->add("SerializedBlockCache: hits [#]", 1);
+	return it->second.data;
+}
+
+void SerializedBlockCache::put(v3s16 pos, u8 ver, bool dict, u64 content_version,
+		std::shared_ptr<const std::string> data)
+{
+	if (data->size() > m_max_bytes)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	const Key key{pos, ver, dict};
+	auto it = m_entries.find(key);
+	if (it != m_entries.end())
+		remove(it);
+
+	m_bytes += data->size();
+	m_lru.push_front(key);
+	m_entries[key] = {content_version, std::move(data), m_lru.begin()};
+
+	while (m_bytes > m_max_bytes)
+		remove(m_entries.find(m_lru.back()));
+}
+
+void SerializedBlockCache::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_entries.clear();
+	m_lru.clear();
+	m_bytes = 0;
+}
+
+size_t SerializedBlockCache::size()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_entries.size();
+}
+
+size_t SerializedBlockCache::getBytes()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_bytes;
+}
+
+void SerializedBlockCache::remove(std::unordered_map<Key, Entry, KeyHash>::iterator it)
+{
+	m_bytes -= it->second.data->size();
+	m_lru.erase(it->second.lru_it);
+	m_entries.erase(it);
+}
@@ -0,0 +1,75 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "irr_v3d.h"
+#include "util/basic_macros.h"
+
+/*
+	Keeps blocks serialized for the network around, so that a block is only
+	serialized and compressed once no matter how many clients it is sent to.
+
+	Entries are tied to MapBlock::getContentVersion(), so a modified block
+	never hits outdated data. Once the size limit is exceeded, the least
+	recently used entries are dropped.
+*/
+class SerializedBlockCache
+{
+public:
+	SerializedBlockCache(size_t max_bytes);
+
+	DISABLE_CLASS_COPY(SerializedBlockCache)
+
+	// Returns null if nothing is cached for this version of the block
+	// dict tells whether the data was compressed with the block dictionary
+	std::shared_ptr<const std::string> get(v3s16 pos, u8 ver, bool dict,
+			u64 content_version);
+
+	void put(v3s16 pos, u8 ver, bool dict, u64 content_version,
+			std::shared_ptr<const std::string> data);
+
+	void clear();
+
+	size_t size();
+	// Sum of the sizes of the cached data
+	size_t getBytes();
+
+private:
+	struct Key {
+		v3s16 pos;
+		u8 ver;
+		bool dict;
+
+		bool operator==(const Key &other) const {
+			return pos == other.pos && ver == other.ver && dict == other.dict;
+		}
+	};
+
+	struct KeyHash {
+		size_t operator() (const Key &k) const {
+			return std::hash<v3s16>()(k.pos) ^ k.ver ^ (k.dict << 8);
+		}
+	};
+
+	struct Entry {
+		u64 content_version;
+		std::shared_ptr<const std::string> data;
+		std::list<Key>::iterator lru_it;
+	};
+
+	// @note call locked
+	void remove(std::unordered_map<Key, Entry, KeyHash>::iterator it);
+
+	const size_t m_max_bytes;
+	std::mutex m_mutex;
+	size_t m_bytes = 0;
+	std::unordered_map<Key, Entry, KeyHash> m_entries;
+	// Most recently used first
+	std::list<Key> m_lru;
+};
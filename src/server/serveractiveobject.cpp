@@ -6,6 +6,7 @@
 #include "inventory.h"
 #include "inventorymanager.h"
 #include "constants.h" // BS
+#include "serverenvironment.h"
 
 ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 	ActiveObject(0),
@@ -14,6 +15,15 @@ ServerActiveObject::ServerActiveObject(ServerEnvironment *env, v3f pos):
 {
 }
 
+void ServerActiveObject::setBasePosition(v3f pos)
+{
+	v3f old_pos = m_base_position;
+	m_base_position = pos;
+	// m_env is NULL for prototypes, which are not indexed anyway
+	if (m_env)
+		m_env->updateActiveObjectPosition(this, old_pos);
+}
+
 float ServerActiveObject::getMinimumSavedMovement()
 {
 	return 2.0*BS;
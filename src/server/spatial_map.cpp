@@ -0,0 +1,79 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "spatial_map.h"
+#include <algorithm>
+#include <cmath>
+#include "constants.h"
+
+namespace server
+{
+
+static inline s16 getCellCoord(f32 v)
+{
+	constexpr f32 cell_size = MAP_BLOCKSIZE * BS;
+	f32 c = std::floor(v / cell_size);
+	// Objects are not supposed to be this far out, but clamp anyway
+	// (this also maps NaN to a valid cell)
+	if (!(c > S16_MIN))
+		return S16_MIN;
+	if (c > S16_MAX)
+		return S16_MAX;
+	return c;
+}
+
+v3s16 SpatialMap::getCell(const v3f &pos)
+{
+	return v3s16(getCellCoord(pos.X), getCellCoord(pos.Y), getCellCoord(pos.Z));
+}
+
+void SpatialMap::insert(ServerActiveObject *obj, const v3f &pos)
+{
+	m_cells[getCell(pos)].push_back(obj);
+	m_count++;
+}
+
+bool SpatialMap::removeFromCell(ServerActiveObject *obj, v3s16 cell)
+{
+	auto it = m_cells.find(cell);
+	if (it == m_cells.end())
+		return false;
+	auto &objs = it->second;
+	auto found = std::find(objs.begin(), objs.end(), obj);
+	if (found == objs.end())
+		return false;
+	*found = objs.back();
+	objs.pop_back();
+	if (objs.empty())
+		m_cells.erase(it);
+	return true;
+}
+
+void SpatialMap::remove(ServerActiveObject *obj, const v3f &pos)
+{
+	if (removeFromCell(obj, getCell(pos)))
+		m_count--;
+}
+
+void SpatialMap::updatePosition(ServerActiveObject *obj,
+		const v3f &old_pos, const v3f &new_pos)
+{
+	v3s16 old_cell = getCell(old_pos);
+	v3s16 new_cell = getCell(new_pos);
+	if (old_cell == new_cell)
+		return;
+
+	if (removeFromCell(obj, old_cell))
+		m_cells[new_cell].push_back(obj);
+}
+
+u64 SpatialMap::getCellCount(const aabb3f &box) const
+{
+	const v3s16 min = getCell(box.MinEdge);
+	const v3s16 max = getCell(box.MaxEdge);
+	if (min.X > max.X || min.Y > max.Y || min.Z > max.Z)
+		return 0;
+	return (u64)(max.X - min.X + 1) * (max.Y - min.Y + 1) * (max.Z - min.Z + 1);
+}
+
+} // namespace server
@@ -0,0 +1,66 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include "irrlichttypes_bloated.h"
+
+class ServerActiveObject;
+
+namespace server
+{
+
+/*
+	Uniform grid over active objects.
+	Objects are bucketed by the mapblock-sized cell containing their base
+	position, so that area queries only have to look at the nearby cells.
+	The owner must remove objects before they are destroyed.
+*/
+class SpatialMap
+{
+public:
+	void insert(ServerActiveObject *obj, const v3f &pos);
+	void remove(ServerActiveObject *obj, const v3f &pos);
+
+	// Moves an indexed object from the cell of old_pos to the cell of new_pos.
+	// Does nothing if the object is not indexed at old_pos.
+	void updatePosition(ServerActiveObject *obj, const v3f &old_pos, const v3f &new_pos);
+
+	// Number of cells touched by the box (may be huge)
+	u64 getCellCount(const aabb3f &box) const;
+
+	// Calls cb(obj) for every object in the cells touched by the box.
+	// This is a superset of the objects actually inside the box.
+	template <typename F>
+	void forEachInArea(const aabb3f &box, F &&cb) const
+	{
+		if (m_cells.empty())
+			return;
+		const v3s16 min = getCell(box.MinEdge);
+		const v3s16 max = getCell(box.MaxEdge);
+		v3s16 p;
+		for (s32 z = min.Z; z <= max.Z; z++)
+		for (s32 y = min.Y; y <= max.Y; y++)
+		for (s32 x = min.X; x <= max.X; x++) {
+			p.set(x, y, z);
+			auto it = m_cells.find(p);
+			if (it == m_cells.end())
+				continue;
+			for (ServerActiveObject *obj : it->second)
+				cb(obj);
+		}
+	}
+
+	size_t size() const { return m_count; }
+
+private:
+	static v3s16 getCell(const v3f &pos);
+	bool removeFromCell(ServerActiveObject *obj, v3s16 cell);
+
+	std::unordered_map<v3s16, std::vector<ServerActiveObject *>> m_cells;
+	size_t m_count = 0;
+};
+
+} // namespace server
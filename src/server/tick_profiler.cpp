@@ -0,0 +1,139 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "tick_profiler.h"
+#include <algorithm>
+#include <cmath>
+#include "porting.h"
+
+static const char *const builtin_phase_names[TP_BUILTIN_COUNT] = {
+	"step",
+	"send_blocks",
+	"active_blocks",
+	"lbms",
+	"node_timers",
+	"abms",
+	"globalsteps",
+	"objects",
+	"map_unload",
+	"liquids",
+	"object_messages",
+	"map_edit_events",
+	"map_save",
+};
+
+void TickProfiler::Histogram::observe(double value)
+{
+	size_t i = std::lower_bound(BUCKETS.begin(), BUCKETS.end(), value) -
+		BUCKETS.begin();
+	counts[i]++;
+	count++;
+	max = std::max(max, value);
+}
+
+double TickProfiler::Histogram::quantile(double q) const
+{
+	if (count == 0)
+		return 0.0;
+	u32 rank = std::max<u32>(1, std::ceil(q * count));
+	u32 seen = 0;
+	for (size_t i = 0; i < BUCKETS.size(); i++) {
+		seen += counts[i];
+		if (seen >= rank)
+			return std::min(BUCKETS[i], max);
+	}
+	return max;
+}
+
+TickProfiler::TickProfiler(MetricsBackend *mb) :
+	m_metrics_backend(mb)
+{
+	for (const char *name : builtin_phase_names)
+		addPhase(name);
+}
+
+u16 TickProfiler::addPhase(const std::string &name)
+{
+	u16 id = m_phases.size();
+	Phase &phase = m_phases.emplace_back();
+	phase.name = name;
+	phase.metric = m_metrics_backend->addHistogram("minetest_core_tick_phase_time",
+		"Time spent in a phase of a server step (in milliseconds)",
+		std::vector<double>(BUCKETS.begin(), BUCKETS.end()),
+		{{"phase", name}});
+	m_phase_ids.emplace(name, id);
+	return id;
+}
+
+u16 TickProfiler::getPhase(const std::string &name)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_phase_ids.find(name);
+	if (it != m_phase_ids.end())
+		return it->second;
+	return addPhase(name);
+}
+
+void TickProfiler::add(u16 phase, u64 time_us)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	Phase &p = m_phases.at(phase);
+	p.pending_us += time_us;
+	p.pending = true;
+}
+
+void TickProfiler::finishStep(u64 step_time_us)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_phases[TP_STEP].pending_us = step_time_us;
+	m_phases[TP_STEP].pending = true;
+
+	// Phases that didn't run are not recorded, their zeros would drown
+	// the interesting values of phases that run at an interval.
+	for (Phase &p : m_phases) {
+		if (!p.pending)
+			continue;
+		double ms = p.pending_us / 1000.0;
+		p.histogram.observe(ms);
+		p.metric->observe(ms);
+		p.pending_us = 0;
+		p.pending = false;
+	}
+}
+
+void TickProfiler::print(std::ostream &o)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	char buffer[128];
+	porting::mt_snprintf(buffer, sizeof(buffer), "  %-32s %7s %9s %9s %9s",
+		"phase", "count", "p50 [ms]", "p99 [ms]", "max [ms]");
+	o << buffer << std::endl;
+	for (const Phase &p : m_phases) {
+		const Histogram &h = p.histogram;
+		if (h.count == 0)
+			continue;
+		porting::mt_snprintf(buffer, sizeof(buffer), "  %-32s %7u %9.3g %9.3g %9.3g",
+			p.name.c_str(), h.count, h.quantile(0.5), h.quantile(0.99), h.max);
+		o << buffer << std::endl;
+	}
+}
+
+void TickProfiler::reset()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (Phase &p : m_phases)
+		p.histogram = Histogram();
+}
+
+TickPhaseTimer::TickPhaseTimer(TickProfiler *profiler, u16 phase) :
+	m_profiler(profiler),
+	m_phase(phase),
+	m_start_us(profiler ? porting::getTimeUs() : 0)
+{
+}
+
+TickPhaseTimer::~TickPhaseTimer()
+{
+	if (m_profiler)
+		m_profiler->add(m_phase, porting::getTimeUs() - m_start_us);
+}
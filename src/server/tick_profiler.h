@@ -0,0 +1,115 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "irrlichttypes.h"
+#include "util/basic_macros.h"
+#include "util/metricsbackend.h"
+
+// Phases of a server step that are always known.
+// More phases (e.g. globalsteps of single mods) are added on demand.
+enum TickPhase : u16 {
+	// Whole Server::AsyncRunStep()
+	TP_STEP,
+	TP_SEND_BLOCKS,
+	TP_ACTIVE_BLOCKS,
+	// Part of TP_ACTIVE_BLOCKS
+	TP_LBMS,
+	TP_NODE_TIMERS,
+	TP_ABMS,
+	// All globalsteps, they are also counted per mod
+	TP_GLOBALSTEPS,
+	TP_OBJECTS,
+	TP_MAP_UNLOAD,
+	TP_LIQUIDS,
+	TP_OBJECT_MESSAGES,
+	TP_MAP_EDIT_EVENTS,
+	TP_MAP_SAVE,
+	TP_BUILTIN_COUNT
+};
+
+/*
+	Records how long each phase of the server step took, in histograms with
+	fixed buckets. Unlike Profiler averages, this shows the tail latency,
+	e.g. which phase was responsible for a lag spike.
+
+	Time spent in a phase is summed up over a step and recorded once the step
+	is finished. The histograms are exported through MetricsBackend and can
+	be printed, including estimated percentiles.
+*/
+class TickProfiler
+{
+public:
+	// Upper bounds of the buckets, in milliseconds
+	static constexpr std::array<double, 15> BUCKETS = {
+		0.1, 0.2, 0.5, 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+	};
+
+	TickProfiler(MetricsBackend *mb);
+
+	DISABLE_CLASS_COPY(TickProfiler)
+
+	// Returns the phase of the given name, adding it if necessary
+	u16 getPhase(const std::string &name);
+
+	// Adds time spent in a phase during the current step
+	void add(u16 phase, u64 time_us);
+
+	// Records the time of all phases that ran during the step
+	void finishStep(u64 step_time_us);
+
+	// Prints count, p50, p99 and max of every phase since the last reset
+	void print(std::ostream &o);
+	void reset();
+
+private:
+	struct Histogram {
+		std::array<u32, BUCKETS.size() + 1> counts {};
+		u32 count = 0;
+		double max = 0.0;
+
+		void observe(double value);
+		// Estimates the given quantile, as the upper bound of its bucket
+		double quantile(double q) const;
+	};
+
+	struct Phase {
+		std::string name;
+		MetricHistogramPtr metric;
+		Histogram histogram;
+		u64 pending_us = 0;
+		bool pending = false;
+	};
+
+	u16 addPhase(const std::string &name);
+
+	MetricsBackend *m_metrics_backend;
+	std::mutex m_mutex;
+	std::vector<Phase> m_phases;
+	std::unordered_map<std::string, u16> m_phase_ids;
+};
+
+/*
+	Adds the time until it goes out of scope to a phase.
+	Does nothing if profiler is null.
+*/
+class TickPhaseTimer
+{
+public:
+	TickPhaseTimer(TickProfiler *profiler, u16 phase);
+	~TickPhaseTimer();
+
+	DISABLE_CLASS_COPY(TickPhaseTimer)
+
+private:
+	TickProfiler *m_profiler;
+	u16 m_phase;
+	u64 m_start_us;
+};
@@ -11,6 +11,7 @@
 #include "mapblock.h"
 #include "nodedef.h"
 #include "nodemetadata.h"
+#include "noise.h"
 #include "gamedef.h"
 #include "porting.h"
 #include "profiler.h"
@@ -23,6 +24,7 @@
 #include "util/basic_macros.h"
 #include "util/pointedthing.h"
 #include "threading/mutex_auto_lock.h"
+#include "threading/thread_pool.h"
 #include "filesys.h"
 #include "gameparams.h"
 #include "database/database-dummy.h"
@@ -37,6 +39,7 @@
 #include "irrlicht_changes/printing.h"
 #include "server/luaentity_sao.h"
 #include "server/player_sao.h"
+#include "server/tick_profiler.h"
 
 #define LBM_NAME_ALLOWED_CHARS "abcdefghijklmnopqrstuvwxyz0123456789_:"
 
@@ -251,8 +254,19 @@ void LBMManager::applyLBMs(ServerEnvironment *env, MapBlock *block,
 	};
 	std::unordered_map<content_t, LBMToRun> to_run;
 
+	const auto &counts = block->getContentCounts();
+
 	// Note: the iteration count of this outer loop is typically very low, so it's ok.
 	for (auto it = getLBMsIntroducedAfter(stamp); it != m_lbm_lookup.end(); ++it) {
+		// Use the content statistics to skip the scan if nothing can match
+		u32 remaining = 0;
+		for (const auto &cc : counts) {
+			if (it->second.lookup(cc.content))
+				remaining += cc.count;
+		}
+		if (remaining == 0)
+			continue;
+
 		v3s16 pos;
 		content_t c;
 
@@ -261,9 +275,10 @@ void LBMManager::applyLBMs(ServerEnvironment *env, MapBlock *block,
 		const LBMContentMapping::lbm_vector *lbm_list = nullptr;
 		LBMToRun *batch = nullptr;
 
-		for (pos.Z = 0; pos.Z < MAP_BLOCKSIZE; pos.Z++)
-		for (pos.Y = 0; pos.Y < MAP_BLOCKSIZE; pos.Y++)
-		for (pos.X = 0; pos.X < MAP_BLOCKSIZE; pos.X++) {
+		// Stop as soon as all matching nodes were found
+		for (pos.Z = 0; pos.Z < MAP_BLOCKSIZE && remaining > 0; pos.Z++)
+		for (pos.Y = 0; pos.Y < MAP_BLOCKSIZE && remaining > 0; pos.Y++)
+		for (pos.X = 0; pos.X < MAP_BLOCKSIZE && remaining > 0; pos.X++) {
 			c = block->getNodeNoCheck(pos).getContent();
 
 			bool c_changed = false;
@@ -283,6 +298,7 @@ void LBMManager::applyLBMs(ServerEnvironment *env, MapBlock *block,
 				// we were here before so the list must be filled
 				assert(!batch->l.empty());
 			}
+			remaining--;
 		}
 	}
 
@@ -469,6 +485,9 @@ ServerEnvironment::ServerEnvironment(std::unique_ptr<ServerMap> map,
 
 	m_active_object_gauge = mb->addGauge(
 		"minetest_env_active_objects", "Number of active objects");
+
+	if (u16 abm_scan_threads = g_settings->getU16("abm_scan_threads"))
+		m_abm_scan_pool = std::make_unique<ThreadPool>("ABMScan", abm_scan_threads);
 }
 
 void ServerEnvironment::init()
@@ -808,13 +827,13 @@ struct ActiveABM
 	s16 min_y, max_y;
 };
 
-#define CONTENT_TYPE_CACHE_MAX 64
-
 class ABMHandler
 {
 private:
 	ServerEnvironment *m_env;
 	std::vector<std::vector<ActiveABM> *> m_aabms;
+	// Whether any of the ABMs looks at neighbors
+	bool m_check_neighbors = false;
 public:
 	ABMHandler(std::vector<ABMWithState> &abms,
 		float dtime_s, ServerEnvironment *env,
@@ -866,6 +885,9 @@ class ABMHandler
 				ndef->getIds(s, aabm.without_neighbors);
 			SORT_AND_UNIQUE(aabm.without_neighbors);
 
+			if (!aabm.required_neighbors.empty() || !aabm.without_neighbors.empty())
+				m_check_neighbors = true;
+
 			// Trigger contents
 			std::vector<content_t> ids;
 			for (const auto &s : abm->getTriggerContents())
@@ -913,27 +935,65 @@ class ABMHandler
 		wider += wider_unknown_count * wider / wider_known_count;
 		return active_object_count;
 	}
+	// Returns the number of nodes in the block that ABMs are registered for
+	u32 countTriggerNodes(MapBlock *block) const
+	{
+		u32 count = 0;
+		for (const auto &it : block->getContentCounts()) {
+			if (it.content < m_aabms.size() && m_aabms[it.content])
+				count += it.count;
+		}
+		return count;
+	}
+
+	// Checks required_neighbors and without_neighbors around p0,
+	// get_content returns the content at a position relative to the block.
+	template <typename F>
+	static bool checkNeighbors(const ActiveABM &aabm, v3s16 p0, F &&get_content)
+	{
+		const bool check_required_neighbors = !aabm.required_neighbors.empty();
+		const bool check_without_neighbors = !aabm.without_neighbors.empty();
+		if (!check_required_neighbors && !check_without_neighbors)
+			return true;
+
+		v3s16 p1;
+		bool have_required = false;
+		for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
+		for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
+		for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
+		{
+			if(p1 == p0)
+				continue;
+			content_t c = get_content(p1);
+			if (check_required_neighbors && !have_required) {
+				if (CONTAINS(aabm.required_neighbors, c)) {
+					if (!check_without_neighbors)
+						return true;
+					have_required = true;
+				}
+			}
+			if (check_without_neighbors) {
+				if (CONTAINS(aabm.without_neighbors, c))
+					return false;
+			}
+		}
+		// No required neighbor found?
+		return have_required || !check_required_neighbors;
+	}
+
 	void apply(MapBlock *block, int &blocks_scanned, int &abms_run, int &blocks_cached)
 	{
 		if (m_aabms.empty())
 			return;
 
-		// Check the content type cache first
+		// Check the content type statistics first
 		// to see whether there are any ABMs
 		// to be run at all for this block.
-		if (!block->contents.empty()) {
-			assert(!block->do_not_cache_contents); // invariant
+		if (block->hasContentCounts())
 			blocks_cached++;
-			bool run_abms = false;
-			for (content_t c : block->contents) {
-				if (c < m_aabms.size() && m_aabms[c]) {
-					run_abms = true;
-					break;
-				}
-			}
-			if (!run_abms)
-				return;
-		}
+		u32 remaining = countTriggerNodes(block);
+		if (remaining == 0)
+			return;
 		blocks_scanned++;
 
 		ServerMap *map = &m_env->getServerMap();
@@ -942,8 +1002,17 @@ class ABMHandler
 		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
 		m_env->m_added_objects = 0;
 
-		bool want_contents_cached = block->contents.empty() && !block->do_not_cache_contents;
+		auto get_content = [&] (v3s16 p1) -> content_t {
+			if (block->isValidPosition(p1)) {
+				// if the neighbor is found on the same map block
+				// get it straight from there
+				return block->getNodeNoCheck(p1).getContent();
+			}
+			// otherwise consult the map
+			return map->getNode(p1 + block->getPosRelative()).getContent();
+		};
 
+		bool block_changed = false;
 		v3s16 p0;
 		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
 		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
@@ -952,19 +1021,6 @@ class ABMHandler
 			MapNode n = block->getNodeNoCheck(p0);
 			content_t c = n.getContent();
 
-			// Cache content types as we go
-			if (want_contents_cached && !CONTAINS(block->contents, c)) {
-				if (block->contents.size() >= CONTENT_TYPE_CACHE_MAX) {
-					// Too many different nodes... don't try to cache
-					want_contents_cached = false;
-					block->do_not_cache_contents = true;
-					block->contents.clear();
-					block->contents.shrink_to_fit();
-				} else {
-					block->contents.push_back(c);
-				}
-			}
-
 			if (c >= m_aabms.size() || !m_aabms[c])
 				continue;
 
@@ -976,49 +1032,8 @@ class ABMHandler
 				if (myrand() % aabm.chance != 0)
 					continue;
 
-				// Check neighbors
-				const bool check_required_neighbors = !aabm.required_neighbors.empty();
-				const bool check_without_neighbors = !aabm.without_neighbors.empty();
-				if (check_required_neighbors || check_without_neighbors) {
-					v3s16 p1;
-					bool have_required = false;
-					for(p1.X = p0.X-1; p1.X <= p0.X+1; p1.X++)
-					for(p1.Y = p0.Y-1; p1.Y <= p0.Y+1; p1.Y++)
-					for(p1.Z = p0.Z-1; p1.Z <= p0.Z+1; p1.Z++)
-					{
-						if(p1 == p0)
-							continue;
-						content_t c;
-						if (block->isValidPosition(p1)) {
-							// if the neighbor is found on the same map block
-							// get it straight from there
-							const MapNode &n = block->getNodeNoCheck(p1);
-							c = n.getContent();
-						} else {
-							// otherwise consult the map
-							MapNode n = map->getNode(p1 + block->getPosRelative());
-							c = n.getContent();
-						}
-						if (check_required_neighbors && !have_required) {
-							if (CONTAINS(aabm.required_neighbors, c)) {
-								if (!check_without_neighbors)
-									goto neighbor_found;
-								have_required = true;
-							}
-						}
-						if (check_without_neighbors) {
-							if (CONTAINS(aabm.without_neighbors, c))
-								goto neighbor_invalid;
-						}
-					}
-					if (have_required || !check_required_neighbors)
-						goto neighbor_found;
-					// No required neighbor found
-					neighbor_invalid:
+				if (!checkNeighbors(aabm, p0, get_content))
 					continue;
-				}
-
-				neighbor_found:
 
 				abms_run++;
 				// Call all the trigger variations
@@ -1040,6 +1055,167 @@ class ABMHandler
 				if (n.getContent() != c)
 					break;
 			}
+
+			// An ABM that changed the block may have placed trigger nodes
+			// further on, so the count can't be relied on anymore
+			if (!block->hasContentCounts())
+				block_changed = true;
+
+			// No need to look further once all of them were found
+			if (!block_changed && --remaining == 0)
+				return;
+		}
+	}
+
+	/*
+		Split version of apply(), for scanning blocks on multiple threads:
+		prepareScan() and trigger() run on the server thread, scan() may run
+		on any thread as long as the map is not modified meanwhile.
+	*/
+
+	struct Candidate {
+		u16 index; // into MapBlock data
+		content_t c;
+		const ActiveABM *aabm;
+	};
+
+	struct BlockScan {
+		MapBlock *block;
+		// The block and its neighbors, indexed by getNeighborIndex()
+		MapBlock *neighbors[27] = {};
+		u32 seed;
+		// Number of nodes ABMs are registered for
+		u32 trigger_nodes;
+		std::vector<Candidate> candidates;
+	};
+
+	static inline int getNeighborIndex(s16 x, s16 y, s16 z)
+	{
+		return (z + 1) * 9 + (y + 1) * 3 + (x + 1);
+	}
+
+	// Returns false if the block doesn't need to be scanned
+	bool prepareScan(MapBlock *block, BlockScan &scan, int &blocks_cached)
+	{
+		if (m_aabms.empty())
+			return false;
+		// The content type statistics are cached in the block, so they have
+		// to be updated here rather than by the scanning threads.
+		if (block->hasContentCounts())
+			blocks_cached++;
+		scan.trigger_nodes = countTriggerNodes(block);
+		if (scan.trigger_nodes == 0)
+			return false;
+
+		scan.block = block;
+		scan.seed = myrand();
+		scan.candidates.clear();
+
+		std::fill(std::begin(scan.neighbors), std::end(scan.neighbors), nullptr);
+		scan.neighbors[getNeighborIndex(0, 0, 0)] = block;
+		if (m_check_neighbors) {
+			ServerMap *map = &m_env->getServerMap();
+			const v3s16 bp = block->getPos();
+			for (s16 z = -1; z <= 1; z++)
+			for (s16 y = -1; y <= 1; y++)
+			for (s16 x = -1; x <= 1; x++) {
+				if (x == 0 && y == 0 && z == 0)
+					continue;
+				scan.neighbors[getNeighborIndex(x, y, z)] =
+						map->getBlockNoCreateNoEx(bp + v3s16(x, y, z));
+			}
+		}
+		return true;
+	}
+
+	// Finds the nodes that the ABMs should be triggered for
+	void scan(BlockScan &scan) const
+	{
+		MapBlock *block = scan.block;
+		PcgRandom rand(scan.seed);
+
+		u32 remaining = scan.trigger_nodes;
+
+		auto get_content = [&] (v3s16 p1) -> content_t {
+			if (block->isValidPosition(p1))
+				return block->getNodeNoCheck(p1).getContent();
+			v3s16 off(
+				p1.X < 0 ? -1 : (p1.X >= MAP_BLOCKSIZE ? 1 : 0),
+				p1.Y < 0 ? -1 : (p1.Y >= MAP_BLOCKSIZE ? 1 : 0),
+				p1.Z < 0 ? -1 : (p1.Z >= MAP_BLOCKSIZE ? 1 : 0));
+			MapBlock *block2 = scan.neighbors[getNeighborIndex(off.X, off.Y, off.Z)];
+			if (!block2)
+				return CONTENT_IGNORE;
+			return block2->getNodeNoCheck(p1 - off * MAP_BLOCKSIZE).getContent();
+		};
+
+		v3s16 p0;
+		u16 index = 0;
+		for(p0.Z=0; p0.Z<MAP_BLOCKSIZE; p0.Z++)
+		for(p0.Y=0; p0.Y<MAP_BLOCKSIZE; p0.Y++)
+		for(p0.X=0; p0.X<MAP_BLOCKSIZE; p0.X++, index++)
+		{
+			content_t c = block->getNodeNoCheck(p0).getContent();
+
+			if (c >= m_aabms.size() || !m_aabms[c])
+				continue;
+
+			s16 y = p0.Y + block->getPosRelative().Y;
+			for (const ActiveABM &aabm : *m_aabms[c]) {
+				if ((y < aabm.min_y) || (y > aabm.max_y))
+					continue;
+
+				if (rand.next() % aabm.chance != 0)
+					continue;
+
+				if (!checkNeighbors(aabm, p0, get_content))
+					continue;
+
+				scan.candidates.push_back({index, c, &aabm});
+			}
+
+			if (--remaining == 0)
+				return;
+		}
+	}
+
+	// Runs the ABMs for the candidates found by scan()
+	void trigger(BlockScan &scan, int &abms_run)
+	{
+		MapBlock *block = scan.block;
+		if (scan.candidates.empty() || block->isOrphan())
+			return;
+
+		ServerMap *map = &m_env->getServerMap();
+
+		u32 active_object_count_wider;
+		u32 active_object_count = this->countObjects(block, map, active_object_count_wider);
+		m_env->m_added_objects = 0;
+
+		for (const Candidate &cand : scan.candidates) {
+			v3s16 p0(cand.index % MAP_BLOCKSIZE,
+				(cand.index / MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+				cand.index / (MAP_BLOCKSIZE * MAP_BLOCKSIZE));
+			// Skip nodes that were changed by an ABM in the meantime
+			MapNode n = block->getNodeNoCheck(p0);
+			if (n.getContent() != cand.c)
+				continue;
+
+			v3s16 p = p0 + block->getPosRelative();
+			abms_run++;
+			// Call all the trigger variations
+			cand.aabm->abm->trigger(m_env, p, n);
+			cand.aabm->abm->trigger(m_env, p, n,
+				active_object_count, active_object_count_wider);
+
+			if (block->isOrphan())
+				return;
+
+			// Count surrounding objects again if the abms added any
+			if(m_env->m_added_objects > 0) {
+				active_object_count = countObjects(block, map, active_object_count_wider);
+				m_env->m_added_objects = 0;
+			}
 		}
 	}
 };
@@ -1083,7 +1259,10 @@ void ServerEnvironment::activateBlock(MapBlock *block, u32 additional_dtime)
 		return;
 
 	/* Handle LoadingBlockModifiers */
-	m_lbm_mgr.applyLBMs(this, block, stamp, (float)dtime_s);
+	{
+		TickPhaseTimer tpt(m_server->getTickProfiler(), TP_LBMS);
+		m_lbm_mgr.applyLBMs(this, block, stamp, (float)dtime_s);
+	}
 	if (block->isOrphan())
 		return;
 
@@ -1374,6 +1553,7 @@ void ServerEnvironment::step(float dtime)
 {
 	ScopeProfiler sp2(g_profiler, "ServerEnv::step()", SPT_AVG);
 	const auto start_time = porting::getTimeUs();
+	TickProfiler *tick_profiler = m_server->getTickProfiler();
 
 	/* Step time of day */
 	stepTimeOfDay(dtime);
@@ -1400,6 +1580,7 @@ void ServerEnvironment::step(float dtime)
 	*/
 	if (m_active_blocks_mgmt_interval.step(dtime, m_cache_active_block_mgmt_interval / m_fast_active_block_divider)) {
 		ScopeProfiler sp(g_profiler, "ServerEnv: update active blocks", SPT_AVG);
+		TickPhaseTimer tpt(tick_profiler, TP_ACTIVE_BLOCKS);
 
 		/*
 			Get player block positions
@@ -1489,6 +1670,7 @@ void ServerEnvironment::step(float dtime)
 	*/
 	if (m_active_blocks_nodemetadata_interval.step(dtime, m_cache_nodetimer_interval)) {
 		ScopeProfiler sp(g_profiler, "ServerEnv: Run node timers", SPT_AVG);
+		TickPhaseTimer tpt(tick_profiler, TP_NODE_TIMERS);
 
 		float dtime = m_cache_nodetimer_interval;
 
@@ -1517,6 +1699,7 @@ void ServerEnvironment::step(float dtime)
 
 	if (m_active_block_modifier_interval.step(dtime, m_cache_abm_interval)) {
 		ScopeProfiler sp(g_profiler, "SEnv: modify in blocks avg per interval", SPT_AVG);
+		TickPhaseTimer tpt(tick_profiler, TP_ABMS);
 		TimeTaker timer("modify in active blocks per interval");
 
 		// Shuffle to prevent persistent artifacts of ordering
@@ -1539,26 +1722,70 @@ void ServerEnvironment::step(float dtime)
 		int i = 0;
 		// determine the time budget for ABMs
 		u32 max_time_ms = m_cache_abm_interval * 1000 * m_cache_abm_time_budget;
-		for (const v3s16 &p : output) {
-			MapBlock *block = m_map->getBlockNoCreateNoEx(p);
-			if (!block)
-				continue;
+		auto over_budget = [&] () -> bool {
+			u32 time_ms = timer.getTimerTime();
+			if (time_ms <= max_time_ms)
+				return false;
+			warningstream << "active block modifiers took "
+				  << time_ms << "ms (processed " << i << " of "
+				  << output.size() << " active blocks)" << std::endl;
+			return true;
+		};
 
-			i++;
+		if (!m_abm_scan_pool) {
+			for (const v3s16 &p : output) {
+				MapBlock *block = m_map->getBlockNoCreateNoEx(p);
+				if (!block)
+					continue;
 
-			// Set current time as timestamp
-			block->setTimestampNoChangedFlag(m_game_time);
+				i++;
 
-			/* Handle ActiveBlockModifiers */
-			abmhandler.apply(block, blocks_scanned, abms_run, blocks_cached);
+				// Set current time as timestamp
+				block->setTimestampNoChangedFlag(m_game_time);
 
-			u32 time_ms = timer.getTimerTime();
+				/* Handle ActiveBlockModifiers */
+				abmhandler.apply(block, blocks_scanned, abms_run, blocks_cached);
 
-			if (time_ms > max_time_ms) {
-				warningstream << "active block modifiers took "
-					  << time_ms << "ms (processed " << i << " of "
-					  << output.size() << " active blocks)" << std::endl;
-				break;
+				if (over_budget())
+					break;
+			}
+		} else {
+			// Scan a batch of blocks in parallel, then run the ABMs on the
+			// server thread. Batches keep the time budget meaningful.
+			const size_t batch_size = 32 * (m_abm_scan_pool->getThreadCount() + 1);
+			std::vector<ABMHandler::BlockScan> scans;
+			size_t next = 0;
+			bool stop = false;
+			while (next < output.size() && !stop) {
+				size_t count = 0;
+				for (; next < output.size() && count < batch_size; next++) {
+					MapBlock *block = m_map->getBlockNoCreateNoEx(output[next]);
+					if (!block)
+						continue;
+
+					i++;
+
+					// Set current time as timestamp
+					block->setTimestampNoChangedFlag(m_game_time);
+
+					if (count == scans.size())
+						scans.emplace_back();
+					if (abmhandler.prepareScan(block, scans[count], blocks_cached))
+						count++;
+				}
+				blocks_scanned += count;
+
+				m_abm_scan_pool->parallelFor(count, [&] (size_t k) {
+					abmhandler.scan(scans[k]);
+				});
+
+				for (size_t k = 0; k < count; k++) {
+					abmhandler.trigger(scans[k], abms_run);
+					if (over_budget()) {
+						stop = true;
+						break;
+					}
+				}
 			}
 		}
 		g_profiler->avg("ServerEnv: active blocks", m_active_blocks.m_abm_list.size());
@@ -1572,7 +1799,10 @@ void ServerEnvironment::step(float dtime)
 	/*
 		Step script environment (run global on_step())
 	*/
-	m_script->environment_Step(dtime);
+	{
+		TickPhaseTimer tpt(tick_profiler, TP_GLOBALSTEPS);
+		m_script->environment_Step(dtime);
+	}
 
 	m_script->stepAsync();
 
@@ -1581,6 +1811,7 @@ void ServerEnvironment::step(float dtime)
 	*/
 	{
 		ScopeProfiler sp(g_profiler, "ServerEnv: Run SAO::step()", SPT_AVG);
+		TickPhaseTimer tpt(tick_profiler, TP_OBJECTS);
 
 		// This helps the objects to send data at the same time
 		bool send_recommended = false;
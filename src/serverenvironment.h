@@ -27,6 +27,7 @@ struct StaticObject;
 class ServerActiveObject;
 class Server;
 class ServerScripting;
+class ThreadPool;
 enum AccessDeniedCode : u8;
 typedef u16 session_t;
 
@@ -275,6 +276,12 @@ class ServerEnvironment final : public Environment
 	*/
 	u16 addActiveObject(std::unique_ptr<ServerActiveObject> object);
 
+	// Called by ServerActiveObject::setBasePosition
+	void updateActiveObjectPosition(ServerActiveObject *obj, const v3f &old_pos)
+	{
+		m_ao_manager.updateObjectPosition(obj, old_pos);
+	}
+
 	void invalidateActiveObjectObserverCaches();
 
 	/*
@@ -486,6 +493,8 @@ class ServerEnvironment final : public Environment
 	u32 m_last_clear_objects_time = 0;
 	// Active block modifiers
 	std::vector<ABMWithState> m_abms;
+	// Scans active blocks for ABMs, if enabled
+	std::unique_ptr<ThreadPool> m_abm_scan_pool;
 	LBMManager m_lbm_mgr;
 	// An interval for generally sending object positions and stuff
 	float m_recommended_send_interval = 0.1f;
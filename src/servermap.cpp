@@ -26,6 +26,9 @@
 #include "database/database-sqlite3.h"
 #include "script/scripting_server.h"
 #include "irrlicht_changes/printing.h"
+#include "server/block_prefetcher.h"
+#include "server/block_saver.h"
+#include "threading/thread_pool.h"
 #if USE_LEVELDB
 #include "database/database-leveldb.h"
 #endif
@@ -43,6 +46,12 @@
 void MapDatabaseAccessor::loadBlock(v3s16 blockpos, std::string &ret)
 {
 	ret.clear();
+	// Not locked, the saver may have to compress the data first
+	if (saver && saver->get(blockpos, ret))
+		return;
+	MutexAutoLock dblock(mutex);
+	if (prefetcher && prefetcher->take(blockpos, ret))
+		return;
 	dbase->loadBlock(blockpos, &ret);
 	if (ret.empty() && dbase_ro)
 		dbase_ro->loadBlock(blockpos, &ret);
@@ -98,6 +107,19 @@ ServerMap::ServerMap(const std::string &savedir, IGameDef *gamedef,
 		"minetest_map_loaded_blocks", "Number of loaded blocks");
 
 	m_map_compression_level = rangelim(g_settings->getS16("map_compression_level_disk"), -1, 9);
+	m_pack_idle_blocks = g_settings->getBool("mapblock_packing");
+
+	if (u16 threads = g_settings->getU16("map_save_threads")) {
+		m_saver = std::make_unique<AsyncBlockSaver>(&m_db,
+			SER_FMT_VER_HIGHEST_WRITE, m_map_compression_level, threads);
+		m_db.saver = m_saver.get();
+	}
+	if (u32 blocks = g_settings->getU32("map_prefetch_blocks")) {
+		m_prefetcher = std::make_unique<BlockPrefetcher>(&m_db, blocks);
+		m_db.prefetcher = m_prefetcher.get();
+	}
+	if (u16 threads = g_settings->getU16("liquid_threads"))
+		m_liquid_pool = std::make_unique<ThreadPool>("Liquid", threads);
 
 	try {
 		// If directory exists, check contents and load if possible
@@ -159,6 +181,13 @@ ServerMap::~ServerMap()
 				 << ", exception: " << e.what() << std::endl;
 	}
 
+	m_db.prefetcher = nullptr;
+	m_prefetcher.reset();
+
+	// Wait for all blocks to be written
+	m_db.saver = nullptr;
+	m_saver.reset();
+
 	m_emerge->resetMap();
 
 	{
@@ -551,10 +580,50 @@ void ServerMap::save(ModifiedState save_level)
 
 void ServerMap::listAllLoadableBlocks(std::vector<v3s16> &dst)
 {
-	MutexAutoLock dblock(m_db.mutex);
-	m_db.dbase->listAllLoadableBlocks(dst);
-	if (m_db.dbase_ro)
-		m_db.dbase_ro->listAllLoadableBlocks(dst);
+	// Taken first, so that blocks written in the meantime are listed by
+	// the database instead
+	std::unordered_set<v3s16> pending;
+	if (m_saver) {
+		std::vector<v3s16> positions;
+		m_saver->listPending(positions);
+		pending.insert(positions.begin(), positions.end());
+	}
+
+	{
+		MutexAutoLock dblock(m_db.mutex);
+		m_db.dbase->listAllLoadableBlocks(dst);
+		if (m_db.dbase_ro)
+			m_db.dbase_ro->listAllLoadableBlocks(dst);
+	}
+
+	if (!pending.empty()) {
+		for (v3s16 p : dst)
+			pending.erase(p);
+		dst.insert(dst.end(), pending.begin(), pending.end());
+	}
+}
+
+void ServerMap::getBlockSamples(u32 count, u8 version, std::vector<std::string> &dst)
+{
+	std::vector<v3s16> positions;
+	listAllLoadableBlocks(positions);
+	if (positions.empty() || count == 0)
+		return;
+
+	const size_t step = std::max<size_t>(1, positions.size() / count);
+	std::string blob;
+	for (size_t i = 0; i < positions.size(); i += step) {
+		m_db.loadBlock(positions[i], blob);
+		// Blocks with unknown nodes are of no use
+		DetachedBlock detached;
+		if (!deSerializeDetached(blob, positions[i], detached) ||
+				!detached.block->correctNodeIds(detached.nimap, false))
+			continue;
+
+		std::ostringstream os(std::ios_base::binary);
+		detached.block->serializeUncompressed(os, version, false);
+		dst.push_back(os.str());
+	}
 }
 
 void ServerMap::listAllLoadedBlocks(std::vector<v3s16> &dst)
@@ -609,21 +678,40 @@ MapDatabase *ServerMap::createDatabase(
 
 void ServerMap::beginSave()
 {
+	// The saver takes care of transactions
+	if (m_saver)
+		return;
 	MutexAutoLock dblock(m_db.mutex);
 	m_db.dbase->beginSave();
 }
 
 void ServerMap::endSave()
 {
+	if (m_saver)
+		return;
 	MutexAutoLock dblock(m_db.mutex);
 	m_db.dbase->endSave();
 }
 
 bool ServerMap::saveBlock(MapBlock *block)
 {
-	// FIXME: serialization happens under mutex
-	MutexAutoLock dblock(m_db.mutex);
-	return saveBlock(block, m_db.dbase, m_map_compression_level);
+	if (m_saver) {
+		// Only take a snapshot here, the rest happens in the background
+		std::ostringstream os(std::ios_base::binary);
+		block->serializeUncompressed(os, SER_FMT_VER_HIGHEST_WRITE, true);
+		m_saver->push(block->getPos(), os.str());
+		block->resetModified();
+	} else {
+		// FIXME: serialization happens under mutex
+		MutexAutoLock dblock(m_db.mutex);
+		if (!saveBlock(block, m_db.dbase, m_map_compression_level))
+			return false;
+	}
+
+	// Whatever was read ahead is outdated now
+	if (m_prefetcher)
+		m_prefetcher->invalidate(block->getPos());
+	return true;
 }
 
 bool ServerMap::saveBlock(MapBlock *block, MapDatabase *db, int compression_level)
@@ -706,6 +794,51 @@ MapBlock *ServerMap::loadBlock(const std::string &blob, v3s16 p3d, bool save_aft
 
 	assert(block);
 
+	finishLoadBlock(block, created_new, save_after_load);
+	return block;
+}
+
+bool ServerMap::deSerializeDetached(const std::string &blob, v3s16 p3d,
+		DetachedBlock &dst)
+{
+	ScopeProfiler sp(g_profiler, "ServerMap: deSer block", SPT_AVG, PRECISION_MICRO);
+	dst.block = std::make_unique<MapBlock>(p3d, m_gamedef);
+
+	try {
+		std::istringstream is(blob, std::ios_base::binary);
+		u8 version = readU8(is);
+		if (is.fail() || !dst.block->deSerializeDetached(is, version, dst.nimap)) {
+			dst.block.reset();
+			return false;
+		}
+	} catch (SerializationError &e) {
+		// loadBlock() knows how to report and handle this
+		dst.block.reset();
+		return false;
+	}
+
+	return true;
+}
+
+MapBlock *ServerMap::loadBlock(DetachedBlock &&detached)
+{
+	ScopeProfiler sp(g_profiler, "ServerMap: load block", SPT_AVG, PRECISION_MICRO);
+	// Resolving the names needs the nodedef, hence the lock
+	detached.block->correctNodeIds(detached.nimap);
+
+	v3s16 p3d = detached.block->getPos();
+	MapSector *sector = createSector(v2s16(p3d.X, p3d.Z));
+	assert(!sector->getBlockNoCreateNoEx(p3d.Y));
+
+	MapBlock *ret = detached.block.get();
+	sector->insertBlock(std::move(detached.block));
+
+	finishLoadBlock(ret, true, false);
+	return ret;
+}
+
+void ServerMap::finishLoadBlock(MapBlock *block, bool created_new, bool save_after_load)
+{
 	if (created_new) {
 		ReflowScan scanner(this, m_emerge->ndef);
 		scanner.scan(block, &m_transforming_liquid);
@@ -726,8 +859,6 @@ MapBlock *ServerMap::loadBlock(const std::string &blob, v3s16 p3d, bool save_aft
 
 	// We just loaded it, so it's up-to-date.
 	block->resetModified();
-
-	return block;
 }
 
 MapBlock* ServerMap::loadBlock(v3s16 blockpos)
@@ -735,7 +866,6 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 	std::string data;
 	{
 		ScopeProfiler sp(g_profiler, "ServerMap: load block - sync (sum)");
-		MutexAutoLock dblock(m_db.mutex);
 		m_db.loadBlock(blockpos, data);
 	}
 
@@ -747,8 +877,13 @@ MapBlock* ServerMap::loadBlock(v3s16 blockpos)
 bool ServerMap::deleteBlock(v3s16 blockpos)
 {
 	MutexAutoLock dblock(m_db.mutex);
+	// Otherwise a pending save could bring the block back
+	if (m_saver)
+		m_saver->discard(blockpos);
 	if (!m_db.dbase->deleteBlock(blockpos))
 		return false;
+	if (m_prefetcher)
+		m_prefetcher->invalidate(blockpos);
 
 	MapBlock *block = getBlockNoCreateNoEx(blockpos);
 	if (block) {
@@ -859,6 +994,297 @@ static s8 get_max_liquid_level(NodeNeighbor nb, s8 current_max_node_level)
 	return max_node_level;
 }
 
+/*
+	How a queued liquid node is going to change
+*/
+struct LiquidTransform {
+	v3s16 p;
+	// Neighbors to queue in any case
+	v3s16 queue[6];
+	u8 num_queue = 0;
+	// Whether the node has not reached its level yet, due to viscosity
+	bool must_reflow = false;
+
+	// Everything below is only set if the node changes
+	bool changed = false;
+	bool floating_node_above = false;
+	// Whether on_flood() is to be called
+	bool flood = false;
+	MapNode n_old;
+	MapNode n_new;
+	// Neighbors to queue after the change
+	v3s16 queue_changed[6];
+	u8 num_queue_changed = 0;
+};
+
+/*
+	Decides how the liquid node at p0 changes, without modifying anything.
+	get_node(p) is used to read the map.
+*/
+template <typename F>
+static void decide_liquid_transform(const NodeDefManager *ndef, v3s16 p0,
+		const F &get_node, LiquidTransform &t)
+{
+	t.p = p0;
+	MapNode n0 = get_node(p0);
+
+	/*
+		Collect information about current node
+	 */
+	s8 liquid_level = -1;
+	// The liquid node which will be placed there if
+	// the liquid flows into this node.
+	content_t liquid_kind = CONTENT_IGNORE;
+	// The node which will be placed there if liquid
+	// can't flow into this node.
+	content_t floodable_node = CONTENT_AIR;
+	const ContentFeatures &cf = ndef->get(n0);
+	LiquidType liquid_type = cf.liquid_type;
+	switch (liquid_type) {
+		case LIQUID_SOURCE:
+			liquid_level = LIQUID_LEVEL_SOURCE;
+			liquid_kind = cf.liquid_alternative_flowing_id;
+			break;
+		case LIQUID_FLOWING:
+			liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
+			liquid_kind = n0.getContent();
+			break;
+		case LIQUID_NONE:
+			// if this node is 'floodable', it *could* be transformed
+			// into a liquid, otherwise, continue with the next node.
+			if (!cf.floodable)
+				return;
+			floodable_node = n0.getContent();
+			liquid_kind = CONTENT_AIR;
+			break;
+		case LiquidType_END:
+			break;
+	}
+
+	/*
+		Collect information about the environment
+	 */
+	NodeNeighbor sources[6]; // surrounding sources
+	int num_sources = 0;
+	NodeNeighbor flows[6]; // surrounding flowing liquid nodes
+	int num_flows = 0;
+	NodeNeighbor airs[6]; // surrounding air
+	int num_airs = 0;
+	NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
+	int num_neutrals = 0;
+	bool flowing_down = false;
+	bool ignored_sources = false;
+	bool floating_node_above = false;
+	for (u16 i = 0; i < 6; i++) {
+		NeighborType nt = NEIGHBOR_SAME_LEVEL;
+		switch (i) {
+			case 0:
+				nt = NEIGHBOR_UPPER;
+				break;
+			case 5:
+				nt = NEIGHBOR_LOWER;
+				break;
+			default:
+				break;
+		}
+		v3s16 npos = p0 + liquid_6dirs[i];
+		NodeNeighbor nb(get_node(npos), nt, npos);
+		const ContentFeatures &cfnb = ndef->get(nb.n);
+		if (nt == NEIGHBOR_UPPER && cfnb.floats)
+			floating_node_above = true;
+		switch (cfnb.liquid_type) {
+			case LIQUID_NONE:
+				if (cfnb.floodable) {
+					airs[num_airs++] = nb;
+					// if the current node is a water source the neighbor
+					// should be enqueded for transformation regardless of whether the
+					// current node changes or not.
+					if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
+						t.queue[t.num_queue++] = npos;
+					// if the current node happens to be a flowing node, it will start to flow down here.
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				} else {
+					neutrals[num_neutrals++] = nb;
+					if (nb.n.getContent() == CONTENT_IGNORE) {
+						// If node below is ignore prevent water from
+						// spreading outwards and otherwise prevent from
+						// flowing away as ignore node might be the source
+						if (nb.t == NEIGHBOR_LOWER)
+							flowing_down = true;
+						else
+							ignored_sources = true;
+					}
+				}
+				break;
+			case LIQUID_SOURCE:
+				// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+				if (liquid_kind == CONTENT_AIR)
+					liquid_kind = cfnb.liquid_alternative_flowing_id;
+				if (cfnb.liquid_alternative_flowing_id != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					// Do not count bottom source, it will screw things up
+					if(nt != NEIGHBOR_LOWER)
+						sources[num_sources++] = nb;
+				}
+				break;
+			case LIQUID_FLOWING:
+				if (nb.t != NEIGHBOR_SAME_LEVEL ||
+					(nb.n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK) {
+					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
+					// but exclude falling liquids on the same level, they cannot flow here anyway
+
+					// used to determine if the neighbor can even flow into this node
+					s8 max_level_from_neighbor = get_max_liquid_level(nb, -1);
+					u8 range = ndef->get(cfnb.liquid_alternative_flowing_id).liquid_range;
+
+					if (liquid_kind == CONTENT_AIR &&
+							max_level_from_neighbor >= (LIQUID_LEVEL_MAX + 1 - range))
+						liquid_kind = cfnb.liquid_alternative_flowing_id;
+				}
+				if (cfnb.liquid_alternative_flowing_id != liquid_kind) {
+					neutrals[num_neutrals++] = nb;
+				} else {
+					flows[num_flows++] = nb;
+					if (nb.t == NEIGHBOR_LOWER)
+						flowing_down = true;
+				}
+				break;
+			case LiquidType_END:
+				break;
+		}
+	}
+
+	/*
+		decide on the type (and possibly level) of the current node
+	 */
+	content_t new_node_content;
+	s8 new_node_level = -1;
+	s8 max_node_level = -1;
+
+	u8 range = ndef->get(liquid_kind).liquid_range;
+	if (range > LIQUID_LEVEL_MAX + 1)
+		range = LIQUID_LEVEL_MAX + 1;
+
+	if ((num_sources >= 2 && ndef->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
+		// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
+		// or the flowing alternative of the first of the surrounding sources (if it's air), so
+		// it's perfectly safe to use liquid_kind here to determine the new node content.
+		new_node_content = ndef->get(liquid_kind).liquid_alternative_source_id;
+	} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
+		// liquid_kind is set properly, see above
+		max_node_level = new_node_level = LIQUID_LEVEL_MAX;
+		if (new_node_level >= (LIQUID_LEVEL_MAX + 1 - range))
+			new_node_content = liquid_kind;
+		else
+			new_node_content = floodable_node;
+	} else if (ignored_sources && liquid_level >= 0) {
+		// Maybe there are neighboring sources that aren't loaded yet
+		// so prevent flowing away.
+		new_node_level = liquid_level;
+		new_node_content = liquid_kind;
+	} else {
+		// no surrounding sources, so get the maximum level that can flow into this node
+		for (u16 i = 0; i < num_flows; i++) {
+			max_node_level = get_max_liquid_level(flows[i], max_node_level);
+		}
+
+		u8 viscosity = ndef->get(liquid_kind).liquid_viscosity;
+		if (viscosity > 1 && max_node_level != liquid_level) {
+			// amount to gain, limited by viscosity
+			// must be at least 1 in absolute value
+			s8 level_inc = max_node_level - liquid_level;
+			if (level_inc < -viscosity || level_inc > viscosity)
+				new_node_level = liquid_level + level_inc/viscosity;
+			else if (level_inc < 0)
+				new_node_level = liquid_level - 1;
+			else if (level_inc > 0)
+				new_node_level = liquid_level + 1;
+			if (new_node_level != max_node_level)
+				t.must_reflow = true;
+		} else {
+			new_node_level = max_node_level;
+		}
+
+		if (max_node_level >= (LIQUID_LEVEL_MAX + 1 - range))
+			new_node_content = liquid_kind;
+		else
+			new_node_content = floodable_node;
+
+	}
+
+	/*
+		check if anything has changed. if not, just continue with the next node.
+	 */
+	if (new_node_content == n0.getContent() &&
+			(ndef->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
+			((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
+			((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
+			== flowing_down)))
+		return;
+
+	t.changed = true;
+	t.floating_node_above = floating_node_above;
+	t.flood = floodable_node != CONTENT_AIR;
+
+	/*
+		the new node
+	 */
+	t.n_old = n0;
+	//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
+	if (ndef->get(new_node_content).liquid_type == LIQUID_FLOWING) {
+		// set level to last 3 bits, flowing down bit to 4th bit
+		n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
+	} else {
+		// set the liquid level and flow bits to 0
+		n0.param2 &= ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
+	}
+	n0.setContent(new_node_content);
+	t.n_new = n0;
+
+	/*
+		neighbors to enqueue for update
+	 */
+	switch (ndef->get(new_node_content).liquid_type) {
+		case LIQUID_SOURCE:
+		case LIQUID_FLOWING:
+			// make sure source flows into all neighboring nodes
+			for (u16 i = 0; i < num_flows; i++)
+				if (flows[i].t != NEIGHBOR_UPPER)
+					t.queue_changed[t.num_queue_changed++] = flows[i].p;
+			for (u16 i = 0; i < num_airs; i++)
+				if (airs[i].t != NEIGHBOR_UPPER)
+					t.queue_changed[t.num_queue_changed++] = airs[i].p;
+			break;
+		case LIQUID_NONE:
+			// this flow has turned to air; neighboring flows might need to do the same
+			for (u16 i = 0; i < num_flows; i++)
+				t.queue_changed[t.num_queue_changed++] = flows[i].p;
+			break;
+		case LiquidType_END:
+			break;
+	}
+}
+
+/*
+	Queued liquid nodes within the same mapblock, for transforming them
+	on a worker thread
+*/
+struct LiquidRegion {
+	v3s16 blockpos;
+	// The block and the neighbors sharing a face with it,
+	// indexed by get_region_neighbor_index()
+	MapBlock *neighbors[27] = {};
+	// Into the list of queued nodes
+	std::vector<u32> indices;
+};
+
+static inline int get_region_neighbor_index(v3s16 d)
+{
+	return (d.Z + 1) * 9 + (d.Y + 1) * 3 + (d.X + 1);
+}
+
 void ServerMap::transforming_liquid_add(v3s16 p)
 {
 	m_transforming_liquid.push_back(p);
@@ -867,7 +1293,6 @@ void ServerMap::transforming_liquid_add(v3s16 p)
 void ServerMap::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks,
 		ServerEnvironment *env)
 {
-	u32 loopcount = 0;
 	u32 initial_size = m_transforming_liquid.size();
 
 	/*if(initial_size != 0)
@@ -883,243 +1308,32 @@ void ServerMap::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks,
 	u32 liquid_loop_max = g_settings->getS32("liquid_loop_max");
 	u32 loop_max = liquid_loop_max;
 
-	while (m_transforming_liquid.size() != 0)
-	{
-		// This should be done here so that it is done when continue is used
-		if (loopcount >= initial_size || loopcount >= loop_max)
-			break;
-		loopcount++;
+	auto apply = [&] (const LiquidTransform &t) {
+		for (u8 i = 0; i < t.num_queue; i++)
+			m_transforming_liquid.push_back(t.queue[i]);
+		if (t.must_reflow)
+			must_reflow.push_back(t.p);
+		if (!t.changed)
+			return;
 
-		/*
-			Get a queued transforming liquid node
-		*/
-		v3s16 p0 = m_transforming_liquid.front();
-		m_transforming_liquid.pop_front();
-
-		MapNode n0 = getNode(p0);
-
-		/*
-			Collect information about current node
-		 */
-		s8 liquid_level = -1;
-		// The liquid node which will be placed there if
-		// the liquid flows into this node.
-		content_t liquid_kind = CONTENT_IGNORE;
-		// The node which will be placed there if liquid
-		// can't flow into this node.
-		content_t floodable_node = CONTENT_AIR;
-		const ContentFeatures &cf = m_nodedef->get(n0);
-		LiquidType liquid_type = cf.liquid_type;
-		switch (liquid_type) {
-			case LIQUID_SOURCE:
-				liquid_level = LIQUID_LEVEL_SOURCE;
-				liquid_kind = cf.liquid_alternative_flowing_id;
-				break;
-			case LIQUID_FLOWING:
-				liquid_level = (n0.param2 & LIQUID_LEVEL_MASK);
-				liquid_kind = n0.getContent();
-				break;
-			case LIQUID_NONE:
-				// if this node is 'floodable', it *could* be transformed
-				// into a liquid, otherwise, continue with the next node.
-				if (!cf.floodable)
-					continue;
-				floodable_node = n0.getContent();
-				liquid_kind = CONTENT_AIR;
-				break;
-			case LiquidType_END:
-				break;
-		}
-
-		/*
-			Collect information about the environment
-		 */
-		NodeNeighbor sources[6]; // surrounding sources
-		int num_sources = 0;
-		NodeNeighbor flows[6]; // surrounding flowing liquid nodes
-		int num_flows = 0;
-		NodeNeighbor airs[6]; // surrounding air
-		int num_airs = 0;
-		NodeNeighbor neutrals[6]; // nodes that are solid or another kind of liquid
-		int num_neutrals = 0;
-		bool flowing_down = false;
-		bool ignored_sources = false;
-		bool floating_node_above = false;
-		for (u16 i = 0; i < 6; i++) {
-			NeighborType nt = NEIGHBOR_SAME_LEVEL;
-			switch (i) {
-				case 0:
-					nt = NEIGHBOR_UPPER;
-					break;
-				case 5:
-					nt = NEIGHBOR_LOWER;
-					break;
-				default:
-					break;
-			}
-			v3s16 npos = p0 + liquid_6dirs[i];
-			NodeNeighbor nb(getNode(npos), nt, npos);
-			const ContentFeatures &cfnb = m_nodedef->get(nb.n);
-			if (nt == NEIGHBOR_UPPER && cfnb.floats)
-				floating_node_above = true;
-			switch (cfnb.liquid_type) {
-				case LIQUID_NONE:
-					if (cfnb.floodable) {
-						airs[num_airs++] = nb;
-						// if the current node is a water source the neighbor
-						// should be enqueded for transformation regardless of whether the
-						// current node changes or not.
-						if (nb.t != NEIGHBOR_UPPER && liquid_type != LIQUID_NONE)
-							m_transforming_liquid.push_back(npos);
-						// if the current node happens to be a flowing node, it will start to flow down here.
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
-					} else {
-						neutrals[num_neutrals++] = nb;
-						if (nb.n.getContent() == CONTENT_IGNORE) {
-							// If node below is ignore prevent water from
-							// spreading outwards and otherwise prevent from
-							// flowing away as ignore node might be the source
-							if (nb.t == NEIGHBOR_LOWER)
-								flowing_down = true;
-							else
-								ignored_sources = true;
-						}
-					}
-					break;
-				case LIQUID_SOURCE:
-					// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-					if (liquid_kind == CONTENT_AIR)
-						liquid_kind = cfnb.liquid_alternative_flowing_id;
-					if (cfnb.liquid_alternative_flowing_id != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						// Do not count bottom source, it will screw things up
-						if(nt != NEIGHBOR_LOWER)
-							sources[num_sources++] = nb;
-					}
-					break;
-				case LIQUID_FLOWING:
-					if (nb.t != NEIGHBOR_SAME_LEVEL ||
-						(nb.n.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK) {
-						// if this node is not (yet) of a liquid type, choose the first liquid type we encounter
-						// but exclude falling liquids on the same level, they cannot flow here anyway
-
-						// used to determine if the neighbor can even flow into this node
-						s8 max_level_from_neighbor = get_max_liquid_level(nb, -1);
-						u8 range = m_nodedef->get(cfnb.liquid_alternative_flowing_id).liquid_range;
-
-						if (liquid_kind == CONTENT_AIR &&
-								max_level_from_neighbor >= (LIQUID_LEVEL_MAX + 1 - range))
-							liquid_kind = cfnb.liquid_alternative_flowing_id;
-					}
-					if (cfnb.liquid_alternative_flowing_id != liquid_kind) {
-						neutrals[num_neutrals++] = nb;
-					} else {
-						flows[num_flows++] = nb;
-						if (nb.t == NEIGHBOR_LOWER)
-							flowing_down = true;
-					}
-					break;
-				case LiquidType_END:
-					break;
-			}
-		}
-
-		/*
-			decide on the type (and possibly level) of the current node
-		 */
-		content_t new_node_content;
-		s8 new_node_level = -1;
-		s8 max_node_level = -1;
-
-		u8 range = m_nodedef->get(liquid_kind).liquid_range;
-		if (range > LIQUID_LEVEL_MAX + 1)
-			range = LIQUID_LEVEL_MAX + 1;
-
-		if ((num_sources >= 2 && m_nodedef->get(liquid_kind).liquid_renewable) || liquid_type == LIQUID_SOURCE) {
-			// liquid_kind will be set to either the flowing alternative of the node (if it's a liquid)
-			// or the flowing alternative of the first of the surrounding sources (if it's air), so
-			// it's perfectly safe to use liquid_kind here to determine the new node content.
-			new_node_content = m_nodedef->get(liquid_kind).liquid_alternative_source_id;
-		} else if (num_sources >= 1 && sources[0].t != NEIGHBOR_LOWER) {
-			// liquid_kind is set properly, see above
-			max_node_level = new_node_level = LIQUID_LEVEL_MAX;
-			if (new_node_level >= (LIQUID_LEVEL_MAX + 1 - range))
-				new_node_content = liquid_kind;
-			else
-				new_node_content = floodable_node;
-		} else if (ignored_sources && liquid_level >= 0) {
-			// Maybe there are neighboring sources that aren't loaded yet
-			// so prevent flowing away.
-			new_node_level = liquid_level;
-			new_node_content = liquid_kind;
-		} else {
-			// no surrounding sources, so get the maximum level that can flow into this node
-			for (u16 i = 0; i < num_flows; i++) {
-				max_node_level = get_max_liquid_level(flows[i], max_node_level);
-			}
-
-			u8 viscosity = m_nodedef->get(liquid_kind).liquid_viscosity;
-			if (viscosity > 1 && max_node_level != liquid_level) {
-				// amount to gain, limited by viscosity
-				// must be at least 1 in absolute value
-				s8 level_inc = max_node_level - liquid_level;
-				if (level_inc < -viscosity || level_inc > viscosity)
-					new_node_level = liquid_level + level_inc/viscosity;
-				else if (level_inc < 0)
-					new_node_level = liquid_level - 1;
-				else if (level_inc > 0)
-					new_node_level = liquid_level + 1;
-				if (new_node_level != max_node_level)
-					must_reflow.push_back(p0);
-			} else {
-				new_node_level = max_node_level;
-			}
-
-			if (max_node_level >= (LIQUID_LEVEL_MAX + 1 - range))
-				new_node_content = liquid_kind;
-			else
-				new_node_content = floodable_node;
-
-		}
-
-		/*
-			check if anything has changed. if not, just continue with the next node.
-		 */
-		if (new_node_content == n0.getContent() &&
-				(m_nodedef->get(n0.getContent()).liquid_type != LIQUID_FLOWING ||
-				((n0.param2 & LIQUID_LEVEL_MASK) == (u8)new_node_level &&
-				((n0.param2 & LIQUID_FLOW_DOWN_MASK) == LIQUID_FLOW_DOWN_MASK)
-				== flowing_down)))
-			continue;
+		const v3s16 p0 = t.p;
+		const MapNode n00 = t.n_old;
+		MapNode n0 = t.n_new;
 
 		/*
 			check if there is a floating node above that needs to be updated.
 		 */
-		if (floating_node_above && new_node_content == CONTENT_AIR)
+		if (t.floating_node_above && n0.getContent() == CONTENT_AIR)
 			check_for_falling.push_back(p0);
 
 		/*
 			update the current node
 		 */
-		MapNode n00 = n0;
-		//bool flow_down_enabled = (flowing_down && ((n0.param2 & LIQUID_FLOW_DOWN_MASK) != LIQUID_FLOW_DOWN_MASK));
-		if (m_nodedef->get(new_node_content).liquid_type == LIQUID_FLOWING) {
-			// set level to last 3 bits, flowing down bit to 4th bit
-			n0.param2 = (flowing_down ? LIQUID_FLOW_DOWN_MASK : 0x00) | (new_node_level & LIQUID_LEVEL_MASK);
-		} else {
-			// set the liquid level and flow bits to 0
-			n0.param2 &= ~(LIQUID_LEVEL_MASK | LIQUID_FLOW_DOWN_MASK);
-		}
-
-		// change the node.
-		n0.setContent(new_node_content);
 
 		// on_flood() the node
-		if (floodable_node != CONTENT_AIR) {
+		if (t.flood) {
 			if (env->getScriptIface()->node_on_flood(p0, n00, n0))
-				continue;
+				return;
 		}
 
 		// Ignore light (because calling voxalgo::update_lighting_nodes)
@@ -1159,27 +1373,35 @@ void ServerMap::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks,
 		/*
 			enqueue neighbors for update if necessary
 		 */
-		switch (m_nodedef->get(n0.getContent()).liquid_type) {
-			case LIQUID_SOURCE:
-			case LIQUID_FLOWING:
-				// make sure source flows into all neighboring nodes
-				for (u16 i = 0; i < num_flows; i++)
-					if (flows[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(flows[i].p);
-				for (u16 i = 0; i < num_airs; i++)
-					if (airs[i].t != NEIGHBOR_UPPER)
-						m_transforming_liquid.push_back(airs[i].p);
-				break;
-			case LIQUID_NONE:
-				// this flow has turned to air; neighboring flows might need to do the same
-				for (u16 i = 0; i < num_flows; i++)
-					m_transforming_liquid.push_back(flows[i].p);
-				break;
-			case LiquidType_END:
+		for (u8 i = 0; i < t.num_queue_changed; i++)
+			m_transforming_liquid.push_back(t.queue_changed[i]);
+	};
+
+	if (m_liquid_pool) {
+		transformLiquidsParallel(std::min(initial_size, loop_max), apply);
+	} else {
+		u32 loopcount = 0;
+		auto get_node = [this] (v3s16 p) { return getNode(p); };
+
+		while (m_transforming_liquid.size() != 0)
+		{
+			// This should be done here so that it is done when continue is used
+			if (loopcount >= initial_size || loopcount >= loop_max)
 				break;
+			loopcount++;
+
+			/*
+				Get a queued transforming liquid node
+			*/
+			v3s16 p0 = m_transforming_liquid.front();
+			m_transforming_liquid.pop_front();
+
+			LiquidTransform t;
+			decide_liquid_transform(m_nodedef, p0, get_node, t);
+			apply(t);
 		}
+		//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
 	}
-	//infostream<<"Map::transformLiquids(): loopcount="<<loopcount<<std::endl;
 
 	for (const auto &iter : must_reflow)
 		m_transforming_liquid.push_back(iter);
@@ -1240,3 +1462,66 @@ void ServerMap::transformLiquids(std::map<v3s16, MapBlock*> &modified_blocks,
 		m_unprocessed_count = m_transforming_liquid.size();
 	}
 }
+
+void ServerMap::transformLiquidsParallel(u32 count,
+		const std::function<void(const LiquidTransform &)> &apply)
+{
+	std::vector<v3s16> queued;
+	queued.reserve(std::min<size_t>(count, m_transforming_liquid.size()));
+	while (m_transforming_liquid.size() != 0 && queued.size() < count) {
+		queued.push_back(m_transforming_liquid.front());
+		m_transforming_liquid.pop_front();
+	}
+
+	// Split up by mapblock
+	std::vector<LiquidRegion> regions;
+	std::unordered_map<v3s16, size_t> region_ids;
+	for (u32 i = 0; i < queued.size(); i++) {
+		v3s16 blockpos = getNodeBlockPos(queued[i]);
+		auto [it, inserted] = region_ids.emplace(blockpos, regions.size());
+		if (inserted)
+			regions.emplace_back().blockpos = blockpos;
+		regions[it->second].indices.push_back(i);
+	}
+	for (LiquidRegion &region : regions) {
+		region.neighbors[get_region_neighbor_index(v3s16(0, 0, 0))] =
+				getBlockNoCreateNoEx(region.blockpos);
+		for (v3s16 dir : liquid_6dirs) {
+			region.neighbors[get_region_neighbor_index(dir)] =
+					getBlockNoCreateNoEx(region.blockpos + dir);
+		}
+	}
+
+	// Every node is decided on based on the map before any change, so
+	// neither the partitioning nor the thread count affect the result.
+	std::vector<LiquidTransform> transforms(queued.size());
+	m_liquid_pool->parallelFor(regions.size(), [&] (size_t k) {
+		const LiquidRegion &region = regions[k];
+		// Neighbors of queued nodes are at most one block away
+		auto get_node = [&region] (v3s16 p) -> MapNode {
+			v3s16 blockpos = getNodeBlockPos(p);
+			MapBlock *block = region.neighbors[
+					get_region_neighbor_index(blockpos - region.blockpos)];
+			if (!block)
+				return {CONTENT_IGNORE};
+			return block->getNodeNoCheck(p - blockpos * MAP_BLOCKSIZE);
+		};
+		for (u32 i : region.indices)
+			decide_liquid_transform(m_nodedef, queued[i], get_node, transforms[i]);
+	});
+
+	// Apply the changes in queue order
+	for (const LiquidTransform &t : transforms) {
+		if (t.changed) {
+			// An on_flood() callback may have changed the node meanwhile
+			MapNode n = getNode(t.p);
+			if (n.getContent() != t.n_old.getContent() ||
+					n.param2 != t.n_old.param2) {
+				m_transforming_liquid.push_back(t.p);
+				continue;
+			}
+		}
+		apply(t);
+	}
+	g_profiler->avg("ServerMap: liquid regions", regions.size());
+}
@@ -4,10 +4,12 @@
 
 #pragma once
 
+#include <functional>
 #include <vector>
 #include <memory>
 
 #include "map.h"
+#include "nameidmapping.h"
 #include "util/container.h" // UniqueQueue
 #include "util/metricsbackend.h" // ptr typedefs
 #include "map_settings_manager.h"
@@ -19,6 +21,17 @@ class EmergeManager;
 class ServerEnvironment;
 struct BlockMakeData;
 class MetricsBackend;
+class AsyncBlockSaver;
+class BlockPrefetcher;
+class ThreadPool;
+struct LiquidTransform;
+
+// A block from ServerMap::deSerializeDetached()
+struct DetachedBlock {
+	std::unique_ptr<MapBlock> block;
+	/// Names of the node ids the block still has, see MapBlock::correctNodeIds()
+	NameIdMapping nimap;
+};
 
 // TODO: this could wrap all calls to MapDatabase, including locking
 struct MapDatabaseAccessor {
@@ -28,9 +41,13 @@ struct MapDatabaseAccessor {
 	MapDatabase *dbase = nullptr;
 	/// Fallback database for read operations
 	MapDatabase *dbase_ro = nullptr;
+	/// Blocks that are yet to be written to dbase, may be null
+	AsyncBlockSaver *saver = nullptr;
+	/// Blocks that were read ahead of time, may be null
+	BlockPrefetcher *prefetcher = nullptr;
 
-	/// Load a block, taking dbase_ro into account.
-	/// @note call locked
+	/// Load a block, taking saver, prefetcher and dbase_ro into account.
+	/// @note call unlocked, this takes the lock as needed
 	void loadBlock(v3s16 blockpos, std::string &ret);
 };
 
@@ -108,6 +125,11 @@ class ServerMap : public Map
 	void listAllLoadableBlocks(std::vector<v3s16> &dst);
 	void listAllLoadedBlocks(std::vector<v3s16> &dst);
 
+	/// Reads up to count blocks spread over the whole database and adds them
+	/// to dst as they would be sent to clients, without compression.
+	/// The blocks aren't loaded into the map.
+	void getBlockSamples(u32 count, u8 version, std::vector<std::string> &dst);
+
 	MapgenParams *getMapgenParams();
 
 	bool saveBlock(MapBlock *block) override;
@@ -118,6 +140,14 @@ class ServerMap : public Map
 	/// Load a block that was already read from disk. Used by EmergeManager.
 	/// @return non-null block (but can be blank)
 	MapBlock *loadBlock(const std::string &blob, v3s16 p, bool save_after_load=false);
+	/// Deserialize a block that was read from disk without touching the map
+	/// or the nodedef, so that it can be done without holding the
+	/// environment lock.
+	/// @return false if this isn't possible, use loadBlock(blob, p) then
+	bool deSerializeDetached(const std::string &blob, v3s16 p, DetachedBlock &dst);
+	/// Insert a block from deSerializeDetached() into the map.
+	/// There must be no block at its position.
+	MapBlock *loadBlock(DetachedBlock &&detached);
 
 	// Helper for deserializing blocks from disk
 	// @throws SerializationError
@@ -155,6 +185,7 @@ class ServerMap : public Map
 			ServerEnvironment *env);
 
 	void transforming_liquid_add(v3s16 p);
+	size_t transforming_liquid_size() { return m_transforming_liquid.size(); }
 
 	MapSettingsManager settings_mgr;
 
@@ -165,6 +196,14 @@ class ServerMap : public Map
 private:
 	friend class ModApiMapgen; // for m_transforming_liquid
 
+	// Fixes up a block that was just loaded into the map
+	void finishLoadBlock(MapBlock *block, bool created_new, bool save_after_load);
+
+	// Decides on up to count queued liquid nodes using m_liquid_pool,
+	// then applies the results on this thread
+	void transformLiquidsParallel(u32 count,
+			const std::function<void(const LiquidTransform &)> &apply);
+
 	// Emerge manager
 	EmergeManager *m_emerge;
 
@@ -184,6 +223,8 @@ class ServerMap : public Map
 	u32 m_unprocessed_count = 0;
 	u64 m_inc_trending_up_start_time = 0; // milliseconds
 	bool m_queue_size_timer_started = false;
+	// Computes liquid transformations, may be null
+	std::unique_ptr<ThreadPool> m_liquid_pool;
 
 	/*
 		Metadata is re-written on disk only if this is true.
@@ -192,6 +233,8 @@ class ServerMap : public Map
 	bool m_map_metadata_changed = true;
 
 	MapDatabaseAccessor m_db;
+	std::unique_ptr<AsyncBlockSaver> m_saver;
+	std::unique_ptr<BlockPrefetcher> m_prefetcher;
 
 	// Map metrics
 	MetricGaugePtr m_loaded_blocks_gauge;
@@ -0,0 +1,141 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#include "thread_pool.h"
+#include <atomic>
+#include "threading/thread.h"
+
+class ThreadPoolWorker : public Thread
+{
+public:
+	ThreadPoolWorker(ThreadPool *pool, const std::string &name) :
+		Thread(name), m_pool(pool)
+	{}
+
+protected:
+	void *run() override
+	{
+		std::function<void()> job;
+		while (m_pool->popJob(job)) {
+			job();
+			job = nullptr;
+			m_pool->jobDone();
+		}
+		return nullptr;
+	}
+
+private:
+	ThreadPool *m_pool;
+};
+
+ThreadPool::ThreadPool(const std::string &name, unsigned int num_threads)
+{
+	m_workers.reserve(num_threads);
+	for (unsigned int i = 0; i < num_threads; i++) {
+		m_workers.emplace_back(std::make_unique<ThreadPoolWorker>(this,
+				name + std::to_string(i)));
+		m_workers.back()->start();
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	if (m_workers.empty()) {
+		waitIdle();
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_job_cv.notify_all();
+	for (auto &worker : m_workers)
+		worker->wait();
+}
+
+void ThreadPool::push(std::function<void()> job)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_jobs.push_back(std::move(job));
+	}
+	m_job_cv.notify_one();
+}
+
+void ThreadPool::waitIdle()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_workers.empty()) {
+		// Nobody else is going to run them
+		while (!m_jobs.empty()) {
+			auto job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+			lock.unlock();
+			job();
+			lock.lock();
+		}
+		return;
+	}
+	m_idle_cv.wait(lock, [this] { return m_jobs.empty() && m_running == 0; });
+}
+
+bool ThreadPool::popJob(std::function<void()> &job)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_job_cv.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+	if (m_jobs.empty())
+		return false;
+	job = std::move(m_jobs.front());
+	m_jobs.pop_front();
+	m_running++;
+	return true;
+}
+
+void ThreadPool::jobDone()
+{
+	bool idle;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_running--;
+		idle = m_jobs.empty() && m_running == 0;
+	}
+	if (idle)
+		m_idle_cv.notify_all();
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)> &fn)
+{
+	if (count == 0)
+		return;
+
+	// Shared between the helpers, which may outlive this call if they
+	// only get to run after all indices have been claimed.
+	struct State {
+		std::atomic<size_t> next{0};
+		std::atomic<size_t> done{0};
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+	auto state = std::make_shared<State>();
+
+	auto work = [state, count, &fn] () {
+		size_t n = 0;
+		for (size_t i; (i = state->next++) < count; n++)
+			fn(i);
+		if (n == 0)
+			return; // don't touch fn, the caller may have returned
+		if (state->done.fetch_add(n) + n == count) {
+			std::lock_guard<std::mutex> lock(state->mutex);
+			state->cv.notify_all();
+		}
+	};
+
+	size_t helpers = std::min<size_t>(m_workers.size(), count - 1);
+	for (size_t i = 0; i < helpers; i++)
+		push(work);
+	work();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->cv.wait(lock, [&] { return state->done == count; });
+}
@@ -0,0 +1,58 @@
+// Luanti
+// SPDX-License-Identifier: LGPL-2.1-or-later
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "util/basic_macros.h"
+
+class ThreadPoolWorker;
+
+/*
+	A fixed set of worker threads that run jobs from a shared queue.
+	Jobs must not throw exceptions.
+*/
+class ThreadPool
+{
+	friend class ThreadPoolWorker;
+
+public:
+	ThreadPool(const std::string &name, unsigned int num_threads);
+	// Finishes all queued jobs before returning, on the calling thread if
+	// there are no workers
+	~ThreadPool();
+
+	DISABLE_CLASS_COPY(ThreadPool)
+
+	unsigned int getThreadCount() const { return m_workers.size(); }
+
+	// Queues a job to be run by any worker
+	void push(std::function<void()> job);
+
+	// Blocks until the queue is empty and no job is running anymore
+	void waitIdle();
+
+	// Calls fn(i) for every i in [0, count) and returns once all calls are done.
+	// The calling thread helps out, so this also works with zero workers.
+	void parallelFor(size_t count, const std::function<void(size_t)> &fn);
+
+private:
+	// Returns false if the pool is shutting down and there is no more work
+	bool popJob(std::function<void()> &job);
+	void jobDone();
+
+	std::vector<std::unique_ptr<ThreadPoolWorker>> m_workers;
+
+	std::mutex m_mutex;
+	std::condition_variable m_job_cv;
+	std::condition_variable m_idle_cv;
+	std::deque<std::function<void()>> m_jobs;
+	size_t m_running = 0;
+	bool m_stopping = false;
+};
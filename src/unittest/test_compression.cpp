@@ -22,6 +22,7 @@ class TestCompression : public TestBase {
 	void testZlibCompression();
 	void testZlibLargeData();
 	void testZstdLargeData();
+	void testZstdDictionary();
 	void testZlibLimit();
 	void _testZlibLimit(u32 size, u32 limit);
 };
@@ -34,6 +35,7 @@ void TestCompression::runTests(IGameDef *gamedef)
 	TEST(testZlibCompression);
 	TEST(testZlibLargeData);
 	TEST(testZstdLargeData);
+	TEST(testZstdDictionary);
 	TEST(testZlibLimit);
 }
 
@@ -196,6 +198,61 @@ void TestCompression::testZstdLargeData()
 	}
 }
 
+void TestCompression::testZstdDictionary()
+{
+	// Similar data made of a few recurring pieces
+	const char *words[] = {"default:stone", "default:dirt_with_grass",
+		"air", "default:water_source", "\x12\x00\x34\xff\x07"};
+	PseudoRandom pseudorandom(5611);
+	auto make_sample = [&] () {
+		std::string s;
+		while (s.size() < 2000) {
+			s.append(words[pseudorandom.range(0, ARRLEN(words) - 1)]);
+			s.push_back(pseudorandom.range(0, 3));
+		}
+		return s;
+	};
+
+	std::vector<std::string> samples;
+	for (int i = 0; i < 500; i++)
+		samples.push_back(make_sample());
+	ZstdDictionary dict(trainZstdDictionary(samples, 4096));
+	UASSERT(dict.getId() != 0);
+	UASSERT(dict.getData().size() <= 4096);
+
+	const std::string data = make_sample();
+	std::ostringstream os_plain(std::ios::binary), os_dict(std::ios::binary);
+	compressZstd(data, os_plain, 0);
+	compressZstd(data, os_dict, 0, &dict);
+	infostream << "Test: compressZstd " << data.size() << " -> "
+		<< os_plain.str().size() << ", with dictionary "
+		<< os_dict.str().size() << std::endl;
+	UASSERT(os_dict.str().size() < os_plain.str().size());
+
+	auto decompress_with = [] (const std::string &in, const ZstdDictionary *d) {
+		std::istringstream is(in, std::ios::binary);
+		std::ostringstream os(std::ios::binary);
+		decompressZstd(is, os, d);
+		return os.str();
+	};
+	UASSERT(decompress_with(os_dict.str(), &dict) == data);
+	// The dictionary is only used if the data needs it
+	UASSERT(decompress_with(os_plain.str(), &dict) == data);
+	EXCEPTION_CHECK(SerializationError, decompress_with(os_dict.str(), nullptr));
+
+	EXCEPTION_CHECK(SerializationError, ZstdDictionary("not a dictionary"));
+
+	// Nothing helps with random data
+	samples.clear();
+	for (int i = 0; i < 100; i++) {
+		std::string s(1000, '\0');
+		for (char &c : s)
+			c = pseudorandom.range(0, 255);
+		samples.push_back(std::move(s));
+	}
+	UASSERT(trainZstdDictionary(samples, 4096).empty());
+}
+
 void TestCompression::testZlibLimit()
 {
 	// edge cases
@@ -11,6 +11,7 @@
 #include "network/peerhandler.h"
 #include "network/mtp/internal.h"
 #include "network/networkpacket.h"
+#include "network/lossy_link.h"
 #include "network/socket.h"
 
 class TestConnection : public TestBase {
@@ -27,7 +28,14 @@ class TestConnection : public TestBase {
 
 	void testNetworkPacketSerialize();
 	void testHelpers();
+	void testReliablePacketBuffer();
 	void testConnectSendReceive();
+	void testConnectSendReceiveWorkers();
+	void testCubicWindow();
+	void testLossyLink();
+	void testPacketPriority();
+
+	u32 sendWithPriorities(u32 bulk_count);
 };
 
 static TestConnection g_test_instance;
@@ -36,7 +44,12 @@ void TestConnection::runTests(IGameDef *gamedef)
 {
 	TEST(testNetworkPacketSerialize);
 	TEST(testHelpers);
+	TEST(testReliablePacketBuffer);
 	TEST(testConnectSendReceive);
+	TEST(testConnectSendReceiveWorkers);
+	TEST(testCubicWindow);
+	TEST(testLossyLink);
+	TEST(testPacketPriority);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -140,9 +153,100 @@ void TestConnection::testHelpers()
 	UASSERT(readU8(&p2[0]) == con::PACKET_TYPE_RELIABLE);
 	UASSERT(readU16(&p2[1]) == seqnum);
 	UASSERT(readU8(&p2[3]) == data1[0]);
+
+	// Split into three chunks of at most 100 bytes
+	SharedBuffer<u8> data3(250);
+	for (u32 i = 0; i < data3.getSize(); i++)
+		data3[i] = i;
+	u16 split_seqnum = 7;
+	std::list<SharedBuffer<u8>> chunks;
+	con::makeAutoSplitPacket(data3, 100, split_seqnum, &chunks);
+	UASSERTEQ(u16, split_seqnum, 8);
+	UASSERTEQ(size_t, chunks.size(), 3);
+	u32 offset = 0, chunk_num = 0;
+	for (const auto &chunk : chunks) {
+		UASSERT(chunk.getSize() <= 100);
+		UASSERT(readU8(&chunk[0]) == con::PACKET_TYPE_SPLIT);
+		UASSERTEQ(u16, readU16(&chunk[1]), 7);
+		UASSERTEQ(u16, readU16(&chunk[3]), 3);
+		UASSERTEQ(u16, readU16(&chunk[5]), chunk_num);
+		UASSERT(memcmp(&chunk[7], &data3[offset], chunk.getSize() - 7) == 0);
+		offset += chunk.getSize() - 7;
+		chunk_num++;
+	}
+	UASSERTEQ(u32, offset, data3.getSize());
 }
 
 
+void TestConnection::testReliablePacketBuffer()
+{
+	Address a(127,0,0,1, 10);
+	SharedBuffer<u8> data(1);
+	data[0] = 42;
+	auto make = [&] (u16 seqnum) {
+		return con::makePacket(a, con::makeReliablePacket(data, seqnum),
+				PROTOCOL_ID, PEER_ID_SERVER, 0);
+	};
+
+	con::ReliablePacketBuffer buffer;
+	u16 first;
+	UASSERT(buffer.empty());
+	UASSERT(!buffer.getFirstSeqnum(first));
+
+	// Out of order and across the wrap around
+	const u16 next_expected = 65530;
+	for (u16 seqnum : {3, 65533, 0, 65535, 65531}) {
+		auto p = make(seqnum);
+		buffer.insert(p, next_expected);
+	}
+	UASSERTEQ(u32, buffer.size(), 5);
+	UASSERT(buffer.getFirstSeqnum(first));
+	UASSERTEQ(u16, first, 65531);
+
+	// A resent packet is not added twice
+	{
+		auto p = make(0);
+		buffer.insert(p, next_expected);
+		UASSERTEQ(u32, buffer.size(), 5);
+	}
+
+	UASSERTEQ(u16, buffer.popSeqnum(65535)->getSeqnum(), 65535);
+	EXCEPTION_CHECK(con::NotFoundException, buffer.popSeqnum(65535));
+	EXCEPTION_CHECK(con::NotFoundException, buffer.popSeqnum(1));
+	UASSERTEQ(u16, buffer.popSeqnum(3)->getSeqnum(), 3);
+
+	// Many packets at once
+	for (u32 i = 1; i < 2000; i++) {
+		auto p = make(i);
+		buffer.insert(p, next_expected);
+	}
+	UASSERTEQ(u32, buffer.size(), 3 + 1999);
+
+	for (u16 expected : {65531, 65533, 0, 1, 2, 3}) {
+		UASSERT(buffer.getFirstSeqnum(first));
+		UASSERTEQ(u16, first, expected);
+		UASSERTEQ(u16, buffer.popFirst()->getSeqnum(), expected);
+	}
+	UASSERTEQ(u32, buffer.size(), 2002 - 6);
+	UASSERTEQ(u16, buffer.popSeqnum(1999)->getSeqnum(), 1999);
+	UASSERTEQ(u16, buffer.popSeqnum(4)->getSeqnum(), 4);
+	UASSERT(buffer.getFirstSeqnum(first));
+	UASSERTEQ(u16, first, 5);
+
+	// The ring shrinks while the packets are taken out
+	for (u16 seqnum = 1990; seqnum < 1999; seqnum++)
+		UASSERTEQ(u16, buffer.popSeqnum(seqnum)->getSeqnum(), seqnum);
+	for (u16 expected = 5; expected < 1990; expected++)
+		UASSERTEQ(u16, buffer.popFirst()->getSeqnum(), expected);
+	UASSERT(buffer.empty());
+	{
+		auto p = make(10);
+		buffer.insert(p, next_expected);
+		UASSERT(buffer.getFirstSeqnum(first));
+		UASSERTEQ(u16, first, 10);
+	}
+}
+
 void TestConnection::testConnectSendReceive()
 {
 
@@ -355,3 +459,156 @@ void TestConnection::testConnectSendReceive()
 	UASSERT(hand_server.count == 1);
 	UASSERT(hand_server.last_id >= 2);
 }
+
+void TestConnection::testConnectSendReceiveWorkers()
+{
+	std::string old_threads = g_settings->get("network_receive_threads");
+	g_settings->setU16("network_receive_threads", 2);
+	try {
+		testConnectSendReceive();
+	} catch (...) {
+		g_settings->set("network_receive_threads", old_threads);
+		throw;
+	}
+	g_settings->set("network_receive_threads", old_threads);
+}
+
+void TestConnection::testCubicWindow()
+{
+	con::CubicWindow cubic;
+	cubic.reset(START_RELIABLE_WINDOW_SIZE);
+	UASSERT(cubic.inSlowStart());
+
+	// Slow start grows by one packet per ACK
+	cubic.onAck(100, 0.0f, 0.1f);
+	UASSERT(cubic.getWindow() == START_RELIABLE_WINDOW_SIZE + 100);
+
+	// A loss cuts the window once per round trip
+	const float before = cubic.getWindow();
+	cubic.onLoss(1.0f, 0.1f);
+	const float after = cubic.getWindow();
+	UASSERT(after < before && after > before / 2);
+	UASSERT(!cubic.inSlowStart());
+	cubic.onLoss(1.05f, 0.1f);
+	UASSERT(cubic.getWindow() == after);
+
+	// Regrows quickly towards the old window, then slowly around it
+	float t = 1.0f;
+	while (cubic.getWindow() < before - 1) {
+		t += 0.1f;
+		cubic.onAck(cubic.getWindow(), t, 0.1f);
+		UASSERT(t < 10.0f);
+	}
+	const float plateau = cubic.getWindow();
+	cubic.onAck(cubic.getWindow(), t + 0.1f, 0.1f);
+	UASSERT(cubic.getWindow() - plateau < 10);
+
+	// But never beyond the bounds of the window
+	for (int i = 0; i < 100; i++)
+		cubic.onAck(MAX_RELIABLE_WINDOW_SIZE_SEND, t += 1.0f, 0.1f);
+	UASSERT(cubic.getWindow() == MAX_RELIABLE_WINDOW_SIZE_SEND);
+	for (int i = 0; i < 100; i++)
+		cubic.onLoss(t += 1.0f, 0.1f);
+	UASSERT(cubic.getWindow() == MIN_CONGESTION_WINDOW_SIZE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void TestConnection::testLossyLink()
+{
+	Handler hand_server("server");
+	Handler hand_client("client");
+
+	std::string old_cc = g_settings->get("congestion_control");
+	g_settings->set("congestion_control", "cubic");
+	con::Connection server(512, CONNECTION_TIMEOUT, false, &hand_server);
+	con::Connection client(512, CONNECTION_TIMEOUT, false, &hand_client);
+	g_settings->set("congestion_control", old_cc);
+
+	server.Serve(Address(0, 0, 0, 0, 30005));
+
+	LossyLink link(Address(127, 0, 0, 1, 30005), 30006);
+	link.delay_ms = 10;
+	link.loss_percent = 5;
+	link.start();
+
+	UASSERT(connectForTesting(server, client, Address(127, 0, 0, 1, 30006)));
+	UASSERT(hand_server.count == 1);
+	const session_t peer_id_client = hand_server.last_id;
+
+	const u32 packet_count = 40;
+	for (u32 i = 0; i < packet_count; i++) {
+		NetworkPacket pkt(0x4c, 0);
+		pkt << i;
+		pkt.putRawString(std::string(400, 'x'));
+		server.Send(peer_id_client, 0, &pkt, true);
+	}
+
+	// Reliable packets of a channel arrive complete and in order
+	for (u32 i = 0; i < packet_count; i++) {
+		NetworkPacket pkt;
+		UASSERT(client.ReceiveTimeoutMs(&pkt, 5000));
+		UASSERT(pkt.getCommand() == 0x4c);
+		u32 n;
+		pkt >> n;
+		UASSERTEQ(u32, n, i);
+	}
+}
+
+// Returns how many packets the client received before the critical one
+u32 TestConnection::sendWithPriorities(u32 bulk_count)
+{
+	Handler hand_server("server");
+	Handler hand_client("client");
+
+	con::Connection server(512, CONNECTION_TIMEOUT, false, &hand_server);
+	server.Serve(Address(0, 0, 0, 0, 30004));
+
+	con::Connection client(512, CONNECTION_TIMEOUT, false, &hand_client);
+	UASSERT(connectForTesting(server, client, Address(127, 0, 0, 1, 30004)));
+	UASSERT(hand_server.count == 1);
+	const session_t peer_id_client = hand_server.last_id;
+
+	for (u32 i = 0; i < bulk_count; i++) {
+		NetworkPacket pkt(0x4c, 0);
+		pkt << i;
+		pkt.putRawString(std::string(400, 'x'));
+		server.Send(peer_id_client, 2, &pkt, true, con::PACKET_PRIORITY_BULK);
+	}
+	{
+		NetworkPacket pkt(0x4d, 0);
+		pkt << (u8)1;
+		server.Send(peer_id_client, 0, &pkt, false);
+	}
+
+	u32 received_before = bulk_count + 1;
+	for (u32 i = 0; i < bulk_count + 1; i++) {
+		NetworkPacket pkt;
+		UASSERT(client.ReceiveTimeoutMs(&pkt, 10000));
+		if (pkt.getCommand() == 0x4d)
+			received_before = i;
+	}
+	return received_before;
+}
+
+void TestConnection::testPacketPriority()
+{
+	// A small quota, so that the bulk packets can't all be sent at once
+	std::string old_mppi = g_settings->get("max_packets_per_iteration");
+	g_settings->setU16("max_packets_per_iteration", 4);
+
+	const u32 bulk_count = 48;
+	u32 received_before;
+	try {
+		received_before = sendWithPriorities(bulk_count);
+	} catch (...) {
+		g_settings->set("max_packets_per_iteration", old_mppi);
+		throw;
+	}
+	g_settings->set("max_packets_per_iteration", old_mppi);
+
+	// The critical packet overtakes the queued bulk packets
+	infostream << "Critical packet received after " << received_before
+		<< " of " << bulk_count << " bulk packets" << std::endl;
+	UASSERT(received_before < bulk_count / 2);
+}
@@ -144,6 +144,8 @@ class TestMapblockMeshGenerator : public TestBase {
 	void testSurroundedNode();
 	void testInterliquidSame();
 	void testInterliquidDifferent();
+	void testPatchedRows();
+	void testLod();
 };
 
 static TestMapblockMeshGenerator g_test_instance;
@@ -155,6 +157,8 @@ void TestMapblockMeshGenerator::runTests(IGameDef *gamedef)
 	TEST(testSurroundedNode);
 	TEST(testInterliquidSame);
 	TEST(testInterliquidDifferent);
+	TEST(testPatchedRows);
+	TEST(testLod);
 }
 
 namespace quad {
@@ -252,4 +256,90 @@ void TestMapblockMeshGenerator::testInterliquidDifferent()
 	UASSERT(checkMeshEqual(buf.vertices, buf.indices, {quad::xn, quad::xp, quad::yn, quad::yp, quad::zn, quad::zp}));
 }
 
+void TestMapblockMeshGenerator::testPatchedRows()
+{
+	MockGameDef gamedef;
+	content_t stone = gamedef.addSimpleNode("stone", 42);
+	content_t wood = gamedef.addSimpleNode("wood", 13);
+	gamedef.finalize();
+
+	constexpr s16 side = 4;
+	MeshMakeData data{gamedef.ndef(), side, MeshGrid{1}};
+	data.m_generate_minimap = false;
+	data.m_smooth_lighting = true;
+	data.m_enable_water_reflections = false;
+	data.m_blockpos = {0, 0, 0};
+	for (s16 x = -1; x <= side; x++)
+	for (s16 y = -1; y <= side; y++)
+	for (s16 z = -1; z <= side; z++)
+		data.m_vmanip.setNode({x, y, z}, MapNode((x + y + z) % 3 ? stone : CONTENT_AIR));
+
+	RetainedMeshGeometry retained;
+	{
+		MeshCollector col{{}};
+		MapblockMeshGenerator{&data, &col}.generate();
+		retained.keep(&data, std::move(col));
+	}
+
+	data.m_vmanip.setNode({1, 2, 1}, {wood, 0, 0});
+
+	std::vector<bool> dirty;
+	UASSERT(retained.findDirtyRows(&data, dirty));
+	UASSERTEQ(std::size_t, std::count(dirty.begin(), dirty.end(), true), 9);
+
+	MeshCollector patched{{}};
+	MapblockMeshGenerator{&data, &patched}.generate(retained.collector, dirty);
+	MeshCollector full{{}};
+	MapblockMeshGenerator{&data, &full}.generate();
+
+	// Rows are generated in the same order, so the geometry is identical
+	for (int layer = 0; layer < MAX_TILE_LAYERS; layer++) {
+		UASSERTEQ(std::size_t, patched.prebuffers[layer].size(),
+				full.prebuffers[layer].size());
+		for (std::size_t i = 0; i < full.prebuffers[layer].size(); i++) {
+			auto &&got = patched.prebuffers[layer][i];
+			auto &&expected = full.prebuffers[layer][i];
+			UASSERTEQ(u32, got.layer.texture_id, expected.layer.texture_id);
+			UASSERT(got.vertices == expected.vertices);
+			UASSERT(got.indices == expected.indices);
+		}
+	}
+	UASSERTEQ(f32, patched.m_bounding_radius_sq, full.m_bounding_radius_sq);
+}
+
+void TestMapblockMeshGenerator::testLod()
+{
+	MockGameDef gamedef;
+	content_t stone = gamedef.addSimpleNode("stone", 42);
+	gamedef.finalize();
+
+	// flat ground, 2 nodes high
+	constexpr s16 side = 4;
+	MeshMakeData data{gamedef.ndef(), side, MeshGrid{1}};
+	data.m_generate_minimap = false;
+	data.m_smooth_lighting = false;
+	data.m_enable_water_reflections = false;
+	data.m_blockpos = {0, 0, 0};
+	data.m_lod = 1;
+	for (s16 x = -1; x <= side; x++)
+	for (s16 y = -1; y <= side; y++)
+	for (s16 z = -1; z <= side; z++)
+		data.m_vmanip.setNode({x, y, z}, MapNode(y < 2 ? stone : CONTENT_AIR));
+
+	MeshCollector col{{}};
+	MapblockMeshGenerator{&data, &col}.generateLod();
+	UASSERTEQ(std::size_t, col.prebuffers[0].size(), 1);
+	UASSERTEQ(std::size_t, col.prebuffers[1].size(), 0);
+
+	// only the tops of the 4 cells of 2x2x2 nodes are visible
+	auto &&buf = col.prebuffers[0][0];
+	UASSERTEQ(u32, buf.layer.texture_id, 42);
+	UASSERTEQ(std::size_t, buf.vertices.size(), 4 * 4);
+	UASSERTEQ(std::size_t, buf.indices.size(), 4 * 6);
+	for (auto &vertex : buf.vertices) {
+		UASSERT(vertex.Normal == v3f(0, 1, 0));
+		UASSERTEQ(f32, vertex.Pos.Y, 1.5f * BS);
+	}
+}
+
 }
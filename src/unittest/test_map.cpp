@@ -21,8 +21,15 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <cstdio>
 #include <unordered_set>
 #include <unordered_map>
+#include <sstream>
 #include "mapblock.h"
 #include "dummymap.h"
+#include "serialization.h"
+#include "servermap.h"
+#include "database/database-dummy.h"
+#include "server/block_prefetcher.h"
+#include "server/block_saver.h"
+#include "server/serialized_block_cache.h"
 
 class TestMap : public TestBase
 {
@@ -36,6 +43,9 @@ class TestMap : public TestBase
 	void testForEachNodeInArea(IGameDef *gamedef);
 	void testForEachNodeInAreaBlank(IGameDef *gamedef);
 	void testForEachNodeInAreaEmpty(IGameDef *gamedef);
+	void testAsyncBlockSaver(IGameDef *gamedef);
+	void testBlockPrefetcher();
+	void testSerializedBlockCache();
 };
 
 static TestMap g_test_instance;
@@ -46,6 +56,9 @@ void TestMap::runTests(IGameDef *gamedef)
 	TEST(testForEachNodeInArea, gamedef);
 	TEST(testForEachNodeInAreaBlank, gamedef);
 	TEST(testForEachNodeInAreaEmpty, gamedef);
+	TEST(testAsyncBlockSaver, gamedef);
+	TEST(testBlockPrefetcher);
+	TEST(testSerializedBlockCache);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -169,3 +182,225 @@ void TestMap::testForEachNodeInAreaEmpty(IGameDef *gamedef)
 		return true;
 	});
 }
+
+// Fails to save the given number of blocks
+class FlakyDatabase : public Database_Dummy
+{
+public:
+	int failures = 0;
+	// Whether failing throws instead of returning false
+	bool throws = false;
+	int open_transactions = 0;
+
+	void beginSave() override { open_transactions++; }
+	void endSave() override { open_transactions--; }
+
+	bool saveBlock(const v3s16 &pos, std::string_view data) override
+	{
+		if (failures > 0) {
+			failures--;
+			if (throws)
+				throw DatabaseException("flaky");
+			return false;
+		}
+		return Database_Dummy::saveBlock(pos, data);
+	}
+};
+
+void TestMap::testAsyncBlockSaver(IGameDef *gamedef)
+{
+	Database_Dummy db;
+	MapDatabaseAccessor accessor;
+	accessor.dbase = &db;
+
+	const u8 version = SER_FMT_VER_HIGHEST_WRITE;
+	auto serialize = [&] (MapBlock &block) {
+		std::ostringstream os(std::ios_base::binary);
+		block.serializeUncompressed(os, version, true);
+		return os.str();
+	};
+	auto load = [&] (v3s16 pos) {
+		std::string blob;
+		accessor.loadBlock(pos, blob);
+		UASSERT(!blob.empty());
+		MapBlock block(pos, gamedef);
+		std::istringstream is(blob, std::ios_base::binary);
+		ServerMap::deSerializeBlock(&block, is);
+		return block.getNodeNoCheck({1, 2, 3});
+	};
+
+	{
+		AsyncBlockSaver saver(&accessor, version, -1, 2);
+		accessor.saver = &saver;
+
+		for (s16 i = 0; i < 600; i++) {
+			MapBlock block({i, 0, 0}, gamedef);
+			block.setNode({1, 2, 3}, MapNode(t_CONTENT_STONE, 0, i & 0xff));
+			saver.push(block.getPos(), serialize(block));
+			if (i % 3 == 0) {
+				// Queued again before it was necessarily written
+				block.setNode({1, 2, 3}, MapNode(t_CONTENT_GRASS));
+				saver.push(block.getPos(), serialize(block));
+			}
+		}
+
+		// Visible right away, whether written or not
+		UASSERT(load({1, 0, 0}) == MapNode(t_CONTENT_STONE, 0, 1));
+		UASSERT(load({3, 0, 0}) == MapNode(t_CONTENT_GRASS));
+
+		saver.flush();
+		UASSERTEQ(size_t, saver.size(), 0);
+		accessor.saver = nullptr;
+	}
+
+	std::vector<v3s16> all;
+	db.listAllLoadableBlocks(all);
+	UASSERTEQ(size_t, all.size(), 600);
+	UASSERT(load({2, 0, 0}) == MapNode(t_CONTENT_STONE, 0, 2));
+	UASSERT(load({300, 0, 0}) == MapNode(t_CONTENT_GRASS));
+	UASSERT(load({599, 0, 0}) == MapNode(t_CONTENT_STONE, 0, 599 & 0xff));
+
+	// Blocks that failed to be written are kept and written later
+	FlakyDatabase flaky_db;
+	flaky_db.failures = 1;
+	accessor.dbase = &flaky_db;
+	{
+		AsyncBlockSaver saver(&accessor, version, -1, 2);
+		accessor.saver = &saver;
+
+		MapBlock block({0, 1, 0}, gamedef);
+		block.setNode({1, 2, 3}, MapNode(t_CONTENT_WATER));
+		saver.push(block.getPos(), serialize(block));
+
+		UASSERT(saver.flush());
+		UASSERTEQ(int, flaky_db.failures, 0);
+		UASSERTEQ(size_t, saver.size(), 0);
+
+		// Also when the database throws, which must not leave the
+		// transaction open
+		flaky_db.failures = 1;
+		flaky_db.throws = true;
+		block.setNode({1, 2, 3}, MapNode(t_CONTENT_GRASS));
+		saver.push(block.getPos(), serialize(block));
+		UASSERT(saver.flush());
+		UASSERTEQ(int, flaky_db.failures, 0);
+		UASSERTEQ(int, flaky_db.open_transactions, 0);
+
+		// flush() gives up instead of retrying forever
+		flaky_db.failures = 100;
+		saver.push(block.getPos(), serialize(block));
+		UASSERT(!saver.flush());
+		UASSERTEQ(size_t, saver.size(), 1);
+		UASSERTEQ(int, flaky_db.open_transactions, 0);
+
+		// Pending blocks are listed, and can be dropped when the block
+		// is deleted
+		std::vector<v3s16> pending;
+		saver.listPending(pending);
+		UASSERT(pending == std::vector<v3s16>({block.getPos()}));
+		{
+			MutexAutoLock dblock(accessor.mutex);
+			saver.discard(block.getPos());
+		}
+		UASSERTEQ(size_t, saver.size(), 0);
+		UASSERT(saver.flush());
+		flaky_db.failures = 0;
+		accessor.saver = nullptr;
+	}
+	UASSERT(load({0, 1, 0}) == MapNode(t_CONTENT_GRASS));
+}
+
+void TestMap::testBlockPrefetcher()
+{
+	Database_Dummy db;
+	MapDatabaseAccessor accessor;
+	accessor.dbase = &db;
+
+	auto load = [&] (v3s16 pos) {
+		std::string blob;
+		accessor.loadBlock(pos, blob);
+		return blob;
+	};
+
+	db.saveBlock({1, 0, 0}, "one");
+	db.saveBlock({2, 0, 0}, "two");
+
+	BlockPrefetcher prefetcher(&accessor, 4);
+	accessor.prefetcher = &prefetcher;
+
+	prefetcher.request({{1, 0, 0}, {2, 0, 0}, {3, 0, 0}});
+	prefetcher.wait();
+	UASSERTEQ(size_t, prefetcher.size(), 3);
+
+	// Served from the cache once, even if the database changed
+	db.saveBlock({1, 0, 0}, "uno");
+	UASSERTEQ(std::string, load({1, 0, 0}), "one");
+	UASSERTEQ(std::string, load({1, 0, 0}), "uno");
+
+	// Unless it was invalidated
+	db.saveBlock({2, 0, 0}, "dos");
+	prefetcher.invalidate({2, 0, 0});
+	UASSERTEQ(std::string, load({2, 0, 0}), "dos");
+
+	// Missing blocks are remembered too
+	UASSERTEQ(size_t, prefetcher.size(), 1);
+	UASSERTEQ(std::string, load({3, 0, 0}), "");
+	UASSERTEQ(size_t, prefetcher.size(), 0);
+
+	// The cache is bounded
+	std::vector<v3s16> many;
+	for (s16 i = 0; i < 10; i++)
+		many.emplace_back(i, 1, 0);
+	prefetcher.request(many);
+	prefetcher.wait();
+	UASSERTEQ(size_t, prefetcher.size(), 4);
+
+	accessor.prefetcher = nullptr;
+}
+
+void TestMap::testSerializedBlockCache()
+{
+	SerializedBlockCache cache(100);
+	auto data = [] (char c, size_t n) {
+		return std::make_shared<const std::string>(n, c);
+	};
+
+	cache.put({1, 2, 3}, 29, false, 7, data('a', 40));
+	cache.put({1, 2, 3}, 28, false, 7, data('b', 40));
+	UASSERTEQ(size_t, cache.getBytes(), 80);
+
+	// Different serialization version, compression or modified block
+	UASSERT(!cache.get({1, 2, 3}, 27, false, 7));
+	UASSERT(!cache.get({1, 2, 3}, 29, true, 7));
+	UASSERT(!cache.get({1, 2, 3}, 29, false, 8));
+	// Outdated entries are dropped on access
+	UASSERTEQ(size_t, cache.size(), 1);
+	auto blob = cache.get({1, 2, 3}, 28, false, 7);
+	UASSERT(blob && *blob == std::string(40, 'b'));
+
+	// Replacing an entry
+	cache.put({1, 2, 3}, 28, false, 9, data('c', 20));
+	UASSERTEQ(size_t, cache.getBytes(), 20);
+	blob = cache.get({1, 2, 3}, 28, false, 9);
+	UASSERT(blob && *blob == std::string(20, 'c'));
+
+	// Least recently used entries go first
+	cache.put({0, 0, 1}, 29, false, 1, data('d', 30));
+	cache.put({0, 0, 2}, 29, false, 1, data('e', 30));
+	UASSERT(cache.get({1, 2, 3}, 28, false, 9));
+	cache.put({0, 0, 3}, 29, false, 1, data('f', 30));
+	UASSERTEQ(size_t, cache.size(), 3);
+	UASSERT(!cache.get({0, 0, 1}, 29, false, 1));
+	UASSERT(cache.get({0, 0, 2}, 29, false, 1));
+	UASSERT(cache.get({1, 2, 3}, 28, false, 9));
+	UASSERT(cache.getBytes() <= 100);
+
+	// Too large to be cached at all
+	cache.put({0, 0, 4}, 29, false, 1, data('g', 101));
+	UASSERT(!cache.get({0, 0, 4}, 29, false, 1));
+	UASSERTEQ(size_t, cache.size(), 3);
+
+	cache.clear();
+	UASSERTEQ(size_t, cache.size(), 0);
+	UASSERTEQ(size_t, cache.getBytes(), 0);
+}
@@ -7,9 +7,11 @@
 #include "gamedef.h"
 #include "nodedef.h"
 #include "mapblock.h"
+#include "nameidmapping.h"
 #include "serialization.h"
 #include "noise.h"
 #include "inventory.h"
+#include "voxel.h"
 
 class TestMapBlock : public TestBase
 {
@@ -33,6 +35,16 @@ class TestMapBlock : public TestBase
 
 	// Tests loading a non-standard MapBlock
 	void testLoadNonStd(IGameDef *gamedef);
+
+	void testContentCounts(IGameDef *gamedef);
+
+	void testPacking(IGameDef *gamedef);
+
+	void testContentVersion(IGameDef *gamedef);
+
+	void testNodeChangeLog(IGameDef *gamedef);
+
+	void testSnapshot(IGameDef *gamedef);
 };
 
 static TestMapBlock g_test_instance;
@@ -45,6 +57,11 @@ void TestMapBlock::runTests(IGameDef *gamedef)
 	TEST(testLoad29, gamedef);
 	TEST(testLoad20, gamedef);
 	TEST(testLoadNonStd, gamedef);
+	TEST(testContentCounts, gamedef);
+	TEST(testPacking, gamedef);
+	TEST(testContentVersion, gamedef);
+	TEST(testNodeChangeLog, gamedef);
+	TEST(testSnapshot, gamedef);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -201,12 +218,35 @@ void TestMapBlock::testLoad29(IGameDef *gamedef)
 	iss.str(std::string(buf));
 	u8 version = readU8(iss);
 	UASSERTEQ(int, version, 29);
+	{
+		// must not touch the nodedef, so the unknown node isn't added
+		MapBlock block({}, gamedef);
+		NameIdMapping nimap;
+		UASSERT(block.deSerializeDetached(iss, version, nimap));
+		UASSERT(ndef->getId("default:chest") == CONTENT_IGNORE);
+		UASSERT(!block.correctNodeIds(nimap, false));
+		UASSERT(ndef->getId("default:chest") == CONTENT_IGNORE);
+		iss.clear();
+		iss.seekg(1);
+	}
 	MapBlock block({}, gamedef);
 	block.deSerialize(iss, version, true);
 
 	auto content_chest = ndef->getId("default:chest");
 	UASSERT(content_chest != CONTENT_IGNORE);
 
+	{
+		// now that it is known, this works too
+		iss.clear();
+		iss.seekg(1);
+		MapBlock block2({}, gamedef);
+		NameIdMapping nimap;
+		UASSERT(block2.deSerializeDetached(iss, version, nimap));
+		UASSERT(block2.correctNodeIds(nimap, false));
+		UASSERTEQ(int, block2.getNodeNoEx({0, 1, 0}).getContent(), content_chest);
+		UASSERT(block2.m_node_metadata.get({0, 1, 0}));
+	}
+
 	// there are bricks at each corner
 	const v3s16 pl[] = {
 		{0, 0, 0}, {15, 0, 0}, {0, 15, 0}, {0, 0, 15},
@@ -356,3 +396,292 @@ void TestMapBlock::testLoadNonStd(IGameDef *gamedef)
 	for (s16 i = 0; i < 16; i++)
 		UASSERTEQ(int, block.getNodeNoEx({i, 1, 0}).param2, data_lo[i]);
 }
+
+void TestMapBlock::testContentCounts(IGameDef *gamedef)
+{
+	MapBlock block({}, gamedef);
+	for (size_t i = 0; i < MapBlock::nodecount; ++i)
+		block.getData()[i] = MapNode(i % 3 == 0 ? t_CONTENT_STONE : CONTENT_AIR);
+	block.expireContentCounts();
+	UASSERT(!block.hasContentCounts());
+
+	UASSERTEQ(u16, block.getContentCount(t_CONTENT_STONE), 1366);
+	UASSERT(block.hasContentCounts());
+	UASSERTEQ(u16, block.getContentCount(CONTENT_AIR), 2730);
+	UASSERTEQ(u16, block.getContentCount(t_CONTENT_GRASS), 0);
+	const auto &counts = block.getContentCounts();
+	UASSERTEQ(size_t, counts.size(), 2);
+	UASSERT(counts[0].content < counts[1].content);
+
+	// Modifying the block has to invalidate the statistics
+	block.setNode({0, 0, 0}, MapNode(t_CONTENT_GRASS));
+	UASSERT(!block.hasContentCounts());
+	UASSERTEQ(u16, block.getContentCount(t_CONTENT_STONE), 1365);
+	UASSERTEQ(u16, block.getContentCount(t_CONTENT_GRASS), 1);
+
+	// Even without raising the modified flag
+	block.getData()[1] = MapNode(t_CONTENT_GRASS);
+	UASSERT(!block.hasContentCounts());
+	UASSERTEQ(u16, block.getContentCount(t_CONTENT_GRASS), 2);
+
+	// Many different ids
+	for (size_t i = 0; i < MapBlock::nodecount; ++i)
+		block.getData()[i] = MapNode(i % 100);
+	UASSERTEQ(size_t, block.getContentCounts().size(), 100);
+	u32 total = 0;
+	content_t prev = 0;
+	for (const auto &cc : block.getContentCounts()) {
+		UASSERT(total == 0 || cc.content > prev);
+		prev = cc.content;
+		total += cc.count;
+	}
+	UASSERTEQ(u32, total, MapBlock::nodecount);
+	UASSERTEQ(u16, block.getContentCount(99), 40);
+}
+
+void TestMapBlock::testPacking(IGameDef *gamedef)
+{
+	MapBlock block({}, gamedef);
+	v3s16 p;
+
+	// Uniform block
+	for (size_t i = 0; i < MapBlock::nodecount; ++i)
+		block.getData()[i] = MapNode(CONTENT_AIR, 0x0f);
+	UASSERT(!block.isPacked());
+	UASSERT(block.pack());
+	UASSERT(block.isPacked());
+	UASSERT(block.getNodeDataSize() < 64);
+	UASSERT(block.getNodeNoCheck({3, 4, 5}) == MapNode(CONTENT_AIR, 0x0f));
+	UASSERT(block.isAir());
+
+	// A new node doesn't fit
+	block.setNode({3, 4, 5}, MapNode(t_CONTENT_STONE));
+	UASSERT(!block.isPacked());
+	UASSERT(block.getNodeNoCheck({3, 4, 5}) == MapNode(t_CONTENT_STONE));
+
+	// A few different ones
+	const MapNode nodes[] = {
+		MapNode(CONTENT_AIR), MapNode(t_CONTENT_STONE), MapNode(t_CONTENT_GRASS),
+		MapNode(t_CONTENT_WATER, 0, 7), MapNode(t_CONTENT_WATER, 0, 3),
+	};
+	for (size_t i = 0; i < MapBlock::nodecount; ++i)
+		block.getData()[i] = nodes[(i * 7 + i / 100) % 5];
+	UASSERT(block.pack());
+	UASSERT(block.getNodeDataSize() <= 8 * sizeof(MapNode) + MapBlock::nodecount * 4 / 8);
+	for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+	for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+	for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++) {
+		u32 i = p.Z * MapBlock::zstride + p.Y * MapBlock::ystride + p.X;
+		UASSERT(block.getNodeNoCheck(p) == nodes[(i * 7 + i / 100) % 5]);
+	}
+	UASSERTEQ(u16, block.getContentCount(CONTENT_AIR), 820);
+	UASSERTEQ(u16, block.getContentCount(t_CONTENT_WATER), 1638);
+
+	// Writes within the palette (which has room for 8) keep it packed
+	block.setNode({0, 0, 0}, MapNode(t_CONTENT_GRASS));
+	block.setNode({1, 0, 0}, MapNode(t_CONTENT_TORCH));
+	UASSERT(block.isPacked());
+	UASSERT(block.getNodeNoCheck({0, 0, 0}) == MapNode(t_CONTENT_GRASS));
+	UASSERT(block.getNodeNoCheck({1, 0, 0}) == MapNode(t_CONTENT_TORCH));
+	UASSERT(block.getNodeNoCheck({2, 0, 0}) == nodes[14 % 5]);
+
+	// Serialization sees the same data
+	std::stringstream ss;
+	block.serialize(ss, SER_FMT_VER_HIGHEST_WRITE, true, -1);
+	UASSERT(block.isPacked());
+	{
+		MapBlock block2({}, gamedef);
+		block2.deSerialize(ss, SER_FMT_VER_HIGHEST_WRITE, true);
+		for (p.Z = 0; p.Z < MAP_BLOCKSIZE; p.Z++)
+		for (p.Y = 0; p.Y < MAP_BLOCKSIZE; p.Y++)
+		for (p.X = 0; p.X < MAP_BLOCKSIZE; p.X++)
+			UASSERT(block2.getNodeNoCheck(p) == block.getNodeNoCheck(p));
+	}
+
+	// Too many different nodes
+	for (size_t i = 0; i < MapBlock::nodecount; ++i)
+		block.getData()[i] = MapNode(CONTENT_AIR, i & 0xff, i >> 8);
+	UASSERT(!block.pack());
+	UASSERT(!block.isPacked());
+
+	// Exactly 256 different nodes still work
+	for (size_t i = 0; i < MapBlock::nodecount; ++i)
+		block.getData()[i] = MapNode(CONTENT_AIR, i & 0xff);
+	UASSERT(block.pack());
+	for (size_t i = 0; i < MapBlock::nodecount; ++i) {
+		v3s16 p2(i % MAP_BLOCKSIZE, (i / MAP_BLOCKSIZE) % MAP_BLOCKSIZE,
+			i / (MAP_BLOCKSIZE * MAP_BLOCKSIZE));
+		UASSERT(block.getNodeNoCheck(p2) == MapNode(CONTENT_AIR, i & 0xff));
+	}
+
+	// Idle tracking
+	block.unpack();
+	block.packIfIdle();
+	UASSERT(!block.isPacked());
+	block.packIfIdle();
+	UASSERT(block.isPacked());
+	block.getData();
+	block.packIfIdle();
+	UASSERT(!block.isPacked());
+}
+
+void TestMapBlock::testContentVersion(IGameDef *gamedef)
+{
+	MapBlock block({}, gamedef);
+	MapBlock block2({}, gamedef);
+	u64 version = block.getContentVersion();
+	UASSERT(block2.getContentVersion() != version);
+
+	// Saving-only changes keep the version
+	block.setTimestamp(1234);
+	block.raiseModified(MOD_STATE_WRITE_AT_UNLOAD, MOD_REASON_BLOCK_EXPIRED);
+	UASSERTEQ(u64, block.getContentVersion(), version);
+
+	block.setNode({1, 2, 3}, MapNode(t_CONTENT_STONE));
+	UASSERT(block.getContentVersion() != version);
+	version = block.getContentVersion();
+
+	block.setLightingComplete(0);
+	UASSERT(block.getContentVersion() != version);
+	version = block.getContentVersion();
+
+	// A reloaded block must not reuse a version
+	std::ostringstream os(std::ios_base::binary);
+	block.serialize(os, SER_FMT_VER_HIGHEST_WRITE, true, -1);
+	std::istringstream is(os.str(), std::ios_base::binary);
+	block2.deSerialize(is, SER_FMT_VER_HIGHEST_WRITE, true);
+	UASSERT(block2.getContentVersion() != version);
+	UASSERT(block2.getContentVersion() != block.getContentVersion());
+}
+
+void TestMapBlock::testNodeChangeLog(IGameDef *gamedef)
+{
+	MapBlock block({}, gamedef);
+	std::vector<u16> changed;
+
+	// Nothing is known before logging starts
+	const u64 v0 = block.getContentVersion();
+	UASSERT(!block.getChangedNodes(v0, changed));
+
+	block.startNodeChangeLog();
+	UASSERT(block.getChangedNodes(v0, changed));
+	UASSERT(changed.empty());
+
+	// Setting a node to what it already is isn't a change
+	block.setNode({1, 2, 3}, block.getNodeNoCheck(1, 2, 3));
+	block.setNode({1, 2, 3}, MapNode(t_CONTENT_STONE));
+	const u64 v1 = block.getContentVersion();
+	block.setNode({0, 0, 0}, MapNode(t_CONTENT_STONE));
+	block.setNode({1, 2, 3}, MapNode(t_CONTENT_GRASS));
+
+	UASSERT(block.getChangedNodes(v0, changed));
+	UASSERT(changed == std::vector<u16>({0, 3 * 256 + 2 * 16 + 1}));
+	changed.clear();
+	UASSERT(block.getChangedNodes(v1, changed));
+	UASSERT(changed == std::vector<u16>({0, 3 * 256 + 2 * 16 + 1}));
+	changed.clear();
+	UASSERT(block.getChangedNodes(block.getContentVersion(), changed));
+	UASSERT(changed.empty());
+
+	// Changes written through a voxel manipulator
+	{
+		VoxelManipulator vm;
+		vm.addArea(VoxelArea({0, 0, 0}, v3s16(MAP_BLOCKSIZE - 1)));
+		block.copyTo(vm);
+		vm.setNode({15, 15, 15}, MapNode(t_CONTENT_WATER));
+		vm.setNode({0, 0, 0}, MapNode(CONTENT_AIR));
+		const u64 v2 = block.getContentVersion();
+		block.copyFrom(vm);
+		block.raiseModified(MOD_STATE_WRITE_NEEDED, MOD_REASON_UNKNOWN);
+		UASSERT(block.getChangedNodes(v2, changed));
+		UASSERT(changed == std::vector<u16>({0, MapBlock::nodecount - 1}));
+		changed.clear();
+	}
+
+	// A full log drops the oldest changes
+	for (u32 i = 0; i < 2000; i++) {
+		block.setNode({(s16)(i % 16), 8, 8},
+			MapNode(i / 16 % 2 ? t_CONTENT_STONE : t_CONTENT_GRASS));
+	}
+	UASSERT(!block.getChangedNodes(v0, changed));
+	UASSERT(changed.empty());
+	const u64 v3 = block.getContentVersion();
+	block.setNode({5, 5, 5}, MapNode(t_CONTENT_WATER));
+	UASSERT(block.getChangedNodes(v3, changed));
+	UASSERT(changed == std::vector<u16>({5 * 256 + 5 * 16 + 5}));
+	changed.clear();
+
+	// Trimming forgets the changes before the given version
+	const u64 v4 = block.getContentVersion();
+	block.setNode({6, 6, 6}, MapNode(t_CONTENT_WATER));
+	block.trimNodeChangeLog(v4);
+	UASSERT(!block.getChangedNodes(v3, changed));
+	UASSERT(block.getChangedNodes(v4, changed));
+	UASSERT(changed == std::vector<u16>({6 * 256 + 6 * 16 + 6}));
+	changed.clear();
+
+	// Stopping forgets everything, until the log is started again
+	block.stopNodeChangeLog();
+	const u64 v5 = block.getContentVersion();
+	block.setNode({7, 7, 7}, MapNode(t_CONTENT_WATER));
+	UASSERT(!block.getChangedNodes(v5, changed));
+	block.startNodeChangeLog();
+
+	// Reloading the block forgets everything
+	std::ostringstream os(std::ios_base::binary);
+	block.serialize(os, SER_FMT_VER_HIGHEST_WRITE, true, -1);
+	std::istringstream is(os.str(), std::ios_base::binary);
+	block.deSerialize(is, SER_FMT_VER_HIGHEST_WRITE, true);
+	UASSERT(!block.getChangedNodes(block.getContentVersion(), changed));
+}
+
+void TestMapBlock::testSnapshot(IGameDef *gamedef)
+{
+	MapBlock block({}, gamedef);
+	const v3s16 p(1, 2, 3);
+	const u32 i = p.Z * MapBlock::zstride + p.Y * MapBlock::ystride + p.X;
+	block.setNode(p, MapNode(t_CONTENT_STONE));
+
+	// Works while packed
+	UASSERT(block.pack());
+	auto snapshot = block.getSnapshot();
+	UASSERT(snapshot[i] == MapNode(t_CONTENT_STONE));
+	UASSERT(snapshot[0] == MapNode(CONTENT_IGNORE));
+
+	// Shares the nodes of the block while they are unchanged
+	block.unpack();
+	snapshot = block.getSnapshot();
+	UASSERT(block.getSnapshot() == snapshot);
+
+	// Changing the block doesn't affect earlier snapshots
+	block.setNode(p, MapNode(t_CONTENT_GRASS));
+	auto snapshot2 = block.getSnapshot();
+	UASSERT(snapshot2 != snapshot);
+	UASSERT(snapshot[i] == MapNode(t_CONTENT_STONE));
+	UASSERT(snapshot2[i] == MapNode(t_CONTENT_GRASS));
+
+	// Writable access counts as a change
+	block.getData()[i] = MapNode(t_CONTENT_WATER);
+	UASSERT(block.getSnapshot() != snapshot2);
+	UASSERT(block.getSnapshot()[i] == MapNode(t_CONTENT_WATER));
+	UASSERT(snapshot2[i] == MapNode(t_CONTENT_GRASS));
+
+	// Nodes no snapshot uses anymore are written in place
+	snapshot.reset();
+	snapshot2.reset();
+	const MapNode *nodes = block.getData().get();
+	block.setNode(p, MapNode(t_CONTENT_STONE));
+	UASSERT(block.getData().get() == nodes);
+
+	// Snapshots taken while the nodes are being written to are copies,
+	// and the block isn't packed in the meantime
+	{
+		auto data = block.getData();
+		snapshot = block.getSnapshot();
+		data[i] = MapNode(t_CONTENT_GRASS);
+		UASSERT(snapshot[i] == MapNode(t_CONTENT_STONE));
+		UASSERT(!block.pack());
+	}
+	UASSERT(block.getSnapshot() != snapshot);
+	UASSERT(block.pack());
+}
@@ -72,6 +72,7 @@ class TestMapDatabase : public TestBase
 	void testLoad();
 	void testList(int expect);
 	void testRemove();
+	void testBatch();
 
 private:
 	MapDatabaseProvider *provider = nullptr;
@@ -142,6 +143,7 @@ void TestMapDatabase::runTestsForCurrentDB()
 	TEST(testList, 1);
 	TEST(testRemove);
 	TEST(testList, 0);
+	TEST(testBatch);
 }
 
 void TestMapDatabase::testSave()
@@ -193,3 +195,39 @@ void TestMapDatabase::testRemove()
 	// FIXME: this isn't working consistently, maybe later
 	//UASSERT(!db->deleteBlock({1, 2, 4}));
 }
+
+void TestMapDatabase::testBatch()
+{
+	auto *db = provider->get();
+
+	// More than fits into one statement of the backends
+	std::vector<std::string> data;
+	std::vector<std::pair<v3s16, std::string_view>> blocks;
+	for (s16 i = 0; i < 70; i++)
+		data.push_back(std::to_string(i) + test_data);
+	for (s16 i = 0; i < 70; i++)
+		blocks.emplace_back(v3s16(i, -i, 2 * i), data[i]);
+	// the last one wins
+	blocks[5].second = "wrong";
+	blocks.emplace_back(v3s16(5, -5, 10), data[5]);
+	UASSERT(db->saveBlocks(blocks));
+
+	db = provider->get();
+	std::vector<v3s16> pos;
+	for (s16 i = 75; i-- > 0; )
+		pos.emplace_back(i, -i, 2 * i);
+	pos.emplace_back(3, -3, 6); // twice
+	std::vector<std::string> dest;
+	db->loadBlocks(pos, &dest);
+	UASSERTEQ(size_t, dest.size(), pos.size());
+	for (size_t j = 0; j < pos.size(); j++) {
+		s16 i = pos[j].X;
+		UASSERT(dest[j] == (i < 70 ? data[i] : std::string()));
+	}
+
+	for (s16 i = 0; i < 70; i++)
+		UASSERT(db->deleteBlock(v3s16(i, -i, 2 * i)));
+	std::vector<v3s16> list;
+	db->listAllLoadableBlocks(list);
+	UASSERT(list.empty());
+}
@@ -4,7 +4,9 @@
 
 #include "test.h"
 
+#include <sstream>
 #include "profiler.h"
+#include "server/tick_profiler.h"
 
 class TestProfiler : public TestBase
 {
@@ -15,6 +17,7 @@ class TestProfiler : public TestBase
 	void runTests(IGameDef *gamedef);
 
 	void testProfilerAverage();
+	void testTickProfiler();
 };
 
 static TestProfiler g_test_instance;
@@ -22,6 +25,7 @@ static TestProfiler g_test_instance;
 void TestProfiler::runTests(IGameDef *gamedef)
 {
 	TEST(testProfilerAverage);
+	TEST(testTickProfiler);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -56,3 +60,49 @@ void TestProfiler::testProfilerAverage()
 
 	UASSERT(p.getValue("Test2") == 123.57f);
 }
+
+void TestProfiler::testTickProfiler()
+{
+	MetricsBackend mb;
+	TickProfiler p(&mb);
+
+	u16 mod = p.getPhase("globalstep:foo");
+	UASSERT(mod >= TP_BUILTIN_COUNT);
+	UASSERTEQ(u16, p.getPhase("globalstep:foo"), mod);
+	UASSERTEQ(u16, p.getPhase("abms"), TP_ABMS);
+
+	for (int i = 0; i < 10; i++) {
+		// summed up per step
+		p.add(TP_ABMS, 300);
+		p.add(TP_ABMS, 500);
+		if (i == 5)
+			p.add(mod, 400000);
+		p.finishStep(1000);
+	}
+
+	std::ostringstream os;
+	p.print(os);
+	std::istringstream is(os.str());
+	std::string line;
+	std::getline(is, line); // header
+
+	std::map<std::string, std::vector<double>> rows;
+	while (std::getline(is, line)) {
+		std::istringstream ls(line);
+		std::string name;
+		double count, p50, p99, max;
+		ls >> name >> count >> p50 >> p99 >> max;
+		rows[name] = {count, p50, p99, max};
+	}
+
+	// phases that never ran are left out
+	UASSERTEQ(size_t, rows.size(), 3);
+	UASSERT(rows["step"] == std::vector<double>({10, 1, 1, 1}));
+	UASSERT(rows["abms"] == std::vector<double>({10, 0.8, 0.8, 0.8}));
+	UASSERT(rows["globalstep:foo"] == std::vector<double>({1, 400, 400, 400}));
+
+	p.reset();
+	os.str("");
+	p.print(os);
+	UASSERT(os.str().find("abms") == std::string::npos);
+}
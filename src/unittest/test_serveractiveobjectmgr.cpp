@@ -24,6 +24,8 @@ class TestServerActiveObjectMgr : public TestBase
 	void testRegisterObject();
 	void testRemoveObject();
 	void testGetObjectsInsideRadius();
+	void testGetObjectsInArea();
+	void testMoveObject();
 	void testGetAddedActiveObjectsAroundPos();
 };
 
@@ -35,6 +37,8 @@ void TestServerActiveObjectMgr::runTests(IGameDef *gamedef)
 	TEST(testRegisterObject)
 	TEST(testRemoveObject)
 	TEST(testGetObjectsInsideRadius);
+	TEST(testGetObjectsInArea);
+	TEST(testMoveObject);
 	TEST(testGetAddedActiveObjectsAroundPos);
 }
 
@@ -128,6 +132,11 @@ void TestServerActiveObjectMgr::testGetObjectsInsideRadius()
 	saomgr.getObjectsInsideRadius(v3f(), 750, result, nullptr);
 	UASSERTCMP(int, ==, result.size(), 2);
 
+	// A negative radius counts as positive
+	result.clear();
+	saomgr.getObjectsInsideRadius(v3f(), -750, result, nullptr);
+	UASSERTCMP(int, ==, result.size(), 2);
+
 	result.clear();
 	saomgr.getObjectsInsideRadius(v3f(), 750000, result, nullptr);
 	UASSERTCMP(int, ==, result.size(), 5);
@@ -143,6 +152,82 @@ void TestServerActiveObjectMgr::testGetObjectsInsideRadius()
 	saomgr.clear();
 }
 
+void TestServerActiveObjectMgr::testGetObjectsInArea()
+{
+	server::ActiveObjectMgr saomgr;
+	static const v3f sao_pos[] = {
+			v3f(10, 40, 10),
+			v3f(159, 0, 0),
+			v3f(161, 0, 0),
+			v3f(-1, -1, -1),
+			v3f(1500, -740, -304),
+	};
+
+	for (const auto &p : sao_pos) {
+		saomgr.registerObject(std::make_unique<MockServerActiveObject>(nullptr, p));
+	}
+	// Filler so that small queries use the spatial index
+	for (int i = 0; i < 100; i++) {
+		saomgr.registerObject(std::make_unique<MockServerActiveObject>(nullptr,
+				v3f(-5000, 0, 0)));
+	}
+
+	std::vector<ServerActiveObject *> result;
+	saomgr.getObjectsInArea(aabb3f(v3f(0, 0, 0), v3f(160, 160, 160)), result, nullptr);
+	UASSERTCMP(int, ==, result.size(), 2);
+
+	result.clear();
+	saomgr.getObjectsInArea(aabb3f(v3f(-1, -1, -1), v3f(161, 161, 161)), result, nullptr);
+	UASSERTCMP(int, ==, result.size(), 4);
+	// Results are ordered by id
+	for (size_t i = 1; i < result.size(); i++)
+		UASSERT(result[i - 1]->getId() < result[i]->getId());
+
+	result.clear();
+	saomgr.getObjectsInArea(aabb3f(v3f(-2000, -2000, -2000), v3f(2000, 2000, 2000)),
+			result, nullptr);
+	UASSERTCMP(int, ==, result.size(), 5);
+
+	saomgr.clear();
+}
+
+void TestServerActiveObjectMgr::testMoveObject()
+{
+	server::ActiveObjectMgr saomgr;
+	auto sao_u = std::make_unique<MockServerActiveObject>(nullptr, v3f(10, 10, 10));
+	auto sao = sao_u.get();
+	UASSERT(saomgr.registerObject(std::move(sao_u)));
+	// Filler so that small queries use the spatial index
+	for (int i = 0; i < 100; i++) {
+		saomgr.registerObject(std::make_unique<MockServerActiveObject>(nullptr,
+				v3f(-5000, 0, 0)));
+	}
+
+	std::vector<ServerActiveObject *> result;
+	saomgr.getObjectsInsideRadius(v3f(10, 10, 10), 1, result, nullptr);
+	UASSERTCMP(int, ==, result.size(), 1);
+
+	// Move it into another cell (there is no environment to do this for us)
+	v3f old_pos = sao->getBasePosition();
+	sao->setBasePosition(v3f(1000, 10, 10));
+	saomgr.updateObjectPosition(sao, old_pos);
+
+	result.clear();
+	saomgr.getObjectsInsideRadius(v3f(10, 10, 10), 1, result, nullptr);
+	UASSERTCMP(int, ==, result.size(), 0);
+	saomgr.getObjectsInsideRadius(v3f(1000, 10, 10), 1, result, nullptr);
+	UASSERTCMP(int, ==, result.size(), 1);
+	UASSERT(result[0] == sao);
+
+	// Removed objects must not be found anymore
+	saomgr.removeObject(sao->getId());
+	result.clear();
+	saomgr.getObjectsInsideRadius(v3f(1000, 10, 10), 1, result, nullptr);
+	UASSERTCMP(int, ==, result.size(), 0);
+
+	saomgr.clear();
+}
+
 void TestServerActiveObjectMgr::testGetAddedActiveObjectsAroundPos()
 {
 	server::ActiveObjectMgr saomgr;
@@ -22,6 +22,7 @@ class TestSocket : public TestBase {
 
 	void testIPv4Socket();
 	void testIPv6Socket();
+	void testBatch();
 
 	static const int port = 30003;
 };
@@ -31,6 +32,7 @@ static TestSocket g_test_instance;
 void TestSocket::runTests(IGameDef *gamedef)
 {
 	TEST(testIPv4Socket);
+	TEST(testBatch);
 
 	if (g_settings->getBool("enable_ipv6"))
 		TEST(testIPv6Socket);
@@ -132,3 +134,36 @@ void TestSocket::testIPv6Socket()
 				Address(&bytes, 0).getAddress6().s6_addr, 16) == 0);
 	}
 }
+
+void TestSocket::testBatch()
+{
+	UDPSocket socket(false);
+	socket.Bind(Address(127, 0, 0, 1, port));
+
+	const Address destination(127, 0, 0, 1, port);
+	const char *messages[] = {"one", "two", "three"};
+	OutgoingDatagram out[3];
+	for (int i = 0; i < 3; i++)
+		out[i] = {&destination, messages[i], (int)strlen(messages[i]) + 1};
+	UASSERTEQ(size_t, socket.SendBatch(out, 3), 0);
+
+	sleep_ms(50);
+
+	char rcvbuffers[4][256] = {};
+	IncomingDatagram in[4];
+	for (int i = 0; i < 4; i++) {
+		in[i].data = rcvbuffers[i];
+		in[i].capacity = sizeof(rcvbuffers[i]);
+	}
+
+	// Datagrams may arrive separately, but must keep their order
+	size_t received = 0;
+	for (int tries = 0; received < 3 && tries < 10; tries++)
+		received += socket.ReceiveBatch(in + received, 4 - received);
+	UASSERTEQ(size_t, received, 3);
+	for (int i = 0; i < 3; i++) {
+		UASSERTEQ(int, in[i].size, (int)strlen(messages[i]) + 1);
+		UASSERT(strcmp(rcvbuffers[i], messages[i]) == 0);
+		UASSERT(in[i].sender == destination);
+	}
+}
@@ -8,6 +8,7 @@
 #include <iostream>
 #include "threading/semaphore.h"
 #include "threading/thread.h"
+#include "threading/thread_pool.h"
 
 
 class TestThreading : public TestBase {
@@ -19,6 +20,7 @@ class TestThreading : public TestBase {
 	void testStartStopWait();
 	void testAtomicSemaphoreThread();
 	void testTLS();
+	void testThreadPool();
 };
 
 static TestThreading g_test_instance;
@@ -28,6 +30,7 @@ void TestThreading::runTests(IGameDef *gamedef)
 	TEST(testStartStopWait);
 	TEST(testAtomicSemaphoreThread);
 	TEST(testTLS);
+	TEST(testThreadPool);
 }
 
 class SimpleTestThread : public Thread {
@@ -227,3 +230,38 @@ void TestThreading::testTLS()
 		}
 	}
 }
+
+
+void TestThreading::testThreadPool()
+{
+	for (unsigned int num_threads : {0, 1, 4}) {
+		ThreadPool pool("PoolTest", num_threads);
+		UASSERT(pool.getThreadCount() == num_threads);
+
+		// every index exactly once
+		std::vector<std::atomic<u32>> hits(1000);
+		pool.parallelFor(hits.size(), [&] (size_t i) {
+			hits[i]++;
+		});
+		for (auto &hit : hits)
+			UASSERT(hit == 1);
+
+		pool.parallelFor(0, [] (size_t i) {
+			UASSERT(false);
+		});
+
+		std::atomic<u32> val(0);
+		for (int i = 0; i < 100; i++)
+			pool.push([&val] { val++; });
+		pool.waitIdle();
+		UASSERT(val == 100);
+
+		// Destroying the pool runs the jobs that are still queued
+		{
+			ThreadPool pool2("PoolTest", num_threads);
+			for (int i = 0; i < 100; i++)
+				pool2.push([&val] { val++; });
+		}
+		UASSERT(val == 200);
+	}
+}
@@ -9,8 +9,10 @@
 #include <prometheus/registry.h>
 #include <prometheus/counter.h>
 #include <prometheus/gauge.h>
+#include <prometheus/histogram.h>
 #include "log.h"
 #include "settings.h"
+#include <unordered_map>
 #endif
 
 /* Plain implementation */
@@ -71,6 +73,13 @@ class SimpleMetricGauge : public MetricGauge
 	double m_gauge;
 };
 
+// Nothing could read the buckets without an exporter, so don't keep them
+class DummyMetricHistogram : public MetricHistogram
+{
+public:
+	void observe(double value) override {}
+};
+
 MetricCounterPtr MetricsBackend::addCounter(
 		const std::string &name, const std::string &help_str, Labels labels)
 {
@@ -83,6 +92,13 @@ MetricGaugePtr MetricsBackend::addGauge(
 	return std::make_shared<SimpleMetricGauge>();
 }
 
+MetricHistogramPtr MetricsBackend::addHistogram(
+		const std::string &name, const std::string &help_str,
+		const std::vector<double> &buckets, Labels labels)
+{
+	return std::make_shared<DummyMetricHistogram>();
+}
+
 /* Prometheus backend */
 
 #if USE_PROMETHEUS
@@ -143,6 +159,27 @@ class PrometheusMetricGauge : public MetricGauge
 	prometheus::Gauge &m_gauge;
 };
 
+class PrometheusMetricHistogram : public MetricHistogram
+{
+public:
+	PrometheusMetricHistogram() = delete;
+
+	PrometheusMetricHistogram(prometheus::Family<prometheus::Histogram> &family,
+			const std::vector<double> &buckets, MetricsBackend::Labels labels) :
+			MetricHistogram(),
+			m_histogram(family.Add(labels,
+							prometheus::Histogram::BucketBoundaries(buckets)))
+	{
+	}
+
+	virtual ~PrometheusMetricHistogram() {}
+
+	virtual void observe(double value) { m_histogram.Observe(value); }
+
+private:
+	prometheus::Histogram &m_histogram;
+};
+
 class PrometheusMetricsBackend : public MetricsBackend
 {
 public:
@@ -161,10 +198,19 @@ class PrometheusMetricsBackend : public MetricsBackend
 	MetricGaugePtr addGauge(
 			const std::string &name, const std::string &help_str,
 			Labels labels = {}) override;
+	MetricHistogramPtr addHistogram(
+			const std::string &name, const std::string &help_str,
+			const std::vector<double> &buckets, Labels labels = {}) override;
 
 private:
 	std::unique_ptr<prometheus::Exposer> m_exposer;
 	std::shared_ptr<prometheus::Registry> m_registry;
+
+	// Histograms sharing a name are told apart by their labels (e.g. the
+	// tick phases), so they belong to one family
+	std::mutex m_histogram_mutex;
+	std::unordered_map<std::string, prometheus::Family<prometheus::Histogram> *>
+			m_histogram_families;
 };
 
 MetricCounterPtr PrometheusMetricsBackend::addCounter(
@@ -179,6 +225,21 @@ MetricGaugePtr PrometheusMetricsBackend::addGauge(
 	return std::make_shared<PrometheusMetricGauge>(name, help_str, labels, m_registry);
 }
 
+MetricHistogramPtr PrometheusMetricsBackend::addHistogram(
+		const std::string &name, const std::string &help_str,
+		const std::vector<double> &buckets, Labels labels)
+{
+	MutexAutoLock lock(m_histogram_mutex);
+	auto &family = m_histogram_families[name];
+	if (!family) {
+		family = &prometheus::BuildHistogram()
+				.Name(name)
+				.Help(help_str)
+				.Register(*m_registry);
+	}
+	return std::make_shared<PrometheusMetricHistogram>(*family, buckets, labels);
+}
+
 MetricsBackend *createPrometheusMetricsBackend()
 {
 	std::string addr;
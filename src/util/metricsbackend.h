@@ -6,6 +6,7 @@
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 #include "config.h"
 
 class MetricCounter
@@ -35,6 +36,17 @@ class MetricGauge
 
 typedef std::shared_ptr<MetricGauge> MetricGaugePtr;
 
+class MetricHistogram
+{
+public:
+	MetricHistogram() = default;
+	virtual ~MetricHistogram() {}
+
+	virtual void observe(double value) = 0;
+};
+
+typedef std::shared_ptr<MetricHistogram> MetricHistogramPtr;
+
 class MetricsBackend
 {
 public:
@@ -50,6 +62,11 @@ class MetricsBackend
 	virtual MetricGaugePtr addGauge(
 			const std::string &name, const std::string &help_str,
 			Labels labels = {});
+	// buckets are the upper bounds of the buckets, in increasing order.
+	// Histograms of the same name form one family and must differ in labels.
+	virtual MetricHistogramPtr addHistogram(
+			const std::string &name, const std::string &help_str,
+			const std::vector<double> &buckets, Labels labels = {});
 };
 
 #if USE_PROMETHEUS